@@ -0,0 +1,193 @@
+package main
+
+import (
+	"encoding/csv"
+	"encoding/json"
+	"flag"
+	"fmt"
+	"io"
+	"os"
+	"runtime"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/bs-iron-trio/go-kusokurae/sm"
+)
+
+// Non-interactive self-play: games are played by the engine's built-in
+// policies on several threads, each adding to aggregates of its own, which
+// are merged for every snapshot. Game n is dealt from stream n of the seed,
+// so the final numbers don't depend on the number of threads.
+
+var (
+	numGames   = flag.Int64("games", 0, "Play this many games non-interactively, and print statistics")
+	numThreads = flag.Int("threads", 0, "Threads for -games (0 for one per core)")
+	numPlayers = flag.Int("players", 3, "Number of players for -games (3 or 4)")
+	policyName = flag.String("policy", "random", "Policy of every seat for -games: random, greedy-high or greedy-low")
+	seed       = flag.Uint64("seed", 1, "Seed for dealing and for the random policy")
+	interval   = flag.Duration("interval", 5*time.Second, "Time between snapshots (0 for the final one only)")
+	format     = flag.String("format", "json", "Snapshot format: json (one object per line) or csv")
+	output     = flag.String("output", "", "File to write snapshots to (default stdout)")
+)
+
+var policies = map[string]sm.Policy{
+	"random":      sm.PolicyRandom,
+	"greedy-high": sm.PolicyGreedyHigh,
+	"greedy-low":  sm.PolicyGreedyLow,
+}
+
+// Games a worker takes at once
+const chunkSize = 1024
+
+type worker struct {
+	mu sync.Mutex
+	s  stats
+}
+
+func runBatch() error {
+	policy, ok := policies[*policyName]
+	if !ok {
+		return fmt.Errorf("unknown policy %q", *policyName)
+	}
+	if *numPlayers != 3 && *numPlayers != 4 {
+		return fmt.Errorf("bad number of players %d", *numPlayers)
+	}
+	if *format != "json" && *format != "csv" {
+		return fmt.Errorf("unknown format %q", *format)
+	}
+	threads := *numThreads
+	if threads <= 0 {
+		threads = runtime.NumCPU()
+	}
+	var w io.Writer = os.Stdout
+	if *output != "" {
+		f, err := os.Create(*output)
+		if err != nil {
+			return err
+		}
+		defer f.Close()
+		w = f
+	}
+	out := newSnapshotWriter(w, *format)
+
+	cfg := sm.GameConfig{NumPlayers: int32(*numPlayers)}
+	workers := make([]*worker, threads)
+	var next uint64
+	var failure atomic.Value
+	var wg sync.WaitGroup
+	start := time.Now()
+	for i := range workers {
+		workers[i] = &worker{s: stats{numPlayers: *numPlayers}}
+		wg.Add(1)
+		go func(w *worker) {
+			defer wg.Done()
+			results := make([]sm.SimResult, chunkSize)
+			for {
+				first := atomic.AddUint64(&next, chunkSize) - chunkSize
+				if first >= uint64(*numGames) {
+					return
+				}
+				n := uint64(*numGames) - first
+				if n > chunkSize {
+					n = chunkSize
+				}
+				if err := sm.SimGames(cfg, policy, *seed, first, results[:n]); err != nil {
+					failure.Store(err)
+					return
+				}
+				w.mu.Lock()
+				for i := range results[:n] {
+					w.s.add(&results[i])
+				}
+				w.mu.Unlock()
+			}
+		}(workers[i])
+	}
+
+	snapshot := func(final bool) error {
+		total := stats{numPlayers: *numPlayers}
+		for _, w := range workers {
+			w.mu.Lock()
+			total.merge(&w.s)
+			w.mu.Unlock()
+		}
+		return out.write(time.Since(start), final, total.metrics())
+	}
+	done := make(chan struct{})
+	go func() {
+		wg.Wait()
+		close(done)
+	}()
+	var tick <-chan time.Time
+	if *interval > 0 {
+		ticker := time.NewTicker(*interval)
+		defer ticker.Stop()
+		tick = ticker.C
+	}
+	for {
+		select {
+		case <-tick:
+			if err := snapshot(false); err != nil {
+				return err
+			}
+		case <-done:
+			if err, ok := failure.Load().(error); ok {
+				return err
+			}
+			return snapshot(true)
+		}
+	}
+}
+
+// snapshotWriter writes snapshots as JSON lines, or as CSV rows of one metric
+// each, under a header written once.
+type snapshotWriter struct {
+	w      io.Writer
+	csv    *csv.Writer
+	header bool
+}
+
+func newSnapshotWriter(w io.Writer, format string) *snapshotWriter {
+	ret := &snapshotWriter{w: w}
+	if format == "csv" {
+		ret.csv = csv.NewWriter(w)
+	}
+	return ret
+}
+
+func (sw *snapshotWriter) write(elapsed time.Duration, final bool, metrics []metric) error {
+	seconds := strconv.FormatFloat(elapsed.Seconds(), 'f', 3, 64)
+	if sw.csv != nil {
+		if !sw.header {
+			sw.csv.Write([]string{"elapsed_s", "final", "metric", "key", "value"})
+			sw.header = true
+		}
+		for _, m := range metrics {
+			sw.csv.Write([]string{seconds, strconv.FormatBool(final), m.name, m.key,
+				strconv.FormatFloat(m.value, 'g', 6, 64)})
+		}
+		sw.csv.Flush()
+		return sw.csv.Error()
+	}
+
+	// Metrics with keys are grouped into objects by key.
+	obj := map[string]interface{}{
+		"elapsed_s": elapsed.Seconds(),
+		"final":     final,
+	}
+	for _, m := range metrics {
+		if m.key == "" {
+			obj[m.name] = m.value
+			continue
+		}
+		byKey, _ := obj[m.name].(map[string]float64)
+		if byKey == nil {
+			byKey = map[string]float64{}
+			obj[m.name] = byKey
+		}
+		byKey[m.key] = m.value
+	}
+	return json.NewEncoder(sw.w).Encode(obj)
+}
@@ -34,6 +34,13 @@ func main() {
 	var err error
 	var cfg sm.GameConfig
 
+	if *numGames > 0 {
+		if err = runBatch(); err != nil {
+			log.Fatal(err)
+		}
+		return
+	}
+
 	fmt.Println("为你吃翔")
 	fmt.Print("请输入游戏人数：")
 	_, err = fmt.Scanf("%d", &cfg.NumPlayers)
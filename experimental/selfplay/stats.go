@@ -0,0 +1,222 @@
+package main
+
+import (
+	"fmt"
+	"math/bits"
+
+	"github.com/bs-iron-trio/go-kusokurae/sm"
+)
+
+// Aggregates over self-play games. Nothing is kept per game: scores are small
+// integers, so counting each value gives exact quantiles in a few hundred
+// bytes, and aggregates of separate runs merge by adding up.
+
+const deckSize = 33
+
+// scoreHist counts the occurrences of each score.
+type scoreHist struct {
+	min    int
+	counts []int64
+	total  int64
+	sum    int64
+}
+
+func (h *scoreHist) addN(v int, n int64) {
+	if n == 0 {
+		return
+	}
+	if len(h.counts) == 0 {
+		h.min = v
+	}
+	if v < h.min {
+		grown := make([]int64, len(h.counts)+h.min-v)
+		copy(grown[h.min-v:], h.counts)
+		h.counts, h.min = grown, v
+	}
+	for v-h.min >= len(h.counts) {
+		h.counts = append(h.counts, 0)
+	}
+	h.counts[v-h.min] += n
+	h.total += n
+	h.sum += int64(v) * n
+}
+
+func (h *scoreHist) add(v int) {
+	h.addN(v, 1)
+}
+
+func (h *scoreHist) merge(o *scoreHist) {
+	for i, n := range o.counts {
+		h.addN(o.min+i, n)
+	}
+}
+
+func (h *scoreHist) mean() float64 {
+	if h.total == 0 {
+		return 0
+	}
+	return float64(h.sum) / float64(h.total)
+}
+
+// quantile returns the smallest score with at least a fraction q of the
+// scores at or below it.
+func (h *scoreHist) quantile(q float64) int {
+	var cum int64
+	for i, n := range h.counts {
+		cum += n
+		if n > 0 && float64(cum) >= q*float64(h.total) {
+			return h.min + i
+		}
+	}
+	return h.min + len(h.counts) - 1
+}
+
+type stats struct {
+	numPlayers int
+	games      int64
+	errors     int64
+
+	// Final scores by seat (player index - 1), and of the Ghost holders and
+	// the other players
+	seat        [4]scoreHist
+	ghostHolder scoreHist
+	others      scoreHist
+
+	// Games with the highest score (shared first places count for everyone
+	// involved), by seat and for the Ghost holder
+	seatWins   [4]int64
+	ghostWins  int64
+	busted     [4][3]int64 // by seat and busted value
+	cardWins   [deckSize + 1]int64
+	cardsDealt [deckSize + 1]int64
+}
+
+func (s *stats) add(r *sm.SimResult) {
+	if r.Err != nil {
+		s.errors++
+		return
+	}
+	s.games++
+	best := r.Score[0]
+	for p := 1; p < r.NumPlayers; p++ {
+		if r.Score[p] > best {
+			best = r.Score[p]
+		}
+	}
+	for p := 0; p < r.NumPlayers; p++ {
+		s.seat[p].add(r.Score[p])
+		if p == r.GhostHolder {
+			s.ghostHolder.add(r.Score[p])
+		} else {
+			s.others.add(r.Score[p])
+		}
+		if r.Score[p] == best {
+			s.seatWins[p]++
+			if p == r.GhostHolder {
+				s.ghostWins++
+			}
+		}
+		s.busted[p][r.Busted[p]]++
+	}
+	for m := r.WinningCards; m != 0; m &= m - 1 {
+		s.cardWins[bits.TrailingZeros64(m)+1]++
+	}
+	// The 4-player game leaves out one Angel.
+	for order := 1; order <= deckSize-r.NumPlayers%3; order++ {
+		s.cardsDealt[order]++
+	}
+}
+
+func (s *stats) merge(o *stats) {
+	s.games += o.games
+	s.errors += o.errors
+	for p := range s.seat {
+		s.seat[p].merge(&o.seat[p])
+		s.seatWins[p] += o.seatWins[p]
+		for b := range s.busted[p] {
+			s.busted[p][b] += o.busted[p][b]
+		}
+	}
+	s.ghostHolder.merge(&o.ghostHolder)
+	s.others.merge(&o.others)
+	s.ghostWins += o.ghostWins
+	for i := range s.cardWins {
+		s.cardWins[i] += o.cardWins[i]
+		s.cardsDealt[i] += o.cardsDealt[i]
+	}
+}
+
+func ratio(n, d int64) float64 {
+	if d == 0 {
+		return 0
+	}
+	return float64(n) / float64(d)
+}
+
+// metric is one number of a snapshot. Key tells seats or cards apart.
+type metric struct {
+	name  string
+	key   string
+	value float64
+}
+
+// metrics flattens the aggregates for output.
+func (s *stats) metrics() (ret []metric) {
+	put := func(name, key string, value float64) {
+		ret = append(ret, metric{name, key, value})
+	}
+	put("games", "", float64(s.games))
+	put("errors", "", float64(s.errors))
+
+	var all scoreHist
+	var busted, busted1, busted2 int64
+	for p := 0; p < s.numPlayers; p++ {
+		h := &s.seat[p]
+		key := fmt.Sprint(p + 1)
+		all.merge(h)
+		put("score_mean", key, h.mean())
+		for _, q := range []float64{0.05, 0.25, 0.5, 0.75, 0.95} {
+			put(fmt.Sprintf("score_p%02.0f", q*100), key, float64(h.quantile(q)))
+		}
+		put("score_min", key, float64(h.quantile(0)))
+		put("score_max", key, float64(h.quantile(1)))
+		put("win_rate", key, ratio(s.seatWins[p], s.games))
+		put("busted_rate", key, ratio(s.busted[p][1]+s.busted[p][2], s.games))
+		busted1 += s.busted[p][1]
+		busted2 += s.busted[p][2]
+	}
+	busted = busted1 + busted2
+	put("first_seat_advantage", "", s.seat[0].mean()-all.mean())
+
+	put("ghost_holder_score_mean", "", s.ghostHolder.mean())
+	put("ghost_holder_advantage", "", s.ghostHolder.mean()-s.others.mean())
+	put("ghost_holder_win_rate", "", ratio(s.ghostWins, s.games))
+
+	players := s.games * int64(s.numPlayers)
+	put("busted_rate", "all", ratio(busted, players))
+	put("busted_single_zero_rate", "", ratio(busted1, players))
+	put("busted_only_zeros_rate", "", ratio(busted2, players))
+
+	// How often each card takes the round it is played in
+	for order := deckSize; order >= 1; order-- {
+		if s.cardsDealt[order] == 0 {
+			continue
+		}
+		put("capture_rate", fmt.Sprintf("%d:%s", order, cardName(order)),
+			ratio(s.cardWins[order], s.cardsDealt[order]))
+	}
+	return
+}
+
+// cardName names a card by display order: the two Angels (Baozi 10) and the
+// Ghost on top, then Baozi, Youtiao and Xiang from 9 down to 0.
+func cardName(order int) string {
+	switch {
+	case order == 31:
+		return suitNamesCHS[sm.SuitOther]
+	case order >= 32:
+		return suitNamesCHS[sm.SuitBaozi] + "10"
+	}
+	suit := sm.SuitBaozi - sm.Suit((30-order)/10)
+	return fmt.Sprintf("%s%d", suitNamesCHS[suit], 9-(30-order)%10)
+}
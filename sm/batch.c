@@ -0,0 +1,265 @@
+#include <string.h>
+#include "sm.h"
+#include "sm_internal.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BATCH_HAVE_AVX2 1
+#endif
+
+// Batch engine: many games in struct-of-arrays form, for rollouts.
+//
+// The games of a batch move in lockstep, so they are all at the same place of
+// a round: whether the mover leads, and whether the move ends the round, are
+// the same for every game. What's left is straight-line work on card sets per
+// game, done by a kernel over all the games at once: the scalar one, or an
+// AVX2 one taking four games per vector where the CPU has it. Picking the
+// moves is shared, so both kernels play the same games from the same seed.
+//
+// The rules are those of the kernels in sm_internal.h, taken lane-wise.
+
+// Rank of each card by display_order (0 for none)
+static int64_t BATCH_RANK[KUSOKURAE_DECK_SIZE + 1];
+static uint64_t GHOST_ORDER;
+static int use_avx2;
+
+typedef void (*batch_kernel_t)(kusokurae_batch_t *b, int leads, int ends);
+
+void batch_init() {
+    for (int order = 1; order <= KUSOKURAE_DECK_SIZE; order++) {
+        BATCH_RANK[order] = DECK_CARD(order).rank;
+    }
+    GHOST_ORDER = mask_lowest(SUIT_MASK[KUSOKURAE_SUIT_OTHER + 1]);
+#ifdef BATCH_HAVE_AVX2
+    __builtin_cpu_init();
+    use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+// Plays b->move[i] in every game i. leads: the movers lead the round; ends:
+// the moves end it.
+static void step_scalar(kusokurae_batch_t *b, int leads, int ends) {
+    int np = b->np;
+    for (int i = 0; i < b->n; i++) {
+        int64_t t = b->turn[i], order = b->move[i];
+        uint64_t bit = CARD_BIT(order);
+        b->hand[t][i] &= ~bit;
+        b->trick[i] |= bit;
+        if (leads || BATCH_RANK[order] > BATCH_RANK[b->high_order[i]]) {
+            b->high_order[i] = order;
+            b->high_player[i] = t;
+        }
+        if (ends) {
+            int64_t points = mask_popcount(b->trick[i] & SUIT_MASK[KUSOKURAE_SUIT_BAOZI + 1]) -
+                             mask_popcount(b->trick[i] & SUIT_MASK[KUSOKURAE_SUIT_XIANG + 1]);
+            if ((uint64_t)b->high_order[i] == GHOST_ORDER) {
+                points *= 2;
+            }
+            t = b->high_player[i];
+            b->score[t][i] += points;
+            b->trick[i] = 0;
+        } else {
+            t = t + 1 == np ? 0 : t + 1;
+        }
+        b->turn[i] = t;
+        int busted = (int)b->busted[t][i];
+        b->playable[i] = rules_playable(b->hand[t][i], ends, &busted);
+        b->busted[t][i] = busted;
+    }
+}
+
+#ifdef BATCH_HAVE_AVX2
+
+__attribute__((target("avx2")))
+static inline __m256i popcount_avx2(__m256i v) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low4 = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low4));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low4));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+#define LOAD(p)         _mm256_loadu_si256((const __m256i *)(p))
+#define STORE(p, v)     _mm256_storeu_si256((__m256i *)(p), (v))
+
+// step_scalar on four games at a time. Per-player fields are read and written
+// for every player under a mask of the lanes the player is concerned in, in
+// place of gathers and scatters.
+__attribute__((target("avx2")))
+static void step_avx2(kusokurae_batch_t *b, int leads, int ends) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    const __m256i np = _mm256_set1_epi64x(b->np);
+    const __m256i zeros_rank = _mm256_set1_epi64x((long long)RANK_MASK[0]);
+    const __m256i baozi = _mm256_set1_epi64x((long long)SUIT_MASK[KUSOKURAE_SUIT_BAOZI + 1]);
+    const __m256i xiang = _mm256_set1_epi64x((long long)SUIT_MASK[KUSOKURAE_SUIT_XIANG + 1]);
+    const __m256i ghost = _mm256_set1_epi64x((long long)GHOST_ORDER);
+    const __m256i two = _mm256_set1_epi64x(2);
+    __m256i seat[KUSOKURAE_MAX_PLAYERS];
+    int p;
+    for (p = 0; p < b->np; p++) {
+        seat[p] = _mm256_set1_epi64x(p);
+    }
+
+    for (int i = 0; i < b->n; i += 4) {
+        __m256i turn = LOAD(&b->turn[i]);
+        __m256i order = LOAD(&b->move[i]);
+        // A move of 0 (padding) shifts the bit out.
+        __m256i bit = _mm256_sllv_epi64(one, _mm256_sub_epi64(order, one));
+        __m256i is[KUSOKURAE_MAX_PLAYERS];
+        for (p = 0; p < b->np; p++) {
+            is[p] = _mm256_cmpeq_epi64(turn, seat[p]);
+            STORE(&b->hand[p][i], _mm256_andnot_si256(_mm256_and_si256(bit, is[p]),
+                                                      LOAD(&b->hand[p][i])));
+        }
+        __m256i trick = _mm256_or_si256(LOAD(&b->trick[i]), bit);
+
+        __m256i high = LOAD(&b->high_order[i]);
+        __m256i high_player = LOAD(&b->high_player[i]);
+        __m256i beats = ones;
+        if (!leads) {
+            __m256i rank = _mm256_i64gather_epi64((const long long *)BATCH_RANK, order, 8);
+            __m256i high_rank = _mm256_i64gather_epi64((const long long *)BATCH_RANK, high, 8);
+            beats = _mm256_cmpgt_epi64(rank, high_rank);
+        }
+        high = _mm256_blendv_epi8(high, order, beats);
+        high_player = _mm256_blendv_epi8(high_player, turn, beats);
+        STORE(&b->high_order[i], high);
+        STORE(&b->high_player[i], high_player);
+
+        if (ends) {
+            __m256i points = _mm256_sub_epi64(popcount_avx2(_mm256_and_si256(trick, baozi)),
+                                              popcount_avx2(_mm256_and_si256(trick, xiang)));
+            // Doubled by the Ghost
+            points = _mm256_add_epi64(points, _mm256_and_si256(points, _mm256_cmpeq_epi64(high, ghost)));
+            turn = high_player;
+            for (p = 0; p < b->np; p++) {
+                is[p] = _mm256_cmpeq_epi64(turn, seat[p]);
+                STORE(&b->score[p][i], _mm256_add_epi64(LOAD(&b->score[p][i]),
+                                                        _mm256_and_si256(points, is[p])));
+            }
+            trick = zero;
+        } else {
+            turn = _mm256_add_epi64(turn, one);
+            turn = _mm256_andnot_si256(_mm256_cmpeq_epi64(turn, np), turn);
+            for (p = 0; p < b->np; p++) {
+                is[p] = _mm256_cmpeq_epi64(turn, seat[p]);
+            }
+        }
+        STORE(&b->trick[i], trick);
+        STORE(&b->turn[i], turn);
+
+        // rules_playable for the player now on turn
+        __m256i hand = zero, busted = zero;
+        for (p = 0; p < b->np; p++) {
+            hand = _mm256_or_si256(hand, _mm256_and_si256(LOAD(&b->hand[p][i]), is[p]));
+            busted = _mm256_or_si256(busted, _mm256_and_si256(LOAD(&b->busted[p][i]), is[p]));
+        }
+        __m256i good = ends ? _mm256_andnot_si256(zeros_rank, hand) : hand;
+        __m256i no_choice = _mm256_andnot_si256(_mm256_cmpeq_epi64(hand, zero),
+                                                _mm256_cmpeq_epi64(good, zero));
+        good = _mm256_blendv_epi8(good, hand, no_choice);
+        // A single card left to play, and a zero
+        __m256i only_one = _mm256_and_si256(
+            _mm256_cmpeq_epi64(_mm256_and_si256(good, _mm256_sub_epi64(good, one)), zero),
+            _mm256_xor_si256(_mm256_cmpeq_epi64(good, zero), ones));
+        __m256i held_zero = _mm256_andnot_si256(
+            _mm256_cmpeq_epi64(_mm256_and_si256(good, zeros_rank), zero),
+            _mm256_andnot_si256(no_choice, only_one));
+        busted = _mm256_blendv_epi8(busted, one, held_zero);
+        busted = _mm256_blendv_epi8(busted, two, no_choice);
+        STORE(&b->playable[i], good);
+        for (p = 0; p < b->np; p++) {
+            STORE(&b->busted[p][i], _mm256_blendv_epi8(LOAD(&b->busted[p][i]), busted, is[p]));
+        }
+    }
+}
+
+#endif // BATCH_HAVE_AVX2
+
+kusokurae_error_t kusokurae_batch_start(kusokurae_batch_t *b, int32_t np, int32_t n, int32_t flags) {
+    if (b == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (np < 3 || np > KUSOKURAE_MAX_PLAYERS) {
+        return KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS;
+    }
+    if (n <= 0 || n > KUSOKURAE_BATCH_MAX) {
+        return KUSOKURAE_ERROR_BAD_ARGUMENT;
+    }
+    kusokurae_rng_t rng = b->rng;
+    memset(b, 0, sizeof(kusokurae_batch_t));
+    b->rng = rng;
+    b->np = np;
+    b->n = n;
+    b->simd = use_avx2 && !(flags & KUSOKURAE_BATCH_SCALAR);
+    uint64_t hands[KUSOKURAE_MAX_PLAYERS];
+    for (int i = 0; i < n; i++) {
+        deal_hands(np, &b->rng, hands);
+        for (int p = 0; p < np; p++) {
+            b->hand[p][i] = hands[p];
+        }
+        int busted = 0;
+        b->playable[i] = rules_playable(hands[0], 1, &busted);
+        b->busted[0][i] = busted;
+    }
+    return KUSOKURAE_SUCCESS;
+}
+
+int kusokurae_batch_finished(const kusokurae_batch_t *b) {
+    return b->nmoves >= b->np * ((KUSOKURAE_DECK_SIZE - (b->np == 4)) / b->np);
+}
+
+kusokurae_error_t kusokurae_batch_step(kusokurae_batch_t *b, const uint8_t *moves) {
+    int i;
+    if (b == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (b->np == 0) {
+        return KUSOKURAE_ERROR_UNINITIALIZED;
+    }
+    if (kusokurae_batch_finished(b)) {
+        return KUSOKURAE_ERROR_NOT_IN_GAME;
+    }
+    // Picked and checked before anything is played
+    for (i = 0; i < b->n; i++) {
+        uint64_t m = b->playable[i];
+        int order;
+        if (moves == NULL) {
+            for (int k = kusokurae_rng_bounded(&b->rng, mask_popcount(m)); k > 0; k--) {
+                m &= m - 1;
+            }
+            order = mask_lowest(m);
+        } else {
+            order = moves[i];
+            if (order < 1 || order > KUSOKURAE_DECK_SIZE || !(m & CARD_BIT(order))) {
+                return KUSOKURAE_ERROR_FORBIDDEN_MOVE;
+            }
+        }
+        const kusokurae_card_t *kind = &DECK_CARD(order);
+        b->move[i] = mask_highest(b->hand[b->turn[i]][i] & SUIT_RANK_MASK[kind->suit + 1][kind->rank]);
+    }
+    int pos = b->nmoves % b->np;
+    batch_kernel_t kernel = step_scalar;
+#ifdef BATCH_HAVE_AVX2
+    if (b->simd) {
+        kernel = step_avx2;
+    }
+#endif
+    kernel(b, pos == 0, pos == b->np - 1);
+    b->nmoves++;
+    return KUSOKURAE_SUCCESS;
+}
+
+kusokurae_error_t kusokurae_batch_rollout(kusokurae_batch_t *b) {
+    kusokurae_error_t err = KUSOKURAE_SUCCESS;
+    if (b == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    while (err == KUSOKURAE_SUCCESS && !kusokurae_batch_finished(b)) {
+        err = kusokurae_batch_step(b, NULL);
+    }
+    return err;
+}
@@ -0,0 +1,334 @@
+// Engine benchmarks, run with "<test program> bench [min_time_ms]". Each result
+// is printed as one line of JSON, to be collected and compared over releases.
+
+#ifndef WHATEVER_YOU_WANT_TO_INDICATE_CGO
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "sm.h"
+#include "sm_internal.h"
+
+namespace {
+
+// Games prepared for the benchmarks that replay moves
+const int N_GAMES = 256;
+
+double min_time = 0.5;
+
+double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Runs fn with growing iteration counts until it takes min_time, like Go's
+// testing.B. fn returns the number of operations done, which may differ from
+// the iterations asked for.
+void run(const char *name, int np, const char *unit, const std::function<int64_t(int64_t)> &fn) {
+    int64_t n = 1, ops = 0;
+    double elapsed = 0;
+    for (;;) {
+        double start = now();
+        ops = fn(n);
+        elapsed = now() - start;
+        if (elapsed >= min_time || n >= (int64_t)1 << 40) {
+            break;
+        }
+        // Aim 20% past min_time, but don't grow more than 100x at once.
+        double want = elapsed > 0 ? n * min_time * 1.2 / elapsed : n * 100.0;
+        n = want > n * 100.0 ? n * 100 : want < n + 1 ? n + 1 : (int64_t)want;
+    }
+    std::printf("{\"bench\":\"%s\",\"np\":%d,\"unit\":\"%s\",\"n\":%lld,"
+                "\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f}\n",
+                name, np, unit, (long long)ops, elapsed * 1e9 / ops, ops / elapsed);
+    std::fflush(stdout);
+}
+
+// A dealt game and the moves of a random playout of it
+struct prepared_game {
+    kusokurae_game_state_t start;
+    uint8_t moves[KUSOKURAE_DECK_SIZE];
+    int nmoves;
+};
+
+std::vector<prepared_game> prepare(int np) {
+    std::vector<prepared_game> ret(N_GAMES);
+    kusokurae_game_config_t cfg = { np };
+    kusokurae_game_state_t g;
+    for (int i = 0; i < N_GAMES; i++) {
+        kusokurae_game_init(&g, &cfg, NULL);
+        kusokurae_game_seed(&g, 1, i);
+        kusokurae_game_start(&g);
+        ret[i].start = g;
+        ret[i].nmoves = 0;
+        while (g.status == KUSOKURAE_STATUS_PLAY) {
+            int order = policy_pick(&g, kusokurae_get_active_player(&g), KUSOKURAE_POLICY_RANDOM);
+            ret[i].moves[ret[i].nmoves++] = (uint8_t)order;
+            kusokurae_game_play(&g, DECK_CARD(order));
+        }
+    }
+    return ret;
+}
+
+void bench_deal(int np) {
+    kusokurae_game_config_t cfg = { np };
+    kusokurae_game_state_t g;
+    kusokurae_game_init(&g, &cfg, NULL);
+    kusokurae_game_seed(&g, 1, 1);
+    run("deal", np, "deal", [&](int64_t n) {
+        for (int64_t i = 0; i < n; i++) {
+            kusokurae_game_start(&g);
+        }
+        return n;
+    });
+}
+
+void bench_deal_many(int np) {
+    std::vector<kusokurae_deal_t> deals(1024);
+    kusokurae_rng_t rng;
+    kusokurae_rng_seed(&rng, 1, 1);
+    run("deal_many", np, "deal", [&](int64_t n) {
+        for (int64_t i = 0; i < n; i += (int64_t)deals.size()) {
+            kusokurae_deal_many(np, &rng, std::min(n - i, (int64_t)deals.size()), deals.data());
+        }
+        return n;
+    });
+}
+
+// Per-move cost of the engine alone: the moves are known in advance. Copying
+// the dealt state back in is part of it, but small next to a game's moves.
+void bench_play(int np, const std::vector<prepared_game> &games) {
+    kusokurae_game_state_t g;
+    run("play", np, "move", [&](int64_t n) {
+        int64_t ops = 0;
+        for (int64_t i = 0; i < n; i++) {
+            const prepared_game &p = games[i % N_GAMES];
+            std::memcpy(&g, &p.start, sizeof(g));
+            for (int j = 0; j < p.nmoves; j++) {
+                kusokurae_game_play(&g, DECK_CARD(p.moves[j]));
+            }
+            ops += p.nmoves;
+        }
+        return ops;
+    });
+}
+
+void bench_play_undo(int np, const std::vector<prepared_game> &games) {
+    kusokurae_game_state_t g;
+    kusokurae_undo_t undo[KUSOKURAE_DECK_SIZE];
+    run("play_undo", np, "move", [&](int64_t n) {
+        int64_t ops = 0;
+        for (int64_t i = 0; i < n; i++) {
+            const prepared_game &p = games[i % N_GAMES];
+            std::memcpy(&g, &p.start, sizeof(g));
+            for (int j = 0; j < p.nmoves; j++) {
+                kusokurae_game_play_undoable(&g, DECK_CARD(p.moves[j]), &undo[j]);
+            }
+            for (int j = p.nmoves - 1; j >= 0; j--) {
+                kusokurae_game_unplay(&g, &undo[j]);
+            }
+            ops += p.nmoves;
+        }
+        return ops;
+    });
+}
+
+void bench_round_state(int np, const std::vector<prepared_game> &games) {
+    // Each game stopped somewhere along the way
+    std::vector<kusokurae_game_state_t> states(N_GAMES);
+    for (int i = 0; i < N_GAMES; i++) {
+        states[i] = games[i].start;
+        for (int j = 0; j < i % games[i].nmoves; j++) {
+            kusokurae_game_play(&states[i], DECK_CARD(games[i].moves[j]));
+        }
+    }
+    kusokurae_round_state_t out;
+    // Keeps the calls from being optimized away
+    volatile int32_t sink = 0;
+    run("round_state", np, "call", [&](int64_t n) {
+        for (int64_t i = 0; i < n; i++) {
+            kusokurae_get_round_state(&states[i % N_GAMES], &out);
+            sink = out.score_on_board;
+        }
+        return n;
+    });
+}
+
+// Whole games as played by the simulator: deal, then random moves
+void bench_games(int np) {
+    kusokurae_game_state_t g;
+    kusokurae_sim_result_t result;
+    std::memset(&g, 0, sizeof(g));
+    run("game", np, "game", [&](int64_t n) {
+        for (int64_t i = 0; i < n; i++) {
+            kusokurae_sim_config_t cfg = { np, 1, (uint64_t)i };
+            sim_play(&g, &cfg, KUSOKURAE_POLICY_RANDOM, &result);
+        }
+        return n;
+    });
+}
+
+// The moves of the prepared games replayed on the compact engine
+void bench_compact(int np, const std::vector<prepared_game> &games) {
+    std::vector<kusokurae_compact_state_t> starts(N_GAMES);
+    for (int i = 0; i < N_GAMES; i++) {
+        kusokurae_compact_from_game(&starts[i], &games[i].start);
+    }
+    kusokurae_compact_state_t s;
+    run("compact_play", np, "move", [&](int64_t n) {
+        int64_t ops = 0;
+        for (int64_t i = 0; i < n; i++) {
+            const prepared_game &p = games[i % N_GAMES];
+            std::memcpy(&s, &starts[i % N_GAMES], sizeof(s));
+            for (int j = 0; j < p.nmoves; j++) {
+                kusokurae_compact_play(&s, p.moves[j]);
+            }
+            ops += p.nmoves;
+        }
+        return ops;
+    });
+}
+
+// Two-deck games dealt and played out on the decks engine, each player
+// playing the highest card he/she may
+void bench_decks(int np) {
+    kusokurae_decks_state_t s;
+    kusokurae_rng_seed(&s.rng_state, 1, 1);
+    run("decks_game", np, "game", [&](int64_t n) {
+        for (int64_t i = 0; i < n; i++) {
+            kusokurae_decks_start(&s, np, 2);
+            while (s.status == KUSOKURAE_STATUS_PLAY) {
+                kusokurae_decks_play(&s, s.playable.deck[1] ? KUSOKURAE_DECK_SIZE + mask_highest(s.playable.deck[1])
+                                                            : mask_highest(s.playable.deck[0]));
+            }
+        }
+        return n;
+    });
+}
+
+// Random games played by the batch engine, KUSOKURAE_BATCH_MAX at a time
+void bench_batch(int np, int32_t flags) {
+    static kusokurae_batch_t b;
+    kusokurae_rng_seed(&b.rng, 1, 1);
+    kusokurae_batch_start(&b, np, KUSOKURAE_BATCH_MAX, flags);
+    run(b.simd ? "batch_simd" : "batch_scalar", np, "game", [&](int64_t n) {
+        int64_t games = 0;
+        for (; games < n; games += KUSOKURAE_BATCH_MAX) {
+            kusokurae_batch_start(&b, np, KUSOKURAE_BATCH_MAX, flags);
+            kusokurae_batch_rollout(&b);
+        }
+        return games;
+    });
+}
+
+
+// Endgame tablebase lookups at the start of a round, and probes of the
+// positions before every move of the last rounds. The tablebase is generated
+// first, outside the timing.
+void bench_tablebase(int np, const std::vector<prepared_game> &games) {
+    const int32_t k = np == 3 ? 2 : 1;
+    // A file of our own, so that bench runs side by side don't share one
+    char path[] = "/tmp/kusokurae-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return;
+    }
+    close(fd);
+    kusokurae_tablebase_config_t cfg = { np, k, 0, 0 };
+    kusokurae_tablebase_t *tb = NULL;
+    if (kusokurae_tablebase_generate(path, &cfg, NULL) == KUSOKURAE_SUCCESS) {
+        tb = kusokurae_tablebase_open(path);
+    }
+    if (tb == NULL) {
+        unlink(path);
+        return;
+    }
+    struct position {
+        uint64_t hands[KUSOKURAE_MAX_PLAYERS];
+        int32_t leader;
+    };
+    std::vector<position> positions;
+    std::vector<kusokurae_game_state_t> states;
+    for (int i = 0; i < N_GAMES; i++) {
+        kusokurae_game_state_t g = games[i].start;
+        for (int j = 0; j < games[i].nmoves; j++) {
+            int left = g.players[0].ncards - g.nround;
+            if (left <= k + 1) {
+                states.push_back(g);
+            }
+            const kusokurae_trick_t *t = kusokurae_get_current_trick(&g);
+            if (left <= k && t->nmoves == 0) {
+                position p;
+                for (int pi = 0; pi < np; pi++) {
+                    p.hands[pi] = g.players[pi].hand;
+                }
+                p.leader = t->leader;
+                positions.push_back(p);
+            }
+            kusokurae_game_play(&g, DECK_CARD(games[i].moves[j]));
+        }
+    }
+    int8_t values[KUSOKURAE_MAX_PLAYERS];
+    volatile int32_t sink = 0;
+    run("tablebase_lookup", np, "lookup", [&](int64_t n) {
+        for (int64_t i = 0; i < n; i++) {
+            const position &p = positions[i % positions.size()];
+            kusokurae_tablebase_lookup(tb, p.hands, p.leader, values);
+            sink = values[0];
+        }
+        return n;
+    });
+    kusokurae_solve_result_t out;
+    run("tablebase_probe", np, "probe", [&](int64_t n) {
+        for (int64_t i = 0; i < n; i++) {
+            kusokurae_tablebase_probe(tb, &states[i % states.size()], 0, &out);
+            sink = out.score;
+        }
+        return n;
+    });
+    kusokurae_tablebase_close(tb);
+    unlink(path);
+}
+}
+
+int bench_main(int argc, char *argv[]) {
+    if (argc > 1) {
+        min_time = std::atof(argv[1]) / 1000;
+    }
+    kusokurae_global_init();
+#ifdef __VERSION__
+    const char *compiler = __VERSION__;
+#else
+    const char *compiler = "unknown";
+#endif
+    std::printf("{\"bench\":\"info\",\"time\":%ld,\"compiler\":\"%s\",\"hardware_threads\":%u,"
+                "\"sizeof_game_state\":%u}\n",
+                (long)time(0), compiler, std::thread::hardware_concurrency(),
+                (unsigned)sizeof(kusokurae_game_state_t));
+    for (int np = 3; np <= KUSOKURAE_MAX_PLAYERS; np++) {
+        std::vector<prepared_game> games = prepare(np);
+        bench_deal(np);
+        bench_deal_many(np);
+        bench_play(np, games);
+        bench_play_undo(np, games);
+        bench_compact(np, games);
+        bench_round_state(np, games);
+        bench_games(np);
+        bench_batch(np, KUSOKURAE_BATCH_SCALAR);
+        bench_batch(np, 0);
+        bench_tablebase(np, games);
+    }
+    for (int np = 3; np <= KUSOKURAE_MAX_DECK_PLAYERS; np++) {
+        bench_decks(np);
+    }
+    return 0;
+}
+
+#endif // WHATEVER_YOU_WANT_TO_INDICATE_CGO
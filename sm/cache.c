@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sm.h"
+
+// Position cache for many threads at once, without locks.
+//
+// Entries are grouped in buckets of four that fill one cache line. An entry
+// stores the key XORed with the value next to the value, so a reader that
+// races with a writer sees a pair that doesn't decode to its key and simply
+// misses, instead of getting a torn value.
+//
+// The table is split into shards by the top bits of the key. The shards only
+// say where their buckets are and are never written after the cache is made,
+// so every thread keeps them in its own cache. The hit, miss and store
+// counters go to a separate stripe per thread instead (threads share a stripe
+// only beyond CACHE_STRIPES of them), each on its own cache line, and are
+// summed up by kusokurae_cache_get_stats.
+
+#define CACHE_SHARD_BITS    6
+#define CACHE_SHARDS        (1 << CACHE_SHARD_BITS)
+#define CACHE_WAYS          4
+#define CACHE_STRIPES       64
+
+typedef struct {
+    uint64_t check; // key ^ value
+    uint64_t value;
+} cache_entry_t;
+
+typedef struct {
+    cache_entry_t ways[CACHE_WAYS];
+} cache_bucket_t;
+
+typedef struct {
+    cache_bucket_t *buckets;
+    uint64_t mask;
+} cache_shard_t;
+
+typedef struct {
+    int64_t hits;
+    int64_t misses;
+    int64_t stores;
+    int64_t evictions;
+} __attribute__((aligned(64))) cache_stripe_t;
+
+struct kusokurae_cache_t {
+    cache_shard_t shards[CACHE_SHARDS];
+    cache_stripe_t stripes[CACHE_STRIPES];
+    cache_bucket_t *buckets;
+    size_t size;
+};
+
+// Stripe of the calling thread, the same in every cache
+static int cache_next_stripe;
+static __thread int cache_thread_stripe = -1;
+
+static cache_shard_t *cache_shard(kusokurae_cache_t *cache, uint64_t key) {
+    return &cache->shards[key >> (64 - CACHE_SHARD_BITS)];
+}
+
+static cache_stripe_t *cache_stripe(kusokurae_cache_t *cache) {
+    int i = cache_thread_stripe;
+    if (i < 0) {
+        i = __atomic_fetch_add(&cache_next_stripe, 1, __ATOMIC_RELAXED) & (CACHE_STRIPES - 1);
+        cache_thread_stripe = i;
+    }
+    return &cache->stripes[i];
+}
+
+kusokurae_cache_t *kusokurae_cache_new(int32_t bits) {
+    if (bits < 8 || bits > 40) {
+        return NULL;
+    }
+    kusokurae_cache_t *cache = NULL;
+    if (posix_memalign((void **)&cache, 64, sizeof(kusokurae_cache_t)) != 0) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(kusokurae_cache_t));
+    cache->size = ((size_t)1 << bits) * sizeof(cache_entry_t);
+    if (posix_memalign((void **)&cache->buckets, 64, cache->size) != 0) {
+        free(cache);
+        return NULL;
+    }
+    size_t per_shard = ((size_t)1 << bits) / CACHE_WAYS / CACHE_SHARDS;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache->shards[i].buckets = cache->buckets + per_shard * i;
+        cache->shards[i].mask = per_shard - 1;
+    }
+    kusokurae_cache_clear(cache);
+    return cache;
+}
+
+void kusokurae_cache_free(kusokurae_cache_t *cache) {
+    if (cache != NULL) {
+        free(cache->buckets);
+        free(cache);
+    }
+}
+
+int kusokurae_cache_get(kusokurae_cache_t *cache, uint64_t key, uint64_t *value) {
+    cache_shard_t *shard = cache_shard(cache, key);
+    cache_entry_t *e = shard->buckets[key & shard->mask].ways;
+    uint64_t check, v;
+    for (int i = 0; i < CACHE_WAYS; i++) {
+        v = __atomic_load_n(&e[i].value, __ATOMIC_RELAXED);
+        check = __atomic_load_n(&e[i].check, __ATOMIC_RELAXED);
+        if ((check ^ v) == key && (check | v) != 0) {
+            __atomic_fetch_add(&cache_stripe(cache)->hits, 1, __ATOMIC_RELAXED);
+            *value = v;
+            return 1;
+        }
+    }
+    __atomic_fetch_add(&cache_stripe(cache)->misses, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void kusokurae_cache_put(kusokurae_cache_t *cache, uint64_t key, uint64_t value) {
+    cache_shard_t *shard = cache_shard(cache, key);
+    cache_entry_t *e = shard->buckets[key & shard->mask].ways;
+    cache_stripe_t *stripe = cache_stripe(cache);
+    int victim = -1;
+    uint64_t check, v;
+    for (int i = 0; i < CACHE_WAYS; i++) {
+        v = __atomic_load_n(&e[i].value, __ATOMIC_RELAXED);
+        check = __atomic_load_n(&e[i].check, __ATOMIC_RELAXED);
+        if ((check ^ v) == key) {
+            victim = i;
+            break;
+        }
+        if (victim < 0 && (check | v) == 0) {
+            victim = i;
+        }
+    }
+    if (victim < 0) {
+        // Bucket full of other keys: rotate through the ways.
+        victim = (int)(__atomic_fetch_add(&stripe->evictions, 1, __ATOMIC_RELAXED) & (CACHE_WAYS - 1));
+    }
+    __atomic_store_n(&e[victim].value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&e[victim].check, key ^ value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stripe->stores, 1, __ATOMIC_RELAXED);
+}
+
+void kusokurae_cache_clear(kusokurae_cache_t *cache) {
+    memset(cache->buckets, 0, cache->size);
+    memset(cache->stripes, 0, sizeof(cache->stripes));
+}
+
+void kusokurae_cache_get_stats(kusokurae_cache_t *cache, kusokurae_cache_stats_t *out) {
+    memset(out, 0, sizeof(kusokurae_cache_stats_t));
+    for (int i = 0; i < CACHE_STRIPES; i++) {
+        out->hits += __atomic_load_n(&cache->stripes[i].hits, __ATOMIC_RELAXED);
+        out->misses += __atomic_load_n(&cache->stripes[i].misses, __ATOMIC_RELAXED);
+        out->stores += __atomic_load_n(&cache->stripes[i].stores, __ATOMIC_RELAXED);
+        out->evictions += __atomic_load_n(&cache->stripes[i].evictions, __ATOMIC_RELAXED);
+    }
+}
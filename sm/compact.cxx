@@ -0,0 +1,114 @@
+#include <string.h>
+#include "sm.h"
+#include "sm_internal.h"
+#include "game.hxx"
+
+// The compact engine works on card sets only, with the same rules as the full
+// one, so both play every game the same way. Moves run on the specialization
+// of kusokurae::Game (game.hxx) for the number of players and one deck.
+
+kusokurae_error_t kusokurae_compact_start(kusokurae_compact_state_t *self, int32_t np) {
+    if (self == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (np < 3 || np > KUSOKURAE_MAX_PLAYERS) {
+        return KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS;
+    }
+    kusokurae_rng_t rng = self->rng_state;
+    memset(self, 0, sizeof(kusokurae_compact_state_t));
+    self->rng_state = rng;
+    self->np = (uint8_t)np;
+
+    deal_hands(np, &self->rng_state, self->hand);
+    if (np == 3) {
+        kusokurae::Game<3, 1>::begin(self);
+    } else {
+        kusokurae::Game<4, 1>::begin(self);
+    }
+    return KUSOKURAE_SUCCESS;
+}
+
+kusokurae_error_t kusokurae_compact_play(kusokurae_compact_state_t *self,
+                                         kusokurae_card_id_t card) {
+    if (self == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    switch (self->np) {
+    case 3:
+        return kusokurae::Game<3, 1>::play(self, card);
+    case 4:
+        return kusokurae::Game<4, 1>::play(self, card);
+    default:
+        return KUSOKURAE_ERROR_NOT_IN_GAME;
+    }
+}
+
+kusokurae_card_t kusokurae_compact_card(const kusokurae_compact_state_t *self,
+                                        kusokurae_card_id_t card) {
+    kusokurae_card_t ret;
+    memset(&ret, 0, sizeof(ret));
+    if (self == NULL || card < 1 || card > KUSOKURAE_DECK_SIZE) {
+        return ret;
+    }
+    for (int i = 0; i < self->np; i++) {
+        if (self->dealt[i] & CARD_BIT(card)) {
+            ret = DECK_CARD(card);
+            ret.flags = self->played_round[card];
+            if (self->turn == i && (self->playable & CARD_BIT(card))) {
+                ret.flags |= MASK_PLAYABLE;
+            }
+        }
+    }
+    return ret;
+}
+
+kusokurae_error_t kusokurae_compact_from_game(kusokurae_compact_state_t *self,
+                                              const kusokurae_game_state_t *game) {
+    int i, j;
+    if (self == NULL || game == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (game->cfg.np == 0) {
+        return KUSOKURAE_ERROR_UNINITIALIZED;
+    }
+    memset(self, 0, sizeof(kusokurae_compact_state_t));
+    self->np = (uint8_t)game->cfg.np;
+    self->status = (uint8_t)game->status;
+    self->high_ranker_index = (int8_t)game->high_ranker_index;
+    self->nround = (uint8_t)game->nround;
+    self->ghost_holder_index = (int8_t)game->ghost_holder_index;
+    self->rng_state = game->rng_state;
+    for (i = 0; i < game->cfg.np; i++) {
+        const kusokurae_player_t *p = &game->players[i];
+        if (p->active == KUSOKURAE_ROUND_ACTIVE) {
+            self->turn = (uint8_t)i;
+            self->playable = p->playable;
+        }
+        self->hand[i] = p->hand;
+        self->dealt[i] = p->dealt;
+        self->taken[i] = p->taken;
+        self->score[i] = (int16_t)p->score;
+        self->busted[i] = (int8_t)p->busted;
+        self->trick[i] = (kusokurae_card_id_t)game->current_round[i].display_order;
+        for (j = 0; j < p->ncards; j++) {
+            self->played_round[p->cards[j].display_order] =
+                (uint8_t)(p->cards[j].flags & MASK_PLAYED_IN_ROUND);
+        }
+    }
+    return KUSOKURAE_SUCCESS;
+}
+
+kusokurae_error_t kusokurae_compact_to_game(const kusokurae_compact_state_t *self,
+                                            kusokurae_game_state_t *game) {
+    uint8_t snapshot[KUSOKURAE_SNAPSHOT_SIZE];
+    if (self == NULL || game == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (self->np == 0) {
+        return KUSOKURAE_ERROR_UNINITIALIZED;
+    }
+    // The snapshot holds just what the compact form does, and unpacking it
+    // rebuilds everything else.
+    compact_pack(self, snapshot);
+    return kusokurae_state_unpack(game, snapshot);
+}
@@ -0,0 +1,304 @@
+#include <string.h>
+#include "sm.h"
+#include "sm_internal.h"
+
+// Dealer shared by kusokurae_game_start, kusokurae_compact_start,
+// kusokurae_decks_start and kusokurae_deal_many, and deal IDs.
+//
+// The deck is shuffled by Fisher-Yates on one-byte card ids, stopping as soon
+// as every hand but the last is drawn. Each shuffle step needs an index below
+// a different bound; several of them are drawn from a single 64-bit number at
+// once (Brackett-Rozinsky & Lemire, "Batched Ranged Random Integer
+// Generation"), so a whole deal costs a handful of generator steps instead of
+// one or more per card.
+
+// Upper limit of the product of the bounds drawn from one 64-bit number. The
+// chance of drawing again is below BATCH_LIMIT / 2^64.
+#define BATCH_LIMIT     (1ULL << 32)
+
+static inline uint64_t rng_next64(kusokurae_rng_t *rng) {
+    uint64_t hi = kusokurae_rng_next(rng);
+    return hi << 32 | kusokurae_rng_next(rng);
+}
+
+// Fills out[0..k) with independent, uniform indices below n, n - 1, ...,
+// n - k + 1, where product is the product of those bounds.
+static void draw_batch(kusokurae_rng_t *rng, int n, int k, uint64_t product, uint8_t *out) {
+    __uint128_t m;
+    uint64_t low, threshold = 0;
+    int i;
+    for (;;) {
+        low = rng_next64(rng);
+        for (i = 0; i < k; i++) {
+            m = (__uint128_t)low * (uint64_t)(n - i);
+            out[i] = (uint8_t)(m >> 64);
+            low = (uint64_t)m;
+        }
+        if (low >= product) {
+            return;
+        }
+        // Slow path, as in Lemire's single-bound method: reject the few
+        // numbers that would bias the result.
+        if (threshold == 0) {
+            threshold = -product % product;
+        }
+        if (low >= threshold) {
+            return;
+        }
+    }
+}
+
+// Puts the cards 1~n into deck[0..n), shuffled as far as deck[0..drawn): the
+// rest are what's left, in no particular order.
+static void shuffle(kusokurae_rng_t *rng, int n, int drawn, uint8_t *deck) {
+    uint8_t index[KUSOKURAE_MAX_DECKS * KUSOKURAE_DECK_SIZE];
+    int i, j, k;
+    uint8_t t;
+    uint64_t product;
+    for (i = 0; i < n; i++) {
+        deck[i] = (uint8_t)(i + 1);
+    }
+    for (i = 0; i < drawn; i += k) {
+        product = n - i;
+        for (k = 1; i + k < drawn && product * (n - i - k) <= BATCH_LIMIT; k++) {
+            product *= n - i - k;
+        }
+        draw_batch(rng, n - i, k, product, index);
+        for (j = 0; j < k; j++) {
+            t = deck[i + j];
+            deck[i + j] = deck[i + j + index[j]];
+            deck[i + j + index[j]] = t;
+        }
+    }
+}
+
+void deal_hands(int np, kusokurae_rng_t *rng, uint64_t *hands) {
+    uint8_t deck[KUSOKURAE_DECK_SIZE];
+    // The 4-player game leaves out one Angel, the first card of the deck.
+    int n = KUSOKURAE_DECK_SIZE - (np == 4), each = n / np, drawn = each * (np - 1);
+    int i, j, k;
+    shuffle(rng, n, drawn, deck);
+    memset(hands, 0, sizeof(uint64_t) * KUSOKURAE_MAX_PLAYERS);
+    uint64_t left = (CARD_BIT(n) << 1) - 1;
+    for (i = 0, k = 0; k < np - 1; k++) {
+        for (j = 0; j < each; j++, i++) {
+            hands[k] |= CARD_BIT(deck[i]);
+        }
+        left &= ~hands[k];
+    }
+    // The last hand gets what's left.
+    hands[np - 1] = left;
+}
+
+void deal_cards(int np, int nd, kusokurae_rng_t *rng, kusokurae_cards_t *hands) {
+    uint8_t deck[KUSOKURAE_MAX_DECKS * KUSOKURAE_DECK_SIZE];
+    // Leave out the top cards of the last deck, so that the deal is even.
+    int n = nd * KUSOKURAE_DECK_SIZE - nd * KUSOKURAE_DECK_SIZE % np, each = n / np;
+    int i, card;
+    shuffle(rng, n, each * (np - 1), deck);
+    memset(hands, 0, sizeof(kusokurae_cards_t) * KUSOKURAE_MAX_DECK_PLAYERS);
+    for (i = 0; i < n; i++) {
+        card = deck[i] - 1;
+        hands[i / each].deck[card / KUSOKURAE_DECK_SIZE] |= 1ULL << card % KUSOKURAE_DECK_SIZE;
+    }
+}
+
+kusokurae_error_t kusokurae_deal_many(int32_t np, kusokurae_rng_t *rng, int64_t n,
+                                      kusokurae_deal_t *out) {
+    if (rng == NULL || (out == NULL && n > 0)) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (np < 3 || np > KUSOKURAE_MAX_PLAYERS) {
+        return KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS;
+    }
+    for (int64_t i = 0; i < n; i++) {
+        deal_hands(np, rng, out[i].hands);
+    }
+    return KUSOKURAE_SUCCESS;
+}
+
+// Deal IDs number the deals of np players in lexicographic order of the owner
+// of card 1, card 2, ... (player index - 1). The number of deals that
+// complete a partial deal depends only on how many cards each player still
+// needs, and is looked up in a table of multinomial coefficients indexed by
+// those counts, written in base each + 1.
+
+#define EACH_3      (KUSOKURAE_DECK_SIZE / 3)
+#define EACH_4      ((KUSOKURAE_DECK_SIZE - 1) / 4)
+
+static uint64_t MULTINOMIAL_3[(EACH_3 + 1) * (EACH_3 + 1) * (EACH_3 + 1)];
+static uint64_t MULTINOMIAL_4[(EACH_4 + 1) * (EACH_4 + 1) * (EACH_4 + 1) * (EACH_4 + 1)];
+
+typedef struct {
+    int n;
+    int each;
+    // Index step of one card more for player i
+    int stride[KUSOKURAE_MAX_PLAYERS];
+    // Index of the full counts, i.e. of a deal not started
+    int full;
+    uint64_t *table;
+} deal_shape_t;
+
+static deal_shape_t SHAPE[KUSOKURAE_MAX_PLAYERS + 1];
+
+void deal_init() {
+    int np, i, idx, rest;
+    for (np = 3; np <= KUSOKURAE_MAX_PLAYERS; np++) {
+        deal_shape_t *shape = &SHAPE[np];
+        shape->n = KUSOKURAE_DECK_SIZE - (np == 4);
+        shape->each = shape->n / np;
+        shape->table = np == 3 ? MULTINOMIAL_3 : MULTINOMIAL_4;
+        shape->full = 0;
+        for (i = 0; i < np; i++) {
+            shape->stride[i] = i ? shape->stride[i - 1] * (shape->each + 1) : 1;
+            shape->full += shape->each * shape->stride[i];
+        }
+        // Every entry only refers to smaller indices.
+        shape->table[0] = 1;
+        for (idx = 1; idx <= shape->full; idx++) {
+            shape->table[idx] = 0;
+            for (i = 0, rest = idx; i < np; i++, rest /= shape->each + 1) {
+                if (rest % (shape->each + 1) != 0) {
+                    shape->table[idx] += shape->table[idx - shape->stride[i]];
+                }
+            }
+        }
+    }
+}
+
+int deal_valid(int np, const uint64_t *hands) {
+    uint64_t seen = 0;
+    const deal_shape_t *shape = &SHAPE[np];
+    for (int i = 0; i < np; i++) {
+        if (mask_popcount(hands[i]) != shape->each || (hands[i] & seen)) {
+            return 0;
+        }
+        seen |= hands[i];
+    }
+    return seen == (CARD_BIT(shape->n) << 1) - 1;
+}
+
+uint64_t kusokurae_deal_count(int32_t np) {
+    if (np < 3 || np > KUSOKURAE_MAX_PLAYERS) {
+        return 0;
+    }
+    return SHAPE[np].table[SHAPE[np].full];
+}
+
+kusokurae_error_t kusokurae_deal_rank(int32_t np, const uint64_t *hands, uint64_t *id) {
+    int counts[KUSOKURAE_MAX_PLAYERS], order, owner, q;
+    if (hands == NULL || id == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (np < 3 || np > KUSOKURAE_MAX_PLAYERS) {
+        return KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS;
+    }
+    if (!deal_valid(np, hands)) {
+        return KUSOKURAE_ERROR_BAD_DEAL;
+    }
+    const deal_shape_t *shape = &SHAPE[np];
+    int idx = shape->full;
+    uint64_t ret = 0;
+    for (q = 0; q < np; q++) {
+        counts[q] = shape->each;
+    }
+    for (order = 1; order <= shape->n; order++) {
+        for (owner = 0; !(hands[owner] & CARD_BIT(order)); owner++);
+        // Skip the deals giving the card to a player before its owner.
+        for (q = 0; q < owner; q++) {
+            if (counts[q] > 0) {
+                ret += shape->table[idx - shape->stride[q]];
+            }
+        }
+        idx -= shape->stride[owner];
+        counts[owner]--;
+    }
+    *id = ret;
+    return KUSOKURAE_SUCCESS;
+}
+
+// Finds the owner of every card of deal id, by display_order - 1.
+static void deal_owners(const deal_shape_t *shape, int np, uint64_t id, uint8_t *owners) {
+    int counts[KUSOKURAE_MAX_PLAYERS], idx = shape->full, i, q;
+    uint64_t w;
+    for (q = 0; q < np; q++) {
+        counts[q] = shape->each;
+    }
+    for (i = 0; i < shape->n; i++) {
+        for (q = 0; ; q++) {
+            if (counts[q] == 0) {
+                continue;
+            }
+            w = shape->table[idx - shape->stride[q]];
+            if (id < w) {
+                break;
+            }
+            id -= w;
+        }
+        owners[i] = (uint8_t)q;
+        idx -= shape->stride[q];
+        counts[q]--;
+    }
+}
+
+static void owners_to_hands(int n, const uint8_t *owners, uint64_t *hands) {
+    memset(hands, 0, sizeof(uint64_t) * KUSOKURAE_MAX_PLAYERS);
+    for (int i = 0; i < n; i++) {
+        hands[owners[i]] |= CARD_BIT(i + 1);
+    }
+}
+
+kusokurae_error_t kusokurae_deal_unrank(int32_t np, uint64_t id, uint64_t *hands) {
+    uint8_t owners[KUSOKURAE_DECK_SIZE];
+    if (hands == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (np < 3 || np > KUSOKURAE_MAX_PLAYERS) {
+        return KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS;
+    }
+    if (id >= kusokurae_deal_count(np)) {
+        return KUSOKURAE_ERROR_BAD_DEAL;
+    }
+    deal_owners(&SHAPE[np], np, id, owners);
+    owners_to_hands(SHAPE[np].n, owners, hands);
+    return KUSOKURAE_SUCCESS;
+}
+
+kusokurae_error_t kusokurae_deal_unrank_many(int32_t np, uint64_t first, int64_t n,
+                                             kusokurae_deal_t *out) {
+    uint8_t owners[KUSOKURAE_DECK_SIZE], t;
+    int i, j, len;
+    if (out == NULL && n > 0) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (np < 3 || np > KUSOKURAE_MAX_PLAYERS) {
+        return KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS;
+    }
+    uint64_t count = kusokurae_deal_count(np);
+    if (n < 0 || first > count || (uint64_t)n > count - first) {
+        return KUSOKURAE_ERROR_BAD_DEAL;
+    }
+    if (n == 0) {
+        return KUSOKURAE_SUCCESS;
+    }
+    len = SHAPE[np].n;
+    deal_owners(&SHAPE[np], np, first, owners);
+    for (int64_t k = 0; ; k++) {
+        owners_to_hands(len, owners, out[k].hands);
+        if (k + 1 == n) {
+            break;
+        }
+        // The next deal in ID order is the next permutation of the owners.
+        for (i = len - 2; owners[i] >= owners[i + 1]; i--);
+        for (j = len - 1; owners[j] <= owners[i]; j--);
+        t = owners[i];
+        owners[i] = owners[j];
+        owners[j] = t;
+        for (i++, j = len - 1; i < j; i++, j--) {
+            t = owners[i];
+            owners[i] = owners[j];
+            owners[j] = t;
+        }
+    }
+    return KUSOKURAE_SUCCESS;
+}
@@ -0,0 +1,30 @@
+#include "sm.h"
+#include "sm_internal.h"
+#include "game.hxx"
+
+// The deck tables of sm_internal.h, laid out at compile time by the constexpr
+// functions of game.hxx. They are in place before any code runs, so nothing
+// has to wait for kusokurae_global_init to read them.
+
+namespace {
+
+using namespace kusokurae;
+
+constexpr deck_layout_t make_deck_layout() {
+    deck_layout_t ret{};
+    for (int i = 0; i < KUSOKURAE_DECK_SIZE; i++) {
+        int order = KUSOKURAE_DECK_SIZE - i, suit = card_suit(order), rank = card_rank(order);
+        ret.deck[i] = kusokurae_card_t{ (uint32_t)order, suit, rank, 0 };
+        ret.suit_rank[suit + 1][rank] |= card_bit(order);
+        ret.suit[suit + 1] |= card_bit(order);
+        ret.rank[rank] |= card_bit(order);
+    }
+    return ret;
+}
+
+} // namespace
+
+constinit const deck_layout_t DECK_LAYOUT = make_deck_layout();
+
+static_assert(make_deck_layout().rank[0] == ZERO_RANK, "zeros agree with game.hxx");
+static_assert(make_deck_layout().suit[KUSOKURAE_SUIT_OTHER + 1] == GHOST, "Ghost agrees with game.hxx");
@@ -0,0 +1,79 @@
+#include <string.h>
+#include "sm.h"
+#include "sm_internal.h"
+#include "game.hxx"
+
+// Games of one or two decks on card sets, for up to 6 players. Like the
+// compact engine, moves run on the specialization of kusokurae::Game
+// (game.hxx) for the number of players and decks.
+
+namespace {
+
+template <int NP, int ND>
+void decks_begin(kusokurae_decks_state_t *self) {
+    deal_cards(NP, ND, &self->rng_state, self->hand);
+    kusokurae::Game<NP, ND>::begin(self);
+}
+
+} // namespace
+
+kusokurae_error_t kusokurae_decks_start(kusokurae_decks_state_t *self, int32_t np, int32_t nd) {
+    if (self == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (nd < 1 || nd > KUSOKURAE_MAX_DECKS) {
+        return KUSOKURAE_ERROR_BAD_ARGUMENT;
+    }
+    if (np < 3 || np > (nd == 1 ? KUSOKURAE_MAX_PLAYERS : KUSOKURAE_MAX_DECK_PLAYERS)) {
+        return KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS;
+    }
+    kusokurae_rng_t rng = self->rng_state;
+    memset(self, 0, sizeof(kusokurae_decks_state_t));
+    self->rng_state = rng;
+    self->np = (uint8_t)np;
+    self->nd = (uint8_t)nd;
+
+    switch (nd * 8 + np) {
+    case 8 + 3:
+        decks_begin<3, 1>(self);
+        break;
+    case 8 + 4:
+        decks_begin<4, 1>(self);
+        break;
+    case 16 + 3:
+        decks_begin<3, 2>(self);
+        break;
+    case 16 + 4:
+        decks_begin<4, 2>(self);
+        break;
+    case 16 + 5:
+        decks_begin<5, 2>(self);
+        break;
+    default:
+        decks_begin<6, 2>(self);
+        break;
+    }
+    return KUSOKURAE_SUCCESS;
+}
+
+kusokurae_error_t kusokurae_decks_play(kusokurae_decks_state_t *self, int32_t card) {
+    if (self == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    switch (self->nd * 8 + self->np) {
+    case 8 + 3:
+        return kusokurae::Game<3, 1>::play(self, card);
+    case 8 + 4:
+        return kusokurae::Game<4, 1>::play(self, card);
+    case 16 + 3:
+        return kusokurae::Game<3, 2>::play(self, card);
+    case 16 + 4:
+        return kusokurae::Game<4, 2>::play(self, card);
+    case 16 + 5:
+        return kusokurae::Game<5, 2>::play(self, card);
+    case 16 + 6:
+        return kusokurae::Game<6, 2>::play(self, card);
+    default:
+        return KUSOKURAE_ERROR_NOT_IN_GAME;
+    }
+}
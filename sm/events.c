@@ -0,0 +1,52 @@
+#include <string.h>
+#include "sm.h"
+#include "sm_internal.h"
+
+// Event rings let a game report what happens in it without calling back into
+// the caller: the engine writes events as it goes (game_event in
+// sm_internal.h), and the caller takes them out in batches, whenever it suits
+// it and possibly from another thread.
+//
+// There is one writer (the thread playing the game) and one reader. The
+// writer only moves head and the reader only moves tail, each publishing its
+// progress to the other with release/acquire ordering. A full ring drops new
+// events rather than overwrite ones the reader may be copying.
+
+kusokurae_error_t kusokurae_event_ring_init(kusokurae_event_ring_t *ring,
+                                            kusokurae_event_t *events,
+                                            uint32_t capacity) {
+    if (ring == NULL || events == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        return KUSOKURAE_ERROR_BAD_ARGUMENT;
+    }
+    memset(ring, 0, sizeof(kusokurae_event_ring_t));
+    ring->events = events;
+    ring->capacity = capacity;
+    return KUSOKURAE_SUCCESS;
+}
+
+int32_t kusokurae_event_ring_drain(kusokurae_event_ring_t *ring,
+                                   kusokurae_event_t *out,
+                                   int32_t max) {
+    if (ring == NULL || out == NULL || max <= 0) {
+        return 0;
+    }
+    uint32_t tail = ring->tail;
+    uint32_t n = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    if (n > (uint32_t)max) {
+        n = (uint32_t)max;
+    }
+    // At most two runs, split where the ring wraps around.
+    uint32_t start = tail & (ring->capacity - 1);
+    uint32_t first = ring->capacity - start < n ? ring->capacity - start : n;
+    memcpy(out, ring->events + start, first * sizeof(kusokurae_event_t));
+    memcpy(out + first, ring->events, (n - first) * sizeof(kusokurae_event_t));
+    __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+    return (int32_t)n;
+}
+
+uint32_t kusokurae_event_ring_dropped(const kusokurae_event_ring_t *ring) {
+    return ring != NULL ? __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) : 0;
+}
@@ -0,0 +1,188 @@
+#include <string.h>
+#include "sm.h"
+#include "sm_internal.h"
+#include "game.hxx"
+
+// The full engine's deal and moves, on the specialization of kusokurae::Game
+// for the number of players. The moves keep the card records, tricks, hash,
+// events and undo records of kusokurae_game_state_t up to date; the loops
+// over players run to the constant NP.
+
+namespace kusokurae {
+
+template <int NP, int ND>
+void Game<NP, ND>::start(kusokurae_game_state_t *self) {
+    uint64_t hands[KUSOKURAE_MAX_PLAYERS];
+    deal_hands(NP, &self->rng_state, hands);
+    game_set_hands(self, hands);
+}
+
+template <int NP, int ND>
+kusokurae_error_t Game<NP, ND>::play(kusokurae_game_state_t *self, kusokurae_card_t card,
+                                     kusokurae_undo_t *undo) {
+    int i;
+    if (self->status != KUSOKURAE_STATUS_PLAY) {
+        return KUSOKURAE_ERROR_NOT_IN_GAME;
+    }
+    // As kusokurae_get_active_player: whoever follows in the round in progress
+    const kusokurae_trick_t *t = &self->tricks[self->nround];
+    i = t->leader + t->nmoves;
+    kusokurae_player_t *p = &self->players[i >= NP ? i - NP : i];
+
+    int pos = player_has_card(p, &card);
+    if (pos < 0) {
+        return KUSOKURAE_ERROR_CARD_NOT_FOUND;
+    }
+    if (!kusokurae_card_is_playable(p->cards[pos])) {
+        return KUSOKURAE_ERROR_FORBIDDEN_MOVE;
+    }
+
+    if (undo != NULL) {
+        undo->player = p->index - 1;
+        undo->order = card.display_order;
+        undo->status = self->status;
+        undo->high_ranker_index = self->high_ranker_index;
+        undo->round_done = 0;
+        undo->mover_playable = p->playable;
+        undo->hash = self->hash;
+        for (i = 0; i < KUSOKURAE_MAX_PLAYERS; i++) {
+            undo->active[i] = self->players[i].active;
+            undo->prev_round[i] = 0;
+        }
+    }
+
+    // The card goes from hand to board, and the turn and maybe the lead move
+    // on. Both are XORed out here and back in at the end.
+    self->hash ^= ZOBRIST_HAND[p->index - 1][card.display_order] ^
+                  ZOBRIST_BOARD[p->index - 1][card.display_order] ^
+                  ZOBRIST_TURN[p->index - 1] ^
+                  ZOBRIST_HIGH[self->high_ranker_index + 1];
+    player_set_card_played(p, pos, self->nround + 1);
+    // Nothing else is playable until the player's next turn.
+    player_set_playable_mask(p, 0);
+    // precord 'pointer to record', not 'pre-cord'
+    kusokurae_card_t *precord = &self->current_round[p->index - 1];
+    if (precord->display_order != 0) {
+        // This is the first move in a round (current_round is holding the last
+        // trick). Clear it.
+        if (undo != NULL) {
+            for (i = 0; i < KUSOKURAE_MAX_PLAYERS; i++) {
+                undo->prev_round[i] = self->current_round[i].display_order;
+            }
+        }
+        memset(&self->current_round, 0, sizeof(self->current_round));
+    }
+    *precord = card;
+    kusokurae_trick_t *trick = &self->tricks[self->nround];
+    trick_push(trick, NP, card.display_order);
+
+    // Update current round winner
+    if (self->high_ranker_index < 0) {
+        self->high_ranker_index = p->index - 1;
+    } else {
+        if (rules_beats(card.display_order,
+                        self->current_round[self->high_ranker_index].display_order)) {
+            self->high_ranker_index = p->index - 1;
+        }
+    }
+
+    if (undo == NULL) {
+        game_event(self, KUSOKURAE_EVENT_PLAY, p->index - 1, card.display_order, 0, 0);
+    }
+
+    kusokurae_player_t *nextp = &self->players[p->index == NP ? 0 : p->index];
+    if (nextp->active != KUSOKURAE_ROUND_WAITING) {
+        // The next player has already played his/her move:
+        // the current round (trick) should conclude.
+        kusokurae_player_t *winner = &self->players[self->high_ranker_index];
+        int doubled = trick->doubled;
+        int score = trick->score;
+        winner->cards_taken += NP;
+        winner->score += score;
+        for (i = 0; i < NP; i++) {
+            int order = self->current_round[i].display_order;
+            winner->taken |= CARD_BIT(order);
+            self->hash ^= ZOBRIST_BOARD[i][order] ^ ZOBRIST_TAKEN[winner->index - 1][order];
+        }
+        if (undo != NULL) {
+            undo->round_done = 1;
+            undo->winner = self->high_ranker_index;
+            undo->score = score;
+            undo->next = self->high_ranker_index;
+            undo->next_busted = winner->busted;
+            undo->next_playable = winner->playable;
+        } else {
+            game_event(self, KUSOKURAE_EVENT_TRICK, self->high_ranker_index,
+                       self->current_round[self->high_ranker_index].display_order, score, doubled);
+            // Before getting into the next round, call the state change
+            // callback to notify library user.
+            // Here the state does not really 'change'.
+            game_state_change(self, KUSOKURAE_STATUS_PLAY);
+        }
+
+        // Next round
+        for (i = 0; i < NP; i++) {
+            self->players[i].active = KUSOKURAE_ROUND_WAITING;
+        }
+        player_set_playable_flags(winner, 1);
+        self->high_ranker_index = -1;
+        winner->active = KUSOKURAE_ROUND_ACTIVE;
+        self->hash ^= ZOBRIST_TURN[winner->index - 1];
+
+        // Game finish
+        self->nround++;
+        if (self->nround < EACH) {
+            // Start the trick history of the next round.
+            memset(&self->tricks[self->nround], 0, sizeof(kusokurae_trick_t));
+            self->tricks[self->nround].leader = (uint8_t)(winner->index - 1);
+        } else {
+            if (undo != NULL) {
+                self->status = KUSOKURAE_STATUS_FINISH;
+            } else {
+                game_state_change(self, KUSOKURAE_STATUS_FINISH);
+                game_event(self, KUSOKURAE_EVENT_FINISH, 0, 0, 0, 0);
+            }
+        }
+    } else {
+        if (undo != NULL) {
+            undo->next = nextp->index - 1;
+            undo->next_busted = nextp->busted;
+            undo->next_playable = nextp->playable;
+        }
+        player_set_playable_flags(nextp, 0);
+        p->active = KUSOKURAE_ROUND_DONE;
+        nextp->active = KUSOKURAE_ROUND_ACTIVE;
+        self->hash ^= ZOBRIST_TURN[nextp->index - 1];
+    }
+    self->hash ^= ZOBRIST_HIGH[self->high_ranker_index + 1];
+
+    if (undo == NULL && self->cbs.move != NULL) {
+        self->cbs.move(self, p->index - 1, card.display_order, self->cbs.userdata_of_move);
+    }
+    return KUSOKURAE_SUCCESS;
+}
+
+} // namespace kusokurae
+
+void game_start(kusokurae_game_state_t *self) {
+    if (self->cfg.np == 3) {
+        kusokurae::Game<3, 1>::start(self);
+    } else {
+        kusokurae::Game<4, 1>::start(self);
+    }
+}
+
+kusokurae_error_t game_play(kusokurae_game_state_t *self, kusokurae_card_t card,
+                            kusokurae_undo_t *undo) {
+    if (self == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    switch (self->cfg.np) {
+    case 3:
+        return kusokurae::Game<3, 1>::play(self, card, undo);
+    case 4:
+        return kusokurae::Game<4, 1>::play(self, card, undo);
+    default:
+        return KUSOKURAE_ERROR_NOT_IN_GAME;
+    }
+}
@@ -0,0 +1,223 @@
+// Rules on card sets for a number of players and decks fixed at compile time,
+// with the deck as compile-time tables. The loops over players have constant
+// trip counts, so each specialization comes out unrolled. The rules themselves
+// are the kernels of sm_internal.h, the same as in the full engine, given the
+// constexpr masks below so that they fold into the specialization.
+//
+// The compact and the decks engines (compact.cxx, decks.cxx) play on the card
+// sets here. The full engine (game.cxx) deals and plays its
+// kusokurae_game_state_t on the same specializations, keeping its card
+// records along with the sets.
+//
+// A game has one deck for 3~4 players, or two for 3~6 (kusokurae_decks_state_t,
+// decks.cxx). Card sets of two decks take a word per deck. The top cards, the
+// Angels of the last deck, are left out as needed for an even deal.
+
+#ifndef BS_KUSOKURAE_GAME_HXX
+#define BS_KUSOKURAE_GAME_HXX
+
+#include <stdint.h>
+#include <utility>
+#include "sm.h"
+#include "sm_internal.h"
+
+namespace kusokurae {
+
+// The deck by display_order, also behind DECK_LAYOUT (deck.cxx): the two
+// Angels and the Ghost on top, then Baozi, Youtiao and Xiang from 9 down to 0.
+// The Ghost is third, so that a 4-player game can leave out the top card.
+constexpr int card_suit(int order) {
+    return order >= 32 ? KUSOKURAE_SUIT_BAOZI
+         : order == 31 ? KUSOKURAE_SUIT_OTHER
+         : KUSOKURAE_SUIT_BAOZI - (30 - order) / 10;
+}
+
+constexpr int card_rank(int order) {
+    return order >= 31 ? 10 : 9 - (30 - order) % 10;
+}
+
+constexpr uint64_t card_bit(int order) {
+    return 1ULL << (order - 1);
+}
+
+constexpr uint64_t suit_mask(int suit, int order = 1) {
+    return order > KUSOKURAE_DECK_SIZE ? 0
+         : (card_suit(order) == suit ? card_bit(order) : 0) | suit_mask(suit, order + 1);
+}
+
+constexpr uint64_t rank_mask(int rank, int order = 1) {
+    return order > KUSOKURAE_DECK_SIZE ? 0
+         : (card_rank(order) == rank ? card_bit(order) : 0) | rank_mask(rank, order + 1);
+}
+
+// Cards of the same suit and rank as the card
+constexpr uint64_t kind_mask(int card, int order = 1) {
+    return order > KUSOKURAE_DECK_SIZE ? 0
+         : (card_suit(order) == card_suit(card) && card_rank(order) == card_rank(card)
+                ? card_bit(order) : 0) | kind_mask(card, order + 1);
+}
+
+struct deck_tables {
+    // By display_order, 0 for none
+    uint64_t kind[KUSOKURAE_DECK_SIZE + 1];
+    int8_t rank[KUSOKURAE_DECK_SIZE + 1];
+};
+
+template <int... I>
+constexpr deck_tables make_deck_tables(std::integer_sequence<int, I...>) {
+    return deck_tables{ { (I ? kind_mask(I) : 0)... }, { (int8_t)(I ? card_rank(I) : 0)... } };
+}
+
+constexpr deck_tables DECK_TABLES = make_deck_tables(std::make_integer_sequence<int, KUSOKURAE_DECK_SIZE + 1>());
+
+constexpr uint64_t ZERO_RANK = rank_mask(0);
+constexpr uint64_t GHOST = suit_mask(KUSOKURAE_SUIT_OTHER);
+constexpr uint64_t BAOZI = suit_mask(KUSOKURAE_SUIT_BAOZI);
+constexpr uint64_t XIANG = suit_mask(KUSOKURAE_SUIT_XIANG);
+
+static_assert(card_rank(33) == 10 && card_suit(31) == KUSOKURAE_SUIT_OTHER, "Angels and Ghost on top");
+static_assert(card_rank(1) == 0 && card_suit(1) == KUSOKURAE_SUIT_XIANG, "Xiang 0 at the bottom");
+static_assert(__builtin_popcountll(ZERO_RANK) == 3, "one zero per suit");
+
+// The words of a card set, one per deck
+inline uint64_t *words(uint64_t &cards) {
+    return &cards;
+}
+
+inline uint64_t *words(kusokurae_cards_t &cards) {
+    return cards.deck;
+}
+
+inline int8_t &ghost_holder(kusokurae_compact_state_t *self, int) {
+    return self->ghost_holder_index;
+}
+
+inline int8_t &ghost_holder(kusokurae_decks_state_t *self, int deck) {
+    return self->ghost_holder_index[deck];
+}
+
+template <int NP, int ND>
+struct Game {
+    static constexpr int CARDS = KUSOKURAE_DECK_SIZE * ND;
+    // The top cards of the last deck left out, so that the deal is even
+    static constexpr int OUT = CARDS % NP;
+    static constexpr int EACH = CARDS / NP;
+
+    static_assert(ND >= 1 && ND <= KUSOKURAE_MAX_DECKS, "one or two decks");
+    static_assert(NP >= 3 && NP <= KUSOKURAE_MAX_DECK_PLAYERS, "3~6 players");
+    static_assert(OUT <= 2, "only the two Angels on top may be left out");
+    static_assert(EACH <= KUSOKURAE_MAX_HAND_CARDS, "hands fit the card slots");
+
+    // Deck (0~) and display_order of a card, see kusokurae_decks_state_t
+    static int deck_of(int card) {
+        return ND == 1 ? 0 : (card - 1) / KUSOKURAE_DECK_SIZE;
+    }
+
+    static int order_of(int card) {
+        return ND == 1 ? card : (card - 1) % KUSOKURAE_DECK_SIZE + 1;
+    }
+
+    // The full engine (game.cxx): deals a game, and plays a card of the player
+    // on turn, as game_start and game_play. One deck only.
+    static void start(kusokurae_game_state_t *self);
+    static kusokurae_error_t play(kusokurae_game_state_t *self, kusokurae_card_t card,
+                                  kusokurae_undo_t *undo);
+
+    // The card-set engines, on kusokurae_compact_state_t with one deck or on
+    // kusokurae_decks_state_t.
+
+    // rules_playable_n for player p, into playable
+    template <class State>
+    static void set_playable(State *self, int p, bool leader) {
+        int busted = self->busted[p];
+        rules_playable_n(words(self->hand[p]), ND, ZERO_RANK, leader, &busted, words(self->playable));
+        self->busted[p] = (int8_t)busted;
+    }
+
+    // Sets up a dealt state for the first move.
+    template <class State>
+    static void begin(State *self) {
+        for (int i = 0; i < NP; i++) {
+            self->dealt[i] = self->hand[i];
+            for (int d = 0; d < ND; d++) {
+                if (words(self->hand[i])[d] & GHOST) {
+                    ghost_holder(self, d) = (int8_t)i;
+                }
+            }
+        }
+        self->status = KUSOKURAE_STATUS_PLAY;
+        self->turn = 0;
+        self->high_ranker_index = -1;
+        set_playable(self, 0, true);
+    }
+
+    template <class State>
+    static kusokurae_error_t play(State *self, int card) {
+        if (self->status != KUSOKURAE_STATUS_PLAY) {
+            return KUSOKURAE_ERROR_NOT_IN_GAME;
+        }
+        if (card < 1 || card > CARDS) {
+            return KUSOKURAE_ERROR_CARD_NOT_FOUND;
+        }
+        int p = self->turn;
+        // Like the full engine, take the player's highest card of the same
+        // kind, from the last deck that has one.
+        uint64_t *hand = words(self->hand[p]), kind = DECK_TABLES.kind[order_of(card)];
+        int d = ND - 1;
+        while (d > 0 && !(hand[d] & kind)) {
+            d--;
+        }
+        if (!(hand[d] & kind)) {
+            return KUSOKURAE_ERROR_CARD_NOT_FOUND;
+        }
+        int order = mask_highest(hand[d] & kind);
+        if (!(words(self->playable)[d] & card_bit(order))) {
+            return KUSOKURAE_ERROR_FORBIDDEN_MOVE;
+        }
+        card = d * KUSOKURAE_DECK_SIZE + order;
+
+        hand[d] &= ~card_bit(order);
+        self->played_round[card] = self->nround + 1;
+        if (self->trick[p]) {
+            // First move of a round: the board still shows the last one.
+            for (int i = 0; i < NP; i++) {
+                self->trick[i] = 0;
+            }
+        }
+        self->trick[p] = (uint8_t)card;
+        // Of equal ranks, the first played keeps the lead.
+        if (self->high_ranker_index < 0 ||
+            DECK_TABLES.rank[order] > DECK_TABLES.rank[order_of(self->trick[self->high_ranker_index])]) {
+            self->high_ranker_index = (int8_t)p;
+        }
+
+        int next = p + 1 == NP ? 0 : p + 1;
+        if (self->trick[next]) {
+            // Everybody has played: the round concludes.
+            int winner = self->high_ranker_index;
+            uint64_t cards[ND] = {};
+            for (int i = 0; i < NP; i++) {
+                cards[deck_of(self->trick[i])] |= card_bit(order_of(self->trick[i]));
+            }
+            self->score[winner] += rules_round_points_n(cards, ND, BAOZI, XIANG,
+                                                        (GHOST & card_bit(order_of(self->trick[winner]))) != 0);
+            for (d = 0; d < ND; d++) {
+                words(self->taken[winner])[d] |= cards[d];
+            }
+            self->high_ranker_index = -1;
+            self->turn = (uint8_t)winner;
+            set_playable(self, winner, true);
+            if (++self->nround >= EACH) {
+                self->status = KUSOKURAE_STATUS_FINISH;
+            }
+        } else {
+            self->turn = (uint8_t)next;
+            set_playable(self, next, false);
+        }
+        return KUSOKURAE_SUCCESS;
+    }
+};
+
+} // namespace kusokurae
+
+#endif // BS_KUSOKURAE_GAME_HXX
@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "sm.h"
+#include "sm_internal.h"
+
+// Information-set Monte Carlo tree search, single observer variant: one tree
+// of the searching player's view, whose nodes are move sequences. Every
+// iteration deals the hidden cards anew, walks down the tree along moves that
+// are legal in that deal, adds one node and finishes the game with random
+// moves.
+
+namespace {
+
+// Rewards are summed in fixed point so that they can be added atomically.
+const int64_t REWARD_ONE = 1 << 20;
+
+// Iterations a worker runs between looks at the clock
+const int64_t CLOCK_EVERY = 16;
+
+const double DEFAULT_EXPLORATION = 0.7;
+
+struct tree_node {
+    // The move leading here (see move_class) and who made it (player index - 1)
+    uint8_t move;
+    int8_t player;
+
+    // Written before the node is published, read-only afterwards
+    tree_node *sibling;
+    std::atomic<tree_node *> children;
+
+    std::atomic<int32_t> visits;
+    // Visits of the parent in which this move was legal
+    std::atomic<int32_t> avail;
+    // Iterations still on their way through this node, counted as losses
+    std::atomic<int32_t> vloss;
+    // Sum of the mover's rewards
+    std::atomic<int64_t> reward;
+};
+
+// Nodes are never freed one by one, so each worker carves them out of its own
+// blocks, which go away with the search.
+class node_arena {
+public:
+    tree_node *alloc(int move, int player) {
+        if (used_ == BLOCK) {
+            blocks_.emplace_back(new tree_node[BLOCK]);
+            used_ = 0;
+        }
+        tree_node *n = &blocks_.back()[used_++];
+        n->move = (uint8_t)move;
+        n->player = (int8_t)player;
+        n->sibling = nullptr;
+        n->children.store(nullptr, std::memory_order_relaxed);
+        n->visits.store(0, std::memory_order_relaxed);
+        n->avail.store(0, std::memory_order_relaxed);
+        n->vloss.store(0, std::memory_order_relaxed);
+        n->reward.store(0, std::memory_order_relaxed);
+        return n;
+    }
+
+private:
+    static const size_t BLOCK = 4096;
+    std::vector<std::unique_ptr<tree_node[]>> blocks_;
+    size_t used_ = BLOCK;
+};
+
+struct search_state {
+    const kusokurae_game_state_t *root_state;
+    int seat;
+    double exploration;
+    uint64_t seed;
+    int64_t max_iterations;
+    bool timed;
+    std::chrono::steady_clock::time_point deadline;
+
+    tree_node *root;
+    std::atomic<int64_t> claimed;
+    std::atomic<int64_t> done;
+    std::atomic<int64_t> nodes;
+};
+
+// Cards of the same suit and rank can't be told apart once played, so moves
+// are named after the highest card of their kind in the deck.
+inline int move_class(int order) {
+    const kusokurae_card_t &card = DECK_CARD(order);
+    return mask_highest(SUIT_RANK_MASK[card.suit + 1][card.rank]);
+}
+
+uint64_t move_set(uint64_t playable) {
+    uint64_t ret = 0;
+    while (playable) {
+        ret |= CARD_BIT(move_class(mask_lowest(playable)));
+        playable &= playable - 1;
+    }
+    return ret;
+}
+
+int random_member(uint64_t set, kusokurae_rng_t *rng) {
+    for (uint32_t n = kusokurae_rng_bounded(rng, mask_popcount(set)); n > 0; n--) {
+        set &= set - 1;
+    }
+    return mask_lowest(set);
+}
+
+// k cards out of pool, each subset equally likely.
+uint64_t random_subset(uint64_t pool, int k, kusokurae_rng_t *rng) {
+    uint64_t ret = 0;
+    int n = mask_popcount(pool), order;
+    while (k > 0) {
+        order = mask_lowest(pool);
+        pool &= pool - 1;
+        if ((int)kusokurae_rng_bounded(rng, n) < k) {
+            ret |= CARD_BIT(order);
+            k--;
+        }
+        n--;
+    }
+    return ret;
+}
+
+// Deals the cards the seat can't see to the other players at random, keeping
+// hand sizes. A player who had to lead a zero (busted == 2) held nothing else,
+// so he/she only gets zeros, dealt first.
+void determinize(kusokurae_game_state_t *g, int seat) {
+    uint64_t unknown = 0, pool, hand;
+    int i, need, pass, restricted;
+    for (i = 0; i < g->cfg.np; i++) {
+        if (i != seat) {
+            unknown |= g->players[i].hand;
+        }
+    }
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < g->cfg.np; i++) {
+            restricted = g->players[i].busted == 2;
+            if (i == seat || restricted != (pass == 0)) {
+                continue;
+            }
+            need = mask_popcount(g->players[i].hand);
+            pool = restricted ? unknown & RANK_MASK[0] : unknown;
+            if (mask_popcount(pool) < need) {
+                pool = unknown;
+            }
+            hand = random_subset(pool, need, &g->rng_state);
+            unknown &= ~hand;
+            player_set_hand(&g->players[i], hand);
+        }
+    }
+}
+
+// Scores mapped to 0 (lowest at the table) ~ 1 (highest).
+void rewards(const kusokurae_game_state_t *g, int64_t *out) {
+    int32_t lo = g->players[0].score, hi = lo, i;
+    for (i = 1; i < g->cfg.np; i++) {
+        lo = std::min(lo, g->players[i].score);
+        hi = std::max(hi, g->players[i].score);
+    }
+    for (i = 0; i < g->cfg.np; i++) {
+        out[i] = hi == lo ? REWARD_ONE / 2 : (g->players[i].score - lo) * REWARD_ONE / (hi - lo);
+    }
+}
+
+// Returns the child for move, adding it if no other worker did first.
+tree_node *add_child(search_state *s, tree_node *parent, int move, int player, node_arena *arena) {
+    tree_node *head = parent->children.load(std::memory_order_acquire), *n = nullptr, *c;
+    for (;;) {
+        for (c = head; c != nullptr; c = c->sibling) {
+            if (c->move == move) {
+                // Lost a race; n (if any) stays unused in the arena.
+                return c;
+            }
+        }
+        if (n == nullptr) {
+            n = arena->alloc(move, player);
+        }
+        n->sibling = head;
+        if (parent->children.compare_exchange_weak(head, n, std::memory_order_release,
+                                                   std::memory_order_acquire)) {
+            s->nodes.fetch_add(1, std::memory_order_relaxed);
+            return n;
+        }
+    }
+}
+
+double ucb(const tree_node *c, double exploration) {
+    double n = c->visits.load(std::memory_order_relaxed) + c->vloss.load(std::memory_order_relaxed);
+    if (n == 0) {
+        return std::numeric_limits<double>::infinity();
+    }
+    double mean = c->reward.load(std::memory_order_relaxed) / (double)REWARD_ONE / n;
+    return mean + exploration * std::sqrt(std::log((double)c->avail.load(std::memory_order_relaxed)) / n);
+}
+
+void iterate(search_state *s, kusokurae_game_state_t *g, kusokurae_rng_t *rng, node_arena *arena) {
+    tree_node *path[KUSOKURAE_DECK_SIZE];
+    int depth = 0, order;
+    std::memcpy(g, s->root_state, sizeof(kusokurae_game_state_t));
+    std::memset(&g->cbs, 0, sizeof(kusokurae_game_callbacks_t));
+    g->rng_state = *rng;
+    determinize(g, s->seat);
+
+    // Selection and expansion
+    tree_node *n = s->root, *c, *best;
+    kusokurae_player_t *p;
+    while (g->status == KUSOKURAE_STATUS_PLAY) {
+        p = kusokurae_get_active_player(g);
+        uint64_t legal = move_set(p->playable), seen = 0;
+        double best_score = -1, score;
+        best = nullptr;
+        for (c = n->children.load(std::memory_order_acquire); c != nullptr; c = c->sibling) {
+            if (!(legal & CARD_BIT(c->move))) {
+                continue;
+            }
+            seen |= CARD_BIT(c->move);
+            c->avail.fetch_add(1, std::memory_order_relaxed);
+            score = ucb(c, s->exploration);
+            if (score > best_score) {
+                best_score = score;
+                best = c;
+            }
+        }
+        if (legal & ~seen) {
+            best = add_child(s, n, random_member(legal & ~seen, &g->rng_state), p->index - 1, arena);
+            best->avail.fetch_add(1, std::memory_order_relaxed);
+        }
+        best->vloss.fetch_add(1, std::memory_order_relaxed);
+        kusokurae_game_play(g, DECK_CARD(best->move));
+        path[depth++] = best;
+        if (legal & ~seen) {
+            break;
+        }
+        n = best;
+    }
+
+    // Playout
+    while (g->status == KUSOKURAE_STATUS_PLAY) {
+        p = kusokurae_get_active_player(g);
+        order = policy_pick(g, p, KUSOKURAE_POLICY_RANDOM);
+        kusokurae_game_play(g, DECK_CARD(order));
+    }
+
+    // Backpropagation
+    int64_t r[KUSOKURAE_MAX_PLAYERS];
+    rewards(g, r);
+    for (int i = 0; i < depth; i++) {
+        path[i]->reward.fetch_add(r[path[i]->player], std::memory_order_relaxed);
+        path[i]->visits.fetch_add(1, std::memory_order_relaxed);
+        path[i]->vloss.fetch_sub(1, std::memory_order_relaxed);
+    }
+    *rng = g->rng_state;
+}
+
+void ismcts_worker(search_state *s, uint64_t stream, node_arena *arena) {
+    kusokurae_game_state_t g;
+    kusokurae_rng_t rng;
+    kusokurae_rng_seed(&rng, s->seed, stream);
+    for (int64_t i = 1;; i++) {
+        if (s->max_iterations > 0 &&
+            s->claimed.fetch_add(1, std::memory_order_relaxed) >= s->max_iterations) {
+            break;
+        }
+        iterate(s, &g, &rng, arena);
+        s->done.fetch_add(1, std::memory_order_relaxed);
+        if (s->timed && i % CLOCK_EVERY == 0 && std::chrono::steady_clock::now() >= s->deadline) {
+            break;
+        }
+    }
+}
+
+} // namespace
+
+kusokurae_error_t kusokurae_ismcts_search(const kusokurae_game_state_t *self,
+                                          const kusokurae_ismcts_config_t *cfg,
+                                          kusokurae_ismcts_result_t *out) {
+    if (self == NULL || cfg == NULL || out == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (self->cfg.np == 0) {
+        return KUSOKURAE_ERROR_UNINITIALIZED;
+    }
+    if (self->status != KUSOKURAE_STATUS_PLAY) {
+        return KUSOKURAE_ERROR_NOT_IN_GAME;
+    }
+    if (cfg->iterations <= 0 && cfg->time_ns <= 0) {
+        return KUSOKURAE_ERROR_BAD_ARGUMENT;
+    }
+    kusokurae_player_t *p = kusokurae_get_active_player(const_cast<kusokurae_game_state_t *>(self));
+    if (p == NULL) {
+        return KUSOKURAE_ERROR_BUG_NOBODY_ACTIVE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::memset(out, 0, sizeof(kusokurae_ismcts_result_t));
+    uint64_t legal = move_set(p->playable);
+    int move = mask_highest(legal);
+    if (mask_popcount(legal) > 1) {
+        int32_t n_threads = cfg->n_threads;
+        if (n_threads <= 0) {
+            n_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        std::vector<node_arena> arenas(n_threads);
+        search_state s;
+        s.root_state = self;
+        s.seat = p->index - 1;
+        s.exploration = cfg->exploration > 0 ? cfg->exploration : DEFAULT_EXPLORATION;
+        s.seed = cfg->seed;
+        s.max_iterations = cfg->iterations;
+        s.timed = cfg->time_ns > 0;
+        s.deadline = start + std::chrono::nanoseconds(cfg->time_ns);
+        s.root = arenas[0].alloc(0, -1);
+        s.claimed.store(0);
+        s.done.store(0);
+        s.nodes.store(1);
+
+        std::vector<std::thread> threads;
+        for (int32_t i = 1; i < n_threads; i++) {
+            threads.emplace_back(ismcts_worker, &s, (uint64_t)i, &arenas[i]);
+        }
+        ismcts_worker(&s, 0, &arenas[0]);
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        int32_t most = 0, visits;
+        for (tree_node *c = s.root->children.load(); c != nullptr; c = c->sibling) {
+            visits = c->visits.load();
+            if (visits > most) {
+                most = visits;
+                move = c->move;
+                out->value = c->reward.load() / (double)REWARD_ONE / visits;
+            }
+        }
+        out->iterations = s.done.load();
+        out->nodes = s.nodes.load();
+    }
+
+    // Hand out the player's own copy of the card.
+    const kusokurae_card_t &card = DECK_CARD(move);
+    int order = mask_highest(p->hand & SUIT_RANK_MASK[card.suit + 1][card.rank]);
+    out->best_move = p->cards[player_card_index(p, order)];
+    out->elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return KUSOKURAE_SUCCESS;
+}
@@ -0,0 +1,113 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sm_internal.h"
+
+// Engine counters, built in with -DKUSOKURAE_METRICS.
+//
+// A thread takes a shard on its first count and keeps adding to it alone. The
+// shards stay on a list for the life of the process: when a thread exits, its
+// shard goes back for the next new thread to take over, counts and all, so
+// nothing is lost and kusokurae_metrics_snapshot just sums the list.
+
+#ifdef KUSOKURAE_METRICS
+
+typedef struct metrics_shard {
+    kusokurae_metrics_t m;
+    struct metrics_shard *next;
+    int in_use;
+} metrics_shard_t;
+
+_Static_assert(sizeof(kusokurae_metrics_t) % sizeof(uint64_t) == 0, "counters only");
+
+__thread kusokurae_metrics_t *metrics_local;
+
+// Shared by the threads that fail to allocate a shard of their own, racily
+static metrics_shard_t metrics_fallback = { .in_use = 1 };
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static metrics_shard_t *metrics_shards = &metrics_fallback;
+
+static void metrics_detach(void *p) {
+    metrics_shard_t *shard = p;
+    pthread_mutex_lock(&metrics_lock);
+    shard->in_use = 0;
+    pthread_mutex_unlock(&metrics_lock);
+    metrics_local = NULL;
+}
+
+static void metrics_init(void) {
+    pthread_key_create(&metrics_key, metrics_detach);
+}
+
+kusokurae_metrics_t *metrics_attach(void) {
+    metrics_shard_t *shard;
+    pthread_once(&metrics_once, metrics_init);
+    pthread_mutex_lock(&metrics_lock);
+    for (shard = metrics_shards; shard != NULL && shard->in_use; shard = shard->next) {
+    }
+    if (shard == NULL) {
+        // Cache line aligned, against false sharing with other shards
+        if (posix_memalign((void **)&shard, 64, sizeof(*shard)) != 0) {
+            pthread_mutex_unlock(&metrics_lock);
+            return &metrics_fallback.m;
+        }
+        memset(shard, 0, sizeof(*shard));
+        shard->next = metrics_shards;
+        metrics_shards = shard;
+    }
+    shard->in_use = 1;
+    pthread_mutex_unlock(&metrics_lock);
+    pthread_setspecific(metrics_key, shard);
+    metrics_local = &shard->m;
+    return metrics_local;
+}
+
+int64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void metrics_observe(kusokurae_histogram_t *h, int64_t ns) {
+    int bucket = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= KUSOKURAE_HISTOGRAM_BUCKETS) {
+        bucket = KUSOKURAE_HISTOGRAM_BUCKETS - 1;
+    }
+    metrics_add(&h->count, 1);
+    metrics_add(&h->sum_ns, ns > 0 ? ns : 0);
+    metrics_add(&h->buckets[bucket], 1);
+}
+
+int32_t kusokurae_metrics_snapshot(kusokurae_metrics_t *out) {
+    uint64_t *sum = (uint64_t *)out;
+    size_t i, n = sizeof(*out) / sizeof(uint64_t);
+    const metrics_shard_t *shard;
+    if (out == NULL) {
+        return 1;
+    }
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&metrics_lock);
+    for (shard = metrics_shards; shard != NULL; shard = shard->next) {
+        const uint64_t *counters = (const uint64_t *)&shard->m;
+        for (i = 0; i < n; i++) {
+            sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    return 1;
+}
+
+#else
+
+int32_t kusokurae_metrics_snapshot(kusokurae_metrics_t *out) {
+    if (out != NULL) {
+        memset(out, 0, sizeof(*out));
+    }
+    return 0;
+}
+
+#endif
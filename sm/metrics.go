@@ -0,0 +1,191 @@
+package sm
+
+// #include "sm.h"
+import "C"
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"net/http"
+	"strings"
+	"sync/atomic"
+	"time"
+	"unsafe"
+)
+
+// Counters of the engine and of the bindings, built in with the
+// kusokurae_metrics build tag (which defines KUSOKURAE_METRICS for the C side).
+// Without it every hook compiles away and ReadMetrics returns zeros.
+//
+// To serve them on a local endpoint:
+//
+//	http.Handle("/metrics", sm.MetricsHandler())
+//	go http.ListenAndServe("localhost:9100", nil)
+
+const cSizeofHistogram = C.sizeof_kusokurae_histogram_t
+
+// HistogramBuckets is the number of buckets in a Histogram.
+const HistogramBuckets = C.KUSOKURAE_HISTOGRAM_BUCKETS
+
+// Histogram has the same memory layout with C.kusokurae_histogram_t. Bucket i
+// counts the times of 2^i up to 2^(i+1) nanoseconds; the first one also takes
+// 0 and the last one everything longer.
+type Histogram struct {
+	Count   uint64
+	SumNs   uint64
+	Buckets [HistogramBuckets]uint64
+}
+
+// Metrics holds the counters since the start of the process.
+type Metrics struct {
+	// Whether the package was built with the kusokurae_metrics tag
+	Enabled bool
+
+	// Results of the C calls behind GameState.Play and PlayUndoable, by error
+	// code (see ResultName)
+	Play [C.KUSOKURAE_ERROR_COUNT]uint64
+
+	// Updates of a player's playable cards, and how many of them found the
+	// player newly busted: with a single zero left, and with nothing but zeros
+	PlayableUpdates uint64
+	Busted          [2]uint64
+
+	// Dealing in C, and the state transition callbacks
+	Deal     Histogram
+	Callback Histogram
+
+	// Calls of the bindings from Go, cgo round trip included
+	GoPlay  Histogram
+	GoStart Histogram
+}
+
+var (
+	goPlayHist  goHistogram
+	goStartHist goHistogram
+)
+
+// goHistogram is a Histogram updated with atomics from any goroutine.
+type goHistogram struct {
+	h Histogram
+}
+
+func (g *goHistogram) observe(start time.Time) {
+	ns := time.Since(start).Nanoseconds()
+	if ns < 0 {
+		ns = 0
+	}
+	bucket := 0
+	for v := ns; v > 1 && bucket < HistogramBuckets-1; v >>= 1 {
+		bucket++
+	}
+	atomic.AddUint64(&g.h.Count, 1)
+	atomic.AddUint64(&g.h.SumNs, uint64(ns))
+	atomic.AddUint64(&g.h.Buckets[bucket], 1)
+}
+
+func (g *goHistogram) load(dst *Histogram) {
+	dst.Count = atomic.LoadUint64(&g.h.Count)
+	dst.SumNs = atomic.LoadUint64(&g.h.SumNs)
+	for i := range dst.Buckets {
+		dst.Buckets[i] = atomic.LoadUint64(&g.h.Buckets[i])
+	}
+}
+
+// ReadMetrics stores the counters summed over all threads to *m.
+func ReadMetrics(m *Metrics) {
+	var c C.kusokurae_metrics_t
+	m.Enabled = C.kusokurae_metrics_snapshot(&c) != 0
+	for i := range m.Play {
+		m.Play[i] = uint64(c.play[i])
+	}
+	m.PlayableUpdates = uint64(c.playable_updates)
+	m.Busted[0] = uint64(c.busted[0])
+	m.Busted[1] = uint64(c.busted[1])
+	m.Deal = *(*Histogram)(unsafe.Pointer(&c.deal))
+	m.Callback = *(*Histogram)(unsafe.Pointer(&c.callback))
+	goPlayHist.load(&m.GoPlay)
+	goStartHist.load(&m.GoStart)
+}
+
+// ResultName returns the name of an error code of the C library, like
+// "SUCCESS" or "FORBIDDEN_MOVE".
+func ResultName(code int) string {
+	err, ok := errMap[C.kusokurae_error_t(code)]
+	switch {
+	case code == C.KUSOKURAE_ERROR_UNIMPLEMENTED:
+		return "UNIMPLEMENTED"
+	case code == C.KUSOKURAE_ERROR_UNSPECIFIED:
+		return "UNSPECIFIED"
+	case !ok:
+		return fmt.Sprint(code)
+	case err == nil:
+		return "SUCCESS"
+	}
+	return strings.TrimPrefix(err.Error(), "KUSOKURAE_ERROR_")
+}
+
+// WritePrometheus writes the metrics in the Prometheus text format.
+func (m *Metrics) WritePrometheus(w io.Writer) error {
+	b := bufio.NewWriter(w)
+	enabled := 0
+	if m.Enabled {
+		enabled = 1
+	}
+	fmt.Fprintln(b, "# HELP kusokurae_metrics_enabled Whether the engine was built with metrics.")
+	fmt.Fprintln(b, "# TYPE kusokurae_metrics_enabled gauge")
+	fmt.Fprintln(b, "kusokurae_metrics_enabled", enabled)
+
+	fmt.Fprintln(b, "# HELP kusokurae_play_total Moves played, by result.")
+	fmt.Fprintln(b, "# TYPE kusokurae_play_total counter")
+	for code, n := range m.Play {
+		fmt.Fprintf(b, "kusokurae_play_total{result=%q} %d\n", ResultName(code), n)
+	}
+
+	fmt.Fprintln(b, "# HELP kusokurae_playable_updates_total Updates of a player's playable cards.")
+	fmt.Fprintln(b, "# TYPE kusokurae_playable_updates_total counter")
+	fmt.Fprintln(b, "kusokurae_playable_updates_total", m.PlayableUpdates)
+
+	fmt.Fprintln(b, "# HELP kusokurae_busted_total Players newly busted, by how.")
+	fmt.Fprintln(b, "# TYPE kusokurae_busted_total counter")
+	fmt.Fprintf(b, "kusokurae_busted_total{kind=\"single_zero\"} %d\n", m.Busted[0])
+	fmt.Fprintf(b, "kusokurae_busted_total{kind=\"only_zeros\"} %d\n", m.Busted[1])
+
+	writeHistogram(b, "kusokurae_deal_seconds", "Time to deal a game in the engine.", "", &m.Deal)
+	writeHistogram(b, "kusokurae_callback_seconds", "Time in state transition callbacks.", "", &m.Callback)
+	fmt.Fprintln(b, "# HELP kusokurae_cgo_call_seconds Calls of the bindings, cgo round trip included.")
+	fmt.Fprintln(b, "# TYPE kusokurae_cgo_call_seconds histogram")
+	writeHistogram(b, "kusokurae_cgo_call_seconds", "", `call="play",`, &m.GoPlay)
+	writeHistogram(b, "kusokurae_cgo_call_seconds", "", `call="start",`, &m.GoStart)
+	return b.Flush()
+}
+
+// Writes a histogram with cumulative buckets, and its HELP and TYPE lines if
+// help is not empty. labels are extra labels, each followed by a comma.
+func writeHistogram(w io.Writer, name, help, labels string, h *Histogram) {
+	if help != "" {
+		fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name)
+	}
+	var cumulative uint64
+	for i := 0; i < HistogramBuckets-1; i++ {
+		cumulative += h.Buckets[i]
+		fmt.Fprintf(w, "%s_bucket{%sle=\"%g\"} %d\n", name, labels, float64(uint64(2)<<uint(i))/1e9, cumulative)
+	}
+	fmt.Fprintf(w, "%s_bucket{%sle=\"+Inf\"} %d\n", name, labels, h.Count)
+	suffix := ""
+	if labels != "" {
+		suffix = "{" + strings.TrimSuffix(labels, ",") + "}"
+	}
+	fmt.Fprintf(w, "%s_sum%s %g\n", name, suffix, float64(h.SumNs)/1e9)
+	fmt.Fprintf(w, "%s_count%s %d\n", name, suffix, h.Count)
+}
+
+// MetricsHandler serves the metrics in the Prometheus text format.
+func MetricsHandler() http.Handler {
+	return http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		var m Metrics
+		ReadMetrics(&m)
+		w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+		m.WritePrometheus(w)
+	})
+}
@@ -0,0 +1,6 @@
+//go:build !kusokurae_metrics
+// +build !kusokurae_metrics
+
+package sm
+
+const metricsEnabled = false
@@ -0,0 +1,10 @@
+//go:build kusokurae_metrics
+// +build kusokurae_metrics
+
+package sm
+
+// #cgo CFLAGS: -DKUSOKURAE_METRICS=1
+// #cgo CXXFLAGS: -DKUSOKURAE_METRICS=1
+import "C"
+
+const metricsEnabled = true
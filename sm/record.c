@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sm.h"
+#include "sm_internal.h"
+
+// Game record layout:
+//
+//   [0]      KUSOKURAE_RECORD_VERSION
+//   [1]      np
+//   [2]      number of moves played
+//   [3~11]   owner (player index - 1) of each card, 2 bits per card by
+//            display_order - 1 (0 for the Angel left out of 4-player games)
+//   [12~44]  display_order of each move, in the order played
+//   [45~46]  zero
+//   [47]     checksum
+//
+// Who leads each round follows from the moves, so the deal and one byte per
+// move are enough to replay the whole game.
+//
+// A log is a series of segment files, each a LOG_HEADER_SIZE-byte header
+// followed by records back to back. Segments are only ever appended to, and a
+// writer never reopens one it did not create.
+
+#define REC_NP          1
+#define REC_NMOVES      2
+#define REC_OWNERS      3
+#define REC_MOVES       12
+#define REC_CHECKSUM    (KUSOKURAE_RECORD_SIZE - 1)
+
+#define LOG_MAGIC           "KUSOLOG"
+#define LOG_HEADER_SIZE     16
+// Records buffered by a writer before they're written out
+#define LOG_BUFFER_RECORDS  1024
+
+struct kusokurae_log_writer_t {
+    pthread_mutex_t lock;
+    char *prefix;
+    int32_t segment;
+    int fd;
+    int64_t segment_records;
+    int64_t in_segment;
+    // Sticky: once writing fails, the log stays failed.
+    kusokurae_error_t error;
+    int nbuf;
+    uint8_t buf[LOG_BUFFER_RECORDS * KUSOKURAE_RECORD_SIZE];
+};
+
+struct kusokurae_log_reader_t {
+    const uint8_t *base;
+    size_t size;
+    int64_t count;
+};
+
+static int cards_dealt(int np) {
+    return KUSOKURAE_DECK_SIZE - (np == 4);
+}
+
+kusokurae_error_t kusokurae_game_record(const kusokurae_game_state_t *self, uint8_t *out) {
+    int i, k, round, order, np, nrounds, nmoves = 0;
+    uint64_t m;
+    if (self == NULL || out == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (self->cfg.np == 0) {
+        return KUSOKURAE_ERROR_UNINITIALIZED;
+    }
+    if (self->status < KUSOKURAE_STATUS_PLAY) {
+        return KUSOKURAE_ERROR_NOT_IN_GAME;
+    }
+    np = self->cfg.np;
+    memset(out, 0, KUSOKURAE_RECORD_SIZE);
+    out[0] = KUSOKURAE_RECORD_VERSION;
+    out[REC_NP] = (uint8_t)np;
+    for (i = 0; i < np; i++) {
+        for (m = self->players[i].dealt; m; m &= m - 1) {
+            order = mask_lowest(m);
+            out[REC_OWNERS + (order - 1) / 4] |= (uint8_t)(i << ((order - 1) % 4 * 2));
+        }
+    }
+    // The moves in order are those of the trick history.
+    nrounds = kusokurae_get_trick_count(self);
+    for (round = 0; round < nrounds; round++) {
+        for (k = 0; k < self->tricks[round].nmoves; k++) {
+            out[REC_MOVES + nmoves++] = self->tricks[round].moves[k];
+        }
+    }
+    out[REC_NMOVES] = (uint8_t)nmoves;
+    out[REC_CHECKSUM] = block_checksum(out, REC_CHECKSUM);
+    return KUSOKURAE_SUCCESS;
+}
+
+kusokurae_error_t kusokurae_record_replay(kusokurae_game_state_t *self, const uint8_t *record) {
+    uint64_t hands[KUSOKURAE_MAX_PLAYERS] = { 0 };
+    int i, order, owner, mover;
+    if (self == NULL || record == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    int np = record[REC_NP], nmoves = record[REC_NMOVES];
+    if (record[0] != KUSOKURAE_RECORD_VERSION ||
+        record[REC_CHECKSUM] != block_checksum(record, REC_CHECKSUM) ||
+        np < 3 || np > KUSOKURAE_MAX_PLAYERS || nmoves > cards_dealt(np)) {
+        return KUSOKURAE_ERROR_BAD_RECORD;
+    }
+    for (order = 1; order <= cards_dealt(np); order++) {
+        owner = (record[REC_OWNERS + (order - 1) / 4] >> ((order - 1) % 4 * 2)) & 3;
+        if (owner >= np) {
+            return KUSOKURAE_ERROR_BAD_RECORD;
+        }
+        hands[owner] |= CARD_BIT(order);
+    }
+
+    self->cfg.np = np;
+    if (kusokurae_game_deal(self, hands) != KUSOKURAE_SUCCESS) {
+        return KUSOKURAE_ERROR_BAD_RECORD;
+    }
+    for (i = 0; i < nmoves; i++) {
+        order = record[REC_MOVES + i];
+        if (order < 1 || order > KUSOKURAE_DECK_SIZE || self->status != KUSOKURAE_STATUS_PLAY) {
+            return KUSOKURAE_ERROR_BAD_RECORD;
+        }
+        mover = kusokurae_get_active_player(self)->index - 1;
+        // The engine picks the highest card of a kind, so a move of the other
+        // Angel shows up as a mismatch on board.
+        if (kusokurae_game_play(self, DECK_CARD(order)) != KUSOKURAE_SUCCESS ||
+            self->current_round[mover].display_order != (uint32_t)order) {
+            return KUSOKURAE_ERROR_BAD_RECORD;
+        }
+    }
+    return KUSOKURAE_SUCCESS;
+}
+
+int kusokurae_log_segment_path(char *out, size_t size, const char *prefix, int32_t n) {
+    return snprintf(out, size, "%s-%06d.kgr", prefix, n);
+}
+
+static char *segment_path(const char *prefix, int32_t n) {
+    int len = kusokurae_log_segment_path(NULL, 0, prefix, n);
+    char *ret = malloc(len + 1);
+    if (ret != NULL) {
+        kusokurae_log_segment_path(ret, len + 1, prefix, n);
+    }
+    return ret;
+}
+
+static int write_all(int fd, const uint8_t *p, size_t n) {
+    ssize_t done;
+    while (n > 0) {
+        done = write(fd, p, n);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += done;
+        n -= done;
+    }
+    return 0;
+}
+
+static int segment_open(kusokurae_log_writer_t *log) {
+    uint8_t header[LOG_HEADER_SIZE];
+    char *path = segment_path(log->prefix, log->segment);
+    if (path == NULL) {
+        return -1;
+    }
+    log->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    free(path);
+    if (log->fd < 0) {
+        return -1;
+    }
+    memset(header, 0, sizeof(header));
+    memcpy(header, LOG_MAGIC, sizeof(LOG_MAGIC));
+    header[8] = KUSOKURAE_RECORD_VERSION;
+    header[9] = KUSOKURAE_RECORD_SIZE;
+    log->in_segment = 0;
+    return write_all(log->fd, header, sizeof(header));
+}
+
+static kusokurae_error_t log_flush_locked(kusokurae_log_writer_t *log) {
+    if (log->error == KUSOKURAE_SUCCESS && log->nbuf > 0) {
+        if (log->fd < 0 || write_all(log->fd, log->buf, (size_t)log->nbuf * KUSOKURAE_RECORD_SIZE) != 0) {
+            log->error = KUSOKURAE_ERROR_IO;
+        }
+    }
+    log->nbuf = 0;
+    return log->error;
+}
+
+kusokurae_log_writer_t *kusokurae_log_writer_open(const char *prefix, int64_t segment_records) {
+    char *path = NULL;
+    int unused = 0;
+    if (prefix == NULL) {
+        return NULL;
+    }
+    kusokurae_log_writer_t *log = calloc(1, sizeof(kusokurae_log_writer_t));
+    if (log == NULL) {
+        return NULL;
+    }
+    log->prefix = strdup(prefix);
+    log->fd = -1;
+    log->segment_records = segment_records;
+    // Skip the segments already there.
+    while (log->prefix != NULL && (path = segment_path(log->prefix, log->segment)) != NULL) {
+        unused = access(path, F_OK) != 0;
+        free(path);
+        if (unused) {
+            break;
+        }
+        log->segment++;
+    }
+    if (!unused || segment_open(log) != 0) {
+        if (log->fd >= 0) {
+            close(log->fd);
+        }
+        free(log->prefix);
+        free(log);
+        return NULL;
+    }
+    pthread_mutex_init(&log->lock, NULL);
+    return log;
+}
+
+kusokurae_error_t kusokurae_log_writer_close(kusokurae_log_writer_t *log) {
+    if (log == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    kusokurae_error_t ret = log_flush_locked(log);
+    if (log->fd >= 0 && close(log->fd) != 0) {
+        ret = KUSOKURAE_ERROR_IO;
+    }
+    pthread_mutex_destroy(&log->lock);
+    free(log->prefix);
+    free(log);
+    return ret;
+}
+
+kusokurae_error_t kusokurae_log_append(kusokurae_log_writer_t *log, const uint8_t *record) {
+    kusokurae_error_t ret = KUSOKURAE_SUCCESS;
+    if (log == NULL || record == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    pthread_mutex_lock(&log->lock);
+    if (log->segment_records > 0 && log->in_segment == log->segment_records) {
+        // Move on to the next segment.
+        ret = log_flush_locked(log);
+        if (ret == KUSOKURAE_SUCCESS) {
+            close(log->fd);
+            log->segment++;
+            if (segment_open(log) != 0) {
+                ret = log->error = KUSOKURAE_ERROR_IO;
+            }
+        }
+    }
+    if (ret == KUSOKURAE_SUCCESS) {
+        memcpy(log->buf + log->nbuf * KUSOKURAE_RECORD_SIZE, record, KUSOKURAE_RECORD_SIZE);
+        log->in_segment++;
+        if (++log->nbuf == LOG_BUFFER_RECORDS) {
+            ret = log_flush_locked(log);
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+kusokurae_error_t kusokurae_log_flush(kusokurae_log_writer_t *log) {
+    if (log == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    pthread_mutex_lock(&log->lock);
+    kusokurae_error_t ret = log_flush_locked(log);
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+void kusokurae_log_on_move(kusokurae_game_state_t *self, int32_t player,
+                           uint32_t display_order, void *userdata) {
+    uint8_t record[KUSOKURAE_RECORD_SIZE];
+    (void)player;
+    (void)display_order;
+    // Errors stick to the log and show up on flushing or closing it.
+    if (self->status == KUSOKURAE_STATUS_FINISH &&
+        kusokurae_game_record(self, record) == KUSOKURAE_SUCCESS) {
+        kusokurae_log_append((kusokurae_log_writer_t *)userdata, record);
+    }
+}
+
+void kusokurae_log_attach(kusokurae_log_writer_t *log, kusokurae_game_state_t *game) {
+    if (game == NULL) {
+        return;
+    }
+    game->cbs.userdata_of_move = log;
+    game->cbs.move = log != NULL ? &kusokurae_log_on_move : NULL;
+}
+
+kusokurae_log_reader_t *kusokurae_log_reader_open(const char *path) {
+    struct stat st;
+    void *base;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < LOG_HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    const uint8_t *header = base;
+    if (memcmp(header, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 ||
+        header[8] != KUSOKURAE_RECORD_VERSION || header[9] != KUSOKURAE_RECORD_SIZE) {
+        munmap(base, (size_t)st.st_size);
+        return NULL;
+    }
+    kusokurae_log_reader_t *log = malloc(sizeof(kusokurae_log_reader_t));
+    if (log == NULL) {
+        munmap(base, (size_t)st.st_size);
+        return NULL;
+    }
+    // Records are read front to back, mostly.
+    madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+    log->base = base;
+    log->size = (size_t)st.st_size;
+    log->count = (int64_t)((log->size - LOG_HEADER_SIZE) / KUSOKURAE_RECORD_SIZE);
+    return log;
+}
+
+void kusokurae_log_reader_close(kusokurae_log_reader_t *log) {
+    if (log != NULL) {
+        munmap((void *)log->base, log->size);
+        free(log);
+    }
+}
+
+kusokurae_error_t kusokurae_log_count(const kusokurae_log_reader_t *log, int64_t *out) {
+    if (log == NULL || out == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    *out = log->count;
+    return KUSOKURAE_SUCCESS;
+}
+
+const uint8_t *kusokurae_log_record(const kusokurae_log_reader_t *log, int64_t i) {
+    if (log == NULL || i < 0 || i >= log->count) {
+        return NULL;
+    }
+    return log->base + LOG_HEADER_SIZE + i * KUSOKURAE_RECORD_SIZE;
+}
+
+kusokurae_error_t kusokurae_log_verify(const kusokurae_log_reader_t *log, int64_t *n_valid) {
+    kusokurae_game_state_t g;
+    kusokurae_error_t err = KUSOKURAE_SUCCESS;
+    int64_t i;
+    if (log == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    memset(&g, 0, sizeof(g));
+    for (i = 0; i < log->count; i++) {
+        err = kusokurae_record_replay(&g, kusokurae_log_record(log, i));
+        if (err != KUSOKURAE_SUCCESS) {
+            break;
+        }
+    }
+    if (n_valid != NULL) {
+        *n_valid = i;
+    }
+    return err;
+}
@@ -0,0 +1,138 @@
+package sm
+
+import (
+	"sync"
+	"sync/atomic"
+	"unsafe"
+)
+
+// The state functions of games live in a registry, since C memory can't hold
+// Go pointers. A game keeps a handle instead: the index of its slot and the
+// generation the slot was at when taken, so a handle outliving its game (in
+// a copy of the state, say) finds a newer generation and calls nothing.
+// Generations have 44 bits, so a slot doesn't come back to an old one even
+// if the same game is made and dropped for years.
+//
+// Calls don't lock: the slots are in pages which, once published, never move.
+// Games are added and removed under the lock of one of several shards, each
+// with slots of its own, so that creating games scales across cores.
+
+const (
+	registryIndexBits = 20
+	registryPageBits  = 10
+	registryPageSize  = 1 << registryPageBits
+	registryShards    = 16
+	registryGenMask   = 1<<(64-registryIndexBits) - 1
+)
+
+type registrySlot struct {
+	gen uint64
+	fn  unsafe.Pointer // *func(GameStatus)
+}
+
+type registryShard struct {
+	mu   sync.Mutex
+	free []uint32
+	// Slots taken so far; the shard's i-th slot has index i*registryShards + shard.
+	used uint32
+	_    [28]byte // Padding to a cache line, against false sharing
+}
+
+type stateRegistry struct {
+	pages  [1 << (registryIndexBits - registryPageBits)]unsafe.Pointer // *[registryPageSize]registrySlot
+	shards [registryShards]registryShard
+	next   uint32
+}
+
+var registry stateRegistry
+
+// add registers fn and returns its handle, or 0 when the registry is full.
+func (r *stateRegistry) add(fn func(GameStatus)) uint64 {
+	shardNo := atomic.AddUint32(&r.next, 1) % registryShards
+	s := &r.shards[shardNo]
+	s.mu.Lock()
+	var index uint32
+	if n := len(s.free); n > 0 {
+		index = s.free[n-1]
+		s.free = s.free[:n-1]
+	} else {
+		index = s.used*registryShards + shardNo
+		if index >= 1<<registryIndexBits {
+			s.mu.Unlock()
+			return 0
+		}
+		s.used++
+		r.ensurePage(index)
+	}
+	s.mu.Unlock()
+
+	slot := r.slot(index)
+	// The function first, then the generation that makes it visible
+	atomic.StorePointer(&slot.fn, unsafe.Pointer(&fn))
+	gen := atomic.LoadUint64(&slot.gen)
+	return gen<<registryIndexBits | uint64(index)
+}
+
+// remove unregisters the function of handle h. Calls with h do nothing
+// afterwards.
+func (r *stateRegistry) remove(h uint64) {
+	if h == 0 {
+		return
+	}
+	index := uint32(h & (1<<registryIndexBits - 1))
+	slot := r.slot(index)
+	gen := h >> registryIndexBits
+	// Generations wrap around, skipping 0 so that no handle is 0.
+	next := (gen + 1) & registryGenMask
+	if next == 0 {
+		next = 1
+	}
+	if !atomic.CompareAndSwapUint64(&slot.gen, gen, next) {
+		// Already removed
+		return
+	}
+	atomic.StorePointer(&slot.fn, nil)
+	s := &r.shards[index%registryShards]
+	s.mu.Lock()
+	s.free = append(s.free, index)
+	s.mu.Unlock()
+}
+
+// call calls the function of handle h, if it's still registered.
+func (r *stateRegistry) call(h uint64, status GameStatus) {
+	if h == 0 {
+		return
+	}
+	index := uint32(h & (1<<registryIndexBits - 1))
+	gen := h >> registryIndexBits
+	slot := r.slot(index)
+	// The generation is checked on both sides of reading the function, which
+	// is only replaced after the generation moves on.
+	if atomic.LoadUint64(&slot.gen) != gen {
+		return
+	}
+	fn := atomic.LoadPointer(&slot.fn)
+	if fn == nil || atomic.LoadUint64(&slot.gen) != gen {
+		return
+	}
+	(*(*func(GameStatus))(fn))(status)
+}
+
+func (r *stateRegistry) slot(index uint32) *registrySlot {
+	page := (*[registryPageSize]registrySlot)(atomic.LoadPointer(&r.pages[index>>registryPageBits]))
+	return &page[index&(registryPageSize-1)]
+}
+
+// ensurePage makes the page of index, if it isn't there yet. Shards share
+// pages, hence the compare-and-swap.
+func (r *stateRegistry) ensurePage(index uint32) {
+	p := &r.pages[index>>registryPageBits]
+	if atomic.LoadPointer(p) != nil {
+		return
+	}
+	page := new([registryPageSize]registrySlot)
+	for i := range page {
+		page[i].gen = 1
+	}
+	atomic.CompareAndSwapPointer(p, nil, unsafe.Pointer(page))
+}
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "sm.h"
+#include "sm_internal.h"
+
+namespace {
+
+// Games are handed out in chunks, so the shared ranges are touched once per
+// chunk instead of once per game.
+const int64_t SIM_CHUNK = 64;
+
+// Chunks still to be played by one worker, packed as (begin << 32 | end).
+// The owner takes chunks from the front; thieves take the back half.
+// Padded to a cache line so that workers don't false-share.
+struct alignas(64) work_range {
+    std::atomic<uint64_t> range;
+};
+
+inline uint64_t range_pack(uint32_t begin, uint32_t end) {
+    return ((uint64_t)begin << 32) | end;
+}
+
+inline uint32_t range_begin(uint64_t range) {
+    return (uint32_t)(range >> 32);
+}
+
+inline uint32_t range_end(uint64_t range) {
+    return (uint32_t)range;
+}
+
+bool take_front(work_range *w, uint32_t *chunk) {
+    uint64_t cur = w->range.load(std::memory_order_acquire);
+    while (range_begin(cur) < range_end(cur)) {
+        if (w->range.compare_exchange_weak(cur, range_pack(range_begin(cur) + 1, range_end(cur)),
+                                           std::memory_order_acq_rel)) {
+            *chunk = range_begin(cur);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves the back half of the fullest other range into ranges[self].
+// Returns false when there is nothing left anywhere.
+bool steal(std::vector<work_range> &ranges, size_t self) {
+    for (;;) {
+        size_t victim = self;
+        uint64_t cur, best = 0;
+        uint32_t most = 0;
+        for (size_t i = 1; i < ranges.size(); i++) {
+            size_t k = (self + i) % ranges.size();
+            cur = ranges[k].range.load(std::memory_order_acquire);
+            if (range_end(cur) > range_begin(cur) && range_end(cur) - range_begin(cur) > most) {
+                most = range_end(cur) - range_begin(cur);
+                best = cur;
+                victim = k;
+            }
+        }
+        if (victim == self) {
+            return false;
+        }
+        uint32_t half = (most + 1) / 2;
+        uint32_t split = range_end(best) - half;
+        if (ranges[victim].range.compare_exchange_strong(best, range_pack(range_begin(best), split),
+                                                         std::memory_order_acq_rel)) {
+            // Only the owner refills its own (empty) range, so a plain store
+            // is enough.
+            ranges[self].range.store(range_pack(split, range_end(best)), std::memory_order_release);
+            return true;
+        }
+        // Lost the race against the owner or another thief, look again.
+    }
+}
+
+void stats_merge(kusokurae_sim_stats_t *dst, const kusokurae_sim_stats_t *src) {
+    __atomic_fetch_add(&dst->games, src->games, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->errors, src->errors, __ATOMIC_RELAXED);
+    for (int i = 0; i < KUSOKURAE_MAX_PLAYERS; i++) {
+        __atomic_fetch_add(&dst->score[i], src->score[i], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&dst->cards_taken[i], src->cards_taken[i], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&dst->wins[i], src->wins[i], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&dst->ghost_holder[i], src->ghost_holder[i], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&dst->busted[i], src->busted[i], __ATOMIC_RELAXED);
+    }
+}
+
+void sim_worker(std::vector<work_range> *ranges, size_t self,
+                const kusokurae_sim_config_t *cfg, int64_t n_games, int32_t policy,
+                kusokurae_sim_stats_t *out) {
+    // Everything a game touches is private to the worker.
+    kusokurae_game_state_t g;
+    kusokurae_sim_stats_t local;
+    kusokurae_sim_result_t result;
+    kusokurae_sim_config_t config = *cfg;
+    std::memset(&g, 0, sizeof(g));
+    std::memset(&local, 0, sizeof(local));
+
+    uint32_t chunk;
+    for (;;) {
+        if (!take_front(&(*ranges)[self], &chunk)) {
+            if (!steal(*ranges, self)) {
+                break;
+            }
+            continue;
+        }
+        int64_t first = chunk * SIM_CHUNK;
+        int64_t last = std::min(first + SIM_CHUNK, n_games);
+        for (int64_t n = first; n < last; n++) {
+            config.stream = cfg->stream + n;
+            sim_play(&g, &config, policy, &result);
+            kusokurae_sim_stats_add(&local, &result, 1);
+        }
+    }
+    stats_merge(out, &local);
+}
+
+} // namespace
+
+kusokurae_error_t kusokurae_sim_parallel(const kusokurae_sim_config_t *cfg,
+                                         int64_t n_games,
+                                         int32_t policy,
+                                         int32_t n_threads,
+                                         kusokurae_sim_stats_t *out) {
+    if (cfg == NULL || out == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (cfg->np < 3 || cfg->np > KUSOKURAE_MAX_PLAYERS) {
+        return KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS;
+    }
+    int64_t n_chunks = (n_games + SIM_CHUNK - 1) / SIM_CHUNK;
+    if (policy < 0 || policy >= KUSOKURAE_POLICY_MAX || n_chunks > UINT32_MAX) {
+        return KUSOKURAE_ERROR_BAD_ARGUMENT;
+    }
+    if (n_threads <= 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    // Deal the chunks out evenly; stealing takes care of the imbalance.
+    std::vector<work_range> ranges(n_threads);
+    for (int32_t i = 0; i < n_threads; i++) {
+        ranges[i].range.store(range_pack((uint32_t)(n_chunks * i / n_threads),
+                                         (uint32_t)(n_chunks * (i + 1) / n_threads)));
+    }
+    std::vector<std::thread> threads;
+    for (int32_t i = 1; i < n_threads; i++) {
+        threads.emplace_back(sim_worker, &ranges, (size_t)i, cfg, n_games, policy, out);
+    }
+    sim_worker(&ranges, 0, cfg, n_games, policy, out);
+    for (auto &t : threads) {
+        t.join();
+    }
+    out->elapsed_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return KUSOKURAE_SUCCESS;
+}
@@ -5,32 +5,11 @@
 #include "sm.h"
 #include "sm_internal.h"
 
-static kusokurae_card_t DECK[KUSOKURAE_DECK_SIZE];
-static int16_t (*rng)(void *);
-
-static void sample(void *ptr, size_t count, size_t size,
-                   size_t wanted, void *pchosen, void *pdiscarded,
-                   void *rng_state) {
-    char *psrc = (char *)ptr, *pdst = (char *)pchosen, *prej = (char *)pdiscarded;
-    size_t rcount = count, rwanted = wanted; // r for remaining
-    int64_t threshold;
-    int16_t dice;
-    while (rcount > 0) {
-        dice = rng(rng_state);
-        threshold = (MS_RAND_MAX + 1ULL) * rwanted / rcount;
-        //printf("%ld wanted, %ld remaining, %lld/%lld\n", rwanted, rcount, dice, threshold);
-        if (dice < threshold) {
-            memmove(pdst, psrc, size);
-            pdst += size;
-            rwanted--;
-        } else {
-            memmove(prej, psrc, size);
-            prej += size;
-        }
-        psrc += size;
-        rcount--;
-    }
-}
+uint64_t ZOBRIST_HAND[KUSOKURAE_MAX_PLAYERS][KUSOKURAE_DECK_SIZE + 1];
+uint64_t ZOBRIST_BOARD[KUSOKURAE_MAX_PLAYERS][KUSOKURAE_DECK_SIZE + 1];
+uint64_t ZOBRIST_TAKEN[KUSOKURAE_MAX_PLAYERS][KUSOKURAE_DECK_SIZE + 1];
+uint64_t ZOBRIST_TURN[KUSOKURAE_MAX_PLAYERS];
+uint64_t ZOBRIST_HIGH[KUSOKURAE_MAX_PLAYERS + 1];
 
 static int compcard(const void *lhs, const void *rhs) {
     if (((const kusokurae_card_t *)lhs)->display_order > ((const kusokurae_card_t *)rhs)->display_order) {
@@ -41,73 +20,44 @@ static int compcard(const void *lhs, const void *rhs) {
     return 0;
 }
 
-static int compcard2(const void *lhs, const void *rhs) {
-    return ((const kusokurae_card_t *)lhs)->rank - ((const kusokurae_card_t *)rhs)->rank;
-}
-
-static int is_zero_card(kusokurae_card_t *p) {
-    // Card assigned in this lib must have display_order set.
-    return p->display_order == 0;
-}
-
-static int round_score(kusokurae_game_state_t *g, int *p_bonus_flag) {
-    int ret = 0;
-    int bonus_flag;
-    if (p_bonus_flag == NULL) {
-        // Optionally export Ghostbonus status
-        p_bonus_flag = &bonus_flag;
-    }
-    *p_bonus_flag = 0;
-    for (int i = 0; i < KUSOKURAE_MAX_PLAYERS; i++) {
-        if (is_zero_card(&g->current_round[i])) {
-            continue;
-        }
-        switch (g->current_round[i].suit) {
-        case KUSOKURAE_SUIT_OTHER:
-            if (i == g->high_ranker_index) {
-                (*p_bonus_flag)++;
-            }
-        default:
-            if (g->current_round[i].suit != KUSOKURAE_SUIT_OTHER) {
-                ret += g->current_round[i].suit;
-            }
-        }
-    }
-    ret <<= *p_bonus_flag;
-    return ret;
-}
-
-int16_t urand(void *state) {
-    // Ref https://bitbucket.org/shlomif/fc-solve/src/dd80a812e8b3aba98a014d939ed77eb1ce764e04/fc-solve/source/board_gen/pi_make_microsoft_freecell_board.c
-    int32_t *istate = (int32_t *)state;
-    *istate = 214013 * (*istate) + 2531011;
-    *istate &= 0x7FFFFFFF;
-    return *istate >> 16;
-}
-
 void game_state_change(kusokurae_game_state_t *g, int32_t newstate) {
     if (g->cbs.state_transition != NULL) {
+        METRICS_START(t0);
         g->cbs.state_transition(g, newstate, g->cbs.userdata_of_state_transition);
+        METRICS_OBSERVE(callback, t0);
     }
     g->status = newstate;
 }
 
+int player_card_index(kusokurae_player_t *player, int order) {
+    // Hand cards are kept in deck order (descending display_order), so the
+    // index of a card is the number of dealt cards above it.
+    return mask_popcount(player->dealt >> order);
+}
+
 int player_has_card(kusokurae_player_t *player, kusokurae_card_t *card) {
-    for (int i = 0; i < player->ncards; i++) {
-        if (player->cards[i].rank == card->rank &&
-            player->cards[i].suit == card->suit &&
-            !kusokurae_card_round_played(player->cards[i])) {
-            *card = player->cards[i]; // Copy metadata of the hand card out
-            return i;
-        }
+    if (card->suit < KUSOKURAE_SUIT_XIANG || card->suit > KUSOKURAE_SUIT_OTHER ||
+        card->rank < 0 || card->rank > 10) {
+        return -1;
+    }
+    uint64_t candidates = player->hand & SUIT_RANK_MASK[card->suit + 1][card->rank];
+    if (candidates == 0) {
+        return -1;
     }
-    return -1;
+    // Like a scan from the front, prefer the card with the highest order.
+    int i = player_card_index(player, mask_highest(candidates));
+    *card = player->cards[i]; // Copy metadata of the hand card out
+    return i;
 }
 
 void player_drop_card(kusokurae_player_t *player, int index) {
     if (index < 0 || index >= player->ncards) {
         return;
     }
+    uint64_t bit = CARD_BIT(player->cards[index].display_order);
+    player->dealt &= ~bit;
+    player->hand &= ~bit;
+    player->playable &= ~bit;
     memmove(&player->cards[index], &player->cards[index + 1], (--player->ncards - index) * sizeof(kusokurae_card_t));
 }
 
@@ -118,6 +68,31 @@ void player_set_card_played(kusokurae_player_t *player, int index, int nround) {
     uint32_t n = nround & 0x7F; // 1~127 - play, 0 - unplay
     player->cards[index].flags &= (~MASK_PLAYED_IN_ROUND);
     player->cards[index].flags |= n;
+    if (n) {
+        player->hand &= ~CARD_BIT(player->cards[index].display_order);
+    } else {
+        player->hand |= CARD_BIT(player->cards[index].display_order);
+    }
+}
+
+void player_set_hand(kusokurae_player_t *player, uint64_t hand) {
+    kusokurae_card_t old[KUSOKURAE_MAX_HAND_CARDS];
+    uint64_t played = player->dealt & ~player->hand;
+    uint64_t old_dealt = player->dealt, m;
+    int i = 0, order;
+    memcpy(old, player->cards, sizeof(old));
+    player->dealt = played | hand;
+    for (m = player->dealt; m; i++) {
+        order = mask_highest(m);
+        m &= ~CARD_BIT(order);
+        if (played & CARD_BIT(order)) {
+            player->cards[i] = old[mask_popcount(old_dealt >> order)];
+        } else {
+            player->cards[i] = DECK_CARD(order);
+        }
+    }
+    player->hand = hand;
+    player->playable = 0;
 }
 
 void player_set_card_playable(kusokurae_player_t *player, int index, int status) {
@@ -126,89 +101,147 @@ void player_set_card_playable(kusokurae_player_t *player, int index, int status)
     }
     if (status) {
         player->cards[index].flags |= MASK_PLAYABLE;
+        player->playable |= CARD_BIT(player->cards[index].display_order);
     } else {
         player->cards[index].flags &= (~MASK_PLAYABLE);
+        player->playable &= ~CARD_BIT(player->cards[index].display_order);
+    }
+}
+
+void player_set_playable_mask(kusokurae_player_t *player, uint64_t mask) {
+    // Only touch the flags of cards whose status actually changes.
+    uint64_t changed = player->playable ^ mask;
+    int order;
+    while (changed) {
+        order = mask_lowest(changed);
+        changed &= changed - 1;
+        player_set_card_playable(player, player_card_index(player, order), (mask & CARD_BIT(order)) != 0);
     }
 }
 
 void player_set_playable_flags(kusokurae_player_t *player, int is_leader) {
-    int i, status, goodcnt = 0, badcnt = 0, lastrank = 0;
-    for (i = 0; i < player->ncards; i++) {
-        if (kusokurae_card_round_played(player->cards[i])) {
-            continue;
-        }
-        if (!is_leader || player->cards[i].rank > 0) {
-            status = 1;
-            goodcnt++;
-            lastrank = player->cards[i].rank;
-        } else {
-            // Leader can't play rank 0 unless he/she has NO CHOICE
-            status = 0;
-            badcnt++;
-        }
-        player_set_card_playable(player, i, status);
+    int busted = player->busted;
+    player_set_playable_mask(player, rules_playable(player->hand, is_leader, &busted));
+    METRICS_INC(playable_updates);
+    if (busted != player->busted && busted > 0) {
+        METRICS_INC(busted[busted - 1]);
     }
-    if (!goodcnt && badcnt) {
-        // NO CHOICE
-        for (i = 0; i < player->ncards; i++) {
-            player_set_card_playable(player, i, 1);
+    player->busted = busted;
+}
+
+int policy_pick(kusokurae_game_state_t *game, kusokurae_player_t *player, int32_t policy) {
+    uint64_t m = player->playable;
+    int r, n;
+    if (m == 0) {
+        return 0;
+    }
+    switch (policy) {
+    case KUSOKURAE_POLICY_GREEDY_HIGH:
+        for (r = 10; !(m & RANK_MASK[r]); r--);
+        return mask_highest(m & RANK_MASK[r]);
+    case KUSOKURAE_POLICY_GREEDY_LOW:
+        for (r = 0; !(m & RANK_MASK[r]); r++);
+        return mask_highest(m & RANK_MASK[r]);
+    default:
+        // Drop the lowest cards until the chosen one is at the bottom.
+        for (n = kusokurae_rng_bounded(&game->rng_state, mask_popcount(m)); n > 0; n--) {
+            m &= m - 1;
         }
-        player->busted = 2;
-    }
-    if (goodcnt == 1 && lastrank == 0) {
-        // A Zero held back
-        player->busted = 1;
+        return mask_lowest(m);
     }
 }
 
-kusokurae_player_t *player_find_next(kusokurae_game_state_t *game, kusokurae_player_t *player) {
-    int index = player->index;
-    if (index >= game->cfg.np) {
-        index = 0;
+static uint64_t zobrist_key(kusokurae_rng_t *rng) {
+    uint64_t hi = kusokurae_rng_next(rng);
+    return (hi << 32) | kusokurae_rng_next(rng);
+}
+
+static uint64_t set_hash(const uint64_t *keys, uint64_t mask) {
+    uint64_t ret = 0;
+    while (mask) {
+        ret ^= keys[mask_lowest(mask)];
+        mask &= mask - 1;
     }
-    return &game->players[index];
+    return ret;
 }
 
 void kusokurae_global_init() {
     int i;
-    // Special treatment for jokers
-    DECK[0].suit = KUSOKURAE_SUIT_BAOZI;
-    DECK[0].rank = 10;
-    DECK[0].display_order = KUSOKURAE_DECK_SIZE;
-    for (i = 1; i < 3; i++) {
-        DECK[i] = DECK[0];
-        DECK[i].display_order -= i;
-    }
-    // Place the Ghost on 3rd place, so as to be able to simply skip the first
-    // card (one of the 2 Angels) when dealing a 4-player game.
-    DECK[2].suit = KUSOKURAE_SUIT_OTHER;
-
-    kusokurae_card_suit_t cursuit = KUSOKURAE_SUIT_BAOZI;
-    int currank = 9;
-    for (; i < KUSOKURAE_DECK_SIZE; i++) {
-        DECK[i].suit = cursuit;
-        DECK[i].rank = currank;
-        DECK[i].display_order = KUSOKURAE_DECK_SIZE - i;
-        if (currank == 0) {
-            cursuit = (kusokurae_card_suit_t)((int)cursuit - 1);
-            currank = 9;
-        } else {
-            currank--;
+    // The deck itself is built at compile time (deck.cxx).
+    // Fixed seed, so that hashes agree between runs and processes.
+    kusokurae_rng_t rng;
+    kusokurae_rng_seed(&rng, 0x6b75736f6b757261ULL, 0x7a6f6272697374ULL);
+    for (i = 0; i < KUSOKURAE_MAX_PLAYERS; i++) {
+        for (int j = 1; j <= KUSOKURAE_DECK_SIZE; j++) {
+            ZOBRIST_HAND[i][j] = zobrist_key(&rng);
+            ZOBRIST_BOARD[i][j] = zobrist_key(&rng);
+            ZOBRIST_TAKEN[i][j] = zobrist_key(&rng);
         }
+        ZOBRIST_TURN[i] = zobrist_key(&rng);
     }
-
-    for (i = 0; i < KUSOKURAE_DECK_SIZE; i++) {
-        DECK[i].flags = 0;
+    for (i = 0; i <= KUSOKURAE_MAX_PLAYERS; i++) {
+        ZOBRIST_HIGH[i] = zobrist_key(&rng);
     }
 
-    // Use the default PRNG
-    rng = &urand;
+    deal_init();
+    batch_init();
+}
+
+void kusokurae_rng_seed(kusokurae_rng_t *rng, uint64_t seed, uint64_t stream) {
+    // Ref https://www.pcg-random.org/ (pcg32_srandom_r)
+    rng->state = 0;
+    rng->inc = (stream << 1) | 1;
+    kusokurae_rng_next(rng);
+    rng->state += seed;
+    kusokurae_rng_next(rng);
+}
+
+uint32_t kusokurae_rng_next(kusokurae_rng_t *rng) {
+    uint64_t old = rng->state;
+    rng->state = old * PCG_MULT + rng->inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
 }
 
-void kusokurae_set_prng(int16_t (*fn)(void *)) {
-    if (fn != NULL) {
-        rng = fn;
+uint32_t kusokurae_rng_bounded(kusokurae_rng_t *rng, uint32_t bound) {
+    // Lemire's multiply-and-reject, unbiased and mostly division-free.
+    uint64_t m = (uint64_t)kusokurae_rng_next(rng) * bound;
+    uint32_t low = (uint32_t)m;
+    if (low < bound) {
+        uint32_t threshold = -bound % bound;
+        while (low < threshold) {
+            m = (uint64_t)kusokurae_rng_next(rng) * bound;
+            low = (uint32_t)m;
+        }
+    }
+    return m >> 32;
+}
+
+void kusokurae_rng_advance(kusokurae_rng_t *rng, uint64_t delta) {
+    // Compose the LCG step with itself by squaring (Brown, "Random Number
+    // Generation with Arbitrary Stride").
+    uint64_t cur_mult = PCG_MULT, cur_plus = rng->inc;
+    uint64_t acc_mult = 1, acc_plus = 0;
+    while (delta > 0) {
+        if (delta & 1) {
+            acc_mult *= cur_mult;
+            acc_plus = acc_plus * cur_mult + cur_plus;
+        }
+        cur_plus = (cur_mult + 1) * cur_plus;
+        cur_mult *= cur_mult;
+        delta >>= 1;
     }
+    rng->state = acc_mult * rng->state + acc_plus;
+}
+
+void kusokurae_rng_split(kusokurae_rng_t *rng, kusokurae_rng_t *child) {
+    uint64_t seed, stream;
+    seed = (uint64_t)kusokurae_rng_next(rng) << 32;
+    seed |= kusokurae_rng_next(rng);
+    stream = (uint64_t)kusokurae_rng_next(rng) << 32;
+    stream |= kusokurae_rng_next(rng);
+    kusokurae_rng_seed(child, seed, stream);
 }
 
 kusokurae_error_t kusokurae_game_init(kusokurae_game_state_t *self,
@@ -229,12 +262,9 @@ kusokurae_error_t kusokurae_game_init(kusokurae_game_state_t *self,
         memset(&self->cbs, 0, sizeof(kusokurae_game_callbacks_t));
     }
 
-    // Seed the PRNG. You can assign to state later if different seeding is needed
-    time_t *state = (time_t *)&self->rng_state;
-    *state = time(0);
-    // Discard the first number that is not quite random.
-    // It will be better if nanosecond clock is used as seed.
-    urand(state);
+    // Seed the PRNG. States created within the same second still get different
+    // streams. Call kusokurae_game_seed later if different seeding is needed.
+    kusokurae_game_seed(self, (uint64_t)time(0), (uint64_t)(uintptr_t)self);
 
     for (int i = 0; i < self->cfg.np; i++) {
         self->players[i].index = i + 1;
@@ -242,42 +272,60 @@ kusokurae_error_t kusokurae_game_init(kusokurae_game_state_t *self,
     return KUSOKURAE_SUCCESS;
 }
 
-kusokurae_error_t kusokurae_game_start(kusokurae_game_state_t *self) {
+void kusokurae_game_seed(kusokurae_game_state_t *self, uint64_t seed, uint64_t stream) {
     if (self == NULL) {
-        return KUSOKURAE_ERROR_NULLPTR;
-    }
-    if (self->cfg.np == 0) {
-        return KUSOKURAE_ERROR_UNINITIALIZED;
+        return;
     }
+    kusokurae_rng_seed(&self->rng_state, seed, stream);
+}
 
-    // Deck should be already prepared in kusokurae_global_init().
-    // Here we pick the useful part: the whole deck (if there're 3 players) or
-    // the deck with one Angel removed (if there're 4 players).
-    kusokurae_card_t *deck_base = DECK;
-    size_t count = KUSOKURAE_DECK_SIZE;
-    if (self->cfg.np == 4) {
-        deck_base++;
-        count--;
-    }
-    size_t counteach = count / self->cfg.np;
-    // At most two remainder areas are used.
-    // TODO: more flexible card assignment (e.g. 5~6 players, 2 decks)
-    kusokurae_card_t remaining[KUSOKURAE_DECK_SIZE], remaining2[KUSOKURAE_DECK_SIZE];
-    sample(deck_base, count, sizeof(kusokurae_card_t), counteach, self->players[0].cards, remaining, &self->rng_state);
-    if (self->cfg.np == 4) {
-        sample(remaining, count - counteach, sizeof(kusokurae_card_t), counteach, self->players[1].cards, remaining2, &self->rng_state);
-        sample(remaining2, count - counteach * 2, sizeof(kusokurae_card_t), counteach, self->players[2].cards, self->players[3].cards, &self->rng_state);
-    } else {
-        sample(remaining, count - counteach, sizeof(kusokurae_card_t), counteach, self->players[1].cards, self->players[2].cards, &self->rng_state);
+void game_rebuild_tricks(kusokurae_game_state_t *self) {
+    // Cards by round played and player
+    kusokurae_card_id_t played[KUSOKURAE_MAX_TRICKS + 1][KUSOKURAE_MAX_PLAYERS];
+    int i, j, k, round, np = self->cfg.np, leader = 0;
+    memset(played, 0, sizeof(played));
+    memset(self->tricks, 0, sizeof(self->tricks));
+    for (i = 0; i < np; i++) {
+        for (j = 0; j < self->players[i].ncards; j++) {
+            round = self->players[i].cards[j].flags & MASK_PLAYED_IN_ROUND;
+            if (round > 0 && round <= KUSOKURAE_MAX_TRICKS) {
+                played[round][i] = (kusokurae_card_id_t)self->players[i].cards[j].display_order;
+            }
+        }
     }
+    // Player 1 leads the first round, and the taker of each round the next.
+    for (round = 1; round <= self->nround + 1 && round <= self->players[0].ncards; round++) {
+        kusokurae_trick_t *t = &self->tricks[round - 1];
+        t->leader = (uint8_t)leader;
+        for (k = 0; k < np; k++) {
+            i = (leader + k) % np;
+            if (played[round][i] == 0) {
+                break;
+            }
+            trick_push(t, np, played[round][i]);
+        }
+        leader = t->winner;
+    }
+}
 
-    int i;
+// Sets up a game whose hands have been dealt into the card slots.
+static void game_begin(kusokurae_game_state_t *self, int counteach) {
+    int i, j;
     // Set up player data and find the ghost holder.
     for (i = 0; i < self->cfg.np; i++) {
         self->players[i].index = i + 1;
         self->players[i].active = KUSOKURAE_ROUND_WAITING;
         self->players[i].ncards = counteach;
+        self->players[i].cards_taken = 0;
+        self->players[i].score = 0;
         self->players[i].busted = 0;
+        self->players[i].dealt = 0;
+        for (j = 0; j < counteach; j++) {
+            self->players[i].dealt |= CARD_BIT(self->players[i].cards[j].display_order);
+        }
+        self->players[i].hand = self->players[i].dealt;
+        self->players[i].playable = 0;
+        self->players[i].taken = 0;
         if (self->players[i].cards[0].suit == KUSOKURAE_SUIT_OTHER ||
             self->players[i].cards[1].suit == KUSOKURAE_SUIT_OTHER ||
             self->players[i].cards[2].suit == KUSOKURAE_SUIT_OTHER) {
@@ -295,83 +343,154 @@ kusokurae_error_t kusokurae_game_start(kusokurae_game_state_t *self) {
     player_set_playable_flags(&self->players[0], 1);
     self->nround = 0;
     self->high_ranker_index = -1;
-    return KUSOKURAE_SUCCESS;
+    memset(self->tricks, 0, sizeof(self->tricks));
+    self->hash = kusokurae_game_compute_hash(self);
+    game_event(self, KUSOKURAE_EVENT_START, 0, 0, 0, 0);
 }
 
-kusokurae_error_t kusokurae_game_play(kusokurae_game_state_t *self,
-                                      kusokurae_card_t card) {
+void game_set_hands(kusokurae_game_state_t *self, const uint64_t *hands) {
+    int i, j;
+    uint64_t m;
+    for (i = 0; i < self->cfg.np; i++) {
+        for (j = 0, m = hands[i]; m; j++) {
+            self->players[i].cards[j] = DECK_CARD(mask_highest(m));
+            m &= ~CARD_BIT(mask_highest(m));
+        }
+    }
+    game_begin(self, mask_popcount(hands[0]));
+}
+
+kusokurae_error_t kusokurae_game_start(kusokurae_game_state_t *self) {
     if (self == NULL) {
         return KUSOKURAE_ERROR_NULLPTR;
     }
-    if (self->status != KUSOKURAE_STATUS_PLAY) {
-        return KUSOKURAE_ERROR_NOT_IN_GAME;
-    }
-    kusokurae_player_t *p = kusokurae_get_active_player(self);
-    if (p == NULL) {
-        return KUSOKURAE_ERROR_BUG_NOBODY_ACTIVE;
+    if (self->cfg.np == 0) {
+        return KUSOKURAE_ERROR_UNINITIALIZED;
     }
+    METRICS_START(t0);
+    game_start(self);
+    METRICS_OBSERVE(deal, t0);
+    return KUSOKURAE_SUCCESS;
+}
 
-    int pos = player_has_card(p, &card);
-    if (pos < 0) {
-        return KUSOKURAE_ERROR_CARD_NOT_FOUND;
+kusokurae_error_t kusokurae_game_deal(kusokurae_game_state_t *self, const uint64_t *hands) {
+    if (self == NULL || hands == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
     }
-    if (!kusokurae_card_is_playable(p->cards[pos])) {
-        return KUSOKURAE_ERROR_FORBIDDEN_MOVE;
+    if (self->cfg.np == 0) {
+        return KUSOKURAE_ERROR_UNINITIALIZED;
     }
-
-    player_set_card_played(p, pos, self->nround + 1);
-    // precord 'pointer to record', not 'pre-cord'
-    kusokurae_card_t *precord = &self->current_round[p->index - 1];
-    if (!is_zero_card(precord)) {
-        // This is the first move in a round (current_round is holding the last
-        // trick). Clear it.
-        memset(&self->current_round, 0, sizeof(self->current_round));
+    if (!deal_valid(self->cfg.np, hands)) {
+        return KUSOKURAE_ERROR_BAD_DEAL;
     }
-    *precord = card;
+    game_set_hands(self, hands);
+    return KUSOKURAE_SUCCESS;
+}
 
-    // Update current round winner
-    if (self->high_ranker_index < 0) {
-        self->high_ranker_index = p->index - 1;
-    } else {
-        if (compcard2(&self->current_round[self->high_ranker_index],
-                      &self->current_round[p->index - 1]) < 0) {
-            self->high_ranker_index = p->index - 1;
-        }
+kusokurae_error_t kusokurae_game_deal_id(kusokurae_game_state_t *self, uint64_t id) {
+    uint64_t hands[KUSOKURAE_MAX_PLAYERS];
+    if (self == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (self->cfg.np == 0) {
+        return KUSOKURAE_ERROR_UNINITIALIZED;
     }
+    kusokurae_error_t err = kusokurae_deal_unrank(self->cfg.np, id, hands);
+    if (err != KUSOKURAE_SUCCESS) {
+        return err;
+    }
+    game_set_hands(self, hands);
+    return KUSOKURAE_SUCCESS;
+}
 
-    kusokurae_player_t *nextp = player_find_next(self, p);
-    if (nextp->active != KUSOKURAE_ROUND_WAITING) {
-        // The next player has already played his/her move:
-        // the current round (trick) should conclude.
-        kusokurae_player_t *winner = &self->players[self->high_ranker_index];
-        winner->cards_taken += self->cfg.np;
-        winner->score += round_score(self, NULL);
+kusokurae_error_t kusokurae_game_play(kusokurae_game_state_t *self,
+                                      kusokurae_card_t card) {
+    kusokurae_error_t ret = game_play(self, card, NULL);
+    METRICS_INC(play[ret]);
+    return ret;
+}
 
-        // Before getting into the next round, call the state change callback to
-        // notify library user.
-        // Here the state does not really 'change'.
-        game_state_change(self, KUSOKURAE_STATUS_PLAY);
+kusokurae_error_t kusokurae_game_play_undoable(kusokurae_game_state_t *self,
+                                               kusokurae_card_t card,
+                                               kusokurae_undo_t *undo) {
+    kusokurae_error_t ret = undo == NULL ? KUSOKURAE_ERROR_NULLPTR : game_play(self, card, undo);
+    METRICS_INC(play[ret]);
+    return ret;
+}
 
-        // Next round
-        for (int i = 0; i < self->cfg.np; i++) {
-            self->players[i].active = KUSOKURAE_ROUND_WAITING;
+void kusokurae_game_unplay(kusokurae_game_state_t *self,
+                           const kusokurae_undo_t *undo) {
+    if (self == NULL || undo == NULL) {
+        return;
+    }
+    kusokurae_player_t *p = &self->players[undo->player];
+    kusokurae_player_t *nextp = &self->players[undo->next];
+    kusokurae_trick_t *t;
+    int i, n;
+    if (undo->round_done) {
+        if (self->nround < self->players[0].ncards) {
+            // The next round had been set up to start.
+            memset(&self->tricks[self->nround], 0, sizeof(kusokurae_trick_t));
         }
-        player_set_playable_flags(winner, 1);
-        self->high_ranker_index = -1;
-        winner->active = KUSOKURAE_ROUND_ACTIVE;
-
-        // Game finish
-        self->nround++;
-        if (self->nround >= self->players[0].ncards) {
-            game_state_change(self, KUSOKURAE_STATUS_FINISH);
+        self->nround--;
+        self->players[undo->winner].cards_taken -= self->cfg.np;
+        self->players[undo->winner].score -= undo->score;
+        for (i = 0; i < self->cfg.np; i++) {
+            self->players[undo->winner].taken &= ~CARD_BIT(self->current_round[i].display_order);
+        }
+    }
+    // In reverse order of game_play, since the next player may be the mover.
+    player_set_playable_mask(nextp, undo->next_playable);
+    nextp->busted = undo->next_busted;
+    player_set_card_played(p, player_card_index(p, undo->order), 0);
+    player_set_playable_mask(p, undo->mover_playable);
+
+    memset(&self->current_round[undo->player], 0, sizeof(kusokurae_card_t));
+    for (i = 0; i < KUSOKURAE_MAX_PLAYERS; i++) {
+        if (undo->prev_round[i]) {
+            // Cards on board are copies of playable hand cards.
+            self->current_round[i] = DECK_CARD(undo->prev_round[i]);
+            self->current_round[i].flags = MASK_PLAYABLE;
         }
-    } else {
-        player_set_playable_flags(nextp, 0);
-        p->active = KUSOKURAE_ROUND_DONE;
-        nextp->active = KUSOKURAE_ROUND_ACTIVE;
     }
+    self->high_ranker_index = undo->high_ranker_index;
+    for (i = 0; i < KUSOKURAE_MAX_PLAYERS; i++) {
+        self->players[i].active = undo->active[i];
+    }
+    // Take the move out of its round by playing the others again.
+    t = &self->tricks[self->nround];
+    n = t->nmoves - 1;
+    t->nmoves = 0;
+    t->winner = 0;
+    t->score = 0;
+    t->doubled = 0;
+    for (i = 0; i < n; i++) {
+        trick_push(t, self->cfg.np, t->moves[i]);
+    }
+    t->moves[n] = 0;
+    self->status = undo->status;
+    self->hash = undo->hash;
+}
 
-    return KUSOKURAE_SUCCESS;
+uint64_t kusokurae_game_compute_hash(const kusokurae_game_state_t *self) {
+    uint64_t ret = 0;
+    int i;
+    if (self == NULL) {
+        return 0;
+    }
+    for (i = 0; i < self->cfg.np; i++) {
+        const kusokurae_player_t *p = &self->players[i];
+        ret ^= set_hash(ZOBRIST_HAND[i], p->hand) ^ set_hash(ZOBRIST_TAKEN[i], p->taken);
+        if (p->active == KUSOKURAE_ROUND_ACTIVE) {
+            ret ^= ZOBRIST_TURN[i];
+        }
+        // Between rounds, the board still shows the last trick, whose cards
+        // are already counted as taken.
+        if (self->high_ranker_index >= 0 && self->current_round[i].display_order) {
+            ret ^= ZOBRIST_BOARD[i][self->current_round[i].display_order];
+        }
+    }
+    return ret ^ ZOBRIST_HIGH[self->high_ranker_index + 1];
 }
 
 int kusokurae_game_is_final_round(kusokurae_game_state_t *self) {
@@ -388,10 +507,14 @@ kusokurae_player_t *kusokurae_get_active_player(kusokurae_game_state_t *self) {
     if (self == NULL) {
         return NULL;
     }
-    for (int i = 0; i < KUSOKURAE_MAX_PLAYERS; i++) {
-        if (self->players[i].active == KUSOKURAE_ROUND_ACTIVE) {
-            return &self->players[i];
-        }
+    // Whoever's turn it is follows from the round in progress; once the game
+    // is over, the taker of the last round is left active.
+    if (self->status == KUSOKURAE_STATUS_PLAY) {
+        const kusokurae_trick_t *t = &self->tricks[self->nround];
+        int i = t->leader + t->nmoves;
+        return &self->players[i >= self->cfg.np ? i - self->cfg.np : i];
+    } else if (self->status == KUSOKURAE_STATUS_FINISH && self->nround > 0) {
+        return &self->players[self->tricks[self->nround - 1].winner];
     }
     return NULL;
 }
@@ -406,40 +529,75 @@ void kusokurae_get_round_state(kusokurae_game_state_t *self,
     // convenience.
     out->seq = self->nround + 1;
     out->round_winner = self->high_ranker_index;
+    out->score_on_board = 0;
+    out->is_doubled = 0;
+    memset(&out->moves, 0, KUSOKURAE_MAX_PLAYERS * sizeof(kusokurae_card_t));
 
-    int bonus_flag;
-    out->score_on_board = round_score(self, &bonus_flag);
-    if (bonus_flag) {
-        out->is_doubled = 1;
-    } else {
-        out->is_doubled = 0;
+    const kusokurae_trick_t *t = kusokurae_get_current_trick(self);
+    if (t == NULL) {
+        return;
     }
+    out->score_on_board = t->score;
+    out->is_doubled = t->doubled;
+    // Moves are copied off the board, where they are in front of their players.
+    int i = t->leader;
+    for (int k = 0; k < t->nmoves; k++) {
+        out->moves[k] = self->current_round[i];
+        if (++i == self->cfg.np) {
+            i = 0;
+        }
+    }
+}
 
-    memset(&out->moves, 0, KUSOKURAE_MAX_PLAYERS * sizeof(kusokurae_card_t));
-    // Get current round's moves.
-    kusokurae_player_t *tail = kusokurae_get_active_player(self), *head = tail;
-    if (head == NULL) {
-        return;
+int32_t kusokurae_get_trick_count(const kusokurae_game_state_t *self) {
+    if (self == NULL || self->status < KUSOKURAE_STATUS_PLAY) {
+        return 0;
     }
-    int i = 0;
-    kusokurae_card_t *move;
-    do {
-        head = player_find_next(self, head);
-        move = &self->current_round[head->index - 1];
-        if (is_zero_card(move)) {
-            if (i > 0) {
-                // List end
-                break;
-            }
-        } else {
-            if (head->active == KUSOKURAE_ROUND_WAITING) {
-                // Round beginning
-                break;
-            } else {
-                out->moves[i++] = *move;
-            }
+    if (self->status == KUSOKURAE_STATUS_PLAY && self->tricks[self->nround].nmoves > 0) {
+        return self->nround + 1;
+    }
+    return self->nround;
+}
+
+const kusokurae_trick_t *kusokurae_get_trick(const kusokurae_game_state_t *self, int32_t seq) {
+    if (seq < 1 || seq > kusokurae_get_trick_count(self)) {
+        return NULL;
+    }
+    return &self->tricks[seq - 1];
+}
+
+const kusokurae_trick_t *kusokurae_get_current_trick(const kusokurae_game_state_t *self) {
+    if (self == NULL || self->status != KUSOKURAE_STATUS_PLAY) {
+        return NULL;
+    }
+    return &self->tricks[self->nround];
+}
+
+int32_t kusokurae_legal_moves(kusokurae_game_state_t *self,
+                              uint64_t *out_mask,
+                              kusokurae_card_t *out_array) {
+    uint64_t m = 0;
+    kusokurae_player_t *p = NULL;
+    if (self != NULL && self->status == KUSOKURAE_STATUS_PLAY) {
+        p = kusokurae_get_active_player(self);
+    }
+    if (p != NULL) {
+        // Kept up to date by player_set_playable_flags.
+        m = p->playable;
+    }
+    if (out_mask != NULL) {
+        *out_mask = m;
+    }
+    int32_t n = 0;
+    int order;
+    for (; m; n++) {
+        order = mask_highest(m);
+        m &= ~CARD_BIT(order);
+        if (out_array != NULL) {
+            out_array[n] = p->cards[player_card_index(p, order)];
         }
-    } while (head != tail);
+    }
+    return n;
 }
 
 inline int kusokurae_card_is_playable(kusokurae_card_t card) {
@@ -449,3 +607,96 @@ inline int kusokurae_card_is_playable(kusokurae_card_t card) {
 inline int kusokurae_card_round_played(kusokurae_card_t card) {
     return(card.flags & MASK_PLAYED_IN_ROUND);
 }
+
+void sim_play(kusokurae_game_state_t *g, const kusokurae_sim_config_t *config,
+              int32_t policy, kusokurae_sim_result_t *out) {
+    kusokurae_game_config_t cfg;
+    kusokurae_player_t *p;
+    int32_t i, order;
+    memset(out, 0, sizeof(kusokurae_sim_result_t));
+    cfg.np = config->np;
+    out->np = config->np;
+    out->error = kusokurae_game_init(g, &cfg, NULL);
+    if (out->error != KUSOKURAE_SUCCESS) {
+        return;
+    }
+    kusokurae_game_seed(g, config->seed, config->stream);
+    kusokurae_game_start(g);
+    while (g->status == KUSOKURAE_STATUS_PLAY) {
+        p = kusokurae_get_active_player(g);
+        if (p == NULL) {
+            out->error = KUSOKURAE_ERROR_BUG_NOBODY_ACTIVE;
+            return;
+        }
+        order = policy_pick(g, p, policy);
+        out->error = kusokurae_game_play(g, DECK_CARD(order));
+        if (out->error != KUSOKURAE_SUCCESS) {
+            return;
+        }
+    }
+    out->ghost_holder_index = g->ghost_holder_index;
+    for (i = 0; i < g->cfg.np; i++) {
+        out->score[i] = g->players[i].score;
+        out->cards_taken[i] = g->players[i].cards_taken;
+        out->busted[i] = g->players[i].busted;
+    }
+    for (i = 0; i < g->nround; i++) {
+        const kusokurae_trick_t *t = &g->tricks[i];
+        order = t->moves[(t->winner - t->leader + g->cfg.np) % g->cfg.np];
+        out->winning_cards |= CARD_BIT(order);
+    }
+}
+
+kusokurae_error_t kusokurae_sim_batch(const kusokurae_sim_config_t *configs,
+                                      int32_t n_games,
+                                      int32_t policy,
+                                      kusokurae_sim_result_t *results_out) {
+    if (configs == NULL || results_out == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (policy < 0 || policy >= KUSOKURAE_POLICY_MAX) {
+        return KUSOKURAE_ERROR_BAD_ARGUMENT;
+    }
+
+    kusokurae_game_state_t g;
+    memset(&g, 0, sizeof(g));
+    for (int32_t n = 0; n < n_games; n++) {
+        sim_play(&g, &configs[n], policy, &results_out[n]);
+    }
+    return KUSOKURAE_SUCCESS;
+}
+
+void kusokurae_sim_stats_add(kusokurae_sim_stats_t *stats,
+                             const kusokurae_sim_result_t *results,
+                             int32_t n) {
+    const kusokurae_sim_result_t *r;
+    int32_t best, i;
+    if (stats == NULL || results == NULL) {
+        return;
+    }
+    for (r = results; r < results + n; r++) {
+        stats->games++;
+        if (r->error != KUSOKURAE_SUCCESS) {
+            stats->errors++;
+            continue;
+        }
+        best = r->score[0];
+        for (i = 1; i < r->np; i++) {
+            if (r->score[i] > best) {
+                best = r->score[i];
+            }
+        }
+        for (i = 0; i < r->np; i++) {
+            stats->score[i] += r->score[i];
+            stats->cards_taken[i] += r->cards_taken[i];
+            // Shared first places count for everyone involved
+            if (r->score[i] == best) {
+                stats->wins[i]++;
+            }
+            if (r->busted[i]) {
+                stats->busted[i]++;
+            }
+        }
+        stats->ghost_holder[r->ghost_holder_index]++;
+    }
+}
@@ -2,19 +2,11 @@ package sm
 
 /*
 #cgo CFLAGS: -DWHATEVER_YOU_WANT_TO_INDICATE_CGO=1
-#cgo CXXFLAGS: -DWHATEVER_YOU_WANT_TO_INDICATE_CGO=1
+#cgo CXXFLAGS: -DWHATEVER_YOU_WANT_TO_INDICATE_CGO=1 -std=c++20
+#cgo LDFLAGS: -pthread
+#include <stdlib.h>
 #include "sm.h"
 
-extern void goRandom(int16_t *);
-static inline int16_t cgo_random(void *state) {
-	int16_t ret;
-	goRandom(&ret);
-	return ret;
-}
-static inline void set_prng() {
-	kusokurae_set_prng(&cgo_random);
-}
-
 extern void goGameStateCB(kusokurae_game_state_t *, int32_t, void *);
 static inline void cgo_game_state_cb(kusokurae_game_state_t *self, int32_t newstate, void *userdata) {
 	goGameStateCB(self, newstate, userdata);
@@ -28,19 +20,13 @@ import "C"
 import (
 	"errors"
 	"fmt"
-	"math/rand"
 	"runtime"
+	"sync"
 	"sync/atomic"
 	"time"
 	"unsafe"
 )
 
-//export goRandom
-func goRandom(out *C.int16_t) {
-	rnd := int16(rand.Intn(0x7FFF))
-	*out = C.int16_t(rnd)
-}
-
 //export goGameStateCB
 func goGameStateCB(self *C.kusokurae_game_state_t, newstate C.int32_t, userdata unsafe.Pointer) {
 	if self == nil {
@@ -49,22 +35,23 @@ func goGameStateCB(self *C.kusokurae_game_state_t, newstate C.int32_t, userdata
 	}
 	// userdata is not used
 	obj := (*GameState)(unsafe.Pointer(self))
-	if obj.goStateCallbackNo > 0 {
-		callbackMap[obj.goStateCallbackNo](GameStatus(newstate))
-	}
+	registry.call(obj.goStateCallbackNo, GameStatus(newstate))
 }
 
 func init() {
 	C.kusokurae_global_init()
-	rand.Seed(time.Now().UnixNano())
-	C.set_prng()
-	callbackMap = make(map[int32]func(GameStatus))
 }
 
 var cbs = GameCallbacks{
 	StateTransition: uintptr(C.get_cgo_cb_bridge_ptr()),
 }
 
+// MaxHandCards is the capacity of a player's card slots.
+const MaxHandCards = C.KUSOKURAE_MAX_HAND_CARDS
+
+// DeckSize is the number of cards in the deck.
+const DeckSize = C.KUSOKURAE_DECK_SIZE
+
 // GameStatus is equivalent to kusokurae_game_status_t.
 type GameStatus int32
 
@@ -99,20 +86,42 @@ const (
 	RoundDone
 )
 
+// Policy is equivalent to C.kusokurae_policy_t.
+type Policy int32
+
+// Policy values.
+const (
+	PolicyRandom Policy = iota
+	PolicyGreedyHigh
+	PolicyGreedyLow
+)
+
 // Errors from underlying library.
 // Don't forget also to change here after adding new error codes in C interface.
 var (
-	ErrNullPtr         = errors.New("KUSOKURAE_ERROR_NULLPTR")
-	ErrBadNPlayers     = errors.New("KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS")
-	ErrUninitialized   = errors.New("KUSOKURAE_ERROR_UNINITIALIZED")
-	ErrNotInGame       = errors.New("KUSOKURAE_ERROR_NOT_IN_GAME")
-	ErrBugNobodyActive = errors.New("KUSOKURAE_ERROR_BUG_NOBODY_ACTIVE")
-	ErrCardNotFound    = errors.New("KUSOKURAE_ERROR_CARD_NOT_FOUND")
-	ErrForbiddenMove   = errors.New("KUSOKURAE_ERROR_FORBIDDEN_MOVE")
+	ErrNullPtr           = errors.New("KUSOKURAE_ERROR_NULLPTR")
+	ErrBadNPlayers       = errors.New("KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS")
+	ErrUninitialized     = errors.New("KUSOKURAE_ERROR_UNINITIALIZED")
+	ErrNotInGame         = errors.New("KUSOKURAE_ERROR_NOT_IN_GAME")
+	ErrBugNobodyActive   = errors.New("KUSOKURAE_ERROR_BUG_NOBODY_ACTIVE")
+	ErrCardNotFound      = errors.New("KUSOKURAE_ERROR_CARD_NOT_FOUND")
+	ErrForbiddenMove     = errors.New("KUSOKURAE_ERROR_FORBIDDEN_MOVE")
+	ErrBadSnapshot       = errors.New("KUSOKURAE_ERROR_BAD_SNAPSHOT")
+	ErrBadRecord         = errors.New("KUSOKURAE_ERROR_BAD_RECORD")
+	ErrIO                = errors.New("KUSOKURAE_ERROR_IO")
+	ErrBadDeal           = errors.New("KUSOKURAE_ERROR_BAD_DEAL")
+	ErrNoTable           = errors.New("KUSOKURAE_ERROR_NO_TABLE")
+	ErrBadTableBase      = errors.New("KUSOKURAE_ERROR_BAD_TABLEBASE")
+	ErrNotInTableBase    = errors.New("KUSOKURAE_ERROR_NOT_IN_TABLEBASE")
+	ErrBadArgument       = errors.New("KUSOKURAE_ERROR_BAD_ARGUMENT")
+	ErrTableBaseTooLarge = errors.New("KUSOKURAE_ERROR_TABLEBASE_TOO_LARGE")
 
 	ErrUnknown = errors.New("Unknown")
 )
 
+// ErrNoMemory is returned when the C library fails to allocate memory.
+var ErrNoMemory = errors.New("out of memory")
+
 var errMap = map[C.kusokurae_error_t]error{
 	C.KUSOKURAE_SUCCESS:                     nil,
 	C.KUSOKURAE_ERROR_NULLPTR:               ErrNullPtr,
@@ -122,6 +131,15 @@ var errMap = map[C.kusokurae_error_t]error{
 	C.KUSOKURAE_ERROR_BUG_NOBODY_ACTIVE:     ErrBugNobodyActive,
 	C.KUSOKURAE_ERROR_CARD_NOT_FOUND:        ErrCardNotFound,
 	C.KUSOKURAE_ERROR_FORBIDDEN_MOVE:        ErrForbiddenMove,
+	C.KUSOKURAE_ERROR_BAD_SNAPSHOT:          ErrBadSnapshot,
+	C.KUSOKURAE_ERROR_BAD_RECORD:            ErrBadRecord,
+	C.KUSOKURAE_ERROR_IO:                    ErrIO,
+	C.KUSOKURAE_ERROR_BAD_DEAL:              ErrBadDeal,
+	C.KUSOKURAE_ERROR_NO_TABLE:              ErrNoTable,
+	C.KUSOKURAE_ERROR_BAD_TABLEBASE:         ErrBadTableBase,
+	C.KUSOKURAE_ERROR_NOT_IN_TABLEBASE:      ErrNotInTableBase,
+	C.KUSOKURAE_ERROR_BAD_ARGUMENT:          ErrBadArgument,
+	C.KUSOKURAE_ERROR_TABLEBASE_TOO_LARGE:   ErrTableBaseTooLarge,
 }
 
 // GameConfig has the same memory layout with C.kusokurae_game_config_t.
@@ -133,6 +151,9 @@ type GameConfig struct {
 type GameCallbacks struct {
 	UserDataOfStateTransition int // void * in C made int for convenience
 	StateTransition           uintptr
+	UserDataOfMove            int
+	Move                      uintptr
+	Events                    unsafe.Pointer // kusokurae_event_ring_t *, in C memory
 }
 
 // Card has the same memory layout with C.kusokurae_card_t.
@@ -152,6 +173,10 @@ type Player struct {
 	cardsTaken int32
 	score      int32
 	busted     int32
+	dealt      uint64
+	hand       uint64
+	playable   uint64
+	taken      uint64
 }
 
 // GameState has the same memory layout with C.kusokurae_game_state_t.
@@ -163,21 +188,113 @@ type GameState struct {
 	ghostHolder int32
 	highRanker  int32
 	curRound    [C.KUSOKURAE_MAX_PLAYERS]Card
-	rngState    int64
+	rngState    rngState
+	hash        uint64
+	tricks      [C.KUSOKURAE_MAX_TRICKS]Trick
 	cbs         GameCallbacks
 
 	// Extra fields for Go library users go here
 	// ------- -------
 	// We can't put actual function variable here, because runtime will complain
-	// about cgo argument containing Go pointer.
-	goStateCallbackNo int32
+	// about cgo argument containing Go pointer. This is a handle in the
+	// registry of state functions instead (see registry.go), 0 for none.
+	goStateCallbackNo uint64
 }
 
-var (
-	nextCBNo    int32
-	callbackMap map[int32]func(GameStatus)
+// Sizes of the C structs mirrored above, for layout checks.
+const (
+	cSizeofPlayer    = C.sizeof_kusokurae_player_t
+	cSizeofGameState = C.sizeof_kusokurae_game_state_t
+	cSizeofTrick     = C.sizeof_kusokurae_trick_t
+
+	cSizeofTableBaseConfig = C.sizeof_kusokurae_tablebase_config_t
 )
 
+// Trick has the same memory layout with C.kusokurae_trick_t: one round in the
+// trick history of a game. Players are numbered by index - 1.
+type Trick struct {
+	leader   uint8
+	numMoves uint8
+	winner   uint8
+	doubled  uint8
+	score    int8
+	_        [3]uint8
+	moves    [C.KUSOKURAE_MAX_PLAYERS]uint8
+}
+
+// Leader returns who led the round.
+func (t *Trick) Leader() int {
+	return int(t.leader)
+}
+
+// NumMoves returns the number of moves made in the round so far.
+func (t *Trick) NumMoves() int {
+	return int(t.numMoves)
+}
+
+// Move returns the display order of the i-th move of the round, the leader's
+// being the 0th, or 0 if it has not been made.
+func (t *Trick) Move(i int) int {
+	if i < 0 || i >= int(t.numMoves) {
+		return 0
+	}
+	return int(t.moves[i])
+}
+
+// Winner returns the current winning player, or the taker once the round is
+// finished. It is -1 if nobody has played in the round yet.
+func (t *Trick) Winner() int {
+	if t.numMoves == 0 {
+		return -1
+	}
+	return int(t.winner)
+}
+
+// Score returns the score in cards played, for the winner.
+func (t *Trick) Score() int {
+	return int(t.score)
+}
+
+// IsDoubled returns whether the winner played the Ghost.
+func (t *Trick) IsDoubled() bool {
+	return t.doubled != 0
+}
+
+// rngState has the same memory layout with C.kusokurae_rng_t.
+type rngState struct {
+	state uint64
+	inc   uint64
+}
+
+var nextStream uint64
+
+// SimStats aggregates the results of games played by SimBatch or
+// SimParallel. It corresponds to C.kusokurae_sim_stats_t. Per-player arrays are
+// indexed by player index - 1.
+type SimStats struct {
+	Games  int
+	Errors int
+
+	// Total score of each player over all games
+	Score [C.KUSOKURAE_MAX_PLAYERS]int64
+
+	// Number of games in which the player had the highest score (shared first
+	// places count for everyone involved)
+	Wins [C.KUSOKURAE_MAX_PLAYERS]int64
+
+	// Number of games in which the player held the Ghost
+	GhostHolder [C.KUSOKURAE_MAX_PLAYERS]int64
+
+	// Number of games in which the player got busted
+	Busted [C.KUSOKURAE_MAX_PLAYERS]int64
+
+	// Total cards taken by each player over all games
+	CardsTaken [C.KUSOKURAE_MAX_PLAYERS]int64
+
+	// Wall time spent (SimParallel only)
+	Elapsed time.Duration
+}
+
 // RoundState corresponds to C.kusokurae_round_state_t, but does not preserve
 // its memory layout - a bit of conversion needs to be done when providing this
 // to user Go code.
@@ -266,6 +383,24 @@ func (p *Player) String() string {
 	return fmt.Sprintf("%dP - %d cards, %d points\nCardset: %v\n", p.index, p.cardsTaken, p.score, p.GetCards())
 }
 
+// HandMask returns the set of cards in the player's hand. Bit
+// (display order - 1) is set for each card.
+func (p *Player) HandMask() uint64 {
+	return p.hand
+}
+
+// PlayableMask returns the set of cards the player could play now, in the same
+// form as HandMask.
+func (p *Player) PlayableMask() uint64 {
+	return p.playable
+}
+
+// TakenMask returns the set of cards the player has won so far, in the same
+// form as HandMask.
+func (p *Player) TakenMask() uint64 {
+	return p.taken
+}
+
 // GetCards returns a slice holding the player's cards. It operates in constant
 // time.
 func (p *Player) GetCards() []Card {
@@ -273,13 +408,20 @@ func (p *Player) GetCards() []Card {
 }
 
 // GetHandCards return the player's cards IN HAND (not played yet).
-func (p *Player) GetHandCards() (ret []Card) {
+func (p *Player) GetHandCards() []Card {
+	return p.AppendHandCards(nil)
+}
+
+// AppendHandCards appends the player's cards in hand to dst and returns the
+// extended slice. It doesn't allocate if dst has room for MaxHandCards more
+// cards.
+func (p *Player) AppendHandCards(dst []Card) []Card {
 	for i := 0; i < int(p.numCards); i++ {
-		if p.allCards[i].RoundPlayed() == 0 {
-			ret = append(ret, p.allCards[i])
+		if p.hand&(1<<(p.allCards[i].displayOrder-1)) != 0 {
+			dst = append(dst, p.allCards[i])
 		}
 	}
-	return
+	return dst
 }
 
 // NewGame creates a new game state with specified number of players.
@@ -290,29 +432,48 @@ func NewGame(cfg GameConfig, stateFn func(GameStatus)) (ret *GameState, err erro
 }
 
 func (g *GameState) init(cfg GameConfig, stateFn func(GameStatus)) error {
-	var cbNo int32
+	var cbNo uint64
 	if stateFn != nil {
-		cbNo = atomic.AddInt32(&nextCBNo, 1)
-		callbackMap[cbNo] = stateFn
+		if cbNo = registry.add(stateFn); cbNo == 0 {
+			return ErrNoMemory
+		}
 	}
 	g.goStateCallbackNo = cbNo
 	runtime.SetFinalizer(g, func(g *GameState) {
-		delete(callbackMap, g.goStateCallbackNo)
+		registry.remove(g.goStateCallbackNo)
+		g.DisableEventQueue()
 	})
+	// Games without a state function don't call back into Go at all.
+	gcbs := cbs
+	if stateFn == nil {
+		gcbs.StateTransition = 0
+	}
 	pret := unsafe.Pointer(g)
 	pcfg := unsafe.Pointer(&cfg)
-	pcbs := unsafe.Pointer(&cbs)
-	return errcode2Go(C.kusokurae_game_init(
+	pcbs := unsafe.Pointer(&gcbs)
+	err := errcode2Go(C.kusokurae_game_init(
 		(*C.kusokurae_game_state_t)(pret),
 		(*C.kusokurae_game_config_t)(pcfg),
 		(*C.kusokurae_game_callbacks_t)(pcbs),
 	))
+	if err == nil {
+		// Every game gets a stream of its own, so games created at the same
+		// time are still dealt differently.
+		g.Seed(uint64(time.Now().UnixNano()), atomic.AddUint64(&nextStream, 1))
+	}
+	return err
 }
 
 func (g *GameState) cPtr() *C.kusokurae_game_state_t {
 	return (*C.kusokurae_game_state_t)(unsafe.Pointer(g))
 }
 
+// Seed reseeds the game's random number generator. Games seeded alike deal
+// the same cards; different streams give independent sequences.
+func (g *GameState) Seed(seed, stream uint64) {
+	C.kusokurae_game_seed(g.cPtr(), C.uint64_t(seed), C.uint64_t(stream))
+}
+
 // GetConfig returns a copy of cfg.
 func (g *GameState) GetConfig() GameConfig {
 	return g.cfg
@@ -326,6 +487,9 @@ func (g *GameState) GetStatus() GameStatus {
 // Start deals cards to each player and begins waiting for play from the first
 // player.
 func (g *GameState) Start() (err error) {
+	if metricsEnabled {
+		defer goStartHist.observe(time.Now())
+	}
 	err = errcode2Go(C.kusokurae_game_start(g.cPtr()))
 	return
 }
@@ -341,8 +505,17 @@ func (g *GameState) IsFinalRound() bool {
 // GetActivePlayer returns the player whose turn it is now, or nil if the game
 // is not in progress.
 func (g *GameState) GetActivePlayer() *Player {
-	cActivePlayer := C.kusokurae_get_active_player(g.cPtr())
-	return (*Player)(unsafe.Pointer(cActivePlayer))
+	// As kusokurae_get_active_player, read off the trick history
+	switch g.status {
+	case StatusPlay:
+		t := &g.tricks[g.numRound]
+		return &g.players[(int32(t.leader)+int32(t.numMoves))%g.cfg.NumPlayers]
+	case StatusFinish:
+		if g.numRound > 0 {
+			return &g.players[g.tricks[g.numRound-1].winner]
+		}
+	}
+	return nil
 }
 
 // GetPlayer returns the player with specified index, or nil if index is out of
@@ -356,29 +529,950 @@ func (g *GameState) GetPlayer(index int32) *Player {
 
 // GetRoundState returns some useful info about the current round.
 func (g *GameState) GetRoundState() (ret RoundState) {
-	var cRoundState C.kusokurae_round_state_t
-	C.kusokurae_get_round_state(g.cPtr(), (*C.kusokurae_round_state_t)(unsafe.Pointer(&cRoundState)))
-	ret.IsDoubled = (cRoundState.is_doubled != 0)
-	if cRoundState.round_winner < 0 || int32(cRoundState.round_winner) >= g.cfg.NumPlayers {
-		// Array bound check
-	} else {
-		ret.RoundWinner = &g.players[cRoundState.round_winner]
-	}
-	ret.ScoreOnBoard = int(cRoundState.score_on_board)
-	ret.Seq = int(cRoundState.seq)
-
-	var move *Card
-	for i := range cRoundState.moves {
-		move = (*Card)(unsafe.Pointer(&cRoundState.moves[i]))
-		if !move.Valid() {
-			break
+	g.RoundStateInto(&ret)
+	return
+}
+
+// RoundStateInto is GetRoundState writing into ret, reusing the room of
+// ret.Moves so that it doesn't allocate once ret has been used a few times.
+func (g *GameState) RoundStateInto(ret *RoundState) {
+	ret.Seq = int(g.numRound) + 1
+	ret.IsDoubled = false
+	ret.ScoreOnBoard = 0
+	ret.RoundWinner = nil
+	ret.Moves = ret.Moves[:0]
+	t := g.CurrentTrick()
+	if t == nil || t.numMoves == 0 {
+		return
+	}
+	ret.IsDoubled = t.doubled != 0
+	ret.ScoreOnBoard = int(t.score)
+	ret.RoundWinner = &g.players[t.winner]
+	// Moves are copied off the board, where they are in front of their players.
+	for i, k := int32(t.leader), 0; k < int(t.numMoves); k++ {
+		ret.Moves = append(ret.Moves, g.curRound[i])
+		if i++; i == g.cfg.NumPlayers {
+			i = 0
+		}
+	}
+}
+
+// NumTricks returns the number of rounds in the trick history: the finished
+// ones, and the one in progress if anybody has played in it.
+func (g *GameState) NumTricks() int {
+	switch g.status {
+	case StatusPlay:
+		if g.tricks[g.numRound].numMoves > 0 {
+			return int(g.numRound) + 1
 		}
-		ret.Moves = append(ret.Moves, *move)
+		return int(g.numRound)
+	case StatusFinish:
+		return int(g.numRound)
 	}
+	return 0
+}
+
+// Trick returns round seq (1 for the first) of the trick history, or nil if
+// there is no such round yet. The Trick is part of g and changes with it.
+func (g *GameState) Trick(seq int) *Trick {
+	if seq < 1 || seq > g.NumTricks() {
+		return nil
+	}
+	return &g.tricks[seq-1]
+}
+
+// CurrentTrick returns the round in progress (with no moves yet between
+// rounds), or nil if the game is not in progress.
+func (g *GameState) CurrentTrick() *Trick {
+	if g.status != StatusPlay {
+		return nil
+	}
+	return &g.tricks[g.numRound]
+}
+
+// AppendTrickCards appends the cards played in t, a round of g, to dst in the
+// order played.
+func (g *GameState) AppendTrickCards(dst []Card, t *Trick) []Card {
+	for i, k := int32(t.leader), 0; k < int(t.numMoves); k++ {
+		p := &g.players[i]
+		for j := 0; j < int(p.numCards); j++ {
+			if p.allCards[j].displayOrder == uint32(t.moves[k]) {
+				dst = append(dst, p.allCards[j])
+				break
+			}
+		}
+		if i++; i == g.cfg.NumPlayers {
+			i = 0
+		}
+	}
+	return dst
+}
+
+// LegalMoveMask returns the set of cards the active player could play now, in
+// the same form as Player.HandMask. It is empty if the game is not in progress.
+func (g *GameState) LegalMoveMask() uint64 {
+	var mask C.uint64_t
+	C.kusokurae_legal_moves(g.cPtr(), &mask, nil)
+	return uint64(mask)
+}
+
+// LegalMoves appends the active player's legal moves to dst, in hand order, and
+// returns the extended slice. It doesn't allocate if dst has room for
+// MaxHandCards more cards.
+func (g *GameState) LegalMoves(dst []Card) []Card {
+	n := len(dst)
+	if cap(dst)-n < MaxHandCards {
+		grown := make([]Card, n, n+MaxHandCards)
+		copy(grown, dst)
+		dst = grown
+	}
+	out := dst[n : n+MaxHandCards]
+	count := C.kusokurae_legal_moves(g.cPtr(), nil, out[0].cPtr())
+	return dst[:n+int(count)]
+}
+
+// Hash returns the Zobrist hash of the position: where every card is, whose turn
+// it is and who leads the round. Positions reached by different move orders
+// hash the same. Scores are not part of it.
+func (g *GameState) Hash() uint64 {
+	return g.hash
+}
+
+func (g *GameState) computeHash() uint64 {
+	return uint64(C.kusokurae_game_compute_hash(g.cPtr()))
+}
+
+// Snapshot is a packed, machine-independent copy of a game state, see Pack.
+type Snapshot [C.KUSOKURAE_SNAPSHOT_SIZE]byte
+
+// Pack writes the state to a snapshot. Equal states give equal snapshots. The
+// state callback is not part of it.
+func (g *GameState) Pack(s *Snapshot) error {
+	return errcode2Go(C.kusokurae_state_pack(g.cPtr(), (*C.uint8_t)(unsafe.Pointer(&s[0]))))
+}
+
+// Unpack restores the state from a snapshot written by Pack, keeping the state
+// callback of g. g is left unchanged if the snapshot is not valid.
+func (g *GameState) Unpack(s *Snapshot) error {
+	return errcode2Go(C.kusokurae_state_unpack(g.cPtr(), (*C.uint8_t)(unsafe.Pointer(&s[0]))))
+}
+
+// Deal starts a game like Start, but with the given hands: hands[i] is the
+// card set (see Player.HandMask) of player index i + 1.
+func (g *GameState) Deal(hands []uint64) error {
+	if len(hands) < int(g.cfg.NumPlayers) {
+		return ErrBadNPlayers
+	}
+	return errcode2Go(C.kusokurae_game_deal(g.cPtr(), (*C.uint64_t)(unsafe.Pointer(&hands[0]))))
+}
+
+// Deal holds the hands of one deal, by player index - 1, in the same form as
+// Player.HandMask. It has the same memory layout with C.kusokurae_deal_t.
+type Deal struct {
+	Hands [C.KUSOKURAE_MAX_PLAYERS]uint64
+}
+
+// DealMany deals n games for np players from the given seed and stream. The
+// first is the deal Start makes after Seed(seed, stream), and every one can be
+// started with Deal.
+func DealMany(np int32, n int, seed, stream uint64) ([]Deal, error) {
+	var rng C.kusokurae_rng_t
+	ret := make([]Deal, n)
+	if n == 0 {
+		return ret, nil
+	}
+	C.kusokurae_rng_seed(&rng, C.uint64_t(seed), C.uint64_t(stream))
+	err := errcode2Go(C.kusokurae_deal_many(C.int32_t(np), &rng, C.int64_t(n), (*C.kusokurae_deal_t)(unsafe.Pointer(&ret[0]))))
+	if err != nil {
+		return nil, err
+	}
+	return ret, nil
+}
+
+// DealCount returns the number of deals for np players. Deal IDs go from 0 to
+// DealCount(np) - 1.
+func DealCount(np int32) uint64 {
+	return uint64(C.kusokurae_deal_count(C.int32_t(np)))
+}
+
+// DealRank returns the ID of d.
+func DealRank(np int32, d *Deal) (uint64, error) {
+	var id C.uint64_t
+	err := errcode2Go(C.kusokurae_deal_rank(C.int32_t(np), (*C.uint64_t)(unsafe.Pointer(&d.Hands[0])), &id))
+	return uint64(id), err
+}
+
+// DealUnrank returns the deal with the given ID.
+func DealUnrank(np int32, id uint64) (ret Deal, err error) {
+	err = errcode2Go(C.kusokurae_deal_unrank(C.int32_t(np), C.uint64_t(id), (*C.uint64_t)(unsafe.Pointer(&ret.Hands[0]))))
 	return
 }
 
+// DealRange returns the n deals with IDs from first on.
+func DealRange(np int32, first uint64, n int) ([]Deal, error) {
+	ret := make([]Deal, n)
+	if n == 0 {
+		return ret, nil
+	}
+	err := errcode2Go(C.kusokurae_deal_unrank_many(C.int32_t(np), C.uint64_t(first), C.int64_t(n), (*C.kusokurae_deal_t)(unsafe.Pointer(&ret[0]))))
+	if err != nil {
+		return nil, err
+	}
+	return ret, nil
+}
+
+// DealID starts a game like Deal, with the deal of the given ID.
+func (g *GameState) DealID(id uint64) error {
+	return errcode2Go(C.kusokurae_game_deal_id(g.cPtr(), C.uint64_t(id)))
+}
+
+// GamePool recycles the GameStates of games played one after another, such
+// as the tables of a server. Its games have no state function and no
+// finalizer, and keep their event queue (if any) from game to game, so a game
+// taken from the pool costs no allocation. It is safe for concurrent use.
+type GamePool struct {
+	cfg      GameConfig
+	capacity int
+	mu       sync.Mutex
+	free     []*GameState
+}
+
+// NewGamePool makes a pool of games of cfg, with event queues of
+// eventCapacity events (0 for none, otherwise a power of 2).
+func NewGamePool(cfg GameConfig, eventCapacity int) (*GamePool, error) {
+	if eventCapacity < 0 || eventCapacity&(eventCapacity-1) != 0 || eventCapacity > 1<<31 {
+		return nil, ErrBadArgument
+	}
+	var check GameState
+	pcfg := unsafe.Pointer(&cfg)
+	if err := errcode2Go(C.kusokurae_game_init(check.cPtr(), (*C.kusokurae_game_config_t)(pcfg), nil)); err != nil {
+		return nil, err
+	}
+	return &GamePool{cfg: cfg, capacity: eventCapacity}, nil
+}
+
+// Get returns a newly dealt game, reusing a game put back if there is one.
+func (p *GamePool) Get() *GameState {
+	var g *GameState
+	p.mu.Lock()
+	if n := len(p.free); n > 0 {
+		g = p.free[n-1]
+		p.free = p.free[:n-1]
+	}
+	p.mu.Unlock()
+	if g == nil {
+		g = &GameState{}
+		if p.capacity > 0 {
+			g.EnableEventQueue(p.capacity)
+		}
+	}
+	// Keep the queue, emptied, and leave the rest to the engine. Everything
+	// passed is already on the heap, so this doesn't allocate.
+	g.cbs = GameCallbacks{Events: g.cbs.Events}
+	if g.cbs.Events != nil {
+		ring := (*C.kusokurae_event_ring_t)(g.cbs.Events)
+		C.kusokurae_event_ring_init(ring, ring.events, ring.capacity)
+	}
+	pcfg := unsafe.Pointer(&p.cfg)
+	pcbs := unsafe.Pointer(&g.cbs)
+	C.kusokurae_game_init(g.cPtr(), (*C.kusokurae_game_config_t)(pcfg), (*C.kusokurae_game_callbacks_t)(pcbs))
+	g.goStateCallbackNo = 0
+	g.Seed(uint64(time.Now().UnixNano()), atomic.AddUint64(&nextStream, 1))
+	C.kusokurae_game_start(g.cPtr())
+	return g
+}
+
+// Put gives g back to the pool, which must have made it. g must not be used
+// afterwards.
+func (p *GamePool) Put(g *GameState) {
+	p.mu.Lock()
+	p.free = append(p.free, g)
+	p.mu.Unlock()
+}
+
+// Close frees the event queues of the games in the pool, which should all
+// have been put back. The pool must not be used afterwards.
+func (p *GamePool) Close() {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	for _, g := range p.free {
+		g.DisableEventQueue()
+	}
+	p.free = nil
+}
+
+// EventType is equivalent to kusokurae_event_type_t.
+type EventType uint8
+
+// EventType values.
+const (
+	EventStart  EventType = C.KUSOKURAE_EVENT_START
+	EventPlay   EventType = C.KUSOKURAE_EVENT_PLAY
+	EventTrick  EventType = C.KUSOKURAE_EVENT_TRICK
+	EventFinish EventType = C.KUSOKURAE_EVENT_FINISH
+)
+
+// Event has the same memory layout with C.kusokurae_event_t.
+type Event struct {
+	Type EventType
+	// Player index - 1: the mover of EventPlay, the winner of EventTrick
+	Player uint8
+	// display_order of the card played, or of the card winning the trick
+	Card uint8
+	// Score of the trick won, for EventTrick
+	Score int8
+	// Whether the Ghost doubled the trick's score, for EventTrick
+	Doubled uint8
+	// Round of the event, counting from 1 (0 for EventStart)
+	Round    uint8
+	reserved uint16
+}
+
+const cSizeofEvent = C.sizeof_kusokurae_event_t
+
+// EnableEventQueue makes g keep what happens in it (deal, moves, tricks and
+// the end of the game) in a queue of capacity events, a power of 2, to be
+// taken out in batches by Events. Unlike a state function, this costs no cgo
+// callbacks. Events that don't fit are dropped and counted.
+func (g *GameState) EnableEventQueue(capacity int) error {
+	if capacity <= 0 || capacity&(capacity-1) != 0 || capacity > 1<<31 {
+		return ErrBadArgument
+	}
+	g.DisableEventQueue()
+	// The engine keeps a pointer to the queue, so it lives in C memory.
+	ring := (*C.kusokurae_event_ring_t)(C.malloc(C.sizeof_kusokurae_event_ring_t))
+	events := (*C.kusokurae_event_t)(C.malloc(C.size_t(capacity) * C.sizeof_kusokurae_event_t))
+	if ring == nil || events == nil {
+		C.free(unsafe.Pointer(ring))
+		C.free(unsafe.Pointer(events))
+		return ErrNoMemory
+	}
+	if err := errcode2Go(C.kusokurae_event_ring_init(ring, events, C.uint32_t(capacity))); err != nil {
+		C.free(unsafe.Pointer(ring))
+		C.free(unsafe.Pointer(events))
+		return err
+	}
+	g.cbs.Events = unsafe.Pointer(ring)
+	return nil
+}
+
+// DisableEventQueue stops queueing events and drops those not taken yet.
+func (g *GameState) DisableEventQueue() {
+	if g.cbs.Events != nil {
+		ring := (*C.kusokurae_event_ring_t)(g.cbs.Events)
+		g.cbs.Events = nil
+		C.free(unsafe.Pointer(ring.events))
+		C.free(unsafe.Pointer(ring))
+	}
+}
+
+// Events appends the queued events to dst, oldest first, and removes them
+// from the queue.
+func (g *GameState) Events(dst []Event) []Event {
+	if g.cbs.Events == nil {
+		return dst
+	}
+	ring := (*C.kusokurae_event_ring_t)(g.cbs.Events)
+	n := len(dst)
+	want := int(ring.capacity)
+	if cap(dst)-n < want {
+		grown := make([]Event, n, n+want)
+		copy(grown, dst)
+		dst = grown
+	}
+	got := C.kusokurae_event_ring_drain(ring, (*C.kusokurae_event_t)(unsafe.Pointer(&dst[:n+1][n])), C.int32_t(want))
+	return dst[:n+int(got)]
+}
+
+// DroppedEvents returns the number of events lost to a full queue.
+func (g *GameState) DroppedEvents() int {
+	if g.cbs.Events == nil {
+		return 0
+	}
+	return int(C.kusokurae_event_ring_dropped((*C.kusokurae_event_ring_t)(g.cbs.Events)))
+}
+
+// GameRecord holds the deal and the moves of a game, one byte each, see Record.
+type GameRecord [C.KUSOKURAE_RECORD_SIZE]byte
+
+// Record writes the deal and every move played so far to r.
+func (g *GameState) Record(r *GameRecord) error {
+	return errcode2Go(C.kusokurae_game_record(g.cPtr(), (*C.uint8_t)(unsafe.Pointer(&r[0]))))
+}
+
+// Replay plays the game in r from the deal on, checking every move. The state
+// callback of g is kept and called as in a live game.
+func (g *GameState) Replay(r *GameRecord) error {
+	return errcode2Go(C.kusokurae_record_replay(g.cPtr(), (*C.uint8_t)(unsafe.Pointer(&r[0]))))
+}
+
 // Play plays a card for the active player and return the operation result.
 func (g *GameState) Play(move Card) error {
+	if metricsEnabled {
+		defer goPlayHist.observe(time.Now())
+	}
 	return errcode2Go(C.kusokurae_game_play(g.cPtr(), *(*C.kusokurae_card_t)(unsafe.Pointer(&move))))
 }
+
+// Undo records how to take back one move, see PlayUndoable.
+type Undo struct {
+	c C.kusokurae_undo_t
+}
+
+// PlayUndoable plays a card like Play, and records in undo how to take it back
+// with Unplay. The state callback is not called, so it can be used for search
+// without copying the game.
+func (g *GameState) PlayUndoable(move Card, undo *Undo) error {
+	if metricsEnabled {
+		defer goPlayHist.observe(time.Now())
+	}
+	return errcode2Go(C.kusokurae_game_play_undoable(g.cPtr(), *move.cPtr(), &undo.c))
+}
+
+// Unplay takes back the last move, recorded by PlayUndoable.
+func (g *GameState) Unplay(undo *Undo) {
+	C.kusokurae_game_unplay(g.cPtr(), &undo.c)
+}
+
+// SimBatch plays nGames complete games inside the C library in one call, with
+// every seat following policy. Game n uses stream n of seed, so the same
+// arguments always give the same results.
+func SimBatch(cfg GameConfig, nGames int, policy Policy, seed uint64) (ret SimStats, err error) {
+	if nGames <= 0 {
+		return
+	}
+	configs := make([]C.kusokurae_sim_config_t, nGames)
+	results := make([]C.kusokurae_sim_result_t, nGames)
+	for i := range configs {
+		configs[i].np = C.int32_t(cfg.NumPlayers)
+		configs[i].seed = C.uint64_t(seed)
+		configs[i].stream = C.uint64_t(i)
+	}
+	err = errcode2Go(C.kusokurae_sim_batch(&configs[0], C.int32_t(nGames), C.int32_t(policy), &results[0]))
+	if err != nil {
+		return
+	}
+	var cStats C.kusokurae_sim_stats_t
+	C.kusokurae_sim_stats_add(&cStats, &results[0], C.int32_t(nGames))
+	ret.fromC(&cStats)
+	return
+}
+
+// SimParallel plays the same games as SimBatch on nThreads threads (0 for one
+// per core). The results don't depend on the number of threads.
+func SimParallel(cfg GameConfig, nGames int64, policy Policy, seed uint64, nThreads int) (ret SimStats, err error) {
+	config := C.kusokurae_sim_config_t{
+		np:   C.int32_t(cfg.NumPlayers),
+		seed: C.uint64_t(seed),
+	}
+	var cStats C.kusokurae_sim_stats_t
+	err = errcode2Go(C.kusokurae_sim_parallel(&config, C.int64_t(nGames), C.int32_t(policy), C.int32_t(nThreads), &cStats))
+	ret.fromC(&cStats)
+	return
+}
+
+// SimResult is the outcome of one game played by SimGames. It corresponds to
+// C.kusokurae_sim_result_t. Per-player arrays are indexed by player index - 1.
+type SimResult struct {
+	// Why the game could not be played to the end, or nil
+	Err error
+
+	NumPlayers  int
+	GhostHolder int
+
+	// Final values of the corresponding Player fields
+	Score      [C.KUSOKURAE_MAX_PLAYERS]int
+	CardsTaken [C.KUSOKURAE_MAX_PLAYERS]int
+	Busted     [C.KUSOKURAE_MAX_PLAYERS]int
+
+	// Cards that took the round they were played in, as a card set (see
+	// Player.HandMask)
+	WinningCards uint64
+}
+
+// SimGames plays len(dst) games like SimBatch, with streams firstStream and
+// on of seed, and stores the outcome of each. Splitting a range of streams
+// over several calls gives the same games as one call.
+func SimGames(cfg GameConfig, policy Policy, seed, firstStream uint64, dst []SimResult) error {
+	if len(dst) == 0 {
+		return nil
+	}
+	configs := make([]C.kusokurae_sim_config_t, len(dst))
+	results := make([]C.kusokurae_sim_result_t, len(dst))
+	for i := range configs {
+		configs[i].np = C.int32_t(cfg.NumPlayers)
+		configs[i].seed = C.uint64_t(seed)
+		configs[i].stream = C.uint64_t(firstStream + uint64(i))
+	}
+	err := errcode2Go(C.kusokurae_sim_batch(&configs[0], C.int32_t(len(dst)), C.int32_t(policy), &results[0]))
+	if err != nil {
+		return err
+	}
+	for i := range results {
+		c, r := &results[i], &dst[i]
+		r.Err = errcode2Go(C.kusokurae_error_t(c.error))
+		r.NumPlayers = int(c.np)
+		r.GhostHolder = int(c.ghost_holder_index)
+		for p := 0; p < C.KUSOKURAE_MAX_PLAYERS; p++ {
+			r.Score[p] = int(c.score[p])
+			r.CardsTaken[p] = int(c.cards_taken[p])
+			r.Busted[p] = int(c.busted[p])
+		}
+		r.WinningCards = uint64(c.winning_cards)
+	}
+	return nil
+}
+
+func (s *SimStats) fromC(c *C.kusokurae_sim_stats_t) {
+	s.Games = int(c.games)
+	s.Errors = int(c.errors)
+	for i := 0; i < C.KUSOKURAE_MAX_PLAYERS; i++ {
+		s.Score[i] = int64(c.score[i])
+		s.Wins[i] = int64(c.wins[i])
+		s.GhostHolder[i] = int64(c.ghost_holder[i])
+		s.Busted[i] = int64(c.busted[i])
+		s.CardsTaken[i] = int64(c.cards_taken[i])
+	}
+	s.Elapsed = time.Duration(c.elapsed_ns)
+}
+
+// Solver finds the outcome of positions in which every hand is known. It keeps
+// its transposition table across calls and is not safe for concurrent use.
+type Solver struct {
+	c *C.kusokurae_solver_t
+}
+
+// SolveResult corresponds to C.kusokurae_solve_result_t.
+type SolveResult struct {
+	// Final score the seat can be sure to reach even if all other players play
+	// against it
+	Score int
+
+	// A move of the active player that reaches it (invalid if the game is over)
+	BestMove Card
+
+	Nodes   int64
+	Elapsed time.Duration
+}
+
+// NodesPerSec returns the search speed.
+func (r *SolveResult) NodesPerSec() float64 {
+	return float64(r.Nodes) / r.Elapsed.Seconds()
+}
+
+// NewSolver creates a solver with a transposition table of 2^ttBits entries of
+// 16 bytes.
+func NewSolver(ttBits int) (*Solver, error) {
+	c := C.kusokurae_solver_new(C.int32_t(ttBits))
+	if c == nil {
+		return nil, ErrNoMemory
+	}
+	ret := &Solver{c: c}
+	runtime.SetFinalizer(ret, (*Solver).Close)
+	return ret, nil
+}
+
+// Close frees the solver's memory. The solver can't be used afterwards.
+func (s *Solver) Close() {
+	if s.c != nil {
+		C.kusokurae_solver_free(s.c)
+		s.c = nil
+	}
+}
+
+// Solve searches g for seat (player index - 1). g is left unchanged.
+func (s *Solver) Solve(g *GameState, seat int) (ret SolveResult, err error) {
+	var out C.kusokurae_solve_result_t
+	err = errcode2Go(C.kusokurae_solve(s.c, g.cPtr(), C.int32_t(seat), &out))
+	if err != nil {
+		return
+	}
+	ret.Score = int(out.score)
+	ret.BestMove = *(*Card)(unsafe.Pointer(&out.best_move))
+	ret.Nodes = int64(out.nodes)
+	ret.Elapsed = time.Duration(out.elapsed_ns)
+	return
+}
+
+// TableBaseConfig has the same memory layout with
+// C.kusokurae_tablebase_config_t.
+type TableBaseConfig struct {
+	NumPlayers int32
+
+	// Positions with up to K cards in each hand are covered.
+	K int32
+
+	// Generating threads (0 for one per core)
+	Threads int32
+
+	// Stop after solving this many card sets (0 for no limit). The next call
+	// goes on from there.
+	MaxSets int64
+}
+
+// TableBaseProgress corresponds to C.kusokurae_tablebase_progress_t.
+type TableBaseProgress struct {
+	PositionsDone int64
+	Positions     int64
+	Complete      bool
+	Bytes         int64
+}
+
+// GenerateTableBase generates the endgame tablebase at path, or goes on with
+// it if the file is a tablebase of the same configuration left incomplete.
+// ErrBadTableBase if it is anything else.
+func GenerateTableBase(path string, cfg TableBaseConfig) (ret TableBaseProgress, err error) {
+	cpath := C.CString(path)
+	defer C.free(unsafe.Pointer(cpath))
+	var out C.kusokurae_tablebase_progress_t
+	err = errcode2Go(C.kusokurae_tablebase_generate(cpath,
+		(*C.kusokurae_tablebase_config_t)(unsafe.Pointer(&cfg)), &out))
+	ret.PositionsDone = int64(out.positions_done)
+	ret.Positions = int64(out.positions)
+	ret.Complete = out.complete != 0
+	ret.Bytes = int64(out.bytes)
+	return
+}
+
+// TableBase is a complete endgame tablebase mapped into memory. It is safe for
+// concurrent use, except for Close.
+type TableBase struct {
+	c *C.kusokurae_tablebase_t
+}
+
+// OpenTableBase maps the tablebase at path. ErrBadTableBase if the file can't
+// be mapped or is not a complete tablebase.
+func OpenTableBase(path string) (*TableBase, error) {
+	cpath := C.CString(path)
+	defer C.free(unsafe.Pointer(cpath))
+	c := C.kusokurae_tablebase_open(cpath)
+	if c == nil {
+		return nil, ErrBadTableBase
+	}
+	ret := &TableBase{c: c}
+	runtime.SetFinalizer(ret, (*TableBase).Close)
+	return ret, nil
+}
+
+// Close unmaps the tablebase. It can't be used afterwards.
+func (tb *TableBase) Close() {
+	if tb.c != nil {
+		C.kusokurae_tablebase_close(tb.c)
+		tb.c = nil
+	}
+}
+
+// NumPlayers returns the number of players the tablebase is for.
+func (tb *TableBase) NumPlayers() int32 {
+	return int32(C.kusokurae_tablebase_np(tb.c))
+}
+
+// K returns the largest hand size covered.
+func (tb *TableBase) K() int32 {
+	return int32(C.kusokurae_tablebase_k(tb.c))
+}
+
+// Lookup looks up a position at the start of a round: hands (by player index
+// - 1, see Player.HandMask) of equal size up to K, and the leader's index - 1.
+// values[i] is what player i+1 can be sure to gain from here on.
+func (tb *TableBase) Lookup(hands []uint64, leader int) (values [C.KUSOKURAE_MAX_PLAYERS]int, err error) {
+	if len(hands) != int(tb.NumPlayers()) {
+		return values, ErrBadNPlayers
+	}
+	var chands [C.KUSOKURAE_MAX_PLAYERS]C.uint64_t
+	for i, h := range hands {
+		chands[i] = C.uint64_t(h)
+	}
+	var cvalues [C.KUSOKURAE_MAX_PLAYERS]C.int8_t
+	err = errcode2Go(C.kusokurae_tablebase_lookup(tb.c, &chands[0], C.int32_t(leader), &cvalues[0]))
+	for i, v := range cvalues {
+		values[i] = int(v)
+	}
+	return
+}
+
+// Probe solves g for seat (player index - 1) like Solver.Solve, from the
+// tablebase. ErrNotInTableBase if the hands are too big.
+func (tb *TableBase) Probe(g *GameState, seat int) (ret SolveResult, err error) {
+	var out C.kusokurae_solve_result_t
+	err = errcode2Go(C.kusokurae_tablebase_probe(tb.c, g.cPtr(), C.int32_t(seat), &out))
+	if err != nil {
+		return
+	}
+	ret.Score = int(out.score)
+	ret.BestMove = *(*Card)(unsafe.Pointer(&out.best_move))
+	ret.Nodes = int64(out.nodes)
+	ret.Elapsed = time.Duration(out.elapsed_ns)
+	return
+}
+
+// PositionCache maps position hashes (see GameState.Hash) to 64-bit values,
+// e.g. evaluations, across games. It has a fixed size: storing into a full
+// bucket pushes out an older entry. It is safe for concurrent use, except for
+// Clear and Close.
+type PositionCache struct {
+	c *C.kusokurae_cache_t
+}
+
+// CacheStats corresponds to C.kusokurae_cache_stats_t.
+type CacheStats struct {
+	Hits      int64
+	Misses    int64
+	Stores    int64
+	Evictions int64
+}
+
+// NewPositionCache creates a cache of 2^bits entries of 16 bytes. bits must be
+// at least 8.
+func NewPositionCache(bits int) (*PositionCache, error) {
+	c := C.kusokurae_cache_new(C.int32_t(bits))
+	if c == nil {
+		return nil, ErrNoMemory
+	}
+	ret := &PositionCache{c: c}
+	runtime.SetFinalizer(ret, (*PositionCache).Close)
+	return ret, nil
+}
+
+// Close frees the cache's memory. The cache can't be used afterwards.
+func (pc *PositionCache) Close() {
+	if pc.c != nil {
+		C.kusokurae_cache_free(pc.c)
+		pc.c = nil
+	}
+}
+
+// Get looks up key.
+func (pc *PositionCache) Get(key uint64) (value uint64, ok bool) {
+	var v C.uint64_t
+	if C.kusokurae_cache_get(pc.c, C.uint64_t(key), &v) != 0 {
+		return uint64(v), true
+	}
+	return 0, false
+}
+
+// Put stores value for key.
+func (pc *PositionCache) Put(key, value uint64) {
+	C.kusokurae_cache_put(pc.c, C.uint64_t(key), C.uint64_t(value))
+}
+
+// Clear drops all entries and zeroes the counters.
+func (pc *PositionCache) Clear() {
+	C.kusokurae_cache_clear(pc.c)
+}
+
+// Stats returns the counters since creation or the last Clear.
+func (pc *PositionCache) Stats() (ret CacheStats) {
+	var c C.kusokurae_cache_stats_t
+	C.kusokurae_cache_get_stats(pc.c, &c)
+	ret.Hits = int64(c.hits)
+	ret.Misses = int64(c.misses)
+	ret.Stores = int64(c.stores)
+	ret.Evictions = int64(c.evictions)
+	return
+}
+
+// ISMCTSConfig corresponds to C.kusokurae_ismcts_config_t.
+type ISMCTSConfig struct {
+	// Budgets: stop after this many playouts or this much time, whichever
+	// comes first. Zero means no limit, but one of them must be set.
+	Iterations int64
+	Time       time.Duration
+
+	// Threads sharing the search tree, 0 for one per CPU
+	Threads int
+
+	// UCB exploration constant, 0 for the default
+	Exploration float64
+
+	Seed uint64
+}
+
+// ISMCTSResult corresponds to C.kusokurae_ismcts_result_t.
+type ISMCTSResult struct {
+	BestMove Card
+
+	// Average playout reward of BestMove, from 0 (lowest score at the table)
+	// to 1 (highest)
+	Value float64
+
+	Iterations int64
+	Nodes      int64
+	Elapsed    time.Duration
+}
+
+// ISMCTS picks a move for the active player by information-set Monte Carlo
+// tree search, using only what that player can see. g is not modified.
+func (g *GameState) ISMCTS(cfg ISMCTSConfig) (ret ISMCTSResult, err error) {
+	c := C.kusokurae_ismcts_config_t{
+		iterations:  C.int64_t(cfg.Iterations),
+		time_ns:     C.int64_t(cfg.Time),
+		n_threads:   C.int32_t(cfg.Threads),
+		exploration: C.double(cfg.Exploration),
+		seed:        C.uint64_t(cfg.Seed),
+	}
+	var out C.kusokurae_ismcts_result_t
+	err = errcode2Go(C.kusokurae_ismcts_search(g.cPtr(), &c, &out))
+	if err != nil {
+		return
+	}
+	ret.BestMove = *(*Card)(unsafe.Pointer(&out.best_move))
+	ret.Value = float64(out.value)
+	ret.Iterations = int64(out.iterations)
+	ret.Nodes = int64(out.nodes)
+	ret.Elapsed = time.Duration(out.elapsed_ns)
+	return
+}
+
+// CompactState is the compact form of a game state, a few hundred bytes
+// instead of more than a kilobyte, for keeping many tables in memory. It plays
+// exactly like GameState, but has no state callback.
+type CompactState struct {
+	c C.kusokurae_compact_state_t
+}
+
+// Start deals a new game. With the same seed and stream, the deal is the same
+// as GameState's.
+func (s *CompactState) Start(np int32, seed, stream uint64) error {
+	C.kusokurae_rng_seed(&s.c.rng_state, C.uint64_t(seed), C.uint64_t(stream))
+	return errcode2Go(C.kusokurae_compact_start(&s.c, C.int32_t(np)))
+}
+
+// GetStatus returns the game status.
+func (s *CompactState) GetStatus() GameStatus {
+	return GameStatus(s.c.status)
+}
+
+// LegalMoveMask returns the set of cards the player on turn may play, in the
+// same form as Player.HandMask.
+func (s *CompactState) LegalMoveMask() uint64 {
+	return uint64(s.c.playable)
+}
+
+// Play plays a card for the player on turn.
+func (s *CompactState) Play(move Card) error {
+	return errcode2Go(C.kusokurae_compact_play(&s.c, C.kusokurae_card_id_t(move.displayOrder)))
+}
+
+// Card returns the card of the given display order with its flags as they
+// would be in GameState, or an invalid card if it was not dealt.
+func (s *CompactState) Card(displayOrder int) (ret Card) {
+	c := C.kusokurae_compact_card(&s.c, C.kusokurae_card_id_t(displayOrder))
+	return *(*Card)(unsafe.Pointer(&c))
+}
+
+// FromGame sets s to the compact form of g.
+func (s *CompactState) FromGame(g *GameState) error {
+	return errcode2Go(C.kusokurae_compact_from_game(&s.c, g.cPtr()))
+}
+
+// ToGame expands s into g, keeping the state callback of g.
+func (s *CompactState) ToGame(g *GameState) error {
+	return errcode2Go(C.kusokurae_compact_to_game(&s.c, g.cPtr()))
+}
+
+// LogWriter appends game records to a log of segment files, see
+// LogSegmentPath. It is safe for concurrent use, except for Close.
+type LogWriter struct {
+	c *C.kusokurae_log_writer_t
+}
+
+// LogSegmentPath returns the path of segment n of the log at prefix.
+func LogSegmentPath(prefix string, n int) string {
+	cprefix := C.CString(prefix)
+	defer C.free(unsafe.Pointer(cprefix))
+	size := C.kusokurae_log_segment_path(nil, 0, cprefix, C.int32_t(n)) + 1
+	buf := (*C.char)(C.malloc(C.size_t(size)))
+	defer C.free(unsafe.Pointer(buf))
+	C.kusokurae_log_segment_path(buf, C.size_t(size), cprefix, C.int32_t(n))
+	return C.GoString(buf)
+}
+
+// OpenLogWriter opens the log at prefix for appending, starting a new segment
+// after the existing ones and then every segmentRecords records (0 for no
+// limit).
+func OpenLogWriter(prefix string, segmentRecords int64) (*LogWriter, error) {
+	cprefix := C.CString(prefix)
+	defer C.free(unsafe.Pointer(cprefix))
+	c := C.kusokurae_log_writer_open(cprefix, C.int64_t(segmentRecords))
+	if c == nil {
+		return nil, ErrIO
+	}
+	ret := &LogWriter{c: c}
+	runtime.SetFinalizer(ret, (*LogWriter).Close)
+	return ret, nil
+}
+
+// Close flushes and closes the log. Games attached to it must not be played
+// on afterwards.
+func (w *LogWriter) Close() (err error) {
+	if w.c != nil {
+		err = errcode2Go(C.kusokurae_log_writer_close(w.c))
+		w.c = nil
+	}
+	return
+}
+
+// Append adds a record to the log.
+func (w *LogWriter) Append(r *GameRecord) error {
+	return errcode2Go(C.kusokurae_log_append(w.c, (*C.uint8_t)(unsafe.Pointer(&r[0]))))
+}
+
+// Flush hands the buffered records to the OS.
+func (w *LogWriter) Flush() error {
+	return errcode2Go(C.kusokurae_log_flush(w.c))
+}
+
+// Attach makes g append every game it finishes to the log, without calling
+// back into Go. Write errors show up on Flush or Close.
+func (w *LogWriter) Attach(g *GameState) {
+	C.kusokurae_log_attach(w.c, g.cPtr())
+}
+
+// LogReader reads a log segment mapped into memory.
+type LogReader struct {
+	c *C.kusokurae_log_reader_t
+}
+
+// OpenLogReader maps the log segment at path.
+func OpenLogReader(path string) (*LogReader, error) {
+	cpath := C.CString(path)
+	defer C.free(unsafe.Pointer(cpath))
+	c := C.kusokurae_log_reader_open(cpath)
+	if c == nil {
+		return nil, ErrIO
+	}
+	ret := &LogReader{c: c}
+	runtime.SetFinalizer(ret, (*LogReader).Close)
+	return ret, nil
+}
+
+// Close unmaps the segment. Records returned by Record are gone afterwards.
+func (r *LogReader) Close() {
+	if r.c != nil {
+		C.kusokurae_log_reader_close(r.c)
+		r.c = nil
+	}
+}
+
+// Len returns the number of records in the segment.
+func (r *LogReader) Len() int {
+	var n C.int64_t
+	if C.kusokurae_log_count(r.c, &n) != C.KUSOKURAE_SUCCESS {
+		return 0
+	}
+	return int(n)
+}
+
+// Record returns record i, without copying it out of the mapping.
+func (r *LogReader) Record(i int) *GameRecord {
+	return (*GameRecord)(unsafe.Pointer(C.kusokurae_log_record(r.c, C.int64_t(i))))
+}
+
+// Verify replays every record of the segment and returns the number of
+// records before the first bad one.
+func (r *LogReader) Verify() (int, error) {
+	var n C.int64_t
+	err := errcode2Go(C.kusokurae_log_verify(r.c, &n))
+	return int(n), err
+}
@@ -5,25 +5,103 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define KUSOKURAE_DECK_SIZE         33
 #define KUSOKURAE_MAX_HAND_CARDS    22
 #define KUSOKURAE_MAX_PLAYERS       4
+// Rounds in a game: one per card in each hand
+#define KUSOKURAE_MAX_TRICKS        (KUSOKURAE_DECK_SIZE / 3)
+// Games of kusokurae_decks_state_t
+#define KUSOKURAE_MAX_DECKS         2
+#define KUSOKURAE_MAX_DECK_PLAYERS  6
+
+// Packed game states, see snapshot.c
+#define KUSOKURAE_SNAPSHOT_SIZE     48
+#define KUSOKURAE_SNAPSHOT_VERSION  1
+
+// Game records, see record.c
+#define KUSOKURAE_RECORD_SIZE       48
+#define KUSOKURAE_RECORD_VERSION    1
 
 struct kusokurae_game_state_t; // Forward declaration
 
 typedef void (*state_transition_cb)(struct kusokurae_game_state_t *self, int32_t newstate, void *userdata);
 
+// player is the index - 1 of the player who moved, display_order the card played.
+typedef void (*move_cb)(struct kusokurae_game_state_t *self, int32_t player, uint32_t display_order, void *userdata);
+
 typedef struct {
     int32_t np; // Number of players (3 or 4)
 } kusokurae_game_config_t;
 
+typedef enum {
+    // A game is dealt: player 1 is on turn.
+    KUSOKURAE_EVENT_START = 1,
+
+    // player played card.
+    KUSOKURAE_EVENT_PLAY,
+
+    // player took the round with card, for score points (doubled if the card
+    // is the Ghost).
+    KUSOKURAE_EVENT_TRICK,
+
+    // The game is over.
+    KUSOKURAE_EVENT_FINISH,
+} kusokurae_event_type_t;
+
+typedef struct {
+    // kusokurae_event_type_t
+    uint8_t type;
+
+    // Player index - 1
+    uint8_t player;
+
+    // display_order
+    uint8_t card;
+
+    int8_t score;
+    uint8_t doubled;
+
+    // The round the event belongs to, counting from 1 (0 for START)
+    uint8_t round;
+
+    uint16_t reserved;
+} kusokurae_event_t;
+
+// Ring buffer of events for a single consumer, which may run on another
+// thread than the game. See events.c.
+typedef struct {
+    kusokurae_event_t *events;
+
+    // Number of slots, a power of 2
+    uint32_t capacity;
+
+    // Free-running counts of events written by the engine and read by the
+    // consumer
+    uint32_t head;
+    uint32_t tail;
+
+    // Events lost because the ring was full. Only the engine writes it; read
+    // it with kusokurae_event_ring_dropped from any thread.
+    uint32_t dropped;
+} kusokurae_event_ring_t;
+
 typedef struct {
     // State transition callback - to be called BEFORE each state change and end
     // of each round.
     void *userdata_of_state_transition;
     state_transition_cb state_transition;
+
+    // Move callback - to be called AFTER each move made with
+    // kusokurae_game_play, once the state (and status) is updated.
+    void *userdata_of_move;
+    move_cb move;
+
+    // If not NULL, kusokurae_game_play and kusokurae_game_start append events
+    // here, besides calling the callbacks above.
+    kusokurae_event_ring_t *events;
 } kusokurae_game_callbacks_t;
 
 typedef enum {
@@ -62,7 +140,7 @@ typedef struct {
     // Sequence in the new, unshuffled deck. Higher value precedes lower
     // e.g. The newbiest card, Ghost, has a display_order of 33.
     // 0 indicates invalid data (unfilled slot).
-    // Should be filled during global initialization and copied afterwards.
+    // Comes from the deck built at compile time, and is copied from there.
     uint32_t display_order;
 
     // Declared above (kusokurae_card_suit_t)
@@ -79,6 +157,16 @@ typedef struct {
     uint32_t flags;
 } kusokurae_card_t;
 
+// PCG32 generator state (64-bit LCG with permuted 32-bit output).
+// Every game carries its own, so games never share or contend for one.
+typedef struct {
+    uint64_t state;
+
+    // Stream selector, always odd. Generators seeded alike but with different
+    // streams produce independent sequences.
+    uint64_t inc;
+} kusokurae_rng_t;
+
 typedef enum {
     KUSOKURAE_ROUND_WAITING,
     KUSOKURAE_ROUND_ACTIVE,
@@ -110,6 +198,22 @@ typedef struct {
     // When you say a player is busted, it means he/she is forced to play
     // forbidden moves because no other card's available.
     int32_t busted;
+
+    // The same hand kept as card sets, for O(1) lookup and legality checks.
+    // Bit (display_order - 1) is set for each card in the set; a single deck
+    // fits in one word.
+    // All cards dealt to the player, including played ones.
+    uint64_t dealt;
+
+    // Cards still in hand (dealt minus played).
+    uint64_t hand;
+
+    // Cards that could be played in the current round (always a subset of
+    // hand, and empty unless it's the player's turn).
+    uint64_t playable;
+
+    // Cards won in the rounds taken so far.
+    uint64_t taken;
 } kusokurae_player_t;
 
 typedef enum {
@@ -121,11 +225,51 @@ typedef enum {
     KUSOKURAE_ERROR_BUG_NOBODY_ACTIVE,
     KUSOKURAE_ERROR_CARD_NOT_FOUND,
     KUSOKURAE_ERROR_FORBIDDEN_MOVE,
+    KUSOKURAE_ERROR_BAD_SNAPSHOT,
+    KUSOKURAE_ERROR_BAD_RECORD,
+    KUSOKURAE_ERROR_IO,
+    KUSOKURAE_ERROR_BAD_DEAL,
+    KUSOKURAE_ERROR_NO_TABLE,
+    KUSOKURAE_ERROR_BAD_TABLEBASE,
+    KUSOKURAE_ERROR_NOT_IN_TABLEBASE,
+    KUSOKURAE_ERROR_BAD_ARGUMENT,
+    KUSOKURAE_ERROR_TABLEBASE_TOO_LARGE,
 
     KUSOKURAE_ERROR_UNIMPLEMENTED,
     KUSOKURAE_ERROR_UNSPECIFIED,
 } kusokurae_error_t;
 
+#define KUSOKURAE_ERROR_COUNT (KUSOKURAE_ERROR_UNSPECIFIED + 1)
+
+// A card by its display_order (1~33), 0 for none. Suit and rank follow from
+// the deck.
+typedef uint8_t kusokurae_card_id_t;
+
+// One round (trick) of the game, as kept in the trick history of
+// kusokurae_game_state_t. Player numbers are index - 1.
+typedef struct {
+    // Who led the round
+    uint8_t leader;
+
+    // Moves made so far, 0~np
+    uint8_t nmoves;
+
+    // The current winning player, or the taker once the round is finished
+    // (undefined while nmoves is 0)
+    uint8_t winner;
+
+    // Whether the winner played the Ghost
+    uint8_t doubled;
+
+    // Score in cards played, for the winner (doubled if so)
+    int8_t score;
+
+    uint8_t reserved[3];
+
+    // Moves in the order made, moves[0] being the leader's
+    kusokurae_card_id_t moves[KUSOKURAE_MAX_PLAYERS];
+} kusokurae_trick_t;
+
 typedef struct kusokurae_game_state_t {
     kusokurae_game_config_t cfg;
     int32_t status;
@@ -147,8 +291,19 @@ typedef struct kusokurae_game_state_t {
     // players[n]'s move is placed in current_round[n].
     kusokurae_card_t current_round[KUSOKURAE_MAX_PLAYERS];
 
-    // 8 bytes of state for random number generator.
-    uint64_t rng_state;
+    // State of the game's own random number generator.
+    kusokurae_rng_t rng_state;
+
+    // Zobrist hash of the position: where every card is (in whose hand, on
+    // board in front of whom, or taken by whom), whose turn it is and who
+    // leads the current round. Maintained by kusokurae_game_start and
+    // kusokurae_game_play. Scores are not part of it.
+    uint64_t hash;
+
+    // Trick history: tricks[n] is round n + 1, up to the round in progress
+    // (tricks[nround], which has no moves yet between rounds). Appended to by
+    // kusokurae_game_play, so that rounds and whose turn it is read in O(1).
+    kusokurae_trick_t tricks[KUSOKURAE_MAX_TRICKS];
 
     // Game-specific callbacks should be put at the bottom, because their sizes
     // are machine-dependent.
@@ -174,19 +329,461 @@ typedef struct {
     kusokurae_card_t moves[KUSOKURAE_MAX_PLAYERS];
 } kusokurae_round_state_t;
 
+// The game state in a few hundred bytes instead of more than a kilobyte, for
+// keeping many tables in memory (see compact.cxx). The fields touched by every
+// move come first and fill one cache line. Compact states have no callbacks
+// and no position hash; kusokurae_compact_to_game gives the full form.
+typedef struct {
+    // Cards still in hand, by player (bit display_order - 1)
+    uint64_t hand[KUSOKURAE_MAX_PLAYERS];
+
+    // What the player on turn may play
+    uint64_t playable;
+
+    int16_t score[KUSOKURAE_MAX_PLAYERS];
+
+    uint8_t np;
+    uint8_t status;
+
+    // Player on turn (player index - 1)
+    uint8_t turn;
+
+    // As in kusokurae_game_state_t
+    int8_t high_ranker_index;
+    uint8_t nround;
+
+    // Cards on board by player, as current_round in kusokurae_game_state_t
+    kusokurae_card_id_t trick[KUSOKURAE_MAX_PLAYERS];
+
+    int8_t busted[KUSOKURAE_MAX_PLAYERS];
+    int8_t ghost_holder_index;
+
+    // Cold fields
+    uint64_t dealt[KUSOKURAE_MAX_PLAYERS];
+    uint64_t taken[KUSOKURAE_MAX_PLAYERS];
+
+    // Round in which each card was played (1~), 0 if not played yet
+    uint8_t played_round[KUSOKURAE_DECK_SIZE + 1];
+
+    kusokurae_rng_t rng_state;
+} kusokurae_compact_state_t;
+
+// A set of cards from up to KUSOKURAE_MAX_DECKS decks, one word per deck (bit
+// display_order - 1).
+typedef struct {
+    uint64_t deck[KUSOKURAE_MAX_DECKS];
+} kusokurae_cards_t;
+
+// A game on card sets like kusokurae_compact_state_t, of one deck for 3~4
+// players or of two decks for 3~6 (see decks.cxx). The card of display_order
+// o in deck d (0~) is card d * KUSOKURAE_DECK_SIZE + o. The top cards, the
+// Angels of the last deck, are left out as needed to deal every player as
+// many cards.
+typedef struct {
+    // Cards still in hand, by player
+    kusokurae_cards_t hand[KUSOKURAE_MAX_DECK_PLAYERS];
+
+    // What the player on turn may play
+    kusokurae_cards_t playable;
+
+    int16_t score[KUSOKURAE_MAX_DECK_PLAYERS];
+
+    uint8_t np;
+    uint8_t nd;
+    uint8_t status;
+
+    // Player on turn (player index - 1)
+    uint8_t turn;
+
+    // As in kusokurae_compact_state_t, by card
+    int8_t high_ranker_index;
+    uint8_t nround;
+    uint8_t trick[KUSOKURAE_MAX_DECK_PLAYERS];
+
+    int8_t busted[KUSOKURAE_MAX_DECK_PLAYERS];
+
+    // Holder of each deck's Ghost (player index - 1)
+    int8_t ghost_holder_index[KUSOKURAE_MAX_DECKS];
+
+    // Cold fields
+    kusokurae_cards_t dealt[KUSOKURAE_MAX_DECK_PLAYERS];
+    kusokurae_cards_t taken[KUSOKURAE_MAX_DECK_PLAYERS];
+
+    // Round in which each card was played (1~), 0 if not played yet
+    uint8_t played_round[KUSOKURAE_MAX_DECKS * KUSOKURAE_DECK_SIZE + 1];
+
+    kusokurae_rng_t rng_state;
+} kusokurae_decks_state_t;
+
+// Everything kusokurae_game_unplay needs to take back one move.
+typedef struct {
+    // The mover and the card (player index - 1, display_order)
+    int8_t player;
+    uint8_t order;
+
+    // Values before the move
+    int8_t status;
+    int8_t high_ranker_index;
+    int8_t active[KUSOKURAE_MAX_PLAYERS];
+
+    // Display orders of the previous trick if the move cleared it, else zeros
+    uint8_t prev_round[KUSOKURAE_MAX_PLAYERS];
+
+    // Whether the move concluded the round, who won it and for how much
+    int8_t round_done;
+    int8_t winner;
+    int16_t score;
+
+    // The player whose playable set was recomputed after the move (next player
+    // or round winner), and his/her values before that
+    int8_t next;
+    int8_t next_busted;
+    uint64_t next_playable;
+
+    // The mover's playable set before the move
+    uint64_t mover_playable;
+
+    // Position hash before the move
+    uint64_t hash;
+} kusokurae_undo_t;
+
+typedef enum {
+    // Uniformly random legal move
+    KUSOKURAE_POLICY_RANDOM,
+
+    // Highest ranked legal move
+    KUSOKURAE_POLICY_GREEDY_HIGH,
+
+    // Lowest ranked legal move
+    KUSOKURAE_POLICY_GREEDY_LOW,
+
+    // Keep this line at the bottom
+    KUSOKURAE_POLICY_MAX,
+} kusokurae_policy_t;
+
+typedef struct {
+    // Number of players (3 or 4)
+    int32_t np;
+
+    // Seed and stream for dealing and for the random policy (see
+    // kusokurae_game_seed). Games with the same config are played identically.
+    uint64_t seed;
+    uint64_t stream;
+} kusokurae_sim_config_t;
+
+typedef struct {
+    // KUSOKURAE_SUCCESS, or why the game could not be played to the end
+    int32_t error;
+
+    // Number of players
+    int32_t np;
+
+    int32_t ghost_holder_index;
+
+    // Final values of the corresponding kusokurae_player_t fields
+    int32_t score[KUSOKURAE_MAX_PLAYERS];
+    int32_t cards_taken[KUSOKURAE_MAX_PLAYERS];
+    int32_t busted[KUSOKURAE_MAX_PLAYERS];
+
+    // Cards that took the round they were played in, as a card set (see
+    // kusokurae_player_t)
+    uint64_t winning_cards;
+} kusokurae_sim_result_t;
+
+// Aggregated results. Per-player arrays are indexed by player index - 1.
+typedef struct {
+    int64_t games;
+    int64_t errors;
+
+    // Totals over all games
+    int64_t score[KUSOKURAE_MAX_PLAYERS];
+    int64_t cards_taken[KUSOKURAE_MAX_PLAYERS];
+
+    // Number of games in which the player had the highest score, held the
+    // Ghost, or got busted
+    int64_t wins[KUSOKURAE_MAX_PLAYERS];
+    int64_t ghost_holder[KUSOKURAE_MAX_PLAYERS];
+    int64_t busted[KUSOKURAE_MAX_PLAYERS];
+
+    // Wall time spent, filled by kusokurae_sim_parallel
+    int64_t elapsed_ns;
+} kusokurae_sim_stats_t;
+
+// Perfect-information solver, see solve.c
+typedef struct kusokurae_solver_t kusokurae_solver_t;
+
+typedef struct {
+    // Final score the seat can be sure to reach even if all other players play
+    // against it
+    int32_t score;
+
+    // A move of the active player that reaches it (zero card if the game is
+    // over)
+    kusokurae_card_t best_move;
+
+    // Search effort: nodes visited and wall time spent
+    int64_t nodes;
+    int64_t elapsed_ns;
+} kusokurae_solve_result_t;
+
+typedef struct {
+    // Stop after this many playouts in total (0 for no limit)
+    int64_t iterations;
+
+    // Stop after this much wall time (0 for no limit). At least one of the two
+    // budgets must be set.
+    int64_t time_ns;
+
+    // Worker threads sharing the tree, 0 for one per hardware thread
+    int32_t n_threads;
+
+    // UCB exploration constant, 0 for the default (0.7)
+    double exploration;
+
+    // Seed for sampling hidden hands and for playouts
+    uint64_t seed;
+} kusokurae_ismcts_config_t;
+
+typedef struct {
+    // The move chosen for the active player (most visited)
+    kusokurae_card_t best_move;
+
+    // Average playout reward of that move for the player, between 0 (lowest
+    // score at the table) and 1 (highest)
+    double value;
+
+    int64_t iterations;
+    int64_t nodes;
+    int64_t elapsed_ns;
+} kusokurae_ismcts_result_t;
+
+// Position cache shared between threads, see cache.c
+typedef struct kusokurae_cache_t kusokurae_cache_t;
+
+typedef struct {
+    int64_t hits;
+    int64_t misses;
+    int64_t stores;
+
+    // Stores that pushed out an entry of another key
+    int64_t evictions;
+} kusokurae_cache_stats_t;
+
+// One deal: the card set (see kusokurae_player_t) of each player, by index - 1
+typedef struct {
+    uint64_t hands[KUSOKURAE_MAX_PLAYERS];
+} kusokurae_deal_t;
+
+// Segmented, append-only files of game records, see record.c
+typedef struct kusokurae_log_writer_t kusokurae_log_writer_t;
+typedef struct kusokurae_log_reader_t kusokurae_log_reader_t;
+
+// Games stepped together, in struct-of-arrays form (see batch.c). All the
+// games of a batch have the same number of players and move in lockstep, one
+// move each per kusokurae_batch_step, so they all finish at once.
+#define KUSOKURAE_BATCH_MAX 256
+
+// Flags of kusokurae_batch_start
+#define KUSOKURAE_BATCH_SCALAR 1    // Don't use the SIMD kernel even if the CPU has it
+
+typedef struct {
+    int32_t np;
+    int32_t n;
+    // Moves played in every game so far
+    int32_t nmoves;
+    // Whether steps run on the AVX2 kernel
+    int32_t simd;
+    // Draws the deals and the random moves; seed it before starting.
+    kusokurae_rng_t rng;
+
+    // Per game (index i of every array), by player index - 1 where it applies.
+    // Entries past n are padding for the kernels. Everything is 64 bits wide
+    // so that every field fills vector lanes alike.
+    uint64_t hand[KUSOKURAE_MAX_PLAYERS][KUSOKURAE_BATCH_MAX];
+    int64_t score[KUSOKURAE_MAX_PLAYERS][KUSOKURAE_BATCH_MAX];
+    int64_t busted[KUSOKURAE_MAX_PLAYERS][KUSOKURAE_BATCH_MAX];
+    // What the player on turn may play
+    uint64_t playable[KUSOKURAE_BATCH_MAX];
+    // Cards of the round in progress
+    uint64_t trick[KUSOKURAE_BATCH_MAX];
+    // Player on turn
+    int64_t turn[KUSOKURAE_BATCH_MAX];
+    // The highest card played so far in the round in progress and who played it
+    int64_t high_order[KUSOKURAE_BATCH_MAX];
+    int64_t high_player[KUSOKURAE_BATCH_MAX];
+    // The last move of each game (display_order)
+    int64_t move[KUSOKURAE_BATCH_MAX];
+} kusokurae_batch_t;
+
+// Endgame tablebase, see tablebase.cxx
+typedef struct kusokurae_tablebase_t kusokurae_tablebase_t;
+
+typedef struct {
+    int32_t np;
+
+    // Positions with up to k cards in each hand are covered.
+    int32_t k;
+
+    // Generating threads (0 for one per core)
+    int32_t n_threads;
+
+    // Stop after solving this many card sets (0 for no limit). The next call
+    // goes on from there.
+    int64_t max_sets;
+} kusokurae_tablebase_config_t;
+
+typedef struct {
+    // Positions solved so far, and in total
+    int64_t positions_done;
+    int64_t positions;
+
+    // Whether the tablebase is complete and can be opened
+    int32_t complete;
+
+    // Size of the file
+    int64_t bytes;
+} kusokurae_tablebase_progress_t;
+
+// Latencies, see metrics.c. Bucket i counts the times of 2^i up to 2^(i+1)
+// nanoseconds; the first one also takes 0 and the last one everything longer.
+#define KUSOKURAE_HISTOGRAM_BUCKETS 32
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[KUSOKURAE_HISTOGRAM_BUCKETS];
+} kusokurae_histogram_t;
+
+// Counters of the engine since the start of the process, summed over threads.
+// Every field is a uint64_t.
+typedef struct {
+    // Results of kusokurae_game_play and kusokurae_game_play_undoable, by
+    // kusokurae_error_t
+    uint64_t play[KUSOKURAE_ERROR_COUNT];
+
+    // Updates of a player's playable cards, and how many of them found the
+    // player newly busted, by busted - 1
+    uint64_t playable_updates;
+    uint64_t busted[2];
+
+    // Dealing in kusokurae_game_start
+    kusokurae_histogram_t deal;
+
+    // State transition callbacks
+    kusokurae_histogram_t callback;
+} kusokurae_metrics_t;
+
+// Many games played at once with remote players, see table.cxx
+typedef struct kusokurae_table_manager_t kusokurae_table_manager_t;
+
+// Asks the client at seat (player index - 1) of table for a move, to be given
+// with kusokurae_table_submit along with ticket. state is a copy of the table,
+// only valid during the call; what the seat may not see is up to the caller.
+// Called from the manager's threads; it should return quickly and never wait
+// for the move.
+typedef void (*kusokurae_table_request_cb)(kusokurae_table_manager_t *mgr, int32_t table,
+                                           int32_t seat, uint32_t ticket,
+                                           const kusokurae_game_state_t *state, void *userdata);
+
+// Reports a table whose game is over. It stays open until kusokurae_table_close.
+typedef void (*kusokurae_table_finish_cb)(kusokurae_table_manager_t *mgr, int32_t table,
+                                          const kusokurae_game_state_t *state, void *userdata);
+
+typedef struct {
+    // Worker threads (0 for one per hardware thread)
+    int32_t n_threads;
+    // Tables that can be open at once, all allocated up front
+    int32_t max_tables;
+    // Time a seat has for a move, after which the first legal card in hand
+    // order is played for it (0 for no limit)
+    int64_t move_timeout_ns;
+
+    kusokurae_table_request_cb request;
+    kusokurae_table_finish_cb finish;
+    void *userdata;
+} kusokurae_table_config_t;
+
+typedef struct {
+    int64_t tables_opened;
+    int64_t tables_finished;
+    int64_t moves;
+    // Moves played for seats that ran out of time
+    int64_t timeouts;
+    // Submissions turned down: late, out of turn or illegal
+    int64_t rejected;
+} kusokurae_table_stats_t;
+
 void kusokurae_global_init();
 
-void kusokurae_set_prng(int16_t (*fn)(void *));
+void kusokurae_rng_seed(kusokurae_rng_t *rng, uint64_t seed, uint64_t stream);
+
+uint32_t kusokurae_rng_next(kusokurae_rng_t *rng);
+
+// Uniformly distributed in [0, bound). bound must be positive.
+uint32_t kusokurae_rng_bounded(kusokurae_rng_t *rng, uint32_t bound);
+
+// Jumps ahead delta steps in O(log delta) time, as if kusokurae_rng_next had
+// been called delta times.
+void kusokurae_rng_advance(kusokurae_rng_t *rng, uint64_t delta);
+
+// Seeds child with a new, independent stream derived from rng (which moves
+// forward). Useful for handing a reproducible generator to each worker.
+void kusokurae_rng_split(kusokurae_rng_t *rng, kusokurae_rng_t *child);
 
 kusokurae_error_t kusokurae_game_init(kusokurae_game_state_t *self,
                                       kusokurae_game_config_t *cfg,
                                       kusokurae_game_callbacks_t *cbs);
 
+// Reseeds the game's PRNG. kusokurae_game_init seeds it from the clock and
+// the address of self; call this afterwards for reproducible deals.
+void kusokurae_game_seed(kusokurae_game_state_t *self, uint64_t seed, uint64_t stream);
+
 kusokurae_error_t kusokurae_game_start(kusokurae_game_state_t *self);
 
+// Starts a game like kusokurae_game_start, but with the given hands instead of
+// a random deal: hands[i] is the card set (see kusokurae_player_t) of player
+// index i + 1. The hands must split the deck of the game evenly
+// (KUSOKURAE_ERROR_BAD_DEAL otherwise).
+kusokurae_error_t kusokurae_game_deal(kusokurae_game_state_t *self, const uint64_t *hands);
+
+// Deals n games for np players into out, drawing from rng (see deal.c). Each
+// deal is the one kusokurae_game_start would make with the same RNG state, and
+// can be started with kusokurae_game_deal.
+kusokurae_error_t kusokurae_deal_many(int32_t np, kusokurae_rng_t *rng, int64_t n,
+                                      kusokurae_deal_t *out);
+
+// Deal IDs: every deal of np players has an ID from 0 to
+// kusokurae_deal_count(np) - 1, in a fixed order that doesn't depend on the
+// machine. The two Angels count as different cards.
+uint64_t kusokurae_deal_count(int32_t np);
+
+kusokurae_error_t kusokurae_deal_rank(int32_t np, const uint64_t *hands, uint64_t *id);
+
+kusokurae_error_t kusokurae_deal_unrank(int32_t np, uint64_t id, uint64_t *hands);
+
+// Writes the n deals with IDs first, first + 1, ... to out. Only the first is
+// unranked, the others are stepped to. Workers can split the deals into such
+// ranges.
+kusokurae_error_t kusokurae_deal_unrank_many(int32_t np, uint64_t first, int64_t n,
+                                             kusokurae_deal_t *out);
+
+// Starts the game like kusokurae_game_deal, with the deal of the given ID.
+kusokurae_error_t kusokurae_game_deal_id(kusokurae_game_state_t *self, uint64_t id);
+
 kusokurae_error_t kusokurae_game_play(kusokurae_game_state_t *self,
                                       kusokurae_card_t card);
 
+// Same as kusokurae_game_play, but records the move in *undo so that
+// kusokurae_game_unplay can take it back exactly. The state transition
+// callback is NOT called, which makes it suitable for search.
+kusokurae_error_t kusokurae_game_play_undoable(kusokurae_game_state_t *self,
+                                               kusokurae_card_t card,
+                                               kusokurae_undo_t *undo);
+
+// Takes back the move recorded in *undo, which must be the last move played.
+void kusokurae_game_unplay(kusokurae_game_state_t *self,
+                           const kusokurae_undo_t *undo);
+
 int kusokurae_game_is_final_round(kusokurae_game_state_t *self);
 
 kusokurae_player_t *kusokurae_get_active_player(kusokurae_game_state_t *self);
@@ -194,6 +791,296 @@ kusokurae_player_t *kusokurae_get_active_player(kusokurae_game_state_t *self);
 void kusokurae_get_round_state(kusokurae_game_state_t *self,
                                kusokurae_round_state_t *out);
 
+// Returns the number of rounds in the trick history: the finished ones, and
+// the one in progress if anybody has played in it.
+int32_t kusokurae_get_trick_count(const kusokurae_game_state_t *self);
+
+// Returns round seq (1 for the first) of the trick history, or NULL if there
+// is no such round yet.
+const kusokurae_trick_t *kusokurae_get_trick(const kusokurae_game_state_t *self, int32_t seq);
+
+// Returns the round in progress (with no moves yet between rounds), or NULL if
+// the game is not in progress.
+const kusokurae_trick_t *kusokurae_get_current_trick(const kusokurae_game_state_t *self);
+
+// Returns the number of legal moves of the active player (0 if the game is not
+// in progress). Optionally stores them as a card set (see kusokurae_player_t)
+// in *out_mask, and copies the hand cards, in hand order, to out_array, which
+// must hold KUSOKURAE_MAX_HAND_CARDS cards. Either output may be NULL.
+int32_t kusokurae_legal_moves(kusokurae_game_state_t *self,
+                              uint64_t *out_mask,
+                              kusokurae_card_t *out_array);
+
+// Plays n_games complete games without any callback, every seat following
+// the same built-in policy. results_out must hold n_games entries.
+kusokurae_error_t kusokurae_sim_batch(const kusokurae_sim_config_t *configs,
+                                      int32_t n_games,
+                                      int32_t policy,
+                                      kusokurae_sim_result_t *results_out);
+
+void kusokurae_sim_stats_add(kusokurae_sim_stats_t *stats,
+                             const kusokurae_sim_result_t *results,
+                             int32_t n);
+
+// Plays n_games games like kusokurae_sim_batch on n_threads threads (0 for one
+// per core) and adds them up into *out. Game n uses cfg->seed and stream
+// cfg->stream + n, so the outcome doesn't depend on the thread count.
+// Implemented in sim.cxx.
+kusokurae_error_t kusokurae_sim_parallel(const kusokurae_sim_config_t *cfg,
+                                         int64_t n_games,
+                                         int32_t policy,
+                                         int32_t n_threads,
+                                         kusokurae_sim_stats_t *out);
+
+// Creates a solver with a transposition table of 2^tt_bits entries (16 bytes
+// each). Returns NULL if out of memory.
+kusokurae_solver_t *kusokurae_solver_new(int32_t tt_bits);
+
+void kusokurae_solver_free(kusokurae_solver_t *solver);
+
+// Solves the position in *self, with every hand known, for the seat (player
+// index - 1). self is used as scratch space but restored before returning.
+// The transposition table is kept across calls.
+kusokurae_error_t kusokurae_solve(kusokurae_solver_t *solver,
+                                  kusokurae_game_state_t *self,
+                                  int32_t seat,
+                                  kusokurae_solve_result_t *out);
+
+// Picks a move for the active player by information-set Monte Carlo tree
+// search (see ismcts.cxx). Only what the player can see is used: the hands of
+// the others are sampled anew for every playout. *self is not modified, and
+// no callback is called.
+kusokurae_error_t kusokurae_ismcts_search(const kusokurae_game_state_t *self,
+                                          const kusokurae_ismcts_config_t *cfg,
+                                          kusokurae_ismcts_result_t *out);
+
+// Writes a KUSOKURAE_SNAPSHOT_SIZE-byte snapshot of *self to out. The snapshot
+// is canonical (equal states give equal bytes) and doesn't depend on the
+// machine. Callbacks are not part of it.
+kusokurae_error_t kusokurae_state_pack(const kusokurae_game_state_t *self, uint8_t *out);
+
+// Restores *self from a snapshot written by kusokurae_state_pack, keeping
+// self->cbs. *self is left untouched if the snapshot is not valid
+// (KUSOKURAE_ERROR_BAD_SNAPSHOT).
+kusokurae_error_t kusokurae_state_unpack(kusokurae_game_state_t *self, const uint8_t *in);
+
+// Deals a new compact game for np players, using self->rng_state (seed it
+// with kusokurae_rng_seed first). With the same RNG state, the deal is the
+// same as kusokurae_game_start's.
+kusokurae_error_t kusokurae_compact_start(kusokurae_compact_state_t *self, int32_t np);
+
+// Plays a card for the player on turn, like kusokurae_game_play.
+kusokurae_error_t kusokurae_compact_play(kusokurae_compact_state_t *self,
+                                         kusokurae_card_id_t card);
+
+// Returns the card with its flags as they would be in the full state, so the
+// kusokurae_card_* accessors work on it. The zero card if the card was not
+// dealt.
+kusokurae_card_t kusokurae_compact_card(const kusokurae_compact_state_t *self,
+                                        kusokurae_card_id_t card);
+
+kusokurae_error_t kusokurae_compact_from_game(kusokurae_compact_state_t *self,
+                                              const kusokurae_game_state_t *game);
+
+// Expands into the full form, keeping game->cbs.
+kusokurae_error_t kusokurae_compact_to_game(const kusokurae_compact_state_t *self,
+                                            kusokurae_game_state_t *game);
+
+// Deals a new game of nd decks for np players, using self->rng_state (seed it
+// with kusokurae_rng_seed first). KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS if
+// there is no such game: np must be 3~4 for one deck, and 3~6 for two.
+// KUSOKURAE_ERROR_BAD_ARGUMENT if nd is not 1 or 2. With one deck, the deal
+// is the same as kusokurae_compact_start's.
+kusokurae_error_t kusokurae_decks_start(kusokurae_decks_state_t *self, int32_t np, int32_t nd);
+
+// Plays a card (see kusokurae_decks_state_t) for the player on turn. As in the
+// full engine, the card stands for its suit and rank, and the player's
+// highest card of those is played.
+kusokurae_error_t kusokurae_decks_play(kusokurae_decks_state_t *self, int32_t card);
+
+// Computes the position hash of *self from scratch. It always equals
+// self->hash; meant for checks and for states built by other means.
+uint64_t kusokurae_game_compute_hash(const kusokurae_game_state_t *self);
+
+// Creates a cache of 2^bits entries (16 bytes each, bits >= 8), mapping
+// position hashes to 64-bit values. Returns NULL if out of memory.
+kusokurae_cache_t *kusokurae_cache_new(int32_t bits);
+
+void kusokurae_cache_free(kusokurae_cache_t *cache);
+
+// Looks up key. Returns 1 and fills *value if found, 0 otherwise.
+// Safe to call from any number of threads along with kusokurae_cache_put.
+int kusokurae_cache_get(kusokurae_cache_t *cache, uint64_t key, uint64_t *value);
+
+// Stores a value for key, possibly evicting another entry.
+// A key of 0 with a value of 0 can't be told from an empty slot and is never
+// found again.
+void kusokurae_cache_put(kusokurae_cache_t *cache, uint64_t key, uint64_t value);
+
+// Drops all entries and zeroes the counters. Not safe against concurrent use.
+void kusokurae_cache_clear(kusokurae_cache_t *cache);
+
+void kusokurae_cache_get_stats(kusokurae_cache_t *cache, kusokurae_cache_stats_t *out);
+
+// Sets up ring to use the capacity slots at events. capacity must be a power
+// of 2, else KUSOKURAE_ERROR_BAD_ARGUMENT.
+kusokurae_error_t kusokurae_event_ring_init(kusokurae_event_ring_t *ring,
+                                            kusokurae_event_t *events,
+                                            uint32_t capacity);
+
+// Moves up to max events out of the ring into out, oldest first. Returns the
+// number moved.
+int32_t kusokurae_event_ring_drain(kusokurae_event_ring_t *ring,
+                                   kusokurae_event_t *out,
+                                   int32_t max);
+
+// Returns the number of events lost because the ring was full.
+uint32_t kusokurae_event_ring_dropped(const kusokurae_event_ring_t *ring);
+
+// Writes a KUSOKURAE_RECORD_SIZE-byte record of the game in *self to out: the
+// deal and every move played so far, in order. Unlike a snapshot, it tells how
+// the game went and not just where it stands.
+kusokurae_error_t kusokurae_game_record(const kusokurae_game_state_t *self, uint8_t *out);
+
+// Plays the game in a record from the deal on, through kusokurae_game_play and
+// so with callbacks, checking every move. self is set up for the record's
+// number of players, keeping self->cbs.
+kusokurae_error_t kusokurae_record_replay(kusokurae_game_state_t *self, const uint8_t *record);
+
+// Writes the path of segment n of the log at prefix to out (of size bytes).
+// Returns the length of the path, like snprintf.
+int kusokurae_log_segment_path(char *out, size_t size, const char *prefix, int32_t n);
+
+// Opens a log for appending. Records go to a new segment after the last one
+// found at prefix, and a new segment is started every segment_records records.
+// Returns NULL if the first segment can't be created.
+kusokurae_log_writer_t *kusokurae_log_writer_open(const char *prefix, int64_t segment_records);
+
+// Flushes and closes the log.
+kusokurae_error_t kusokurae_log_writer_close(kusokurae_log_writer_t *log);
+
+// Appends a record. Records are buffered; call kusokurae_log_flush to hand
+// them to the OS. Safe to call from any number of threads.
+kusokurae_error_t kusokurae_log_append(kusokurae_log_writer_t *log, const uint8_t *record);
+
+kusokurae_error_t kusokurae_log_flush(kusokurae_log_writer_t *log);
+
+// Sets the move callback of the game to kusokurae_log_on_move, so that every
+// game it finishes is appended to the log. The log must outlive the
+// attachment.
+void kusokurae_log_attach(kusokurae_log_writer_t *log, kusokurae_game_state_t *game);
+
+// Move callback appending the game to the log in userdata when it finishes.
+void kusokurae_log_on_move(kusokurae_game_state_t *self, int32_t player,
+                           uint32_t display_order, void *userdata);
+
+// Maps a log segment into memory for reading. A record cut short at the end,
+// as left by a crash, is ignored. Returns NULL if the file can't be mapped or
+// is not a log segment.
+kusokurae_log_reader_t *kusokurae_log_reader_open(const char *path);
+
+void kusokurae_log_reader_close(kusokurae_log_reader_t *log);
+
+// Stores the number of records in the segment to *out.
+kusokurae_error_t kusokurae_log_count(const kusokurae_log_reader_t *log, int64_t *out);
+
+// Returns record i, pointing right into the mapping, or NULL if out of range.
+const uint8_t *kusokurae_log_record(const kusokurae_log_reader_t *log, int64_t i);
+
+// Replays every record of the segment (without callbacks). *n_valid is set to
+// the number of records before the first bad one, if any.
+kusokurae_error_t kusokurae_log_verify(const kusokurae_log_reader_t *log, int64_t *n_valid);
+
+// Deals n games (1 to KUSOKURAE_BATCH_MAX, else KUSOKURAE_ERROR_BAD_ARGUMENT)
+// of np players into the batch, drawing from b->rng. Game i gets the deal
+// kusokurae_deal_many would give as its i-th.
+kusokurae_error_t kusokurae_batch_start(kusokurae_batch_t *b, int32_t np, int32_t n, int32_t flags);
+
+// Plays one move in every game: moves[i] (display_order) in game i, or a
+// random legal card for all if moves is NULL. A card of which the player holds
+// several of the same kind stands for the highest one, like in
+// kusokurae_game_play. Nothing is played if any move is not legal
+// (KUSOKURAE_ERROR_FORBIDDEN_MOVE); KUSOKURAE_ERROR_NOT_IN_GAME once the
+// games are over.
+kusokurae_error_t kusokurae_batch_step(kusokurae_batch_t *b, const uint8_t *moves);
+
+// Plays the games to the end with random moves.
+kusokurae_error_t kusokurae_batch_rollout(kusokurae_batch_t *b);
+
+// Whether the games of the batch are over
+int kusokurae_batch_finished(const kusokurae_batch_t *b);
+
+// Starts a table manager and its threads. Returns NULL if cfg is not valid or
+// out of memory.
+kusokurae_table_manager_t *kusokurae_table_manager_new(const kusokurae_table_config_t *cfg);
+
+// Stops the threads and frees every table, open or not. No callback is
+// called once this returns; none may be running when it's called from one.
+void kusokurae_table_manager_free(kusokurae_table_manager_t *mgr);
+
+// Deals a game of np players at a free table, seeded with seed and stream,
+// and sets *table. The first request follows from one of the manager's
+// threads. KUSOKURAE_ERROR_NO_TABLE if every table is taken.
+kusokurae_error_t kusokurae_table_open(kusokurae_table_manager_t *mgr, int32_t np,
+                                       uint64_t seed, uint64_t stream, int32_t *table);
+
+// Gives the move (display_order) asked for by the request with ticket. Safe
+// to call from any thread, including from the request callback. The move is
+// played later on one of the manager's threads. KUSOKURAE_ERROR_FORBIDDEN_MOVE
+// if the request is no longer open (answered, timed out) or the card can't be
+// played.
+kusokurae_error_t kusokurae_table_submit(kusokurae_table_manager_t *mgr, int32_t table,
+                                         int32_t seat, uint32_t ticket,
+                                         uint32_t display_order);
+
+// Copies the state of an open table to out.
+kusokurae_error_t kusokurae_table_state(kusokurae_table_manager_t *mgr, int32_t table,
+                                        kusokurae_game_state_t *out);
+
+// Frees a table, finished or not. Requests still open are dropped.
+kusokurae_error_t kusokurae_table_close(kusokurae_table_manager_t *mgr, int32_t table);
+
+void kusokurae_table_get_stats(kusokurae_table_manager_t *mgr, kusokurae_table_stats_t *out);
+
+// Generates the tablebase at path, or goes on with it if the file is a
+// tablebase of the same np and k left incomplete. KUSOKURAE_ERROR_BAD_TABLEBASE
+// if it is anything else. k goes up to 3 for 3 players and 2 for 4, else
+// KUSOKURAE_ERROR_TABLEBASE_TOO_LARGE. Progress is stored to *out if it's not
+// NULL.
+kusokurae_error_t kusokurae_tablebase_generate(const char *path,
+                                               const kusokurae_tablebase_config_t *cfg,
+                                               kusokurae_tablebase_progress_t *out);
+
+// Maps a complete tablebase into memory. Returns NULL if the file can't be
+// mapped or is not one.
+kusokurae_tablebase_t *kusokurae_tablebase_open(const char *path);
+
+void kusokurae_tablebase_close(kusokurae_tablebase_t *tb);
+
+int32_t kusokurae_tablebase_np(const kusokurae_tablebase_t *tb);
+
+int32_t kusokurae_tablebase_k(const kusokurae_tablebase_t *tb);
+
+// Looks up a position at the start of a round: hands (by player index - 1)
+// of equal size up to k, and the leader. values[i] is set to what player i can
+// be sure to gain from here on, like kusokurae_solve for seat i.
+kusokurae_error_t kusokurae_tablebase_lookup(const kusokurae_tablebase_t *tb,
+                                             const uint64_t *hands, int32_t leader,
+                                             int8_t *values);
+
+// Solves the position in *self for the seat, like kusokurae_solve, by
+// searching the rest of the round in progress and looking up the positions
+// after it. KUSOKURAE_ERROR_NOT_IN_TABLEBASE if the hands are too big. nodes
+// counts the lookups.
+kusokurae_error_t kusokurae_tablebase_probe(const kusokurae_tablebase_t *tb,
+                                            const kusokurae_game_state_t *self,
+                                            int32_t seat,
+                                            kusokurae_solve_result_t *out);
+
+// Sums the counters of all threads into *out. Returns 0 and zeros if the
+// library was built without KUSOKURAE_METRICS.
+int32_t kusokurae_metrics_snapshot(kusokurae_metrics_t *out);
+
 int kusokurae_card_is_playable(kusokurae_card_t card);
 
 int kusokurae_card_round_played(kusokurae_card_t card);
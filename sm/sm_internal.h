@@ -7,24 +7,254 @@ extern "C" {
 
 #include "sm.h"
 
-// RAND_MAX used in Microsoft implementation of C rand() which I replicated
-#define MS_RAND_MAX 32767
+// Multiplier of the PCG32 LCG
+#define PCG_MULT 6364136223846793005ULL
 
 #define MASK_PLAYED_IN_ROUND    0x7F
 #define MASK_PLAYABLE           0x80
 
-int16_t urand(void *state);
+// Bit of a card in kusokurae_player_t card sets
+#define CARD_BIT(order)         (1ULL << ((order) - 1))
+
+// The deck and its card sets, built at compile time (deck.cxx).
+typedef struct {
+    // By display_order, highest first
+    kusokurae_card_t deck[KUSOKURAE_DECK_SIZE];
+    // Card sets indexed by [suit + 1][rank]
+    uint64_t suit_rank[KUSOKURAE_SUIT_OTHER + 2][11];
+    // Card sets indexed by suit + 1
+    uint64_t suit[KUSOKURAE_SUIT_OTHER + 2];
+    // Card sets indexed by rank. rank[0] holds the cards a leader can't play
+    // unless busted.
+    uint64_t rank[11];
+} deck_layout_t;
+
+extern const deck_layout_t DECK_LAYOUT;
+
+#define DECK                    (DECK_LAYOUT.deck)
+#define SUIT_RANK_MASK          (DECK_LAYOUT.suit_rank)
+#define SUIT_MASK               (DECK_LAYOUT.suit)
+#define RANK_MASK               (DECK_LAYOUT.rank)
+
+#define DECK_CARD(order)        (DECK[KUSOKURAE_DECK_SIZE - (order)])
+
+// Zobrist keys, indexed by player index - 1 and display_order. Filled by
+// kusokurae_global_init() and read-only afterwards.
+extern uint64_t ZOBRIST_HAND[KUSOKURAE_MAX_PLAYERS][KUSOKURAE_DECK_SIZE + 1];
+extern uint64_t ZOBRIST_BOARD[KUSOKURAE_MAX_PLAYERS][KUSOKURAE_DECK_SIZE + 1];
+extern uint64_t ZOBRIST_TAKEN[KUSOKURAE_MAX_PLAYERS][KUSOKURAE_DECK_SIZE + 1];
+extern uint64_t ZOBRIST_TURN[KUSOKURAE_MAX_PLAYERS];
+// Indexed by high_ranker_index + 1
+extern uint64_t ZOBRIST_HIGH[KUSOKURAE_MAX_PLAYERS + 1];
+
+static inline int mask_popcount(uint64_t mask) {
+    return __builtin_popcountll(mask);
+}
+
+// Display order of the highest card in a non-empty set
+static inline int mask_highest(uint64_t mask) {
+    return 64 - __builtin_clzll(mask);
+}
+
+// Display order of the lowest card in a non-empty set
+static inline int mask_lowest(uint64_t mask) {
+    return __builtin_ctzll(mask) + 1;
+}
+
+// Rebuilds the trick history of a game from the rounds its cards were played
+// in, for states set up other than move by move.
+void game_rebuild_tricks(kusokurae_game_state_t *self);
+
+// Counters of metrics.c. Each thread has a shard of its own and only ever adds
+// to it, so the hot paths take no lock and share no cache line. Everything
+// compiles away unless KUSOKURAE_METRICS is defined.
+#ifdef KUSOKURAE_METRICS
+extern __thread kusokurae_metrics_t *metrics_local;
+
+kusokurae_metrics_t *metrics_attach(void);
+
+static inline kusokurae_metrics_t *metrics_shard(void) {
+    kusokurae_metrics_t *m = metrics_local;
+    return m != NULL ? m : metrics_attach();
+}
+
+// Only the owning thread writes, so a plain add is enough; the store is atomic
+// for kusokurae_metrics_snapshot reading along.
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+int64_t metrics_now(void);
+
+void metrics_observe(kusokurae_histogram_t *h, int64_t ns);
+
+#define METRICS_INC(field)              metrics_add(&metrics_shard()->field, 1)
+#define METRICS_START(t0)               int64_t t0 = metrics_now()
+#define METRICS_OBSERVE(field, t0)      metrics_observe(&metrics_shard()->field, metrics_now() - (t0))
+#else
+#define METRICS_INC(field)              ((void)0)
+#define METRICS_START(t0)               ((void)0)
+#define METRICS_OBSERVE(field, t0)      ((void)0)
+#endif
+
+// Rule kernels on card sets, shared by the full and the compact engines.
+// The _n forms take card sets of nwords words, one per deck, and the masks of
+// one deck; with constant arguments they inline to straight-line code.
+
+// Cards a player holding hand may play, into good. zeros is the rank 0 cards.
+// Sets *busted to 2 if a leader has nothing but zeros, to 1 if a single zero
+// is all that's left to play, and leaves it alone otherwise.
+static inline void rules_playable_n(const uint64_t *hand, int nwords, uint64_t zeros,
+                                    int is_leader, int *busted, uint64_t *good) {
+    uint64_t any = 0, zero = 0;
+    // Playable cards, counted up to 2 without a popcount
+    int i, n = 0;
+    for (i = 0; i < nwords; i++) {
+        // Leader can't play rank 0 unless he/she has NO CHOICE
+        good[i] = is_leader ? hand[i] & ~zeros : hand[i];
+        any |= hand[i];
+        zero |= good[i] & zeros;
+        if (good[i]) {
+            n += good[i] & (good[i] - 1) ? 2 : 1;
+        }
+    }
+    if (n == 0 && any) {
+        // NO CHOICE
+        for (i = 0; i < nwords; i++) {
+            good[i] = hand[i];
+        }
+        *busted = 2;
+    } else if (n == 1 && zero) {
+        // A Zero held back
+        *busted = 1;
+    }
+}
+
+static inline uint64_t rules_playable(uint64_t hand, int is_leader, int *busted) {
+    uint64_t good;
+    rules_playable_n(&hand, 1, RANK_MASK[0], is_leader, busted, &good);
+    return good;
+}
+
+// Whether a card takes the lead of the round from the current high ranker
+static inline int rules_beats(int order, int high_order) {
+    return DECK_CARD(order).rank > DECK_CARD(high_order).rank;
+}
+
+// Points of the cards of a finished round for the taker, given the Baozi and
+// Xiang masks: doubled if the round was won with the Ghost.
+static inline int rules_round_points_n(const uint64_t *cards, int nwords, uint64_t baozi,
+                                       uint64_t xiang, int ghost_won) {
+    int i, ret = 0;
+    for (i = 0; i < nwords; i++) {
+        ret += mask_popcount(cards[i] & baozi) - mask_popcount(cards[i] & xiang);
+    }
+    return ghost_won ? ret << 1 : ret;
+}
+
+static inline int rules_round_points(uint64_t cards, int winning_order) {
+    return rules_round_points_n(&cards, 1, SUIT_MASK[KUSOKURAE_SUIT_BAOZI + 1],
+                                SUIT_MASK[KUSOKURAE_SUIT_XIANG + 1],
+                                DECK_CARD(winning_order).suit == KUSOKURAE_SUIT_OTHER);
+}
+
+// Appends a move to the round in progress, following its lead.
+static inline void trick_push(kusokurae_trick_t *t, int np, int order) {
+    int player = t->leader + t->nmoves;
+    int suit = DECK_CARD(order).suit;
+    // The score is kept for the winner, so undo any doubling first.
+    int score = t->doubled ? t->score / 2 : t->score;
+    if (player >= np) {
+        player -= np;
+    }
+    if (t->nmoves == 0 ||
+        rules_beats(order, t->moves[(t->winner - t->leader + np) % np])) {
+        t->winner = (uint8_t)player;
+        t->doubled = suit == KUSOKURAE_SUIT_OTHER;
+    }
+    if (suit != KUSOKURAE_SUIT_OTHER) {
+        score += suit;
+    }
+    t->moves[t->nmoves++] = (kusokurae_card_id_t)order;
+    t->score = (int8_t)(t->doubled ? score * 2 : score);
+}
 
 void game_state_change(kusokurae_game_state_t *g, int32_t newstate);
 
+// Puts the hands into the card slots in deck order, and sets up the game.
+void game_set_hands(kusokurae_game_state_t *self, const uint64_t *hands);
+
+// Deal and moves of the full engine, run on the specialization of
+// kusokurae::Game for the number of players (game.cxx). game_play records how
+// to take the move back in undo if it is not NULL, and then does NOT call the
+// state transition callback.
+void game_start(kusokurae_game_state_t *self);
+kusokurae_error_t game_play(kusokurae_game_state_t *self, kusokurae_card_t card,
+                            kusokurae_undo_t *undo);
+
+// Appends an event to the game's ring, if any (see events.c). PLAY and TRICK
+// events are made before the round is counted as finished.
+static inline void game_event(kusokurae_game_state_t *g, int type, int player, int card,
+                              int score, int doubled) {
+    kusokurae_event_ring_t *ring = g->cbs.events;
+    if (ring == NULL) {
+        return;
+    }
+    uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->capacity) {
+        // The engine is the only writer, so no read-modify-write is needed.
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    kusokurae_event_t *e = &ring->events[head & (ring->capacity - 1)];
+    e->type = (uint8_t)type;
+    e->player = (uint8_t)player;
+    e->card = (uint8_t)card;
+    e->score = (int8_t)score;
+    e->doubled = (uint8_t)doubled;
+    e->round = (uint8_t)(g->nround + (type == KUSOKURAE_EVENT_PLAY || type == KUSOKURAE_EVENT_TRICK));
+    e->reserved = 0;
+    // Publishes the event to the consumer.
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int player_card_index(kusokurae_player_t *player, int order);
 int player_has_card(kusokurae_player_t *player, kusokurae_card_t *card);
 void player_drop_card(kusokurae_player_t *player, int index);
 
 void player_set_card_played(kusokurae_player_t *player, int index, int nround);
 void player_set_card_playable(kusokurae_player_t *player, int index, int status);
+void player_set_playable_mask(kusokurae_player_t *player, uint64_t mask);
 void player_set_playable_flags(kusokurae_player_t *player, int is_leader);
+// Replaces the cards still in hand with another set of the same size, keeping
+// the played ones. The player must not be on turn.
+void player_set_hand(kusokurae_player_t *player, uint64_t hand);
+
+// Writes a snapshot of a compact state, as kusokurae_state_pack would of its
+// full form.
+void compact_pack(const kusokurae_compact_state_t *self, uint8_t *out);
+
+// Deals a new game for np players into hands (KUSOKURAE_MAX_PLAYERS sets, the
+// unused ones empty). Implemented in deal.c.
+void deal_hands(int np, kusokurae_rng_t *rng, uint64_t *hands);
+// Deals a game of nd decks for np players into hands
+// (KUSOKURAE_MAX_DECK_PLAYERS sets, the unused ones empty), with one deck the
+// same deal as deal_hands.
+void deal_cards(int np, int nd, kusokurae_rng_t *rng, kusokurae_cards_t *hands);
+// Fills the tables for deal IDs, called by kusokurae_global_init.
+void deal_init();
+
+// Fills the tables of batch.c and picks its kernel.
+void batch_init();
+// Whether the hands split the deck of an np-player game evenly
+int deal_valid(int np, const uint64_t *hands);
+
+// Checksum of n bytes, as stored in snapshots and game records
+uint8_t block_checksum(const uint8_t *p, int n);
 
-kusokurae_player_t *player_find_next(kusokurae_game_state_t *game, kusokurae_player_t *player);
+int policy_pick(kusokurae_game_state_t *game, kusokurae_player_t *player, int32_t policy);
+void sim_play(kusokurae_game_state_t *g, const kusokurae_sim_config_t *config,
+              int32_t policy, kusokurae_sim_result_t *out);
 
 #ifdef __cplusplus
 }
@@ -2,7 +2,18 @@ package sm
 
 import (
 	"fmt"
+	"io/ioutil"
+	"math/bits"
+	"net/http"
+	"net/http/httptest"
+	"os"
+	"path/filepath"
+	"runtime"
+	"strings"
+	"sync"
 	"testing"
+	"time"
+	"unsafe"
 
 	"github.com/stretchr/testify/assert"
 )
@@ -116,3 +127,1254 @@ func TestCardString(t *testing.T) {
 		{0, SuitYoutiao, 3, 128},
 	}))
 }
+
+func TestLayout(t *testing.T) {
+	assert.EqualValues(t, cSizeofPlayer, unsafe.Sizeof(Player{}))
+	assert.EqualValues(t, cSizeofGameState, unsafe.Offsetof(GameState{}.goStateCallbackNo))
+	assert.EqualValues(t, cSizeofEvent, unsafe.Sizeof(Event{}))
+	assert.EqualValues(t, cSizeofTrick, unsafe.Sizeof(Trick{}))
+	assert.EqualValues(t, cSizeofTableBaseConfig, unsafe.Sizeof(TableBaseConfig{}))
+	assert.EqualValues(t, cSizeofHistogram, unsafe.Sizeof(Histogram{}))
+}
+
+// playFirstPlayable plays the first legal card of the active player.
+func playFirstPlayable(t *testing.T, g *GameState) {
+	for _, card := range g.GetActivePlayer().GetHandCards() {
+		if card.Playable() {
+			assert.NoError(t, g.Play(card))
+			return
+		}
+	}
+	t.Fatal("No playable card")
+}
+
+func TestHandMasks(t *testing.T) {
+	for _, np := range []int32{3, 4} {
+		state, err := NewGame(GameConfig{
+			NumPlayers: np,
+		}, nil)
+		assert.NoError(t, err)
+		assert.NoError(t, state.Start())
+		for state.GetStatus() == StatusPlay {
+			for i := int32(0); i < np; i++ {
+				p := state.GetPlayer(i)
+				var hand, playable uint64
+				for _, card := range p.GetCards() {
+					bit := uint64(1) << (card.displayOrder - 1)
+					if card.RoundPlayed() == 0 {
+						hand |= bit
+					}
+					if card.Playable() {
+						playable |= bit
+					}
+				}
+				assert.Equal(t, hand, p.HandMask())
+				assert.Equal(t, playable, p.PlayableMask())
+				assert.Equal(t, playable, p.PlayableMask()&p.HandMask())
+				if p != state.GetActivePlayer() {
+					assert.Zero(t, p.PlayableMask())
+				}
+			}
+			playFirstPlayable(t, state)
+		}
+		for i := int32(0); i < np; i++ {
+			assert.Zero(t, state.GetPlayer(i).HandMask())
+		}
+	}
+}
+
+func TestSimBatch(t *testing.T) {
+	for _, np := range []int32{3, 4} {
+		for _, policy := range []Policy{PolicyRandom, PolicyGreedyHigh, PolicyGreedyLow} {
+			cfg := GameConfig{NumPlayers: np}
+			stats, err := SimBatch(cfg, 200, policy, 42)
+			assert.NoError(t, err)
+			assert.Equal(t, 200, stats.Games)
+			assert.Equal(t, 0, stats.Errors)
+			var cards, ghosts int64
+			for i := int32(0); i < np; i++ {
+				cards += stats.CardsTaken[i]
+				ghosts += stats.GhostHolder[i]
+			}
+			// The 4-player deck has one Angel removed
+			assert.EqualValues(t, 200*(33-np%3), cards)
+			assert.EqualValues(t, 200, ghosts)
+
+			again, err := SimBatch(cfg, 200, policy, 42)
+			assert.NoError(t, err)
+			assert.Equal(t, stats, again)
+		}
+	}
+
+	stats, err := SimBatch(GameConfig{NumPlayers: 5}, 1, PolicyRandom, 0)
+	assert.NoError(t, err)
+	assert.Equal(t, 1, stats.Errors)
+}
+
+func TestSimParallel(t *testing.T) {
+	cfg := GameConfig{NumPlayers: 4}
+	batch, err := SimBatch(cfg, 1000, PolicyRandom, 7)
+	assert.NoError(t, err)
+	for _, threads := range []int{1, 3, 8} {
+		stats, err := SimParallel(cfg, 1000, PolicyRandom, 7, threads)
+		assert.NoError(t, err)
+		stats.Elapsed = 0
+		assert.Equal(t, batch, stats)
+	}
+
+	_, err = SimParallel(GameConfig{NumPlayers: 2}, 1, PolicyRandom, 0, 1)
+	assert.Equal(t, ErrBadNPlayers, err)
+}
+
+func TestSimGames(t *testing.T) {
+	for _, np := range []int32{3, 4} {
+		cfg := GameConfig{NumPlayers: np}
+		stats, err := SimBatch(cfg, 200, PolicyGreedyHigh, 42)
+		assert.NoError(t, err)
+		results := make([]SimResult, 200)
+		assert.NoError(t, SimGames(cfg, PolicyGreedyHigh, 42, 0, results))
+
+		// The same games as SimBatch, also when split
+		split := make([]SimResult, 200)
+		assert.NoError(t, SimGames(cfg, PolicyGreedyHigh, 42, 0, split[:70]))
+		assert.NoError(t, SimGames(cfg, PolicyGreedyHigh, 42, 70, split[70:]))
+		assert.Equal(t, results, split)
+		var score, ghosts [4]int64
+		for _, r := range results {
+			assert.NoError(t, r.Err)
+			assert.Equal(t, int(np), r.NumPlayers)
+			score[0] += int64(r.Score[0])
+			score[np-1] += int64(r.Score[np-1])
+			ghosts[r.GhostHolder]++
+			// One winning card per round
+			assert.Equal(t, (33-int(np)%3)/int(np), bits.OnesCount64(r.WinningCards))
+		}
+		assert.Equal(t, stats.Score[0], score[0])
+		assert.Equal(t, stats.Score[np-1], score[np-1])
+		assert.Equal(t, stats.GhostHolder[:np], ghosts[:np])
+	}
+
+	assert.Equal(t, ErrBadArgument, SimGames(GameConfig{NumPlayers: 3}, Policy(-1), 0, 0, make([]SimResult, 1)))
+	results := make([]SimResult, 1)
+	assert.NoError(t, SimGames(GameConfig{NumPlayers: 5}, PolicyRandom, 0, 0, results))
+	assert.Equal(t, ErrBadNPlayers, results[0].Err)
+}
+
+func TestSeed(t *testing.T) {
+	deal := func(seed, stream uint64) (ret [3]uint64) {
+		state, err := NewGame(GameConfig{
+			NumPlayers: 3,
+		}, nil)
+		assert.NoError(t, err)
+		state.Seed(seed, stream)
+		assert.NoError(t, state.Start())
+		for i := range ret {
+			ret[i] = state.GetPlayer(int32(i)).HandMask()
+		}
+		return
+	}
+	assert.Equal(t, deal(1, 2), deal(1, 2))
+	assert.NotEqual(t, deal(1, 2), deal(1, 3))
+	assert.NotEqual(t, deal(1, 2), deal(2, 2))
+
+	// Unseeded games created together are dealt differently
+	g1, _ := NewGame(GameConfig{NumPlayers: 3}, nil)
+	g2, _ := NewGame(GameConfig{NumPlayers: 3}, nil)
+	assert.NoError(t, g1.Start())
+	assert.NoError(t, g2.Start())
+	assert.NotEqual(t, g1.GetPlayer(0).HandMask(), g2.GetPlayer(0).HandMask())
+}
+
+func TestLegalMoves(t *testing.T) {
+	state, err := NewGame(GameConfig{
+		NumPlayers: 3,
+	}, nil)
+	assert.NoError(t, err)
+	assert.Equal(t, 0, len(state.LegalMoves(nil)))
+	assert.NoError(t, state.Start())
+
+	buf := make([]Card, 0, MaxHandCards)
+	for state.GetStatus() == StatusPlay {
+		var expected []Card
+		for _, card := range state.GetActivePlayer().GetHandCards() {
+			if card.Playable() {
+				expected = append(expected, card)
+			}
+		}
+		moves := state.LegalMoves(buf[:0])
+		assert.Equal(t, expected, moves)
+		assert.Equal(t, state.GetActivePlayer().PlayableMask(), state.LegalMoveMask())
+		assert.Equal(t, 0.0, testing.AllocsPerRun(10, func() {
+			state.LegalMoves(buf[:0])
+		}))
+		assert.NoError(t, state.Play(moves[len(moves)-1]))
+	}
+	assert.Zero(t, state.LegalMoveMask())
+}
+
+func TestUnplay(t *testing.T) {
+	for _, np := range []int32{3, 4} {
+		var calls int
+		state, err := NewGame(GameConfig{
+			NumPlayers: np,
+		}, func(GameStatus) {
+			calls++
+		})
+		assert.NoError(t, err)
+		assert.NoError(t, state.Start())
+
+		var undo Undo
+		buf := make([]Card, 0, MaxHandCards)
+		for state.GetStatus() == StatusPlay {
+			before := *state
+			calls = 0
+			moves := state.LegalMoves(buf[:0])
+			for _, move := range moves {
+				assert.NoError(t, state.PlayUndoable(move, &undo))
+				state.Unplay(&undo)
+				assert.Equal(t, before, *state)
+			}
+			assert.Equal(t, 0, calls)
+
+			// Also take back a whole round played ahead
+			var undos []Undo
+			for state.GetStatus() == StatusPlay && len(undos) < int(np) {
+				undos = append(undos, Undo{})
+				ahead := state.LegalMoves(nil)
+				assert.NoError(t, state.PlayUndoable(ahead[0], &undos[len(undos)-1]))
+			}
+			for i := len(undos) - 1; i >= 0; i-- {
+				state.Unplay(&undos[i])
+			}
+			assert.Equal(t, before, *state)
+
+			if !assert.NoError(t, state.Play(moves[len(moves)/2])) {
+				return
+			}
+		}
+	}
+}
+
+// paranoid returns the final score of seat with every other player playing
+// against it, by plain minimax.
+func paranoid(g *GameState, seat int) int {
+	if g.GetStatus() != StatusPlay {
+		return g.GetPlayer(int32(seat)).GetScore()
+	}
+	maximizing := g.GetActivePlayer().GetIndex()-1 == seat
+	best := 1000
+	if maximizing {
+		best = -1000
+	}
+	var undo Undo
+	for _, move := range g.LegalMoves(nil) {
+		g.PlayUndoable(move, &undo)
+		value := paranoid(g, seat)
+		g.Unplay(&undo)
+		if maximizing == (value > best) && value != best {
+			best = value
+		}
+	}
+	return best
+}
+
+func TestSolve(t *testing.T) {
+	solver, err := NewSolver(16)
+	assert.NoError(t, err)
+	defer solver.Close()
+
+	for _, np := range []int32{3, 4} {
+		for game := 0; game < 5; game++ {
+			state, err := NewGame(GameConfig{
+				NumPlayers: np,
+			}, nil)
+			assert.NoError(t, err)
+			state.Seed(uint64(game), uint64(np))
+			assert.NoError(t, state.Start())
+			// Leave 3 cards in the last hand, stopping in the middle of a round
+			for bits.OnesCount64(state.GetPlayer(np-1).HandMask()) > 3 ||
+				state.GetActivePlayer().GetIndex() != game%int(np)+1 {
+				playFirstPlayable(t, state)
+			}
+			before := *state
+			for seat := 0; seat < int(np); seat++ {
+				result, err := solver.Solve(state, seat)
+				assert.NoError(t, err)
+				assert.Equal(t, before, *state)
+				assert.Equal(t, paranoid(state, seat), result.Score)
+				assert.True(t, result.BestMove.Valid())
+				assert.True(t, result.Nodes > 0)
+				if seat == state.GetActivePlayer().GetIndex()-1 {
+					var undo Undo
+					assert.NoError(t, state.PlayUndoable(result.BestMove, &undo))
+					assert.Equal(t, result.Score, paranoid(state, seat))
+					state.Unplay(&undo)
+				}
+			}
+			_, err = solver.Solve(state, int(np))
+			assert.Equal(t, ErrBadArgument, err)
+		}
+	}
+
+	_, err = solver.Solve(&GameState{}, 0)
+	assert.Equal(t, ErrUninitialized, err)
+}
+
+func TestTableBase(t *testing.T) {
+	dir, err := ioutil.TempDir("", "kusokurae")
+	assert.NoError(t, err)
+	defer os.RemoveAll(dir)
+	path := filepath.Join(dir, "3p2.ktb")
+
+	_, err = GenerateTableBase(path, TableBaseConfig{NumPlayers: 3, K: 0})
+	assert.Equal(t, ErrBadArgument, err)
+	_, err = GenerateTableBase(path, TableBaseConfig{NumPlayers: 3, K: 4})
+	assert.Equal(t, ErrTableBaseTooLarge, err)
+	_, err = GenerateTableBase(path, TableBaseConfig{NumPlayers: 4, K: 3})
+	assert.Equal(t, ErrTableBaseTooLarge, err)
+	_, err = os.Stat(path)
+	assert.True(t, os.IsNotExist(err))
+
+	cfg := TableBaseConfig{NumPlayers: 3, K: 2, MaxSets: 500}
+	progress, err := GenerateTableBase(path, cfg)
+	assert.NoError(t, err)
+	assert.False(t, progress.Complete)
+	_, err = OpenTableBase(path)
+	assert.Equal(t, ErrBadTableBase, err)
+	// Goes on from where it stopped, but not with another configuration
+	_, err = GenerateTableBase(path, TableBaseConfig{NumPlayers: 3, K: 1})
+	assert.Equal(t, ErrBadTableBase, err)
+	cfg.MaxSets = 0
+	progress, err = GenerateTableBase(path, cfg)
+	assert.NoError(t, err)
+	assert.True(t, progress.Complete)
+	assert.Equal(t, progress.Positions, progress.PositionsDone)
+
+	tb, err := OpenTableBase(path)
+	assert.NoError(t, err)
+	defer tb.Close()
+	assert.EqualValues(t, 3, tb.NumPlayers())
+	assert.EqualValues(t, 2, tb.K())
+
+	for game := 0; game < 5; game++ {
+		state, err := NewGame(GameConfig{
+			NumPlayers: 3,
+		}, nil)
+		assert.NoError(t, err)
+		state.Seed(uint64(game), 3)
+		assert.NoError(t, state.Start())
+		_, err = tb.Probe(state, 0)
+		assert.Equal(t, ErrNotInTableBase, err)
+		// Leave 2 cards in each hand, then stop in the middle of a round
+		for bits.OnesCount64(state.GetPlayer(0).HandMask()) > 2 || state.CurrentTrick().NumMoves() != 0 {
+			playFirstPlayable(t, state)
+		}
+		hands := []uint64{}
+		for i := int32(0); i < 3; i++ {
+			hands = append(hands, state.GetPlayer(i).HandMask())
+		}
+		_, err = tb.Lookup(hands, 3)
+		assert.Equal(t, ErrBadArgument, err)
+		values, err := tb.Lookup(hands, state.CurrentTrick().Leader())
+		assert.NoError(t, err)
+		for seat := 0; seat < 3; seat++ {
+			assert.Equal(t, paranoid(state, seat)-state.GetPlayer(int32(seat)).GetScore(), values[seat])
+		}
+		for i := 0; i <= game%3; i++ {
+			playFirstPlayable(t, state)
+		}
+		_, err = tb.Probe(state, -1)
+		assert.Equal(t, ErrBadArgument, err)
+		before := *state
+		for seat := 0; seat < 3; seat++ {
+			result, err := tb.Probe(state, seat)
+			assert.NoError(t, err)
+			assert.Equal(t, before, *state)
+			assert.Equal(t, paranoid(state, seat), result.Score)
+			assert.True(t, result.BestMove.Valid())
+		}
+	}
+}
+
+func TestMetrics(t *testing.T) {
+	var before, after Metrics
+	ReadMetrics(&before)
+	state, err := NewGame(GameConfig{
+		NumPlayers: 3,
+	}, nil)
+	assert.NoError(t, err)
+	assert.NoError(t, state.Start())
+	moves := 0
+	for state.GetStatus() == StatusPlay {
+		playFirstPlayable(t, state)
+		moves++
+	}
+	assert.Equal(t, ErrNotInGame, state.Play(state.GetPlayer(0).GetCards()[0]))
+	ReadMetrics(&after)
+
+	assert.Equal(t, metricsEnabled, after.Enabled)
+	if after.Enabled {
+		// Other tests may play along.
+		assert.True(t, after.Play[0]-before.Play[0] >= uint64(moves))
+		notInGame := 0
+		for ResultName(notInGame) != "NOT_IN_GAME" {
+			notInGame++
+		}
+		assert.True(t, after.Play[notInGame]-before.Play[notInGame] >= 1)
+		assert.True(t, after.Deal.Count > before.Deal.Count)
+		assert.True(t, after.GoPlay.Count-before.GoPlay.Count >= uint64(moves+1))
+		assert.True(t, after.GoStart.Count > before.GoStart.Count)
+	} else {
+		assert.Equal(t, Metrics{}, after)
+	}
+
+	assert.Equal(t, "SUCCESS", ResultName(0))
+	assert.Equal(t, "NULLPTR", ResultName(1))
+	assert.Equal(t, "1000", ResultName(1000))
+	server := httptest.NewServer(MetricsHandler())
+	defer server.Close()
+	resp, err := http.Get(server.URL)
+	assert.NoError(t, err)
+	body, err := ioutil.ReadAll(resp.Body)
+	resp.Body.Close()
+	assert.NoError(t, err)
+	text := string(body)
+	assert.True(t, strings.Contains(text, "# TYPE kusokurae_play_total counter\n"))
+	assert.True(t, strings.Contains(text, `kusokurae_play_total{result="NOT_IN_GAME"} `))
+	assert.True(t, strings.Contains(text, `kusokurae_cgo_call_seconds_bucket{call="play",le="+Inf"} `))
+	assert.True(t, strings.Contains(text, "kusokurae_deal_seconds_count "))
+}
+
+func TestHash(t *testing.T) {
+	for _, np := range []int32{3, 4} {
+		state, err := NewGame(GameConfig{
+			NumPlayers: np,
+		}, nil)
+		assert.NoError(t, err)
+		state.Seed(7, uint64(np))
+		assert.NoError(t, state.Start())
+		start := state.Hash()
+		assert.Equal(t, state.computeHash(), start)
+
+		var undo Undo
+		for state.GetStatus() == StatusPlay {
+			// Every move leads to a different position. Cards of the same suit
+			// and rank (the two Angels) can't be told apart when played.
+			seen := map[uint64]bool{state.Hash(): true}
+			played := map[[2]int32]bool{}
+			moves := state.LegalMoves(nil)
+			for _, move := range moves {
+				if played[[2]int32{int32(move.suit), move.rank}] {
+					continue
+				}
+				played[[2]int32{int32(move.suit), move.rank}] = true
+				assert.NoError(t, state.PlayUndoable(move, &undo))
+				assert.Equal(t, state.computeHash(), state.Hash())
+				assert.False(t, seen[state.Hash()])
+				seen[state.Hash()] = true
+				state.Unplay(&undo)
+			}
+			if !assert.NoError(t, state.Play(moves[0])) {
+				return
+			}
+			assert.Equal(t, state.computeHash(), state.Hash())
+		}
+		var taken uint64
+		for i := int32(0); i < np; i++ {
+			p := state.GetPlayer(i)
+			assert.Equal(t, int(p.cardsTaken), bits.OnesCount64(p.TakenMask()))
+			assert.Zero(t, taken&p.TakenMask())
+			taken |= p.TakenMask()
+		}
+
+		// Same deal, same hash
+		state.Seed(7, uint64(np))
+		assert.NoError(t, state.Start())
+		assert.Equal(t, start, state.Hash())
+	}
+}
+
+func TestPositionCache(t *testing.T) {
+	cache, err := NewPositionCache(12)
+	assert.NoError(t, err)
+	defer cache.Close()
+
+	_, ok := cache.Get(42)
+	assert.False(t, ok)
+	cache.Put(42, 1)
+	cache.Put(42, 2)
+	value, ok := cache.Get(42)
+	assert.True(t, ok)
+	assert.Equal(t, uint64(2), value)
+
+	// Many more keys than entries, from several goroutines: whatever is found
+	// must be what was stored for that key.
+	var wg sync.WaitGroup
+	for w := uint64(0); w < 4; w++ {
+		wg.Add(1)
+		go func(w uint64) {
+			defer wg.Done()
+			for i := uint64(0); i < 20000; i++ {
+				key := (w<<32 | i) * 0x9e3779b97f4a7c15
+				cache.Put(key, key>>7)
+				if v, ok := cache.Get(key); ok {
+					assert.Equal(t, key>>7, v)
+				}
+			}
+		}(w)
+	}
+	wg.Wait()
+	stats := cache.Stats()
+	assert.Equal(t, int64(80002), stats.Stores)
+	assert.Equal(t, int64(80002), stats.Hits+stats.Misses)
+	assert.True(t, stats.Evictions > 0)
+
+	cache.Clear()
+	assert.Equal(t, CacheStats{}, cache.Stats())
+	_, ok = cache.Get(42)
+	assert.False(t, ok)
+
+	_, err = NewPositionCache(1)
+	assert.Equal(t, ErrNoMemory, err)
+}
+
+func TestISMCTS(t *testing.T) {
+	for _, np := range []int32{3, 4} {
+		state, err := NewGame(GameConfig{
+			NumPlayers: np,
+		}, nil)
+		assert.NoError(t, err)
+		state.Seed(3, uint64(np))
+		assert.NoError(t, state.Start())
+
+		_, err = state.ISMCTS(ISMCTSConfig{})
+		assert.Equal(t, ErrBadArgument, err)
+
+		for state.GetStatus() == StatusPlay {
+			before := *state
+			cfg := ISMCTSConfig{Iterations: 200, Threads: 2, Seed: 1}
+			if state.GetActivePlayer().GetIndex() == 1 {
+				cfg = ISMCTSConfig{Time: 5 * time.Millisecond, Seed: 1}
+			}
+			result, err := state.ISMCTS(cfg)
+			assert.NoError(t, err)
+			assert.Equal(t, before, *state)
+			assert.True(t, result.BestMove.Playable())
+			assert.True(t, result.Value >= 0 && result.Value <= 1)
+			if cfg.Iterations > 0 && len(state.LegalMoves(nil)) > 1 {
+				assert.Equal(t, cfg.Iterations, result.Iterations)
+			}
+			if !assert.NoError(t, state.Play(result.BestMove)) {
+				return
+			}
+		}
+		_, err = state.ISMCTS(ISMCTSConfig{Iterations: 1})
+		assert.Equal(t, ErrNotInGame, err)
+	}
+}
+
+func TestSnapshot(t *testing.T) {
+	for _, np := range []int32{3, 4} {
+		state, err := NewGame(GameConfig{
+			NumPlayers: np,
+		}, nil)
+		assert.NoError(t, err)
+		var snap, again Snapshot
+		restored := GameState{cbs: state.cbs, goStateCallbackNo: state.goStateCallbackNo}
+
+		// Before and after every move, including the last
+		assert.NoError(t, state.Pack(&snap))
+		assert.NoError(t, restored.Unpack(&snap))
+		assert.Equal(t, *state, restored)
+		assert.NoError(t, state.Start())
+		for {
+			assert.NoError(t, state.Pack(&snap))
+			assert.NoError(t, restored.Unpack(&snap))
+			assert.Equal(t, *state, restored)
+			assert.NoError(t, restored.Pack(&again))
+			assert.Equal(t, snap, again)
+			if state.GetStatus() != StatusPlay {
+				break
+			}
+			moves := state.LegalMoves(nil)
+			if !assert.NoError(t, state.Play(moves[len(moves)-1])) {
+				return
+			}
+		}
+
+		// Garbled snapshots are refused and leave the state alone
+		for i := range snap {
+			bad := snap
+			bad[i] ^= 0x10
+			assert.Equal(t, ErrBadSnapshot, restored.Unpack(&bad))
+			assert.Equal(t, *state, restored)
+		}
+	}
+}
+
+func TestCompactState(t *testing.T) {
+	var compact, again CompactState
+	// The fields touched by every move fill the first cache line.
+	assert.True(t, unsafe.Offsetof(compact.c.dealt) <= 64)
+	assert.True(t, unsafe.Sizeof(compact) < unsafe.Sizeof(GameState{})/4)
+
+	for _, np := range []int32{3, 4} {
+		for game := uint64(0); game < 20; game++ {
+			state, err := NewGame(GameConfig{
+				NumPlayers: np,
+			}, nil)
+			assert.NoError(t, err)
+			state.Seed(game, 5)
+			assert.NoError(t, state.Start())
+			assert.NoError(t, compact.Start(np, game, 5))
+			expanded := GameState{cbs: state.cbs, goStateCallbackNo: state.goStateCallbackNo}
+
+			for {
+				assert.NoError(t, compact.ToGame(&expanded))
+				if !assert.Equal(t, *state, expanded) {
+					return
+				}
+				assert.NoError(t, again.FromGame(state))
+				assert.Equal(t, compact, again)
+				assert.Equal(t, state.LegalMoveMask(), compact.LegalMoveMask())
+				for _, card := range state.GetActivePlayer().GetCards() {
+					assert.Equal(t, card, compact.Card(int(card.displayOrder)))
+				}
+				if state.GetStatus() != StatusPlay {
+					break
+				}
+				moves := state.LegalMoves(nil)
+				move := moves[int(game)%len(moves)]
+				assert.NoError(t, state.Play(move))
+				assert.NoError(t, compact.Play(move))
+			}
+			assert.Equal(t, StatusFinish, compact.GetStatus())
+			assert.Equal(t, ErrNotInGame, compact.Play(Card{}))
+		}
+	}
+}
+
+func TestGameRecord(t *testing.T) {
+	dir, err := ioutil.TempDir("", "kusokurae")
+	if !assert.NoError(t, err) {
+		return
+	}
+	defer os.RemoveAll(dir)
+	prefix := filepath.Join(dir, "games")
+	log, err := OpenLogWriter(prefix, 7)
+	if !assert.NoError(t, err) {
+		return
+	}
+
+	var rec GameRecord
+	var finals []GameState
+	// Replays g into a new state, and compares it with g except for the
+	// callbacks and the RNG.
+	checkReplay := func(g *GameState, r *GameRecord) {
+		replayed := GameState{}
+		assert.NoError(t, replayed.Replay(r))
+		replayed.cbs, replayed.goStateCallbackNo, replayed.rngState = g.cbs, g.goStateCallbackNo, g.rngState
+		assert.Equal(t, *g, replayed)
+	}
+	for _, np := range []int32{3, 4} {
+		for n := 0; n < 10; n++ {
+			state, err := NewGame(GameConfig{
+				NumPlayers: np,
+			}, nil)
+			assert.NoError(t, err)
+			log.Attach(state)
+			state.Seed(uint64(n), uint64(np))
+			assert.NoError(t, state.Start())
+			for k := 0; ; k++ {
+				// Replaying a game in progress gets to the same state.
+				assert.NoError(t, state.Record(&rec))
+				checkReplay(state, &rec)
+				if state.GetStatus() != StatusPlay {
+					break
+				}
+				moves := state.LegalMoves(nil)
+				assert.NoError(t, state.Play(moves[(k*7+n)%len(moves)]))
+			}
+			finals = append(finals, *state)
+		}
+	}
+	assert.NoError(t, log.Close())
+
+	// The games went to segments of 7, in the order finished.
+	i := 0
+	for n := 0; n < 3; n++ {
+		r, err := OpenLogReader(LogSegmentPath(prefix, n))
+		if !assert.NoError(t, err) {
+			return
+		}
+		assert.Equal(t, []int{7, 7, 6}[n], r.Len())
+		valid, err := r.Verify()
+		assert.NoError(t, err)
+		assert.Equal(t, r.Len(), valid)
+		for k := 0; k < r.Len(); k, i = k+1, i+1 {
+			checkReplay(&finals[i], r.Record(k))
+		}
+		r.Close()
+		assert.Equal(t, 0, r.Len())
+	}
+	_, err = OpenLogReader(LogSegmentPath(prefix, 3))
+	assert.Equal(t, ErrIO, err)
+
+	// Another writer leaves the existing segments alone.
+	log, err = OpenLogWriter(prefix, 0)
+	assert.NoError(t, err)
+	assert.NoError(t, log.Append(&rec))
+	assert.NoError(t, log.Close())
+	r, err := OpenLogReader(LogSegmentPath(prefix, 3))
+	if assert.NoError(t, err) {
+		assert.Equal(t, 1, r.Len())
+		assert.Equal(t, rec, *r.Record(0))
+		r.Close()
+	}
+
+	// Garbled records are refused.
+	var replayed GameState
+	for i := range rec {
+		bad := rec
+		bad[i] ^= 0x10
+		assert.Equal(t, ErrBadRecord, replayed.Replay(&bad))
+	}
+	// Hands must split the deck.
+	state, err := NewGame(GameConfig{
+		NumPlayers: 4,
+	}, nil)
+	assert.NoError(t, err)
+	assert.Equal(t, ErrBadDeal, state.Deal([]uint64{1, 2, 4, 8}))
+}
+
+func TestDealMany(t *testing.T) {
+	const n = 30000
+	for _, np := range []int32{3, 4} {
+		deals, err := DealMany(np, n, 7, 1)
+		if !assert.NoError(t, err) {
+			return
+		}
+		state, err := NewGame(GameConfig{
+			NumPlayers: np,
+		}, nil)
+		assert.NoError(t, err)
+		state.Seed(7, 1)
+		assert.NoError(t, state.Start())
+		for i := int32(0); i < np; i++ {
+			assert.Equal(t, deals[0].Hands[i], state.GetPlayer(i).HandMask())
+		}
+
+		// Every card goes to every player equally often.
+		deck := uint64(1)<<DeckSize - 1
+		if np == 4 {
+			deck >>= 1
+		}
+		var owned [4][DeckSize]int
+		for _, d := range deals {
+			var seen uint64
+			for i := int32(0); i < np; i++ {
+				assert.Equal(t, bits.OnesCount64(deck)/int(np), bits.OnesCount64(d.Hands[i]))
+				seen |= d.Hands[i]
+				for m := d.Hands[i]; m != 0; m &= m - 1 {
+					owned[i][bits.TrailingZeros64(m)]++
+				}
+			}
+			assert.Equal(t, deck, seen)
+		}
+		for i := int32(0); i < np; i++ {
+			for card := 0; card < bits.Len64(deck); card++ {
+				want := n / int(np)
+				assert.True(t, owned[i][card] > want*95/100 && owned[i][card] < want*105/100,
+					fmt.Sprintf("player %d got card %d %d times out of %d", i+1, card+1, owned[i][card], n))
+			}
+		}
+	}
+	_, err := DealMany(5, 1, 0, 0)
+	assert.Equal(t, ErrBadNPlayers, err)
+}
+
+func TestDealID(t *testing.T) {
+	// 33! / (11!)^3 and 32! / (8!)^4
+	assert.Equal(t, uint64(136526995463040), DealCount(3))
+	assert.Equal(t, uint64(99561092450391000), DealCount(4))
+	assert.Equal(t, uint64(0), DealCount(5))
+
+	for _, np := range []int32{3, 4} {
+		count := DealCount(np)
+		ids := []uint64{0, 1, 2, count / 3, count/2 + 12345, count - 2, count - 1}
+		for i := uint64(1); i < 50; i++ {
+			ids = append(ids, i*0x9e3779b97f4a7c15%count)
+		}
+		var prev Deal
+		for _, id := range ids {
+			d, err := DealUnrank(np, id)
+			assert.NoError(t, err)
+			back, err := DealRank(np, &d)
+			assert.NoError(t, err)
+			assert.Equal(t, id, back)
+			assert.NotEqual(t, prev, d)
+			prev = d
+
+			// Ranges step through the same deals as unranking one by one.
+			if id+3 <= count {
+				r, err := DealRange(np, id, 3)
+				assert.NoError(t, err)
+				for k := range r {
+					one, _ := DealUnrank(np, id+uint64(k))
+					assert.Equal(t, one, r[k])
+				}
+			}
+		}
+
+		// The first deal gives player 1 the lowest cards.
+		d, _ := DealUnrank(np, 0)
+		assert.Equal(t, uint64(1)<<uint(bits.OnesCount64(d.Hands[0]))-1, d.Hands[0])
+
+		state, err := NewGame(GameConfig{
+			NumPlayers: np,
+		}, nil)
+		assert.NoError(t, err)
+		assert.NoError(t, state.DealID(count/2+12345))
+		d, _ = DealUnrank(np, count/2+12345)
+		for i := int32(0); i < np; i++ {
+			assert.Equal(t, d.Hands[i], state.GetPlayer(i).HandMask())
+		}
+
+		_, err = DealUnrank(np, count)
+		assert.Equal(t, ErrBadDeal, err)
+		_, err = DealRange(np, count-2, 3)
+		assert.Equal(t, ErrBadDeal, err)
+		d.Hands[0], d.Hands[1] = d.Hands[0]|1, d.Hands[1]&^1
+		_, err = DealRank(np, &d)
+		assert.Equal(t, ErrBadDeal, err)
+	}
+}
+
+func TestStateRegistry(t *testing.T) {
+	var r stateRegistry
+	var got []GameStatus
+	h := r.add(func(s GameStatus) { got = append(got, s) })
+	assert.True(t, h != 0)
+	r.call(h, StatusPlay)
+	r.remove(h)
+	r.remove(h)
+	r.call(h, StatusFinish)
+	assert.Equal(t, []GameStatus{StatusPlay}, got)
+
+	// The slot comes back with a new generation; the old handle stays dead.
+	var again []GameStatus
+	const indexMask = 1<<registryIndexBits - 1
+	h2 := r.add(func(s GameStatus) { again = append(again, s) })
+	for i := 0; i < registryShards && h2&indexMask != h&indexMask; i++ {
+		h2 = r.add(func(s GameStatus) { again = append(again, s) })
+	}
+	assert.Equal(t, h&indexMask, h2&indexMask)
+	assert.NotEqual(t, h, h2)
+	r.call(h, StatusPlay)
+	r.call(h2, StatusFinish)
+	assert.Equal(t, []GameStatus{StatusPlay}, got)
+	assert.Equal(t, []GameStatus{StatusFinish}, again)
+
+	// Nor does it match any later game in the slot, however many come and go.
+	r.remove(h2)
+	stale := 0
+	for i := 0; i < registryShards<<12; i++ {
+		h2 = r.add(func(GameStatus) { stale++ })
+		r.call(h, StatusPlay)
+		r.remove(h2)
+	}
+	assert.Equal(t, 0, stale)
+}
+
+// Games made, played and dropped from many goroutines at once, with the race
+// detector watching
+func TestStateCBConcurrent(t *testing.T) {
+	var wg sync.WaitGroup
+	for w := 0; w < 8; w++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for i := 0; i < 50; i++ {
+				var calls int
+				state, err := NewGame(GameConfig{
+					NumPlayers: 3,
+				}, func(GameStatus) { calls++ })
+				if !assert.NoError(t, err) {
+					return
+				}
+				state.Start()
+				for state.GetStatus() == StatusPlay {
+					state.Play(state.LegalMoves(nil)[0])
+				}
+				// One at the deal, one per trick and one at the end
+				assert.Equal(t, 1+11+1, calls)
+				registry.remove(state.goStateCallbackNo)
+				runtime.GC()
+			}
+		}()
+	}
+	wg.Wait()
+}
+
+func TestEventQueue(t *testing.T) {
+	for _, np := range []int32{3, 4} {
+		state, err := NewGame(GameConfig{
+			NumPlayers: np,
+		}, nil)
+		assert.NoError(t, err)
+		assert.Equal(t, ErrBadArgument, state.EnableEventQueue(100))
+		assert.Equal(t, ErrBadArgument, state.EnableEventQueue(0))
+		assert.NoError(t, state.EnableEventQueue(64))
+		assert.NoError(t, state.Start())
+
+		var events []Event
+		for state.GetStatus() == StatusPlay {
+			playFirstPlayable(t, state)
+			// Taken out now and then, so the queue wraps around.
+			if state.numRound%3 == 0 {
+				events = state.Events(events)
+			}
+		}
+		events = state.Events(events)
+		assert.Equal(t, 0, state.DroppedEvents())
+
+		ncards := int(state.players[0].numCards)
+		assert.Equal(t, 1+ncards*(int(np)+1)+1, len(events))
+		assert.Equal(t, EventStart, events[0].Type)
+		assert.Equal(t, EventFinish, events[len(events)-1].Type)
+		assert.EqualValues(t, ncards, events[len(events)-1].Round)
+		scores := make([]int, np)
+		played := uint64(0)
+		for i, e := range events[1 : len(events)-1] {
+			round := i/(int(np)+1) + 1
+			assert.EqualValues(t, round, e.Round)
+			if i%(int(np)+1) < int(np) {
+				assert.Equal(t, EventPlay, e.Type)
+				for _, card := range state.GetPlayer(int32(e.Player)).GetCards() {
+					if card.displayOrder == uint32(e.Card) {
+						assert.Equal(t, round, card.RoundPlayed())
+					}
+				}
+				played |= 1 << (e.Card - 1)
+			} else {
+				assert.Equal(t, EventTrick, e.Type)
+				scores[e.Player] += int(e.Score)
+			}
+		}
+		assert.Equal(t, 0, bits.OnesCount64(played)-int(np)*ncards)
+		for i := int32(0); i < np; i++ {
+			assert.Equal(t, state.GetPlayer(i).GetScore(), scores[i])
+		}
+
+		// A queue too small drops what doesn't fit.
+		assert.NoError(t, state.EnableEventQueue(4))
+		assert.NoError(t, state.Start())
+		for state.GetStatus() == StatusPlay {
+			playFirstPlayable(t, state)
+		}
+		assert.Equal(t, 4, len(state.Events(nil)))
+		assert.Equal(t, len(events)-4, state.DroppedEvents())
+		state.DisableEventQueue()
+		assert.Equal(t, 0, len(state.Events(nil)))
+	}
+}
+
+func TestGamePool(t *testing.T) {
+	_, err := NewGamePool(GameConfig{NumPlayers: 5}, 0)
+	assert.Equal(t, ErrBadNPlayers, err)
+	_, err = NewGamePool(GameConfig{NumPlayers: 3}, 48)
+	assert.Equal(t, ErrBadArgument, err)
+	_, err = NewGamePool(GameConfig{NumPlayers: 3}, -1)
+	assert.Equal(t, ErrBadArgument, err)
+
+	pool, err := NewGamePool(GameConfig{NumPlayers: 3}, 64)
+	assert.NoError(t, err)
+	defer pool.Close()
+	g := pool.Get()
+	assert.Equal(t, StatusPlay, g.GetStatus())
+	for g.GetStatus() == StatusPlay {
+		playFirstPlayable(t, g)
+	}
+	assert.Equal(t, 3*11+11+2, len(g.Events(nil)))
+	pool.Put(g)
+
+	// The game comes back dealt again, with an empty queue.
+	again := pool.Get()
+	assert.True(t, g == again)
+	assert.Equal(t, StatusPlay, again.GetStatus())
+	assert.Equal(t, int32(0), again.numRound)
+	for i := int32(0); i < 3; i++ {
+		assert.Equal(t, 0, again.GetPlayer(i).GetScore())
+		assert.Equal(t, 11, len(again.GetPlayer(i).GetHandCards()))
+	}
+	events := again.Events(nil)
+	assert.Equal(t, 1, len(events))
+	assert.Equal(t, EventStart, events[0].Type)
+	pool.Put(again)
+
+	allocs := testing.AllocsPerRun(100, func() {
+		pool.Put(pool.Get())
+	})
+	assert.Equal(t, 0.0, allocs)
+}
+
+func TestAllocationFreeAccessors(t *testing.T) {
+	state, err := NewGame(GameConfig{
+		NumPlayers: 3,
+	}, nil)
+	assert.NoError(t, err)
+	assert.NoError(t, state.Start())
+	playFirstPlayable(t, state)
+	playFirstPlayable(t, state)
+
+	p := state.GetPlayer(0)
+	hand := p.AppendHandCards(nil)
+	assert.Equal(t, 10, len(hand))
+	for _, card := range hand {
+		assert.Equal(t, 0, card.RoundPlayed())
+	}
+	var rs RoundState
+	state.RoundStateInto(&rs)
+	assert.Equal(t, state.GetRoundState(), rs)
+	assert.Equal(t, 2, len(rs.Moves))
+	// The round ends, leaving no moves on the board
+	playFirstPlayable(t, state)
+
+	buf := make([]Card, 0, MaxHandCards)
+	allocs := testing.AllocsPerRun(100, func() {
+		buf = p.AppendHandCards(buf[:0])
+		state.RoundStateInto(&rs)
+	})
+	assert.Equal(t, 0.0, allocs)
+
+	// Reused state doesn't keep stale moves or winners.
+	playFirstPlayable(t, state)
+	state.RoundStateInto(&rs)
+	assert.Equal(t, 1, len(rs.Moves))
+	assert.Equal(t, state.GetRoundState().Moves, rs.Moves)
+	assert.True(t, rs.RoundWinner == state.GetRoundState().RoundWinner)
+}
+
+func TestTrickHistory(t *testing.T) {
+	for _, np := range []int32{3, 4} {
+		state, err := NewGame(GameConfig{
+			NumPlayers: np,
+		}, nil)
+		assert.NoError(t, err)
+		assert.Nil(t, state.CurrentTrick())
+		assert.Equal(t, 0, state.NumTricks())
+		assert.NoError(t, state.Start())
+
+		var played []int
+		var cards []Card
+		for state.GetStatus() == StatusPlay {
+			mover := state.GetActivePlayer().GetIndex() - 1
+			moves := state.LegalMoves(nil)
+			move := moves[len(moves)/2]
+			assert.NoError(t, state.Play(move))
+			n := len(played)/int(np) + 1
+			assert.Equal(t, n, state.NumTricks())
+
+			// The last round in the history ends with the move, or with the
+			// highest card of the same kind, which the engine plays instead.
+			trick := state.Trick(n)
+			assert.Equal(t, len(played)%int(np)+1, trick.NumMoves())
+			moved := trick.Move(trick.NumMoves() - 1)
+			last := state.AppendTrickCards(nil, trick)[trick.NumMoves()-1]
+			assert.Equal(t, move.GetSuit(), last.GetSuit())
+			assert.Equal(t, move.GetRank(), last.GetRank())
+			played = append(played, moved)
+			assert.Equal(t, mover, (trick.Leader()+trick.NumMoves()-1)%int(np))
+			if state.GetStatus() != StatusPlay {
+				break
+			}
+			if trick.NumMoves() == int(np) {
+				// The taker leads the next round.
+				assert.Equal(t, 0, state.CurrentTrick().NumMoves())
+				assert.Equal(t, trick.Winner(), state.CurrentTrick().Leader())
+				assert.Equal(t, trick.Winner(), state.GetActivePlayer().GetIndex()-1)
+			} else {
+				assert.True(t, trick == state.CurrentTrick())
+				rs := state.GetRoundState()
+				assert.Equal(t, trick.Score(), rs.ScoreOnBoard)
+				assert.Equal(t, trick.IsDoubled(), rs.IsDoubled)
+				assert.True(t, state.GetPlayer(int32(trick.Winner())) == rs.RoundWinner)
+				assert.Equal(t, trick.NumMoves(), len(rs.Moves))
+				for i, card := range rs.Moves {
+					assert.EqualValues(t, trick.Move(i), card.displayOrder)
+				}
+			}
+		}
+		assert.Nil(t, state.CurrentTrick())
+		assert.Nil(t, state.Trick(0))
+		assert.Nil(t, state.Trick(state.NumTricks()+1))
+		assert.Equal(t, int(state.GetPlayer(0).numCards), state.NumTricks())
+
+		// The history holds every move in order, and the scores add up.
+		scores := make([]int, np)
+		k := 0
+		for seq := 1; seq <= state.NumTricks(); seq++ {
+			trick := state.Trick(seq)
+			cards = state.AppendTrickCards(cards[:0], trick)
+			assert.Equal(t, int(np), len(cards))
+			points, doubled := 0, false
+			for i, card := range cards {
+				assert.Equal(t, played[k], int(card.displayOrder))
+				assert.Equal(t, seq, card.RoundPlayed())
+				if card.GetSuit() == SuitOther {
+					doubled = (trick.Leader()+i)%int(np) == trick.Winner()
+				} else {
+					points += int(card.GetSuit())
+				}
+				k++
+			}
+			if doubled {
+				points *= 2
+			}
+			assert.Equal(t, doubled, trick.IsDoubled())
+			assert.Equal(t, points, trick.Score())
+			scores[trick.Winner()] += trick.Score()
+		}
+		for i := range scores {
+			assert.Equal(t, scores[i], state.GetPlayer(int32(i)).GetScore())
+		}
+		assert.Equal(t, state.Trick(state.NumTricks()).Winner(), state.GetActivePlayer().GetIndex()-1)
+	}
+}
+
+// playOut plays g to the end, always with the last legal move.
+func playOut(b *testing.B, g *GameState, moves []Card) {
+	for g.GetStatus() == StatusPlay {
+		moves = g.LegalMoves(moves[:0])
+		if err := g.Play(moves[len(moves)-1]); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func newBenchGame(b *testing.B, np int32, stateFn func(GameStatus)) *GameState {
+	g, err := NewGame(GameConfig{
+		NumPlayers: np,
+	}, stateFn)
+	if err != nil {
+		b.Fatal(err)
+	}
+	g.Seed(1, 1)
+	return g
+}
+
+// Cost of a cgo call that does next to nothing, against the same check in Go
+func BenchmarkCgoCall(b *testing.B) {
+	card := Card{displayOrder: 1, flags: 0x80}
+	for i := 0; i < b.N; i++ {
+		if !card.Playable() {
+			b.Fatal("not playable")
+		}
+	}
+}
+
+func BenchmarkGoCall(b *testing.B) {
+	p := Player{playable: 1}
+	for i := 0; i < b.N; i++ {
+		if p.PlayableMask()&1 == 0 {
+			b.Fatal("not playable")
+		}
+	}
+}
+
+func BenchmarkStart(b *testing.B) {
+	g := newBenchGame(b, 3, nil)
+	for i := 0; i < b.N; i++ {
+		g.Start()
+	}
+}
+
+// Whole games played from Go, one cgo call per move
+func BenchmarkGame3(b *testing.B) {
+	benchmarkGame(b, 3, nil)
+}
+
+func BenchmarkGame4(b *testing.B) {
+	benchmarkGame(b, 4, nil)
+}
+
+// The same with a state callback, called back into Go at the end of every
+// round
+func BenchmarkGame3Callback(b *testing.B) {
+	benchmarkGame(b, 3, func(GameStatus) {})
+}
+
+// Like BenchmarkGame3Callback, with the events of each game taken out at the
+// end instead of calling back into Go on every trick
+func BenchmarkGame3Events(b *testing.B) {
+	g := newBenchGame(b, 3, nil)
+	if err := g.EnableEventQueue(64); err != nil {
+		b.Fatal(err)
+	}
+	moves := make([]Card, 0, MaxHandCards)
+	events := make([]Event, 0, 64)
+	for i := 0; i < b.N; i++ {
+		g.Start()
+		playOut(b, g, moves)
+		events = g.Events(events[:0])
+	}
+}
+
+func benchmarkGame(b *testing.B, np int32, stateFn func(GameStatus)) {
+	g := newBenchGame(b, np, stateFn)
+	moves := make([]Card, 0, MaxHandCards)
+	for i := 0; i < b.N; i++ {
+		g.Start()
+		playOut(b, g, moves)
+	}
+}
+
+// A table served from a GamePool: no allocation per game
+func BenchmarkGame3Pool(b *testing.B) {
+	pool, err := NewGamePool(GameConfig{NumPlayers: 3}, 64)
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer pool.Close()
+	moves := make([]Card, 0, MaxHandCards)
+	events := make([]Event, 0, 64)
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		g := pool.Get()
+		playOut(b, g, moves)
+		events = g.Events(events[:0])
+		pool.Put(g)
+	}
+}
+
+func BenchmarkNewGameParallel(b *testing.B) {
+	b.RunParallel(func(pb *testing.PB) {
+		for pb.Next() {
+			g, err := NewGame(GameConfig{NumPlayers: 3}, func(GameStatus) {})
+			if err != nil {
+				b.Fatal(err)
+			}
+			registry.remove(g.goStateCallbackNo)
+		}
+	})
+}
+
+// Whole games played inside the C library, for comparison with BenchmarkGame3
+func BenchmarkSimBatch3(b *testing.B) {
+	if _, err := SimBatch(GameConfig{NumPlayers: 3}, b.N, PolicyGreedyHigh, 1); err != nil {
+		b.Fatal(err)
+	}
+}
+
+func BenchmarkGetRoundState(b *testing.B) {
+	g := newBenchGame(b, 3, nil)
+	g.Start()
+	for k := 0; k < 5; k++ {
+		moves := g.LegalMoves(nil)
+		g.Play(moves[0])
+	}
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		g.GetRoundState()
+	}
+}
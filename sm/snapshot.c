@@ -0,0 +1,285 @@
+#include <string.h>
+#include "sm.h"
+#include "sm_internal.h"
+
+// Snapshot layout (all multi-byte fields little-endian, unused bits zero):
+//
+//   [0]      KUSOKURAE_SNAPSHOT_VERSION
+//   [1]      bit 0: np - 3, bits 1~2: status, bits 3~4: player on turn,
+//            bits 5~7: high_ranker_index + 1
+//   [2]      busted, 2 bits per player
+//   [3~5]    taker of each finished round, 2 bits per round
+//   [6~21]   RNG state and inc
+//   [22~46]  6 bits per card by display_order - 1: owner << 4 | round played
+//            (0 if still in hand)
+//   [47]     checksum
+//
+// Everything else in the state (hands, playable flags, taken cards, scores,
+// the board, ...) follows from these and is rebuilt on unpacking.
+
+#define SNAP_HEADER     1
+#define SNAP_BUSTED     2
+#define SNAP_TAKERS     3
+#define SNAP_RNG        6
+#define SNAP_CARDS      22
+#define SNAP_CHECKSUM   (KUSOKURAE_SNAPSHOT_SIZE - 1)
+
+static void put_bits(uint8_t *base, int pos, int n, uint32_t value) {
+    for (int i = 0; i < n; i++, pos++) {
+        if (value & (1u << i)) {
+            base[pos / 8] |= (uint8_t)(1u << (pos % 8));
+        }
+    }
+}
+
+static uint32_t get_bits(const uint8_t *base, int pos, int n) {
+    uint32_t ret = 0;
+    for (int i = 0; i < n; i++, pos++) {
+        ret |= (uint32_t)((base[pos / 8] >> (pos % 8)) & 1) << i;
+    }
+    return ret;
+}
+
+static void put_u64(uint8_t *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (uint8_t)(value >> (i * 8));
+    }
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    uint64_t ret = 0;
+    for (int i = 0; i < 8; i++) {
+        ret |= (uint64_t)p[i] << (i * 8);
+    }
+    return ret;
+}
+
+// Catches truncated or garbled data, not deliberate tampering.
+uint8_t block_checksum(const uint8_t *p, int n) {
+    uint8_t sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum = (uint8_t)((sum << 1 | sum >> 7) ^ p[i]);
+    }
+    return (uint8_t)~sum;
+}
+
+// The 4-player game leaves out one Angel, the first card of the deck.
+static int card_dealt(int np, int order) {
+    return np != 4 || order != KUSOKURAE_DECK_SIZE;
+}
+
+// Puts the given cards on board in front of their owners, as copies of the
+// playable hand cards they were when played.
+static void set_board(kusokurae_game_state_t *g, uint64_t cards) {
+    int i, order;
+    memset(g->current_round, 0, sizeof(g->current_round));
+    for (; cards; cards &= cards - 1) {
+        order = mask_lowest(cards);
+        for (i = 0; !(g->players[i].dealt & CARD_BIT(order)); i++);
+        g->current_round[i] = DECK_CARD(order);
+        g->current_round[i].flags = MASK_PLAYABLE;
+    }
+}
+
+static void snapshot_begin(uint8_t *out, int np, int status, int turn, int high_ranker,
+                           const int *busted) {
+    memset(out, 0, KUSOKURAE_SNAPSHOT_SIZE);
+    out[0] = KUSOKURAE_SNAPSHOT_VERSION;
+    out[SNAP_HEADER] = (uint8_t)((np - 3) | (status << 1) | (turn << 3) | ((high_ranker + 1) << 5));
+    for (int i = 0; i < np; i++) {
+        out[SNAP_BUSTED] |= (uint8_t)((busted[i] & 3) << (i * 2));
+    }
+}
+
+static void snapshot_put_card(uint8_t *out, int order, int owner, int round) {
+    put_bits(out + SNAP_CARDS, (order - 1) * 6, 6, (uint32_t)(owner << 4 | round));
+}
+
+// Records the taker of every round in which one of the cards was played.
+static void snapshot_put_taker(uint8_t *out, uint64_t taken, const uint8_t *round_of, int owner) {
+    for (; taken; taken &= taken - 1) {
+        put_bits(out + SNAP_TAKERS, (round_of[mask_lowest(taken)] - 1) * 2, 2, (uint32_t)owner);
+    }
+}
+
+static void snapshot_end(uint8_t *out, const kusokurae_rng_t *rng) {
+    put_u64(out + SNAP_RNG, rng->state);
+    put_u64(out + SNAP_RNG + 8, rng->inc);
+    out[SNAP_CHECKSUM] = block_checksum(out, SNAP_CHECKSUM);
+}
+
+kusokurae_error_t kusokurae_state_pack(const kusokurae_game_state_t *self, uint8_t *out) {
+    int i, j, order, turn = 0, busted[KUSOKURAE_MAX_PLAYERS];
+    uint8_t round_of[KUSOKURAE_DECK_SIZE + 1];
+    if (self == NULL || out == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (self->cfg.np == 0) {
+        return KUSOKURAE_ERROR_UNINITIALIZED;
+    }
+    for (i = 0; i < self->cfg.np; i++) {
+        if (self->players[i].active == KUSOKURAE_ROUND_ACTIVE) {
+            turn = i;
+        }
+        busted[i] = self->players[i].busted;
+    }
+    snapshot_begin(out, self->cfg.np, self->status, turn, self->high_ranker_index, busted);
+    if (self->status >= KUSOKURAE_STATUS_PLAY) {
+        for (i = 0; i < self->cfg.np; i++) {
+            for (j = 0; j < self->players[i].ncards; j++) {
+                order = self->players[i].cards[j].display_order;
+                round_of[order] = self->players[i].cards[j].flags & MASK_PLAYED_IN_ROUND;
+                snapshot_put_card(out, order, i, round_of[order]);
+            }
+        }
+        for (i = 0; i < self->cfg.np; i++) {
+            snapshot_put_taker(out, self->players[i].taken, round_of, i);
+        }
+    }
+    snapshot_end(out, &self->rng_state);
+    return KUSOKURAE_SUCCESS;
+}
+
+void compact_pack(const kusokurae_compact_state_t *self, uint8_t *out) {
+    int i, busted[KUSOKURAE_MAX_PLAYERS];
+    uint64_t m;
+    for (i = 0; i < self->np; i++) {
+        busted[i] = self->busted[i];
+    }
+    snapshot_begin(out, self->np, self->status, self->turn, self->high_ranker_index, busted);
+    if (self->status >= KUSOKURAE_STATUS_PLAY) {
+        for (i = 0; i < self->np; i++) {
+            for (m = self->dealt[i]; m; m &= m - 1) {
+                snapshot_put_card(out, mask_lowest(m), i, self->played_round[mask_lowest(m)]);
+            }
+            snapshot_put_taker(out, self->taken[i], self->played_round, i);
+        }
+    }
+    snapshot_end(out, &self->rng_state);
+}
+
+kusokurae_error_t kusokurae_state_unpack(kusokurae_game_state_t *self, const uint8_t *in) {
+    kusokurae_game_state_t g;
+    kusokurae_player_t *p;
+    uint64_t in_round[KUSOKURAE_DECK_SIZE + 2];
+    int played_in[KUSOKURAE_DECK_SIZE + 2];
+    int i, order, field, owner, round, played = 0;
+    if (self == NULL || in == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (in[0] != KUSOKURAE_SNAPSHOT_VERSION || in[SNAP_CHECKSUM] != block_checksum(in, SNAP_CHECKSUM)) {
+        return KUSOKURAE_ERROR_BAD_SNAPSHOT;
+    }
+    int np = (in[SNAP_HEADER] & 1) + 3;
+    int status = (in[SNAP_HEADER] >> 1) & 3;
+    int turn = (in[SNAP_HEADER] >> 3) & 3;
+    int high_ranker = (in[SNAP_HEADER] >> 5) - 1;
+    if (turn >= np || high_ranker >= np) {
+        return KUSOKURAE_ERROR_BAD_SNAPSHOT;
+    }
+
+    memset(&g, 0, sizeof(g));
+    g.cfg.np = np;
+    g.status = status;
+    g.high_ranker_index = high_ranker;
+    g.rng_state.state = get_u64(in + SNAP_RNG);
+    g.rng_state.inc = get_u64(in + SNAP_RNG + 8);
+    for (i = 0; i < np; i++) {
+        g.players[i].index = i + 1;
+    }
+
+    if (status >= KUSOKURAE_STATUS_PLAY) {
+        int counteach = (KUSOKURAE_DECK_SIZE - (np == 4)) / np;
+        memset(in_round, 0, sizeof(in_round));
+        memset(played_in, 0, sizeof(played_in));
+        // Deal the cards back in deck order.
+        for (order = KUSOKURAE_DECK_SIZE; order > 0; order--) {
+            field = (int)get_bits(in + SNAP_CARDS, (order - 1) * 6, 6);
+            if (!card_dealt(np, order)) {
+                if (field != 0) {
+                    return KUSOKURAE_ERROR_BAD_SNAPSHOT;
+                }
+                continue;
+            }
+            owner = field >> 4;
+            round = field & 0xF;
+            p = &g.players[owner];
+            if (owner >= np || p->ncards == counteach || round > counteach ||
+                (played_in[round] & (1 << owner))) {
+                return KUSOKURAE_ERROR_BAD_SNAPSHOT;
+            }
+            p->cards[p->ncards] = DECK_CARD(order);
+            p->cards[p->ncards].flags = (uint32_t)round;
+            p->ncards++;
+            p->dealt |= CARD_BIT(order);
+            if (round) {
+                played_in[round] |= 1 << owner;
+                in_round[round] |= CARD_BIT(order);
+                played++;
+            } else {
+                p->hand |= CARD_BIT(order);
+            }
+        }
+        g.nround = played / np;
+        for (round = 1; round <= counteach; round++) {
+            int want = round <= g.nround ? np : round == g.nround + 1 ? played % np : 0;
+            if (mask_popcount(in_round[round]) != want) {
+                return KUSOKURAE_ERROR_BAD_SNAPSHOT;
+            }
+        }
+        if ((status == KUSOKURAE_STATUS_FINISH) != (g.nround == counteach) ||
+            (high_ranker >= 0) != (in_round[g.nround + 1] != 0)) {
+            return KUSOKURAE_ERROR_BAD_SNAPSHOT;
+        }
+
+        // Replay the rounds into the trick history to hand out what was taken:
+        // the takers must be the ones the rules make.
+        game_rebuild_tricks(&g);
+        for (round = 1; round <= g.nround; round++) {
+            owner = (int)get_bits(in + SNAP_TAKERS, (round - 1) * 2, 2);
+            if (owner != g.tricks[round - 1].winner) {
+                return KUSOKURAE_ERROR_BAD_SNAPSHOT;
+            }
+            g.players[owner].score += g.tricks[round - 1].score;
+            g.players[owner].cards_taken += np;
+            g.players[owner].taken |= in_round[round];
+        }
+        // The board holds the round in progress, or else the last one.
+        if (in_round[g.nround + 1]) {
+            const kusokurae_trick_t *t = &g.tricks[g.nround];
+            if (t->nmoves != played % np || t->winner != high_ranker) {
+                return KUSOKURAE_ERROR_BAD_SNAPSHOT;
+            }
+            set_board(&g, in_round[g.nround + 1]);
+            for (i = 0; i < np; i++) {
+                if (g.current_round[i].display_order) {
+                    g.players[i].active = KUSOKURAE_ROUND_DONE;
+                }
+            }
+        } else if (g.nround > 0) {
+            set_board(&g, in_round[g.nround]);
+        }
+        g.high_ranker_index = high_ranker;
+
+        for (i = 0; i < np; i++) {
+            if (g.players[i].dealt & CARD_BIT(KUSOKURAE_DECK_SIZE - 2)) {
+                g.ghost_holder_index = i;
+            }
+        }
+        if (kusokurae_get_active_player(&g) != &g.players[turn]) {
+            return KUSOKURAE_ERROR_BAD_SNAPSHOT;
+        }
+        g.players[turn].active = KUSOKURAE_ROUND_ACTIVE;
+        if (status == KUSOKURAE_STATUS_PLAY) {
+            player_set_playable_flags(&g.players[turn], high_ranker < 0);
+        }
+        g.hash = kusokurae_game_compute_hash(&g);
+    }
+    for (i = 0; i < np; i++) {
+        g.players[i].busted = (in[SNAP_BUSTED] >> (i * 2)) & 3;
+    }
+
+    g.cbs = self->cbs;
+    memcpy(self, &g, sizeof(g));
+    return KUSOKURAE_SUCCESS;
+}
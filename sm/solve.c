@@ -0,0 +1,279 @@
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sm.h"
+#include "sm_internal.h"
+
+// Perfect-information solver.
+//
+// With more than two players there is no single "optimal" line, so the solver
+// is paranoid: the seat being solved for maximizes its own score and everybody
+// else plays to minimize it. That turns the game into a two-sided zero-sum
+// search where alpha-beta applies.
+
+#define TT_EXACT    0
+#define TT_LOWER    1
+#define TT_UPPER    2
+
+typedef struct {
+    uint64_t key;
+    int8_t value;   // Future gain of the seat
+    int8_t bound;
+    uint8_t best;   // Display order of the best move found, 0 for none
+    uint8_t seat;
+} tt_entry_t;
+
+struct kusokurae_solver_t {
+    tt_entry_t *tt;
+    uint64_t tt_mask;
+    int64_t nodes;
+    int32_t seat;
+};
+
+static uint64_t mix64(uint64_t x) {
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// At the beginning of a round, what happens next depends only on the cards in
+// every hand and on who leads. Positions in the middle of a round are not
+// stored.
+static uint64_t position_key(kusokurae_game_state_t *g, int leader) {
+    // Mix the leader in before any hand, so that it can't cancel out against
+    // the low bits of the first one.
+    uint64_t key = mix64((uint64_t)leader + 1);
+    for (int i = 0; i < g->cfg.np; i++) {
+        key = mix64(key ^ g->players[i].hand);
+    }
+    return key;
+}
+
+// Ranks of the cards that could still meet the given player's cards in a
+// round: those in other hands and those already on board in this round.
+static uint32_t outside_ranks(kusokurae_game_state_t *g, kusokurae_player_t *p) {
+    uint64_t cards = 0;
+    uint32_t ranks = 0;
+    int i;
+    for (i = 0; i < g->cfg.np; i++) {
+        if (&g->players[i] != p) {
+            cards |= g->players[i].hand;
+        }
+    }
+    if (g->high_ranker_index >= 0) {
+        for (i = 0; i < g->cfg.np; i++) {
+            if (g->current_round[i].display_order) {
+                cards |= CARD_BIT(g->current_round[i].display_order);
+            }
+        }
+    }
+    for (i = 0; i <= 10; i++) {
+        if (cards & RANK_MASK[i]) {
+            ranks |= 1u << i;
+        }
+    }
+    return ranks;
+}
+
+// Fills moves[] with one card of each class of equivalent legal moves, in the
+// order they should be tried. Two cards of the same suit are equivalent if no
+// card that could meet them ranks between them (both ends included), since
+// then every round plays out the same with either. Rank 0 cards are never
+// merged with others, because holding them matters to a leader.
+static int generate_moves(kusokurae_game_state_t *g, kusokurae_player_t *p,
+                          int tt_best, uint8_t *moves) {
+    uint32_t outside = outside_ranks(g, p);
+    uint64_t legal = p->playable, m;
+    int n = 0, suit, rank, prev_rank, order, i;
+    for (suit = KUSOKURAE_SUIT_OTHER; suit >= KUSOKURAE_SUIT_XIANG; suit--) {
+        prev_rank = -1;
+        for (rank = 10; rank >= 0; rank--) {
+            m = legal & SUIT_RANK_MASK[suit + 1][rank];
+            while (m) {
+                order = mask_highest(m);
+                m &= ~CARD_BIT(order);
+                if (prev_rank == rank ||
+                    (prev_rank > 0 && rank > 0 &&
+                     !(outside & (((2u << prev_rank) - 1) & ~((1u << rank) - 1))))) {
+                    if (order == tt_best) {
+                        // Keep the remembered card as the representative.
+                        moves[n - 1] = order;
+                    }
+                    continue;
+                }
+                moves[n++] = order;
+                prev_rank = rank;
+            }
+        }
+    }
+    // Higher ranks first, remembered best move before everything.
+    for (i = 1; i < n; i++) {
+        uint8_t cur = moves[i];
+        int j = i;
+        while (j > 0 && (cur == tt_best ||
+                         (moves[j - 1] != tt_best &&
+                          DECK_CARD(moves[j - 1]).rank < DECK_CARD(cur).rank))) {
+            moves[j] = moves[j - 1];
+            j--;
+        }
+        moves[j] = cur;
+    }
+    return n;
+}
+
+// Returns the seat's score gained from here to the end of the game.
+static int search(kusokurae_solver_t *s, kusokurae_game_state_t *g,
+                  int alpha, int beta, uint8_t *best_out) {
+    s->nodes++;
+    if (g->status != KUSOKURAE_STATUS_PLAY) {
+        return 0;
+    }
+    kusokurae_player_t *p = kusokurae_get_active_player(g);
+    int leader = g->high_ranker_index < 0;
+    int alpha0 = alpha, beta0 = beta;
+    int tt_best = 0;
+    tt_entry_t *e = NULL;
+    uint64_t key = 0;
+    if (leader) {
+        key = position_key(g, p->index - 1);
+        e = &s->tt[key & s->tt_mask];
+        if (e->key == key && e->seat == s->seat) {
+            if (e->bound == TT_EXACT ||
+                (e->bound == TT_LOWER && e->value >= beta) ||
+                (e->bound == TT_UPPER && e->value <= alpha)) {
+                if (best_out != NULL) {
+                    *best_out = e->best;
+                }
+                return e->value;
+            }
+            tt_best = e->best;
+        }
+    }
+
+    uint8_t moves[KUSOKURAE_MAX_HAND_CARDS];
+    int n = generate_moves(g, p, tt_best, moves);
+    int maximizing = (p->index - 1 == s->seat);
+    int best = maximizing ? -1000 : 1000;
+    uint8_t best_move = 0;
+    int seat_score = g->players[s->seat].score;
+    int gain, value;
+    kusokurae_undo_t undo;
+    for (int i = 0; i < n; i++) {
+        kusokurae_game_play_undoable(g, DECK_CARD(moves[i]), &undo);
+        gain = g->players[s->seat].score - seat_score;
+        value = gain + search(s, g, alpha - gain, beta - gain, NULL);
+        kusokurae_game_unplay(g, &undo);
+        if (maximizing ? value > best : value < best) {
+            best = value;
+            best_move = moves[i];
+        }
+        if (maximizing) {
+            if (best > alpha) {
+                alpha = best;
+            }
+        } else if (best < beta) {
+            beta = best;
+        }
+        if (alpha >= beta) {
+            break;
+        }
+    }
+
+    if (e != NULL) {
+        e->key = key;
+        e->seat = s->seat;
+        e->value = best;
+        e->best = best_move;
+        if (best <= alpha0) {
+            e->bound = TT_UPPER;
+        } else if (best >= beta0) {
+            e->bound = TT_LOWER;
+        } else {
+            e->bound = TT_EXACT;
+        }
+    }
+    if (best_out != NULL) {
+        *best_out = best_move;
+    }
+    return best;
+}
+
+kusokurae_solver_t *kusokurae_solver_new(int32_t tt_bits) {
+    if (tt_bits < 1 || tt_bits > 40) {
+        return NULL;
+    }
+    kusokurae_solver_t *s = (kusokurae_solver_t *)calloc(1, sizeof(kusokurae_solver_t));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->tt = (tt_entry_t *)calloc((size_t)1 << tt_bits, sizeof(tt_entry_t));
+    if (s->tt == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->tt_mask = ((uint64_t)1 << tt_bits) - 1;
+    return s;
+}
+
+void kusokurae_solver_free(kusokurae_solver_t *solver) {
+    if (solver != NULL) {
+        free(solver->tt);
+        free(solver);
+    }
+}
+
+kusokurae_error_t kusokurae_solve(kusokurae_solver_t *solver,
+                                  kusokurae_game_state_t *self,
+                                  int32_t seat,
+                                  kusokurae_solve_result_t *out) {
+    if (solver == NULL || self == NULL || out == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (self->cfg.np == 0) {
+        return KUSOKURAE_ERROR_UNINITIALIZED;
+    }
+    if (seat < 0 || seat >= self->cfg.np) {
+        return KUSOKURAE_ERROR_BAD_ARGUMENT;
+    }
+    if (self->status != KUSOKURAE_STATUS_PLAY && self->status != KUSOKURAE_STATUS_FINISH) {
+        return KUSOKURAE_ERROR_NOT_IN_GAME;
+    }
+
+    struct timespec t0, t1;
+    uint8_t best = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    solver->nodes = 0;
+    solver->seat = seat;
+    // MTD(f): narrow down the value with null-window searches, which cut off
+    // far more than a single full-window one, relying on the table to avoid
+    // repeating work between passes.
+    // Only a pass that fails high proves its move reaches the bound, so the
+    // best move is taken from the last one of those.
+    int lo = -1000, hi = 1000, guess = 0, value, beta;
+    uint8_t move = 0;
+    while (lo < hi) {
+        beta = guess == lo ? guess + 1 : guess;
+        value = search(solver, self, beta - 1, beta, &move);
+        if (value < beta) {
+            hi = value;
+        } else {
+            lo = value;
+            best = move;
+        }
+        guess = value;
+    }
+    out->score = self->players[seat].score + lo;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    memset(&out->best_move, 0, sizeof(kusokurae_card_t));
+    if (best) {
+        out->best_move = DECK_CARD(best);
+    }
+    out->nodes = solver->nodes;
+    out->elapsed_ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+    return KUSOKURAE_SUCCESS;
+}
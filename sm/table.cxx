@@ -0,0 +1,445 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "sm.h"
+#include "sm_internal.h"
+
+// Table manager: many games at once, each waiting on remote players who answer
+// in their own time, played out on a few threads.
+//
+// The game at every table is a coroutine (play_table) that co_awaits the move
+// of each seat in turn. While it waits, the request is open and the coroutine
+// is suspended in its slot until the move comes in or the seat's time runs
+// out. Either puts the table on the run queue, from which the workers resume
+// it. Nothing waits on a thread, so thousands of tables need no more threads
+// than cores. The coroutine only runs with its slot locked, and the worker
+// that resumed it makes the request or reports the end once it is suspended
+// again. Each slot keeps its coroutine frame, so games after the first one at
+// a table don't allocate.
+//
+// Each request has a ticket. An answer only counts with the ticket of the
+// request still open, so late answers, answers to a timed out request and
+// answers to a table reopened since are turned down.
+
+namespace {
+
+typedef std::chrono::steady_clock table_clock;
+
+enum table_phase {
+    TABLE_FREE,
+    // A request is open
+    TABLE_WAITING,
+    // On the run queue, or being run
+    TABLE_READY,
+    TABLE_FINISHED,
+};
+
+struct table_game {
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle;
+
+    struct promise_type {
+        // Frames are kept by their slots, see below.
+        static void *operator new(std::size_t size, kusokurae_table_manager_t *mgr,
+                                  int32_t table) noexcept;
+        static void operator delete(void *, std::size_t) noexcept {}
+        static table_game get_return_object_on_allocation_failure() noexcept {
+            return table_game{ handle() };
+        }
+
+        table_game get_return_object() noexcept {
+            return table_game{ handle::from_promise(*this) };
+        }
+        // Started by the first worker to take the table
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        // Destroyed when the table is opened again
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+    handle h;
+};
+
+struct table_slot {
+    std::mutex mu;
+    kusokurae_game_state_t state;
+    table_phase phase;
+    // Seat the open request is for
+    int32_t seat;
+    uint32_t ticket;
+    // Move the coroutine is resumed with (display_order)
+    uint32_t move;
+
+    // The game in progress, suspended whenever no worker is running it
+    table_game::handle game;
+    // Memory for its frame, allocated with the slot's first coroutine
+    void *frame = NULL;
+
+    ~table_slot() {
+        if (game) {
+            game.destroy();
+        }
+        ::operator delete(frame);
+    }
+};
+
+// What play_table waits on: the move of seat, from kusokurae_table_submit or
+// run_timeout. Suspending opens the request.
+struct seat_move {
+    table_slot *slot;
+    int32_t seat;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<>) noexcept {
+        slot->phase = TABLE_WAITING;
+        slot->seat = seat;
+        slot->ticket++;
+    }
+
+    uint32_t await_resume() const noexcept { return slot->move; }
+};
+
+struct table_timer {
+    table_clock::time_point deadline;
+    int32_t table;
+    uint32_t ticket;
+
+    bool operator>(const table_timer &rhs) const {
+        return deadline > rhs.deadline;
+    }
+};
+
+struct table_task {
+    int32_t table;
+    uint32_t ticket;
+};
+
+} // namespace
+
+struct kusokurae_table_manager_t {
+    kusokurae_table_config_t cfg;
+    // The arena: all tables, allocated once
+    std::unique_ptr<table_slot[]> slots;
+
+    // Guards everything below
+    std::mutex mu;
+    std::condition_variable wake;
+    std::vector<int32_t> free_slots;
+    std::deque<table_task> run_queue;
+    // Timers of open requests. Requests answered in time leave theirs behind,
+    // to be dropped when they come up.
+    std::priority_queue<table_timer, std::vector<table_timer>, std::greater<table_timer> > timers;
+    kusokurae_table_stats_t stats;
+    bool stopping;
+
+    std::vector<std::thread> workers;
+};
+
+// Every coroutine of a table has a frame of the same size, so the one
+// allocated for the slot is reused from then on.
+void *table_game::promise_type::operator new(std::size_t size, kusokurae_table_manager_t *mgr,
+                                             int32_t table) noexcept {
+    table_slot *slot = &mgr->slots[table];
+    if (slot->frame == NULL) {
+        slot->frame = ::operator new(size, std::nothrow);
+    }
+    return slot->frame;
+}
+
+namespace {
+
+void stat_add(kusokurae_table_manager_t *mgr, int64_t kusokurae_table_stats_t::*field) {
+    std::lock_guard<std::mutex> lock(mgr->mu);
+    mgr->stats.*field += 1;
+}
+
+void schedule(kusokurae_table_manager_t *mgr, int32_t table, uint32_t ticket) {
+    {
+        std::lock_guard<std::mutex> lock(mgr->mu);
+        mgr->run_queue.push_back(table_task{ table, ticket });
+    }
+    mgr->wake.notify_one();
+}
+
+// The game at a table, from its first request to its end
+table_game play_table(kusokurae_table_manager_t *mgr, int32_t table) {
+    table_slot *slot = &mgr->slots[table];
+    kusokurae_game_state_t *g = &slot->state;
+    while (g->status == KUSOKURAE_STATUS_PLAY) {
+        uint32_t move = co_await seat_move{ slot, kusokurae_get_active_player(g)->index - 1 };
+        // Checked when submitted, and nothing else moves the table meanwhile
+        kusokurae_game_play(g, DECK_CARD(move));
+        stat_add(mgr, &kusokurae_table_stats_t::moves);
+    }
+    slot->phase = TABLE_FINISHED;
+}
+
+// Resumes the table's coroutine up to its next request or the end of the
+// game, then makes the request or reports the end. Called with slot->mu held
+// and the slot TABLE_READY; returns with it released.
+void table_resume(kusokurae_table_manager_t *mgr, int32_t table, std::unique_lock<std::mutex> &lock) {
+    table_slot *slot = &mgr->slots[table];
+    slot->game.resume();
+    // The callbacks get a copy, so they may submit or close right away.
+    kusokurae_game_state_t view = slot->state;
+    if (slot->phase == TABLE_FINISHED) {
+        lock.unlock();
+        stat_add(mgr, &kusokurae_table_stats_t::tables_finished);
+        if (mgr->cfg.finish != NULL) {
+            mgr->cfg.finish(mgr, table, &view, mgr->cfg.userdata);
+        }
+        return;
+    }
+    uint32_t ticket = slot->ticket;
+    int32_t seat = slot->seat;
+    lock.unlock();
+    if (mgr->cfg.move_timeout_ns > 0) {
+        table_timer timer = { table_clock::now() + std::chrono::nanoseconds(mgr->cfg.move_timeout_ns),
+                              table, ticket };
+        std::lock_guard<std::mutex> qlock(mgr->mu);
+        bool sooner = mgr->timers.empty() || timer.deadline < mgr->timers.top().deadline;
+        mgr->timers.push(timer);
+        if (sooner) {
+            // A worker may be sleeping until a later deadline.
+            mgr->wake.notify_one();
+        }
+    }
+    mgr->cfg.request(mgr, table, seat, ticket, &view, mgr->cfg.userdata);
+}
+
+void run_task(kusokurae_table_manager_t *mgr, const table_task &task) {
+    table_slot *slot = &mgr->slots[task.table];
+    std::unique_lock<std::mutex> lock(slot->mu);
+    if (slot->phase != TABLE_READY || slot->ticket != task.ticket) {
+        // Closed since
+        return;
+    }
+    table_resume(mgr, task.table, lock);
+}
+
+void run_timeout(kusokurae_table_manager_t *mgr, const table_timer &timer) {
+    table_slot *slot = &mgr->slots[timer.table];
+    std::unique_lock<std::mutex> lock(slot->mu);
+    if (slot->phase != TABLE_WAITING || slot->ticket != timer.ticket) {
+        // Answered in time
+        return;
+    }
+    kusokurae_card_t moves[KUSOKURAE_MAX_HAND_CARDS];
+    if (kusokurae_legal_moves(&slot->state, NULL, moves) == 0) {
+        return;
+    }
+    slot->move = moves[0].display_order;
+    slot->phase = TABLE_READY;
+    stat_add(mgr, &kusokurae_table_stats_t::timeouts);
+    table_resume(mgr, timer.table, lock);
+}
+
+void table_worker(kusokurae_table_manager_t *mgr) {
+    std::unique_lock<std::mutex> lock(mgr->mu);
+    while (!mgr->stopping) {
+        if (!mgr->timers.empty() && mgr->timers.top().deadline <= table_clock::now()) {
+            table_timer timer = mgr->timers.top();
+            mgr->timers.pop();
+            lock.unlock();
+            run_timeout(mgr, timer);
+            lock.lock();
+        } else if (!mgr->run_queue.empty()) {
+            table_task task = mgr->run_queue.front();
+            mgr->run_queue.pop_front();
+            lock.unlock();
+            run_task(mgr, task);
+            lock.lock();
+        } else if (!mgr->timers.empty()) {
+            // A copy, since the heap may change while waiting
+            table_clock::time_point deadline = mgr->timers.top().deadline;
+            mgr->wake.wait_until(lock, deadline);
+        } else {
+            mgr->wake.wait(lock);
+        }
+    }
+}
+
+table_slot *open_slot(kusokurae_table_manager_t *mgr, int32_t table) {
+    if (mgr == NULL || table < 0 || table >= mgr->cfg.max_tables) {
+        return NULL;
+    }
+    return &mgr->slots[table];
+}
+
+} // namespace
+
+kusokurae_table_manager_t *kusokurae_table_manager_new(const kusokurae_table_config_t *cfg) {
+    if (cfg == NULL || cfg->max_tables <= 0 || cfg->request == NULL || cfg->move_timeout_ns < 0) {
+        return NULL;
+    }
+    std::unique_ptr<kusokurae_table_manager_t> mgr(new (std::nothrow) kusokurae_table_manager_t);
+    if (!mgr) {
+        return NULL;
+    }
+    mgr->cfg = *cfg;
+    mgr->slots.reset(new (std::nothrow) table_slot[cfg->max_tables]);
+    if (!mgr->slots) {
+        return NULL;
+    }
+    mgr->free_slots.reserve(cfg->max_tables);
+    for (int32_t i = cfg->max_tables - 1; i >= 0; i--) {
+        std::memset(&mgr->slots[i].state, 0, sizeof(kusokurae_game_state_t));
+        mgr->slots[i].phase = TABLE_FREE;
+        mgr->slots[i].ticket = 0;
+        mgr->slots[i].move = 0;
+        // Allocates the frame every game at the table is played in
+        mgr->slots[i].game = play_table(mgr.get(), i).h;
+        if (!mgr->slots[i].game) {
+            return NULL;
+        }
+        mgr->free_slots.push_back(i);
+    }
+    std::memset(&mgr->stats, 0, sizeof(mgr->stats));
+    mgr->stopping = false;
+    int32_t n_threads = cfg->n_threads;
+    if (n_threads <= 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (int32_t i = 0; i < n_threads; i++) {
+        mgr->workers.emplace_back(table_worker, mgr.get());
+    }
+    return mgr.release();
+}
+
+void kusokurae_table_manager_free(kusokurae_table_manager_t *mgr) {
+    if (mgr == NULL) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mgr->mu);
+        mgr->stopping = true;
+    }
+    mgr->wake.notify_all();
+    for (auto &t : mgr->workers) {
+        t.join();
+    }
+    delete mgr;
+}
+
+kusokurae_error_t kusokurae_table_open(kusokurae_table_manager_t *mgr, int32_t np,
+                                       uint64_t seed, uint64_t stream, int32_t *table) {
+    if (mgr == NULL || table == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    kusokurae_game_config_t gcfg = { np };
+    if (np < 3 || np > KUSOKURAE_MAX_PLAYERS) {
+        return KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS;
+    }
+    int32_t t;
+    {
+        std::lock_guard<std::mutex> lock(mgr->mu);
+        if (mgr->free_slots.empty()) {
+            return KUSOKURAE_ERROR_NO_TABLE;
+        }
+        t = mgr->free_slots.back();
+        mgr->free_slots.pop_back();
+        mgr->stats.tables_opened++;
+    }
+    table_slot *slot = &mgr->slots[t];
+    uint32_t ticket;
+    {
+        std::lock_guard<std::mutex> lock(slot->mu);
+        kusokurae_game_init(&slot->state, &gcfg, NULL);
+        kusokurae_game_seed(&slot->state, seed, stream);
+        kusokurae_game_start(&slot->state);
+        // In the frame of the last game, so this can't fail
+        slot->game.destroy();
+        slot->game = play_table(mgr, t).h;
+        slot->phase = TABLE_READY;
+        slot->move = 0;
+        ticket = ++slot->ticket;
+    }
+    *table = t;
+    schedule(mgr, t, ticket);
+    return KUSOKURAE_SUCCESS;
+}
+
+kusokurae_error_t kusokurae_table_submit(kusokurae_table_manager_t *mgr, int32_t table,
+                                         int32_t seat, uint32_t ticket,
+                                         uint32_t display_order) {
+    table_slot *slot = open_slot(mgr, table);
+    if (slot == NULL) {
+        return KUSOKURAE_ERROR_NO_TABLE;
+    }
+    bool ok;
+    {
+        std::lock_guard<std::mutex> lock(slot->mu);
+        uint64_t legal = 0;
+        ok = slot->phase == TABLE_WAITING && slot->ticket == ticket && slot->seat == seat &&
+             display_order >= 1 && display_order <= KUSOKURAE_DECK_SIZE &&
+             kusokurae_legal_moves(&slot->state, &legal, NULL) > 0 &&
+             (legal & CARD_BIT(display_order));
+        if (ok) {
+            // Closes the request, so that its timer finds nothing to do.
+            slot->phase = TABLE_READY;
+            slot->move = display_order;
+        }
+    }
+    if (!ok) {
+        stat_add(mgr, &kusokurae_table_stats_t::rejected);
+        return KUSOKURAE_ERROR_FORBIDDEN_MOVE;
+    }
+    schedule(mgr, table, ticket);
+    return KUSOKURAE_SUCCESS;
+}
+
+kusokurae_error_t kusokurae_table_state(kusokurae_table_manager_t *mgr, int32_t table,
+                                        kusokurae_game_state_t *out) {
+    table_slot *slot = open_slot(mgr, table);
+    if (slot == NULL) {
+        return KUSOKURAE_ERROR_NO_TABLE;
+    }
+    if (out == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    std::lock_guard<std::mutex> lock(slot->mu);
+    if (slot->phase == TABLE_FREE) {
+        return KUSOKURAE_ERROR_NO_TABLE;
+    }
+    *out = slot->state;
+    return KUSOKURAE_SUCCESS;
+}
+
+kusokurae_error_t kusokurae_table_close(kusokurae_table_manager_t *mgr, int32_t table) {
+    table_slot *slot = open_slot(mgr, table);
+    if (slot == NULL) {
+        return KUSOKURAE_ERROR_NO_TABLE;
+    }
+    {
+        std::lock_guard<std::mutex> lock(slot->mu);
+        if (slot->phase == TABLE_FREE) {
+            return KUSOKURAE_ERROR_NO_TABLE;
+        }
+        slot->phase = TABLE_FREE;
+        // Turns down whatever still refers to the game.
+        slot->ticket++;
+    }
+    std::lock_guard<std::mutex> lock(mgr->mu);
+    mgr->free_slots.push_back(table);
+    return KUSOKURAE_SUCCESS;
+}
+
+void kusokurae_table_get_stats(kusokurae_table_manager_t *mgr, kusokurae_table_stats_t *out) {
+    if (mgr == NULL || out == NULL) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mgr->mu);
+    *out = mgr->stats;
+}
@@ -0,0 +1,738 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <vector>
+#include "sm.h"
+#include "sm_internal.h"
+
+// Endgame tablebase: what every player can be sure to gain from the start of a
+// round on, for every position with up to k cards in each hand, each player
+// maximizing its own gain against everybody else like kusokurae_solve does.
+//
+// Only the order of ranks matters to how a round plays out, apart from rank 0
+// (which a leader can't play) and the Ghost, so positions are stored with the
+// ranks in play closed up from 1, and rotated so that player 0 leads. What is
+// left is a card set and a way to deal it into the hands: the file has, for
+// every k, the card sets in that form with an index on them, and the values by
+// set, deal and player. Positions of k cards per hand are solved by searching
+// one round and looking up the positions of k - 1 after it.
+//
+// Sizes grow fast with k: 3 players need about 2 MB for k = 2 and 2 GB for
+// k = 3, 4 players 1 GB for k = 2. Larger tables are refused with
+// KUSOKURAE_ERROR_TABLEBASE_TOO_LARGE.
+
+namespace {
+
+const char TB_MAGIC[8] = { 'K', 'S', 'K', 'R', 'T', 'B', '\r', '\n' };
+const uint32_t TB_VERSION = 1;
+const size_t TB_HEADER_SIZE = 4096;
+const int TB_MAX_K = 4;
+
+// Largest k generated, by number of players. The file format goes up to
+// TB_MAX_K, but the next k would take hundreds of GB.
+const int TB_MAX_GEN_K[KUSOKURAE_MAX_PLAYERS + 1] = { 0, 0, 0, 3, 2 };
+
+const int GHOST = KUSOKURAE_DECK_SIZE - 2;
+const int ANGEL_LOW = KUSOKURAE_DECK_SIZE - 1;
+const int ANGEL_HIGH = KUSOKURAE_DECK_SIZE;
+
+// The part of the file for positions of k cards per hand. Offsets are from the
+// start of the file, and everything is in native byte order.
+struct tb_level {
+    // Card sets in canonical form, sorted
+    uint64_t nsets;
+    uint64_t sets_off;      // uint64_t[nsets]
+
+    // Open-addressing index of the sets: set number + 1, 0 for none
+    uint32_t index_bits;
+    uint32_t reserved;
+    uint64_t index_off;     // uint32_t[1 << index_bits]
+
+    // Ways to deal a set into the hands
+    uint64_t ndeals;
+
+    // By set, deal and player, with player 0 leading
+    uint64_t values_off;    // int8_t[nsets][ndeals][np]
+
+    // Whether the values of a set are in, for generation to go on from
+    uint64_t done_off;      // uint8_t[nsets]
+};
+
+struct tb_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t np;
+    uint32_t k;
+    uint32_t complete;
+    uint64_t size;
+    // By cards per hand, [0] unused
+    tb_level levels[TB_MAX_K + 1];
+};
+
+static_assert(sizeof(tb_header) <= TB_HEADER_SIZE, "header fits its page");
+
+struct tb_view {
+    const uint64_t *sets;
+    const uint32_t *index;
+    uint32_t index_shift;
+    uint32_t index_mask;
+    uint64_t nsets;
+    uint64_t ndeals;
+    int8_t *values;
+    uint8_t *done;
+};
+
+} // namespace
+
+struct kusokurae_tablebase_t {
+    uint8_t *base;
+    size_t size;
+    int np;
+    int k;
+    tb_view levels[TB_MAX_K + 1];
+};
+
+namespace {
+
+uint64_t tb_hash(uint64_t x) {
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+struct binomials {
+    uint64_t c[KUSOKURAE_MAX_PLAYERS * TB_MAX_K + 1][TB_MAX_K + 1];
+
+    binomials() {
+        std::memset(c, 0, sizeof(c));
+        for (int n = 0; n <= KUSOKURAE_MAX_PLAYERS * TB_MAX_K; n++) {
+            c[n][0] = 1;
+            for (int k = 1; k <= TB_MAX_K && k <= n; k++) {
+                c[n][k] = c[n - 1][k - 1] + (k < n ? c[n - 1][k] : 0);
+            }
+        }
+    }
+};
+
+uint64_t binom(int n, int k) {
+    static const binomials table;
+    return table.c[n][k];
+}
+
+uint64_t deal_count(int np, int k) {
+    uint64_t ret = 1;
+    for (int n = np * k; n > k; n -= k) {
+        ret *= binom(n, k);
+    }
+    return ret;
+}
+
+// The card of the given suit and rank, for ranks 0~9
+int order_of(int suit, int rank) {
+    return mask_highest(SUIT_RANK_MASK[suit + 1][rank]);
+}
+
+// Renumbers the cards so that positions which play out alike come out the
+// same: the ranks in play are closed up from 1, while zeros stay at 0 and a
+// Ghost or a pair of Angels stays at 10, the only place for them. An Angel
+// alone is the lower one.
+void canonicalize(int np, const uint64_t *hands, uint64_t *out) {
+    uint64_t all = 0;
+    int target[11], i, r, m = 0;
+    for (i = 0; i < np; i++) {
+        all |= hands[i];
+    }
+    target[0] = 0;
+    for (r = 1; r <= 10; r++) {
+        if (all & RANK_MASK[r]) {
+            target[r] = ++m;
+        }
+    }
+    uint64_t angels = CARD_BIT(ANGEL_LOW) | CARD_BIT(ANGEL_HIGH);
+    if ((all & CARD_BIT(GHOST)) || (all & angels) == angels) {
+        target[10] = 10;
+    }
+    for (i = 0; i < np; i++) {
+        uint64_t ret = 0;
+        for (uint64_t h = hands[i]; h; h &= h - 1) {
+            int order = mask_lowest(h);
+            const kusokurae_card_t &card = DECK_CARD(order);
+            int t = target[card.rank];
+            if (t < 10) {
+                ret |= CARD_BIT(order_of(card.suit, t));
+            } else if (order == ANGEL_HIGH && !(all & CARD_BIT(ANGEL_LOW))) {
+                ret |= CARD_BIT(ANGEL_LOW);
+            } else {
+                ret |= CARD_BIT(order);
+            }
+        }
+        out[i] = ret;
+    }
+}
+
+// Lists the canonical sets of left more cards, given the set so far with
+// ranks up to rank - 1.
+void enum_sets(int np, uint64_t set, int rank, int left, std::vector<uint64_t> &out) {
+    if (left == 0) {
+        out.push_back(set);
+        return;
+    }
+    // A Ghost or both Angels go at 10, and nothing goes after them.
+    uint64_t ghost = CARD_BIT(GHOST), low = CARD_BIT(ANGEL_LOW), high = CARD_BIT(ANGEL_HIGH);
+    const uint64_t tops[] = { ghost, ghost | low, low | high, ghost | low | high };
+    for (int i = 0; i < (np == 4 ? 2 : 4); i++) {
+        if (mask_popcount(tops[i]) == left) {
+            out.push_back(set | tops[i]);
+        }
+    }
+    if (rank <= 9) {
+        uint64_t cards = RANK_MASK[rank];
+        for (uint64_t sub = cards; sub; sub = (sub - 1) & cards) {
+            if (mask_popcount(sub) <= left) {
+                enum_sets(np, set | sub, rank + 1, left - mask_popcount(sub), out);
+            }
+        }
+    } else if (rank == 10 && left == 1) {
+        out.push_back(set | low);
+    }
+}
+
+std::vector<uint64_t> canonical_sets(int np, int n) {
+    std::vector<uint64_t> ret;
+    uint64_t zeros = RANK_MASK[0];
+    // Every subset of the zeros, the empty one included
+    uint64_t sub = 0;
+    do {
+        if (mask_popcount(sub) <= n) {
+            enum_sets(np, sub, 1, n - mask_popcount(sub), ret);
+        }
+        sub = (sub - zeros) & zeros;
+    } while (sub != 0);
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+// The number of a deal of set into np hands of k cards: hand 0 as a k-subset
+// of the set, hand 1 of what's left and so on, each numbered in colex order.
+uint64_t deal_rank(int np, int k, uint64_t set, const uint64_t *hands) {
+    uint64_t ret = 0, rest = set;
+    int n = np * k;
+    for (int i = 0; i < np - 1; i++, n -= k) {
+        uint64_t r = 0;
+        int j = 1;
+        for (uint64_t h = hands[i]; h; h &= h - 1, j++) {
+            r += binom(mask_popcount(rest & ((h & -h) - 1)), j);
+        }
+        ret = ret * binom(n, k) + r;
+        rest &= ~hands[i];
+    }
+    return ret;
+}
+
+void deal_unrank(int np, int k, uint64_t set, uint64_t deal, uint64_t *hands) {
+    uint64_t digits[KUSOKURAE_MAX_PLAYERS];
+    int i, j, p;
+    for (i = np - 2; i >= 0; i--) {
+        uint64_t radix = binom(np * k - i * k, k);
+        digits[i] = deal % radix;
+        deal /= radix;
+    }
+    uint64_t rest = set;
+    for (i = 0; i < np - 1; i++) {
+        uint64_t r = digits[i];
+        hands[i] = 0;
+        p = np * k - i * k;
+        for (j = k; j > 0; j--) {
+            // The largest position p with C(p, j) <= r
+            for (p--; binom(p, j) > r; p--);
+            r -= binom(p, j);
+            uint64_t m = rest;
+            for (int skip = p; skip > 0; skip--) {
+                m &= m - 1;
+            }
+            hands[i] |= m & -m;
+        }
+        rest &= ~hands[i];
+    }
+    hands[np - 1] = rest;
+}
+
+// Values of the position of j cards per hand at the start of a round, by
+// player.
+kusokurae_error_t level_lookup(const kusokurae_tablebase_t *tb, const uint64_t *hands,
+                               int leader, int8_t *values) {
+    uint64_t rotated[KUSOKURAE_MAX_PLAYERS], canon[KUSOKURAE_MAX_PLAYERS], set = 0;
+    int np = tb->np, i;
+    int j = mask_popcount(hands[0]);
+    if (j == 0) {
+        // Game over
+        std::memset(values, 0, np);
+        return KUSOKURAE_SUCCESS;
+    }
+    if (j > tb->k) {
+        return KUSOKURAE_ERROR_NOT_IN_TABLEBASE;
+    }
+    for (i = 0; i < np; i++) {
+        rotated[i] = hands[(leader + i) % np];
+    }
+    canonicalize(np, rotated, canon);
+    for (i = 0; i < np; i++) {
+        set |= canon[i];
+    }
+    const tb_view &lv = tb->levels[j];
+    uint64_t slot = tb_hash(set) >> lv.index_shift, n;
+    for (;;) {
+        n = lv.index[slot];
+        if (n == 0) {
+            return KUSOKURAE_ERROR_BAD_TABLEBASE;
+        }
+        if (lv.sets[n - 1] == set) {
+            break;
+        }
+        slot = (slot + 1) & lv.index_mask;
+    }
+    const int8_t *v = lv.values + ((n - 1) * lv.ndeals + deal_rank(np, j, set, canon)) * np;
+    for (i = 0; i < np; i++) {
+        values[(leader + i) % np] = v[i];
+    }
+    return KUSOKURAE_SUCCESS;
+}
+
+struct round_search {
+    const kusokurae_tablebase_t *tb;
+    int np;
+    uint64_t hands[KUSOKURAE_MAX_PLAYERS];
+    int leader;
+    // Moves of the round in the order made
+    int played[KUSOKURAE_MAX_PLAYERS];
+    int64_t lookups;
+};
+
+// What every player can be sure to gain from move n of the round on, the
+// leader's being move 0 and the high ranker's move high. If best is not NULL,
+// the move to make for seat is stored to it.
+kusokurae_error_t round_values(round_search *s, int n, int high, int *values,
+                               int seat, int *best) {
+    kusokurae_error_t err;
+    int np = s->np, i;
+    if (n == np) {
+        int8_t next[KUSOKURAE_MAX_PLAYERS];
+        int winner = (s->leader + high) % np;
+        uint64_t cards = 0;
+        for (i = 0; i < np; i++) {
+            cards |= CARD_BIT(s->played[i]);
+        }
+        s->lookups++;
+        if ((err = level_lookup(s->tb, s->hands, winner, next)) != KUSOKURAE_SUCCESS) {
+            return err;
+        }
+        for (i = 0; i < np; i++) {
+            values[i] = next[i];
+        }
+        values[winner] += rules_round_points(cards, s->played[high]);
+        return KUSOKURAE_SUCCESS;
+    }
+
+    int p = (s->leader + n) % np, busted = 0, child[KUSOKURAE_MAX_PLAYERS];
+    bool first = true;
+    uint64_t legal = rules_playable(s->hands[p], n == 0, &busted);
+    while (legal) {
+        int order = mask_highest(legal);
+        // Other cards of the kind play out the same; the engine would play
+        // this one for them anyway.
+        legal &= ~SUIT_RANK_MASK[DECK_CARD(order).suit + 1][DECK_CARD(order).rank];
+        s->hands[p] &= ~CARD_BIT(order);
+        s->played[n] = order;
+        err = round_values(s, n + 1, n == 0 || rules_beats(order, s->played[high]) ? n : high,
+                           child, -1, NULL);
+        s->hands[p] |= CARD_BIT(order);
+        if (err != KUSOKURAE_SUCCESS) {
+            return err;
+        }
+        if (best != NULL &&
+            (first || (p == seat ? child[seat] > values[seat] : child[seat] < values[seat]))) {
+            *best = order;
+        }
+        for (i = 0; i < np; i++) {
+            if (first || (i == p ? child[i] > values[i] : child[i] < values[i])) {
+                values[i] = child[i];
+            }
+        }
+        first = false;
+    }
+    return KUSOKURAE_SUCCESS;
+}
+
+size_t align_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+// Points the views of tb at the levels in the mapping. Returns false if the
+// header doesn't describe a file of the mapping's size.
+bool tb_attach(kusokurae_tablebase_t *tb) {
+    const tb_header *h = (const tb_header *)tb->base;
+    if (tb->size < TB_HEADER_SIZE || std::memcmp(h->magic, TB_MAGIC, sizeof(TB_MAGIC)) != 0 ||
+        h->version != TB_VERSION || h->np < 3 || h->np > KUSOKURAE_MAX_PLAYERS ||
+        h->k < 1 || h->k > (uint32_t)TB_MAX_K || h->size != tb->size) {
+        return false;
+    }
+    tb->np = (int)h->np;
+    tb->k = (int)h->k;
+    std::memset(tb->levels, 0, sizeof(tb->levels));
+    for (int j = 1; j <= tb->k; j++) {
+        const tb_level &l = h->levels[j];
+        if (l.index_bits < 1 || l.index_bits > 40 || l.nsets >= (1ULL << l.index_bits) ||
+            l.ndeals != deal_count(tb->np, j) ||
+            l.sets_off + l.nsets * 8 > tb->size ||
+            l.index_off + (4ULL << l.index_bits) > tb->size ||
+            l.done_off + l.nsets > tb->size ||
+            l.values_off + l.nsets * l.ndeals * tb->np > tb->size) {
+            return false;
+        }
+        tb_view &v = tb->levels[j];
+        v.sets = (const uint64_t *)(tb->base + l.sets_off);
+        v.index = (const uint32_t *)(tb->base + l.index_off);
+        v.index_shift = 64 - l.index_bits;
+        v.index_mask = (uint32_t)((1ULL << l.index_bits) - 1);
+        v.nsets = l.nsets;
+        v.ndeals = l.ndeals;
+        v.values = (int8_t *)(tb->base + l.values_off);
+        v.done = tb->base + l.done_off;
+    }
+    return true;
+}
+
+// Lays out a new tablebase in the file and writes everything but the values.
+kusokurae_error_t tb_setup(int fd, int np, int k, kusokurae_tablebase_t *tb) {
+    tb_header h;
+    std::vector<uint64_t> sets[TB_MAX_K + 1];
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, TB_MAGIC, sizeof(TB_MAGIC));
+    h.version = TB_VERSION;
+    h.np = (uint32_t)np;
+    h.k = (uint32_t)k;
+    size_t off = TB_HEADER_SIZE;
+    for (int j = 1; j <= k; j++) {
+        tb_level &l = h.levels[j];
+        sets[j] = canonical_sets(np, np * j);
+        l.nsets = sets[j].size();
+        l.ndeals = deal_count(np, j);
+        for (l.index_bits = 1; (1ULL << l.index_bits) < l.nsets * 2; l.index_bits++);
+        l.sets_off = off;
+        l.index_off = align_up(l.sets_off + l.nsets * 8, 64);
+        l.done_off = align_up(l.index_off + (4ULL << l.index_bits), 64);
+        l.values_off = align_up(l.done_off + l.nsets, 4096);
+        off = align_up(l.values_off + l.nsets * l.ndeals * np, 4096);
+    }
+    h.size = off;
+    if (ftruncate(fd, (off_t)off) != 0) {
+        return KUSOKURAE_ERROR_IO;
+    }
+    void *base = mmap(NULL, off, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        return KUSOKURAE_ERROR_IO;
+    }
+    tb->base = (uint8_t *)base;
+    tb->size = off;
+    for (int j = 1; j <= k; j++) {
+        const tb_level &l = h.levels[j];
+        uint64_t *out = (uint64_t *)(tb->base + l.sets_off);
+        uint32_t *index = (uint32_t *)(tb->base + l.index_off);
+        uint64_t mask = (1ULL << l.index_bits) - 1;
+        for (uint64_t n = 0; n < l.nsets; n++) {
+            out[n] = sets[j][n];
+            uint64_t slot = tb_hash(sets[j][n]) >> (64 - l.index_bits);
+            while (index[slot] != 0) {
+                slot = (slot + 1) & mask;
+            }
+            index[slot] = (uint32_t)(n + 1);
+        }
+    }
+    // The header goes last, so that a file cut short here is set up again.
+    msync(tb->base, off, MS_SYNC);
+    std::memcpy(tb->base, &h, sizeof(h));
+    msync(tb->base, TB_HEADER_SIZE, MS_SYNC);
+    return tb_attach(tb) ? KUSOKURAE_SUCCESS : KUSOKURAE_ERROR_BAD_TABLEBASE;
+}
+
+struct level_work {
+    kusokurae_tablebase_t *tb;
+    int j;
+    std::atomic<uint64_t> next;
+    std::atomic<int64_t> budget;
+    std::atomic<int> err;
+};
+
+void level_worker(level_work *w) {
+    round_search s;
+    const tb_view &lv = w->tb->levels[w->j];
+    int np = w->tb->np, values[KUSOKURAE_MAX_PLAYERS], i;
+    std::memset(&s, 0, sizeof(s));
+    s.tb = w->tb;
+    s.np = np;
+    for (;;) {
+        uint64_t n = w->next.fetch_add(1);
+        if (n >= lv.nsets || w->err.load() != KUSOKURAE_SUCCESS) {
+            break;
+        }
+        if (lv.done[n]) {
+            continue;
+        }
+        if (w->budget.fetch_sub(1) <= 0) {
+            break;
+        }
+        int8_t *out = lv.values + n * lv.ndeals * np;
+        for (uint64_t deal = 0; deal < lv.ndeals; deal++) {
+            deal_unrank(np, w->j, lv.sets[n], deal, s.hands);
+            kusokurae_error_t err = round_values(&s, 0, 0, values, -1, NULL);
+            if (err != KUSOKURAE_SUCCESS) {
+                w->err.store(err);
+                return;
+            }
+            for (i = 0; i < np; i++) {
+                out[deal * np + i] = (int8_t)values[i];
+            }
+        }
+        lv.done[n] = 1;
+    }
+}
+
+void tb_progress(const kusokurae_tablebase_t *tb, kusokurae_tablebase_progress_t *out) {
+    std::memset(out, 0, sizeof(*out));
+    for (int j = 1; j <= tb->k; j++) {
+        const tb_view &lv = tb->levels[j];
+        for (uint64_t n = 0; n < lv.nsets; n++) {
+            out->positions_done += lv.done[n] ? (int64_t)lv.ndeals : 0;
+        }
+        out->positions += (int64_t)(lv.nsets * lv.ndeals);
+    }
+    out->complete = ((const tb_header *)tb->base)->complete;
+    out->bytes = (int64_t)tb->size;
+}
+
+} // namespace
+
+kusokurae_error_t kusokurae_tablebase_generate(const char *path,
+                                               const kusokurae_tablebase_config_t *cfg,
+                                               kusokurae_tablebase_progress_t *out) {
+    if (path == NULL || cfg == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (cfg->np < 3 || cfg->np > KUSOKURAE_MAX_PLAYERS) {
+        return KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS;
+    }
+    if (cfg->k < 1) {
+        return KUSOKURAE_ERROR_BAD_ARGUMENT;
+    }
+    if (cfg->k > TB_MAX_GEN_K[cfg->np]) {
+        return KUSOKURAE_ERROR_TABLEBASE_TOO_LARGE;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return KUSOKURAE_ERROR_IO;
+    }
+    kusokurae_tablebase_t tb;
+    kusokurae_error_t err = KUSOKURAE_SUCCESS;
+    struct stat st;
+    std::memset(&tb, 0, sizeof(tb));
+    if (fstat(fd, &st) != 0) {
+        err = KUSOKURAE_ERROR_IO;
+    } else if ((size_t)st.st_size >= TB_HEADER_SIZE) {
+        void *base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            err = KUSOKURAE_ERROR_IO;
+        } else {
+            tb.base = (uint8_t *)base;
+            tb.size = (size_t)st.st_size;
+            static const char unset[sizeof(TB_MAGIC)] = { 0 };
+            if (std::memcmp(tb.base, unset, sizeof(unset)) == 0) {
+                // Setup never got to the header
+                munmap(tb.base, tb.size);
+                tb.base = NULL;
+                err = tb_setup(fd, cfg->np, cfg->k, &tb);
+            } else if (!tb_attach(&tb) || tb.np != cfg->np || tb.k != cfg->k) {
+                err = KUSOKURAE_ERROR_BAD_TABLEBASE;
+            }
+        }
+    } else if (st.st_size == 0) {
+        err = tb_setup(fd, cfg->np, cfg->k, &tb);
+    } else {
+        err = KUSOKURAE_ERROR_BAD_TABLEBASE;
+    }
+    close(fd);
+
+    int32_t n_threads = cfg->n_threads;
+    if (n_threads <= 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    int64_t budget = cfg->max_sets > 0 ? cfg->max_sets : INT64_MAX;
+    tb_header *h = (tb_header *)tb.base;
+    // Each level looks up the one below, so they go one at a time.
+    for (int j = 1; err == KUSOKURAE_SUCCESS && !h->complete && j <= tb.k; j++) {
+        level_work w;
+        w.tb = &tb;
+        w.j = j;
+        w.next.store(0);
+        w.budget.store(budget);
+        w.err.store(KUSOKURAE_SUCCESS);
+        std::vector<std::thread> threads;
+        for (int32_t i = 1; i < n_threads; i++) {
+            threads.emplace_back(level_worker, &w);
+        }
+        level_worker(&w);
+        for (auto &t : threads) {
+            t.join();
+        }
+        err = (kusokurae_error_t)w.err.load();
+        budget = std::max<int64_t>(w.budget.load(), 0);
+        const tb_view &lv = tb.levels[j];
+        if (err != KUSOKURAE_SUCCESS ||
+            std::find(lv.done, lv.done + lv.nsets, 0) != lv.done + lv.nsets) {
+            break;
+        }
+        msync(tb.base + h->levels[j].values_off, lv.nsets * lv.ndeals * tb.np, MS_SYNC);
+        if (j == tb.k) {
+            h->complete = 1;
+        }
+    }
+    if (tb.base != NULL) {
+        msync(tb.base, tb.size, MS_SYNC);
+        if (err == KUSOKURAE_SUCCESS && out != NULL) {
+            tb_progress(&tb, out);
+        }
+        munmap(tb.base, tb.size);
+    }
+    return err;
+}
+
+kusokurae_tablebase_t *kusokurae_tablebase_open(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < TB_HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    kusokurae_tablebase_t *tb = new (std::nothrow) kusokurae_tablebase_t;
+    if (tb != NULL) {
+        tb->base = (uint8_t *)base;
+        tb->size = (size_t)st.st_size;
+        if (tb_attach(tb) && ((const tb_header *)tb->base)->complete) {
+            // Probes land anywhere.
+            madvise(base, tb->size, MADV_RANDOM);
+            return tb;
+        }
+        delete tb;
+    }
+    munmap(base, (size_t)st.st_size);
+    return NULL;
+}
+
+void kusokurae_tablebase_close(kusokurae_tablebase_t *tb) {
+    if (tb != NULL) {
+        munmap(tb->base, tb->size);
+        delete tb;
+    }
+}
+
+int32_t kusokurae_tablebase_np(const kusokurae_tablebase_t *tb) {
+    return tb == NULL ? 0 : tb->np;
+}
+
+int32_t kusokurae_tablebase_k(const kusokurae_tablebase_t *tb) {
+    return tb == NULL ? 0 : tb->k;
+}
+
+kusokurae_error_t kusokurae_tablebase_lookup(const kusokurae_tablebase_t *tb,
+                                             const uint64_t *hands, int32_t leader,
+                                             int8_t *values) {
+    if (tb == NULL || hands == NULL || values == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    uint64_t all = 0, dealt = (1ULL << (KUSOKURAE_DECK_SIZE - (tb->np == 4))) - 1;
+    for (int i = 0; i < tb->np; i++) {
+        if ((all & hands[i]) || (hands[i] & ~dealt) ||
+            mask_popcount(hands[i]) != mask_popcount(hands[0])) {
+            return KUSOKURAE_ERROR_BAD_DEAL;
+        }
+        all |= hands[i];
+    }
+    if (leader < 0 || leader >= tb->np) {
+        return KUSOKURAE_ERROR_BAD_ARGUMENT;
+    }
+    return level_lookup(tb, hands, leader, values);
+}
+
+kusokurae_error_t kusokurae_tablebase_probe(const kusokurae_tablebase_t *tb,
+                                            const kusokurae_game_state_t *self,
+                                            int32_t seat,
+                                            kusokurae_solve_result_t *out) {
+    if (tb == NULL || self == NULL || out == NULL) {
+        return KUSOKURAE_ERROR_NULLPTR;
+    }
+    if (self->cfg.np != tb->np) {
+        return KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS;
+    }
+    if (seat < 0 || seat >= self->cfg.np) {
+        return KUSOKURAE_ERROR_BAD_ARGUMENT;
+    }
+    if (self->status != KUSOKURAE_STATUS_PLAY && self->status != KUSOKURAE_STATUS_FINISH) {
+        return KUSOKURAE_ERROR_NOT_IN_GAME;
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::memset(out, 0, sizeof(*out));
+    out->score = self->players[seat].score;
+    const kusokurae_trick_t *t = kusokurae_get_current_trick(self);
+    if (t == NULL) {
+        // Game over
+        return KUSOKURAE_SUCCESS;
+    }
+
+    round_search s;
+    int np = self->cfg.np, i, high = 0, best = 0, values[KUSOKURAE_MAX_PLAYERS];
+    s.tb = tb;
+    s.np = np;
+    s.leader = t->leader;
+    s.lookups = 0;
+    for (i = 0; i < np; i++) {
+        s.hands[i] = self->players[i].hand;
+    }
+    for (i = 0; i < t->nmoves; i++) {
+        s.played[i] = t->moves[i];
+    }
+    if (t->nmoves > 0) {
+        high = (t->winner - t->leader + np) % np;
+    }
+    // Hands left after the round
+    if (mask_popcount(s.hands[s.leader]) - (t->nmoves == 0) > tb->k) {
+        return KUSOKURAE_ERROR_NOT_IN_TABLEBASE;
+    }
+    kusokurae_error_t err = round_values(&s, t->nmoves, high, values, seat, &best);
+    if (err != KUSOKURAE_SUCCESS) {
+        return err;
+    }
+    out->score += values[seat];
+    out->best_move = DECK_CARD(best);
+    out->nodes = s.lookups;
+    out->elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return KUSOKURAE_SUCCESS;
+}
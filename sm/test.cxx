@@ -1,7 +1,16 @@
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include <unistd.h>
 #include "sm.h"
 #include "sm_internal.h"
+#include "game.hxx"
 
 void print_card(kusokurae_card_t *p) {
     if (p == NULL) {
@@ -67,22 +76,539 @@ void test_start(kusokurae_game_state_t *g) {
     print_all_card_slots(g);
 }
 
+void test_rng() {
+    kusokurae_rng_t a, b;
+    kusokurae_rng_seed(&a, 42, 54);
+    b = a;
+    // First output of the reference pcg32-demo with the same seed
+    std::printf("\nrng_next: %s\n", kusokurae_rng_next(&a) == 0xa15c02b7 ? "OK" : "MISMATCH");
+    for (int i = 1; i < 1000; i++) {
+        kusokurae_rng_next(&a);
+    }
+    kusokurae_rng_advance(&b, 1000);
+    std::printf("rng_advance: %s\n", a.state == b.state ? "OK" : "MISMATCH");
+}
+
+void test_sim_scaling() {
+    kusokurae_sim_config_t cfg = { 3, (uint64_t)time(0), 0 };
+    const int64_t n_games = 200000;
+    unsigned ncores = std::thread::hardware_concurrency();
+    std::printf("\nSimulation scaling (%ld games):\n", (long)n_games);
+    for (unsigned t = 1; t <= ncores || t == 1; t *= 2) {
+        kusokurae_sim_stats_t stats;
+        std::memset(&stats, 0, sizeof(stats));
+        kusokurae_sim_parallel(&cfg, n_games, KUSOKURAE_POLICY_RANDOM, t, &stats);
+        std::printf("%2u threads: %.0f games/sec\n", t, stats.games * 1e9 / stats.elapsed_ns);
+        if (t < ncores && t * 2 > ncores) {
+            t = ncores / 2; // Always finish with all cores
+        }
+    }
+}
+
+void test_ismcts() {
+    kusokurae_game_config_t cfg = { 3 };
+    kusokurae_game_state_t g;
+    kusokurae_game_init(&g, &cfg, NULL);
+    kusokurae_game_seed(&g, 1, 1);
+    kusokurae_game_start(&g);
+    unsigned ncores = std::thread::hardware_concurrency();
+    std::printf("\nISMCTS on the first move, 20ms budget:\n");
+    for (unsigned t = 1; t <= ncores || t == 1; t *= 2) {
+        kusokurae_ismcts_config_t icfg = { 0, 20000000, (int32_t)t, 0, 1 };
+        kusokurae_ismcts_result_t r;
+        kusokurae_ismcts_search(&g, &icfg, &r);
+        std::printf("%2u threads: %ld playouts, %ld nodes, chose %d (value %.2f)\n",
+                    t, (long)r.iterations, (long)r.nodes, r.best_move.display_order, r.value);
+        if (t < ncores && t * 2 > ncores) {
+            t = ncores / 2;
+        }
+    }
+}
+
+static double seconds_since(const timespec &start) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+void test_record() {
+    const int64_t n_games = 100000;
+    const char *prefix = "/tmp/kusokurae-test-log";
+    char path[256];
+    kusokurae_game_state_t g;
+    kusokurae_sim_result_t result;
+    uint8_t record[KUSOKURAE_RECORD_SIZE];
+    timespec start;
+    int64_t n, valid;
+    std::memset(&g, 0, sizeof(g));
+
+    std::printf("\nGame log (%ld games, %d bytes each):\n", (long)n_games, KUSOKURAE_RECORD_SIZE);
+    kusokurae_log_segment_path(path, sizeof(path), prefix, 0);
+    unlink(path);
+    kusokurae_log_writer_t *w = kusokurae_log_writer_open(prefix, 0);
+    if (w == NULL) {
+        std::printf("can't open %s\n", path);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (n = 0; n < n_games; n++) {
+        kusokurae_sim_config_t cfg = { 3 + (int32_t)(n & 1), 1, (uint64_t)n };
+        sim_play(&g, &cfg, KUSOKURAE_POLICY_RANDOM, &result);
+        kusokurae_game_record(&g, record);
+        kusokurae_log_append(w, record);
+    }
+    kusokurae_error_t err = kusokurae_log_writer_close(w);
+    std::printf("played and written: %.0f games/sec (%d)\n", n_games / seconds_since(start), err);
+
+    kusokurae_log_reader_t *r = kusokurae_log_reader_open(path);
+    if (r == NULL) {
+        std::printf("can't map %s\n", path);
+        return;
+    }
+    int64_t count = 0;
+    kusokurae_log_count(r, &count);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = kusokurae_log_verify(r, &valid);
+    std::printf("replayed: %.0f games/sec, %ld of %ld valid (%d)\n",
+                valid / seconds_since(start), (long)valid, (long)count, err);
+    kusokurae_log_reader_close(r);
+    unlink(path);
+}
+
+// Fake remote players for the table manager: answers come from threads of
+// their own after a random delay. Every tenth table has a first seat too slow
+// for the timeout, and some answers are illegal at first.
+struct fake_answer {
+    std::chrono::steady_clock::time_point due;
+    int32_t table, seat;
+    uint32_t ticket, move;
+
+    bool operator>(const fake_answer &rhs) const {
+        return due > rhs.due;
+    }
+};
+
+struct fake_clients {
+    std::mutex mu;
+    std::condition_variable wake;
+    std::priority_queue<fake_answer, std::vector<fake_answer>, std::greater<fake_answer> > answers;
+    std::vector<int32_t> finished;
+    kusokurae_rng_t rng;
+    bool stopping;
+};
+
+const int64_t FAKE_TIMEOUT_NS = 2000000;
+
+void fake_request(kusokurae_table_manager_t *mgr, int32_t table, int32_t seat, uint32_t ticket,
+                  const kusokurae_game_state_t *state, void *userdata) {
+    (void)mgr;
+    fake_clients *c = (fake_clients *)userdata;
+    uint64_t legal = state->players[seat].playable;
+    std::lock_guard<std::mutex> lock(c->mu);
+    // A random legal card, or once in a while one that isn't
+    uint32_t move;
+    if (kusokurae_rng_bounded(&c->rng, 50) == 0 && (state->players[seat].hand & ~legal)) {
+        move = __builtin_ctzll(state->players[seat].hand & ~legal) + 1;
+    } else {
+        uint32_t k = kusokurae_rng_bounded(&c->rng, mask_popcount(legal));
+        while (k--) {
+            legal &= legal - 1;
+        }
+        move = __builtin_ctzll(legal) + 1;
+    }
+    int64_t delay = kusokurae_rng_bounded(&c->rng, 200000);
+    if (table % 10 == 0 && seat == 0) {
+        delay += 2 * FAKE_TIMEOUT_NS;
+    }
+    fake_answer a = { std::chrono::steady_clock::now() + std::chrono::nanoseconds(delay),
+                      table, seat, ticket, move };
+    c->answers.push(a);
+    c->wake.notify_one();
+}
+
+void fake_finish(kusokurae_table_manager_t *mgr, int32_t table,
+                 const kusokurae_game_state_t *state, void *userdata) {
+    (void)mgr;
+    (void)state;
+    fake_clients *c = (fake_clients *)userdata;
+    std::lock_guard<std::mutex> lock(c->mu);
+    c->finished.push_back(table);
+    c->wake.notify_all();
+}
+
+void fake_client(fake_clients *c, kusokurae_table_manager_t **mgr) {
+    std::unique_lock<std::mutex> lock(c->mu);
+    while (!c->stopping) {
+        if (c->answers.empty()) {
+            c->wake.wait(lock);
+            continue;
+        }
+        fake_answer a = c->answers.top();
+        if (a.due > std::chrono::steady_clock::now()) {
+            c->wake.wait_until(lock, a.due);
+            continue;
+        }
+        c->answers.pop();
+        lock.unlock();
+        // Late and illegal answers are turned down, and counted by the manager.
+        kusokurae_table_submit(*mgr, a.table, a.seat, a.ticket, a.move);
+        lock.lock();
+    }
+}
+
+void test_tables() {
+    const int64_t n_games = 5000;
+    const int32_t max_tables = 512;
+    fake_clients c;
+    kusokurae_rng_seed(&c.rng, 1, 1);
+    c.stopping = false;
+    kusokurae_table_manager_t *mgr = NULL;
+    std::vector<std::thread> clients;
+    for (int i = 0; i < 2; i++) {
+        clients.emplace_back(fake_client, &c, &mgr);
+    }
+    kusokurae_table_config_t cfg = { 4, max_tables, FAKE_TIMEOUT_NS, fake_request, fake_finish, &c };
+    mgr = kusokurae_table_manager_new(&cfg);
+
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int64_t opened = 0, done = 0;
+    int32_t table;
+    for (; opened < max_tables; opened++) {
+        kusokurae_table_open(mgr, 3 + (int32_t)(opened & 1), 1, (uint64_t)opened, &table);
+    }
+    kusokurae_error_t full = kusokurae_table_open(mgr, 3, 1, 0, &table);
+    std::vector<int32_t> finished;
+    while (done < n_games) {
+        {
+            std::unique_lock<std::mutex> lock(c.mu);
+            c.wake.wait(lock, [&] { return !c.finished.empty(); });
+            finished.swap(c.finished);
+        }
+        for (int32_t t : finished) {
+            kusokurae_table_close(mgr, t);
+            done++;
+            if (opened < n_games) {
+                kusokurae_table_open(mgr, 3 + (int32_t)(opened & 1), 1, (uint64_t)opened, &table);
+                opened++;
+            }
+        }
+        finished.clear();
+    }
+    double elapsed = seconds_since(start);
+    kusokurae_table_stats_t stats;
+    // The clients may still be submitting to the manager.
+    {
+        std::lock_guard<std::mutex> lock(c.mu);
+        c.stopping = true;
+    }
+    c.wake.notify_all();
+    for (auto &t : clients) {
+        t.join();
+    }
+    kusokurae_table_get_stats(mgr, &stats);
+    kusokurae_table_manager_free(mgr);
+    std::printf("\nTable manager (%ld games, %d tables, 4 threads):\n", (long)n_games, max_tables);
+    std::printf("%.0f games/sec, %ld finished, %ld moves, %ld timeouts, %ld rejected\n",
+                done / elapsed, (long)stats.tables_finished, (long)stats.moves,
+                (long)stats.timeouts, (long)stats.rejected);
+    std::printf("open when full: %s\n", full == KUSOKURAE_ERROR_NO_TABLE ? "OK" : "MISMATCH");
+    std::printf("moves: %s\n", stats.moves == n_games / 2 * 33 + n_games / 2 * 32 ? "OK" : "MISMATCH");
+}
+
+// Plays batches of random games on both batch kernels next to the full
+// engine, comparing every field after every move.
+void test_batch() {
+    static kusokurae_batch_t scalar, simd;
+    static kusokurae_game_state_t games[KUSOKURAE_BATCH_MAX];
+    const int32_t n = KUSOKURAE_BATCH_MAX - 3;
+    std::printf("\nBatch engine against the full one:\n");
+    for (int32_t np = 3; np <= KUSOKURAE_MAX_PLAYERS; np++) {
+        int64_t mismatches = 0;
+        kusokurae_game_config_t cfg = { np };
+        kusokurae_rng_seed(&scalar.rng, 7, (uint64_t)np);
+        simd.rng = scalar.rng;
+        kusokurae_batch_start(&scalar, np, n, KUSOKURAE_BATCH_SCALAR);
+        kusokurae_batch_start(&simd, np, n, 0);
+        for (int32_t i = 0; i < n; i++) {
+            uint64_t hands[KUSOKURAE_MAX_PLAYERS];
+            for (int p = 0; p < np; p++) {
+                hands[p] = scalar.hand[p][i];
+            }
+            kusokurae_game_init(&games[i], &cfg, NULL);
+            kusokurae_game_deal(&games[i], hands);
+        }
+        while (!kusokurae_batch_finished(&scalar)) {
+            kusokurae_batch_step(&scalar, NULL);
+            kusokurae_batch_step(&simd, NULL);
+            for (int32_t i = 0; i < n; i++) {
+                kusokurae_game_state_t *g = &games[i];
+                kusokurae_game_play(g, DECK_CARD(scalar.move[i]));
+                int turn = kusokurae_get_active_player(g) ? kusokurae_get_active_player(g)->index - 1 : -1;
+                bool ok = simd.move[i] == scalar.move[i] && simd.playable[i] == scalar.playable[i] &&
+                          simd.turn[i] == scalar.turn[i] && simd.trick[i] == scalar.trick[i];
+                if (g->status == KUSOKURAE_STATUS_PLAY) {
+                    ok = ok && turn == scalar.turn[i] && g->players[turn].playable == scalar.playable[i];
+                }
+                for (int p = 0; p < np; p++) {
+                    ok = ok && g->players[p].hand == scalar.hand[p][i] &&
+                         g->players[p].score == scalar.score[p][i] &&
+                         g->players[p].busted == scalar.busted[p][i] &&
+                         simd.hand[p][i] == scalar.hand[p][i] && simd.score[p][i] == scalar.score[p][i] &&
+                         simd.busted[p][i] == scalar.busted[p][i];
+                }
+                mismatches += !ok;
+            }
+        }
+        std::printf("%dP, %d games, simd %d: %s\n", np, n, simd.simd,
+                    mismatches == 0 && kusokurae_batch_finished(&simd) ? "OK" : "MISMATCH");
+    }
+    bool bad = kusokurae_batch_start(&scalar, 3, 0, 0) == KUSOKURAE_ERROR_BAD_ARGUMENT &&
+               kusokurae_batch_start(&scalar, 3, KUSOKURAE_BATCH_MAX + 1, 0) == KUSOKURAE_ERROR_BAD_ARGUMENT;
+    std::printf("bad batch sizes: %s\n", bad ? "OK" : "MISMATCH");
+}
+
+// The compile-time deck against its layout, and the card sets against the deck
+void test_deck_tables() {
+    // Angels, Ghost, then Baozi, Youtiao and Xiang from 9 down to 0
+    static const int suits[] = { KUSOKURAE_SUIT_BAOZI, KUSOKURAE_SUIT_YOUTIAO, KUSOKURAE_SUIT_XIANG };
+    uint64_t suit_rank[KUSOKURAE_SUIT_OTHER + 2][11] = {}, rank[11] = {};
+    bool ok = true;
+    for (int i = 0; i < KUSOKURAE_DECK_SIZE; i++) {
+        const kusokurae_card_t &c = DECK[i];
+        int suit = i < 2 ? KUSOKURAE_SUIT_BAOZI : i == 2 ? KUSOKURAE_SUIT_OTHER : suits[(i - 3) / 10];
+        int r = i < 3 ? 10 : 9 - (i - 3) % 10;
+        ok = ok && c.display_order == (uint32_t)(KUSOKURAE_DECK_SIZE - i) && c.suit == suit &&
+             c.rank == r && c.flags == 0;
+        suit_rank[suit + 1][r] |= CARD_BIT(c.display_order);
+        rank[r] |= CARD_BIT(c.display_order);
+    }
+    for (int order = 1; order <= KUSOKURAE_DECK_SIZE; order++) {
+        const kusokurae_card_t &c = DECK_CARD(order);
+        ok = ok && kusokurae::DECK_TABLES.kind[order] == suit_rank[c.suit + 1][c.rank];
+    }
+    ok = ok && std::memcmp(suit_rank, SUIT_RANK_MASK, sizeof(suit_rank)) == 0 &&
+         std::memcmp(rank, RANK_MASK, sizeof(rank)) == 0 && kusokurae::ZERO_RANK == rank[0];
+    std::printf("\nconstexpr deck tables: %s\n", ok ? "OK" : "MISMATCH");
+}
+
+// Random games of every layout of the decks engine. One-deck games are played
+// along on the compact engine, and two-deck games are checked for an even deal
+// and for every card ending up taken.
+void test_decks() {
+    static const int32_t layouts[][2] = { { 3, 1 }, { 4, 1 }, { 3, 2 }, { 4, 2 }, { 5, 2 }, { 6, 2 } };
+    std::printf("\nDecks engine:\n");
+    for (const auto &layout : layouts) {
+        int32_t np = layout[0], nd = layout[1];
+        int n = nd * KUSOKURAE_DECK_SIZE - nd * KUSOKURAE_DECK_SIZE % np;
+        bool ok = true;
+        for (uint64_t game = 0; game < 200; game++) {
+            kusokurae_decks_state_t s;
+            kusokurae_compact_state_t c;
+            kusokurae_rng_seed(&s.rng_state, game, (uint64_t)np);
+            kusokurae_rng_seed(&c.rng_state, game, (uint64_t)np);
+            ok = ok && kusokurae_decks_start(&s, np, nd) == KUSOKURAE_SUCCESS;
+            if (nd == 1) {
+                kusokurae_compact_start(&c, np);
+            }
+            kusokurae_cards_t all = {};
+            for (int p = 0; p < np; p++) {
+                for (int d = 0; d < nd; d++) {
+                    ok = ok && !(all.deck[d] & s.hand[p].deck[d]);
+                    all.deck[d] |= s.hand[p].deck[d];
+                }
+                ok = ok && mask_popcount(s.hand[p].deck[0]) + mask_popcount(s.hand[p].deck[1]) == n / np;
+            }
+            // Every card but the top ones of the last deck
+            for (int card = 1; card <= nd * KUSOKURAE_DECK_SIZE; card++) {
+                int d = (card - 1) / KUSOKURAE_DECK_SIZE;
+                ok = ok && ((all.deck[d] & CARD_BIT(card - d * KUSOKURAE_DECK_SIZE)) != 0) == (card <= n);
+            }
+            kusokurae_rng_t rng = s.rng_state;
+            while (s.status == KUSOKURAE_STATUS_PLAY) {
+                // A random playable card, by number
+                int k = kusokurae_rng_bounded(&rng, mask_popcount(s.playable.deck[0]) +
+                                                        mask_popcount(s.playable.deck[1]));
+                int d = k < mask_popcount(s.playable.deck[0]) ? 0 : 1;
+                uint64_t m = s.playable.deck[d];
+                for (k -= d ? mask_popcount(s.playable.deck[0]) : 0; k > 0; k--) {
+                    m &= m - 1;
+                }
+                int card = d * KUSOKURAE_DECK_SIZE + mask_lowest(m);
+                ok = ok && kusokurae_decks_play(&s, card) == KUSOKURAE_SUCCESS;
+                if (nd == 1) {
+                    ok = ok && kusokurae_compact_play(&c, (kusokurae_card_id_t)card) == KUSOKURAE_SUCCESS &&
+                         c.playable == s.playable.deck[0] && c.turn == s.turn;
+                }
+            }
+            ok = ok && s.nround == n / np && kusokurae_decks_play(&s, 1) == KUSOKURAE_ERROR_NOT_IN_GAME;
+            kusokurae_cards_t taken = {};
+            for (int p = 0; p < np; p++) {
+                for (int d = 0; d < nd; d++) {
+                    ok = ok && s.hand[p].deck[d] == 0 && !(taken.deck[d] & s.taken[p].deck[d]);
+                    taken.deck[d] |= s.taken[p].deck[d];
+                }
+                if (nd == 1) {
+                    ok = ok && c.score[p] == s.score[p] && c.taken[p] == s.taken[p].deck[0];
+                }
+            }
+            ok = ok && std::memcmp(&taken, &all, sizeof(all)) == 0;
+        }
+        std::printf("%dP, %d deck(s): %s\n", np, nd, ok ? "OK" : "MISMATCH");
+    }
+    kusokurae_decks_state_t s = {};
+    bool bad = kusokurae_decks_start(&s, 5, 1) == KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS &&
+               kusokurae_decks_start(&s, 7, 2) == KUSOKURAE_ERROR_BAD_NUMBER_OF_PLAYERS &&
+               kusokurae_decks_start(&s, 3, 3) == KUSOKURAE_ERROR_BAD_ARGUMENT;
+    std::printf("bad layouts: %s\n", bad ? "OK" : "MISMATCH");
+}
+
+// Checks tablebase probes against the solver on the last rounds of random
+// games, probing before every move.
+void test_tablebase(int32_t np, int32_t k) {
+    char path[] = "/tmp/kusokurae-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        std::printf("\nTablebase %dP k=%d: can't make a file\n", np, k);
+        return;
+    }
+    close(fd);
+    kusokurae_tablebase_config_t cfg = { np, k, 0, 1000 };
+    kusokurae_tablebase_progress_t progress;
+    timespec start;
+    int slices = 0;
+    kusokurae_error_t err;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // In slices, going on from the file every time
+    do {
+        err = kusokurae_tablebase_generate(path, &cfg, &progress);
+        slices++;
+    } while (err == KUSOKURAE_SUCCESS && !progress.complete);
+    std::printf("\nTablebase %dP k=%d: %ld positions, %ld bytes, %d slices in %.2f s (%d)\n",
+                np, k, (long)progress.positions, (long)progress.bytes, slices,
+                seconds_since(start), err);
+    kusokurae_tablebase_t *tb = kusokurae_tablebase_open(path);
+    if (tb == NULL) {
+        std::printf("can't map %s\n", path);
+        return;
+    }
+
+    kusokurae_solver_t *solver = kusokurae_solver_new(16);
+    kusokurae_game_config_t gcfg = { np };
+    kusokurae_game_state_t g;
+    kusokurae_card_t moves[KUSOKURAE_MAX_HAND_CARDS];
+    kusokurae_solve_result_t want, got;
+    kusokurae_undo_t undo;
+    int64_t probes = 0, lookups = 0, probe_ns = 0, mismatches = 0;
+    kusokurae_game_init(&g, &gcfg, NULL);
+    for (uint64_t n = 0; n < 200; n++) {
+        kusokurae_game_seed(&g, n, 7);
+        kusokurae_game_start(&g);
+        while (g.status == KUSOKURAE_STATUS_PLAY) {
+            if (kusokurae_get_active_player(&g)->ncards - g.nround <= k + 1) {
+                int32_t seat = (int32_t)(n % np);
+                kusokurae_solve(solver, &g, seat, &want);
+                err = kusokurae_tablebase_probe(tb, &g, seat, &got);
+                probes++;
+                lookups += got.nodes;
+                probe_ns += got.elapsed_ns;
+                bool ok = err == KUSOKURAE_SUCCESS && got.score == want.score;
+                // The move found must reach the score too.
+                if (ok) {
+                    kusokurae_game_play_undoable(&g, got.best_move, &undo);
+                    kusokurae_solve(solver, &g, seat, &want);
+                    kusokurae_game_unplay(&g, &undo);
+                    ok = want.score == got.score;
+                }
+                mismatches += !ok;
+            }
+            int32_t nmoves = kusokurae_legal_moves(&g, NULL, moves);
+            kusokurae_game_play(&g, moves[kusokurae_rng_bounded(&g.rng_state, nmoves)]);
+        }
+    }
+    std::printf("%ld probes against the solver: %s, %.0f ns each, %.1f lookups\n",
+                (long)probes, mismatches == 0 ? "OK" : "MISMATCH",
+                probe_ns / (double)probes, lookups / (double)probes);
+    kusokurae_solver_free(solver);
+    kusokurae_tablebase_close(tb);
+    unlink(path);
+}
+
+// Engine counters over games on several threads. With KUSOKURAE_METRICS they
+// must add up to the moves made; without it they stay at zero.
+void test_metrics() {
+    kusokurae_sim_config_t cfg = { 3, 11, 0 };
+    const int64_t n_games = 10000;
+    kusokurae_metrics_t before, after;
+    kusokurae_sim_stats_t stats;
+    std::memset(&stats, 0, sizeof(stats));
+    int32_t enabled = kusokurae_metrics_snapshot(&before);
+    kusokurae_sim_parallel(&cfg, n_games, KUSOKURAE_POLICY_RANDOM, 4, &stats);
+    kusokurae_game_state_t g;
+    kusokurae_game_config_t gcfg = { 3 };
+    kusokurae_game_init(&g, &gcfg, NULL);
+    kusokurae_game_start(&g);
+    kusokurae_game_play(&g, DECK_CARD(mask_lowest(g.players[1].hand)));
+    kusokurae_metrics_snapshot(&after);
+
+    // Each 3P game is 33 moves.
+    uint64_t moves = after.play[KUSOKURAE_SUCCESS] - before.play[KUSOKURAE_SUCCESS];
+    uint64_t deals = after.deal.count - before.deal.count;
+    uint64_t bad = after.play[KUSOKURAE_ERROR_CARD_NOT_FOUND] - before.play[KUSOKURAE_ERROR_CARD_NOT_FOUND];
+    uint64_t buckets = 0;
+    for (int i = 0; i < KUSOKURAE_HISTOGRAM_BUCKETS; i++) {
+        buckets += after.deal.buckets[i] - before.deal.buckets[i];
+    }
+    bool ok = enabled ? moves == (uint64_t)n_games * 33 && deals == (uint64_t)n_games + 1 && bad == 1 &&
+                            buckets == deals && after.playable_updates - before.playable_updates >= moves
+                      : std::memcmp(&after, &before, sizeof(after)) == 0 && moves == 0;
+    std::printf("\nMetrics (%s): %llu moves, %llu deals in %.0f ns each, %llu busted: %s\n",
+                enabled ? "enabled" : "disabled", (unsigned long long)moves, (unsigned long long)deals,
+                deals ? (double)(after.deal.sum_ns - before.deal.sum_ns) / deals : 0.0,
+                (unsigned long long)(after.busted[0] + after.busted[1] - before.busted[0] - before.busted[1]),
+                ok ? "OK" : "MISMATCH");
+}
+
 void dummy_state_cb(kusokurae_game_state_t *self, int32_t newstate, void *userdata) {
     std::printf("dummy_state_cb(%p, %d, %p)\n", self, newstate, userdata);
 }
 
 #ifndef WHATEVER_YOU_WANT_TO_INDICATE_CGO
 
+// See bench.cxx
+int bench_main(int argc, char *argv[]);
+
 int main(int argc, char *argv[]) {
+    if (argc > 1 && std::strcmp(argv[1], "bench") == 0) {
+        return bench_main(argc - 1, argv + 1);
+    }
     test_init();
 
     kusokurae_game_config_t cfg = { 3 };
     kusokurae_game_state_t g;
-    kusokurae_game_callbacks_t cbs = { &g, &dummy_state_cb };
+    kusokurae_game_callbacks_t cbs = {};
+    cbs.userdata_of_state_transition = &g;
+    cbs.state_transition = &dummy_state_cb;
     kusokurae_game_init(&g, &cfg, &cbs);
 
     test_start(&g);
     std::printf("\n%dP has the ghost\n", g.ghost_holder_index + 1);
+
+    test_rng();
+    test_deck_tables();
+    test_decks();
+    test_sim_scaling();
+    test_ismcts();
+    test_record();
+    test_tables();
+    test_batch();
+    test_tablebase(3, 2);
+    test_tablebase(4, 1);
+    kusokurae_tablebase_config_t too_large = { 3, 4, 0, 0 };
+    bool refused = kusokurae_tablebase_generate("/nonexistent/tb", &too_large, NULL) ==
+                   KUSOKURAE_ERROR_TABLEBASE_TOO_LARGE;
+    std::printf("Tablebase 3P k=4 refused: %s\n", refused ? "OK" : "MISMATCH");
+    test_metrics();
 }
 
 #endif // WHATEVER_YOU_WANT_TO_INDICATE_CGO